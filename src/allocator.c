@@ -36,22 +36,33 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <libpmem.h>
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include "pmem.h"
+#include "util.h"
+#include "out.h"
 #include "allocator.h"
 
 #define	KB 1024
 #define	MB 1024 * KB
 
-#define	LINE_SIZE	4 * MB
+#define	LINE_SIZE	(4 * MB)
 
-#define	LINE_OFFSET(base, n)      \
-(uintptr_t)(base) +               \
-sizeof (struct thread_line_info) + \
-((n) * LINE_SIZE)
+/*
+ * Lines are laid out back to back starting at base_offset, all offsets
+ * (both the ones stored in line headers and the ones handed out) are
+ * relative to the beginning of the pool so they stay valid no matter
+ * where the pool gets mapped and no matter how many parts it spans.
+ */
+#define	LINE_START(a, n) ((a)->base_offset + (uint64_t)(n) * LINE_SIZE)
+#define	LINE_HDR(a, n) \
+((struct thread_line_info *)((a)->pool_addr + LINE_START(a, n)))
 
 #define	ALIGN(v) (((v) & ~7)+8)
 #define	ALIGN_HUGE(v) (((v) & ~(LINE_SIZE - 1)) + LINE_SIZE)
@@ -59,110 +70,677 @@ sizeof (struct thread_line_info) + \
 #define	LINE_INFO_VALID 0x95857284
 #define	HUGE_INFO_VALID 0x85629667
 
-__thread struct thread_line_info {
+struct thread_line_info {
 	uint64_t valid;
-	uint64_t offset;
-} *thread_line;
+	uint64_t offset;	/* bytes used, relative to the line start */
+};
 
 struct huge_info {
 	uint64_t valid;
 	uint64_t lines;
 };
 
+/*
+ * the line a thread is currently carving small objects from, tagged with
+ * the allocator instance so it is never used for another (or reopened) pool
+ */
+static __thread struct {
+	uint64_t instance;
+	uint64_t idx;
+	struct thread_line_info *line;
+} Thread_line;
+
+static uint64_t Instances;	/* source of allocator instance ids */
+
 pthread_mutex_t line_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * allocator_persist -- (internal) flush allocator metadata
+ *
+ * Nothing is flushed when the pool is a private copy-on-write mapping.
+ */
+static void
+allocator_persist(struct allocator_hdr *allocator, void *addr, size_t len)
+{
+	if (!allocator->cow)
+		libpmem_persist(PMEM_FLUSH_SRC_ALLOC, allocator->is_pmem,
+				addr, len);
+}
+
+/*
+ * allocator_init -- prepare the allocator for a freshly mapped pool
+ */
 bool
-allocator_init(struct allocator_hdr *allocator, uint64_t base_offset,
-	int is_pmem)
+allocator_init(struct allocator_hdr *allocator, void *pool_addr,
+	uint64_t pool_size, uint64_t base_offset, int is_pmem, int cow)
 {
 	allocator->base_offset = ALIGN(base_offset);
 	allocator->lines_used = 0;
+	allocator->pool_size = pool_size;
+	allocator->pool_addr = pool_addr;
+	allocator->instance = __sync_add_and_fetch(&Instances, 1);
 	allocator->is_pmem = is_pmem;
+	allocator->cow = cow;
 
 	/*
 	 * These variables are initialized every time right now,
 	 * but that might change later on.
-	 * libpmem_persist(is_pmem, allocator, sizeof (*allocator));
+	 * libpmem_persist(PMEM_FLUSH_SRC_ALLOC, is_pmem,
+	 *	allocator, sizeof (*allocator));
 	 */
 	return true;
 }
 
-struct thread_line_info *get_thread_line(struct allocator_hdr *allocator,
-	size_t size)
+/*
+ * allocator_grow -- make lines added to the end of the pool available
+ *
+ * The pool can only grow, the new size is published under the line lock
+ * so a thread scanning for a fresh line either sees the old or the new
+ * bound, both of which are backed by mapped memory.
+ */
+void
+allocator_grow(struct allocator_hdr *allocator, uint64_t pool_size)
 {
-	if (thread_line != NULL && (thread_line->offset + size) > LINE_SIZE)
-		thread_line = NULL;
+	pthread_mutex_lock(&line_lock);
+	if (pool_size > allocator->pool_size)
+		allocator->pool_size = pool_size;
+	pthread_mutex_unlock(&line_lock);
+}
 
-	if (thread_line != NULL)
-		return thread_line;
+/*
+ * line_limit -- (internal) usable bytes of the given line
+ *
+ * The last line may be cut short by the end of the pool, returns 0 when
+ * the line does not exist (yet).
+ */
+static uint64_t
+line_limit(struct allocator_hdr *allocator, uint64_t idx)
+{
+	uint64_t start = LINE_START(allocator, idx);
+	uint64_t size = allocator->pool_size;
+
+	if (start + sizeof (struct thread_line_info) >= size)
+		return 0;
+
+	return (size - start < LINE_SIZE) ? size - start : LINE_SIZE;
+}
+
+/*
+ * get_thread_line -- (internal) find a line with room for size bytes
+ *
+ * Returns NULL if the pool is exhausted.
+ */
+static struct thread_line_info *
+get_thread_line(struct allocator_hdr *allocator, size_t size)
+{
+	if (Thread_line.instance == allocator->instance &&
+		Thread_line.line->offset + size <=
+			line_limit(allocator, Thread_line.idx))
+		return Thread_line.line;
+
+	struct thread_line_info *line = NULL;
 
 	pthread_mutex_lock(&line_lock);
-	while (thread_line == NULL) {
-		uint64_t line_idx = allocator->lines_used++;
-		thread_line = (void *) LINE_OFFSET(allocator, line_idx);
-		if (thread_line->valid == HUGE_INFO_VALID) {
-			struct huge_info *huge =
-				(struct huge_info *)thread_line;
+	while (line == NULL) {
+		uint64_t line_idx = allocator->lines_used;
+		uint64_t limit = line_limit(allocator, line_idx);
+		if (limit == 0)
+			break;
+
+		allocator->lines_used++;
+		line = LINE_HDR(allocator, line_idx);
+		if (line->valid == HUGE_INFO_VALID) {
+			struct huge_info *huge = (struct huge_info *)line;
 			allocator->lines_used += huge->lines - 1;
-			thread_line = NULL;
-		} else if (thread_line->valid != LINE_INFO_VALID) {
-			thread_line->offset =
-				LINE_OFFSET(allocator->base_offset, line_idx);
-			thread_line->valid = LINE_INFO_VALID - 1;
-			libpmem_persist(allocator->is_pmem, thread_line,
-				sizeof (*thread_line));
-			thread_line->valid = LINE_INFO_VALID;
-			libpmem_persist(allocator->is_pmem, thread_line,
-				sizeof (*thread_line));
-		} else if (thread_line->offset + size > LINE_SIZE) {
-			thread_line = NULL;
+			line = NULL;
+		} else if (line->valid != LINE_INFO_VALID) {
+			line->offset = sizeof (*line);
+			line->valid = LINE_INFO_VALID - 1;
+			allocator_persist(allocator, line,
+				sizeof (*line));
+			line->valid = LINE_INFO_VALID;
+			allocator_persist(allocator, line,
+				sizeof (*line));
+		}
+
+		if (line != NULL && line->offset + size > limit)
+			line = NULL;
+
+		if (line != NULL) {
+			Thread_line.instance = allocator->instance;
+			Thread_line.idx = line_idx;
+			Thread_line.line = line;
 		}
 	}
 	pthread_mutex_unlock(&line_lock);
 
-	return thread_line;
+	return line;
 }
 
-void
-thread_alloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size)
+/*
+ * alloc_publish -- (internal) store the offset of a new object at *ptr
+ *
+ * A *ptr inside the pool, such as an undo log entry, is made durable
+ * before the allocation itself, so after a crash whoever logged *ptr
+ * finds every object that may have been allocated.
+ */
+static void
+alloc_publish(struct allocator_hdr *allocator, uint64_t *ptr, uint64_t off)
+{
+	*ptr = off;
+
+	char *p = (char *)ptr;
+	if (p >= allocator->pool_addr &&
+			p < allocator->pool_addr + allocator->pool_size)
+		allocator_persist(allocator, ptr, sizeof (*ptr));
+}
+
+/*
+ * thread_alloc -- (internal) carve a small object out of the thread's line
+ */
+static void
+thread_alloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size,
+	uint32_t type_num)
 {
+	size = ALIGN(size + sizeof (struct alloc_hdr));
 	struct thread_line_info *line = get_thread_line(allocator, size);
-	size = ALIGN(size);
-	*ptr = line->offset;
+	if (line == NULL) {
+		LOG(1, "out of space for %zu bytes", size);
+		*ptr = 0;
+		errno = ENOMEM;
+		return;
+	}
+
+	/* the object only exists once the line offset covers its header */
+	uint64_t off = LINE_START(allocator, Thread_line.idx) + line->offset;
+	struct alloc_hdr *hdr = (void *)(allocator->pool_addr + off);
+	hdr->size = size - sizeof (*hdr);
+	hdr->type_num = type_num;
+	hdr->unused = 0;
+	allocator_persist(allocator, hdr, sizeof (*hdr));
+
+	alloc_publish(allocator, ptr, off + sizeof (*hdr));
 	line->offset += size;
-	libpmem_persist(allocator->is_pmem, thread_line, sizeof (*thread_line));
+	allocator_persist(allocator, line, sizeof (*line));
 }
 
-void
-huge_alloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size)
+/*
+ * huge_alloc -- (internal) hand out a run of whole lines
+ */
+static void
+huge_alloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size,
+	uint32_t type_num)
 {
-	size = ALIGN_HUGE(size);
+	size = ALIGN_HUGE(size + sizeof (struct huge_info) +
+			sizeof (struct alloc_hdr));
+	*ptr = 0;
+
 	pthread_mutex_lock(&line_lock);
-	struct huge_info *huge =
-		(void *) LINE_OFFSET(allocator, allocator->lines_used);
+
+	/* skip lines that are already in use from a previous run */
+	struct thread_line_info *line;
+	while (line_limit(allocator, allocator->lines_used) != 0) {
+		line = LINE_HDR(allocator, allocator->lines_used);
+		if (line->valid == HUGE_INFO_VALID)
+			allocator->lines_used +=
+				((struct huge_info *)line)->lines;
+		else if (line->valid == LINE_INFO_VALID)
+			allocator->lines_used++;
+		else
+			break;
+	}
+
+	uint64_t start = LINE_START(allocator, allocator->lines_used);
+	if (start + size > allocator->pool_size) {
+		pthread_mutex_unlock(&line_lock);
+		LOG(1, "out of space for %zu bytes", size);
+		errno = ENOMEM;
+		return;
+	}
+
+	struct huge_info *huge = (void *)LINE_HDR(allocator,
+					allocator->lines_used);
+	struct alloc_hdr *hdr = (void *)(huge + 1);
+	hdr->size = size - sizeof (*huge) - sizeof (*hdr);
+	hdr->type_num = type_num;
+	hdr->unused = 0;
+	allocator_persist(allocator, hdr, sizeof (*hdr));
+
+	alloc_publish(allocator, ptr, start + sizeof (*huge) + sizeof (*hdr));
+
 	huge->valid = HUGE_INFO_VALID;
 	huge->lines = size / LINE_SIZE;
-
-	*ptr = LINE_OFFSET(allocator->base_offset, allocator->lines_used) +
-		(sizeof (struct huge_info));
-	libpmem_persist(allocator->is_pmem, huge, sizeof (*huge));
+	allocator_persist(allocator, huge, sizeof (*huge));
 	allocator->lines_used += huge->lines;
 	pthread_mutex_unlock(&line_lock);
 }
 
+/*
+ * pmalloc -- allocate size bytes from the pool
+ *
+ * The pool-relative offset of the new object is stored at *ptr, on
+ * failure *ptr is set to zero and errno is set.  A *ptr in the pool is
+ * durable before the object is.  The object is tagged
+ * with type_num, which allocator_first() and allocator_next() look for.
+ */
 void
-pmalloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size)
+pmalloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size,
+	uint32_t type_num)
 {
-	if (size >= LINE_SIZE - (sizeof (struct thread_line_info))) {
-		huge_alloc(allocator, ptr, size);
+	if (ALIGN(size + sizeof (struct alloc_hdr)) >
+			LINE_SIZE - (sizeof (struct thread_line_info))) {
+		huge_alloc(allocator, ptr, size, type_num);
 	} else {
-		thread_alloc(allocator, ptr, size);
+		thread_alloc(allocator, ptr, size, type_num);
 	}
 }
 
+/*
+ * pfree -- release an object
+ *
+ * The space is not reused yet, but the object no longer shows up when
+ * iterating over the pool.
+ */
 void
 pfree(struct allocator_hdr *allocator, uint64_t ptr)
 {
 	/* uint64_t line_idx = ALIGN_LINE(ptr); */
 	/* XXX implement freelist bins */
+	if (ptr == 0)
+		return;
+
+	allocator_set_type(allocator, ptr, ALLOC_TYPE_FREE);
+}
+
+/*
+ * allocator_set_type -- change the type number of an object
+ *
+ * The type is a single 4-byte store, so the object changes its type
+ * atomically, which is how an object allocated as ALLOC_TYPE_FREE is
+ * published.
+ */
+void
+allocator_set_type(struct allocator_hdr *allocator, uint64_t ptr,
+	uint32_t type_num)
+{
+	struct alloc_hdr *hdr = (void *)(allocator->pool_addr + ptr);
+	hdr--;
+	hdr->type_num = type_num;
+	allocator_persist(allocator, &hdr->type_num, sizeof (hdr->type_num));
+}
+
+/*
+ * alloc_scan -- (internal) find the next object of the given type
+ *
+ * The search starts pos bytes into line idx and walks the lines in
+ * address order, and the object headers of each small line back to back,
+ * so the whole scan is sequential.  Returns the pool offset of the object
+ * found, or 0 if there is none.
+ */
+static uint64_t
+alloc_scan(struct allocator_hdr *allocator, uint64_t idx, uint64_t pos,
+	uint32_t type_num)
+{
+	for (; line_limit(allocator, idx) != 0; idx++, pos = 0) {
+		struct thread_line_info *line = LINE_HDR(allocator, idx);
+		uint64_t start = LINE_START(allocator, idx);
+
+		/* line headers are LINE_SIZE apart, fetch the next one early */
+		if (line_limit(allocator, idx + 1) != 0)
+			__builtin_prefetch(LINE_HDR(allocator, idx + 1));
+
+		if (line->valid == HUGE_INFO_VALID) {
+			struct huge_info *huge = (struct huge_info *)line;
+			struct alloc_hdr *hdr = (void *)(huge + 1);
+
+			if (pos == 0 && hdr->type_num == type_num)
+				return start + sizeof (*huge) + sizeof (*hdr);
+
+			idx += huge->lines - 1;
+			continue;
+		}
+
+		if (line->valid != LINE_INFO_VALID)
+			continue;
+
+		if (pos < sizeof (*line))
+			pos = sizeof (*line);
+
+		while (pos + sizeof (struct alloc_hdr) <= line->offset) {
+			struct alloc_hdr *hdr =
+				(void *)(allocator->pool_addr + start + pos);
+
+			if (hdr->type_num == type_num)
+				return start + pos + sizeof (*hdr);
+
+			pos += sizeof (*hdr) + hdr->size;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * allocator_first -- return the first object of the given type
+ *
+ * Returns the pool offset of the object, or 0 if there is none.
+ */
+uint64_t
+allocator_first(struct allocator_hdr *allocator, uint32_t type_num)
+{
+	LOG(3, "allocator %p type_num %u", allocator, type_num);
+
+	return alloc_scan(allocator, 0, 0, type_num);
+}
+
+/*
+ * allocator_next -- return the object of the same type following ptr
+ *
+ * Returns the pool offset of the object, or 0 if there is none.
+ */
+uint64_t
+allocator_next(struct allocator_hdr *allocator, uint64_t ptr)
+{
+	LOG(3, "allocator %p ptr 0x%" PRIx64, allocator, ptr);
+
+	struct alloc_hdr *hdr = (void *)(allocator->pool_addr + ptr);
+	hdr--;
+
+	uint64_t idx = (ptr - allocator->base_offset) / LINE_SIZE;
+	struct thread_line_info *line = LINE_HDR(allocator, idx);
+	if (line->valid == HUGE_INFO_VALID)
+		return alloc_scan(allocator,
+			idx + ((struct huge_info *)line)->lines, 0,
+			hdr->type_num);
+
+	return alloc_scan(allocator, idx,
+			ptr - LINE_START(allocator, idx) + hdr->size,
+			hdr->type_num);
+}
+
+/* what a line header claims the line holds */
+#define	LINE_KIND_FREE 0	/* never handed out */
+#define	LINE_KIND_SMALL 1	/* carved into small objects */
+#define	LINE_KIND_HUGE 2	/* first line of a huge object */
+
+/* what the walk of a batch found at each line */
+#define	CHECK_VISITED 0x1	/* a line header on the walk */
+#define	CHECK_BAD 0x2		/* an inconsistent one */
+
+#define	CHECK_BATCH 8		/* lines a worker claims at a time */
+#define	CHECK_PROGRESS_STEPS 100	/* progress reports per check */
+
+/* the outcome of walking one batch from its first line */
+struct check_batch {
+	uint64_t end;		/* first line after the last header walked */
+	uint64_t nbad;		/* inconsistent headers walked */
+};
+
+struct check_ctx {
+	struct allocator_hdr *allocator;
+	uint8_t *marks;		/* CHECK_* of each line */
+	struct check_batch *batches;
+	uint64_t nlines;
+	uint64_t next;		/* next line to be claimed */
+	uint64_t done;		/* lines verified so far */
+	uint64_t reported;	/* done count of the last progress report */
+	pthread_mutex_t progress_lock;
+	void (*progress)(size_t done, size_t total);
+};
+
+/*
+ * check_line -- (internal) verify the header of a single line
+ */
+static int
+check_line(struct allocator_hdr *allocator, uint64_t idx, uint8_t kind)
+{
+	struct thread_line_info *line = LINE_HDR(allocator, idx);
+
+	switch (kind) {
+	case LINE_KIND_SMALL: {
+		if (line->offset < sizeof (*line) ||
+				line->offset > line_limit(allocator, idx)) {
+			LOG(1, "line %" PRIu64 ": bad offset %" PRIu64,
+					idx, line->offset);
+			return 0;
+		}
+
+		/* the object headers must chain up to the line offset */
+		char *start = (char *)line;
+		uint64_t pos = sizeof (*line);
+		while (pos + sizeof (struct alloc_hdr) <= line->offset) {
+			struct alloc_hdr *hdr = (void *)(start + pos);
+			if (hdr->size == 0 ||
+				hdr->size > line->offset - pos - sizeof (*hdr))
+				break;
+			pos += sizeof (*hdr) + hdr->size;
+		}
+		if (pos != line->offset) {
+			LOG(1, "line %" PRIu64 ": broken object chain at "
+					"%" PRIu64, idx, pos);
+			return 0;
+		}
+		break;
+	}
+	case LINE_KIND_HUGE: {
+		/* the extent was already verified by check_header() */
+		struct huge_info *huge = (struct huge_info *)line;
+		struct alloc_hdr *hdr = (void *)(huge + 1);
+		if (hdr->size != huge->lines * LINE_SIZE - sizeof (*huge) -
+				sizeof (*hdr)) {
+			LOG(1, "line %" PRIu64 ": bad huge object size "
+					"%" PRIu64, idx, hdr->size);
+			return 0;
+		}
+		break;
+	}
+	}
+
+	return 1;
+}
+
+/*
+ * check_header -- (internal) verify the line header at idx
+ *
+ * Sets *badp if it is inconsistent.  Returns the line of the next header,
+ * past the whole extent of a huge object.
+ */
+static uint64_t
+check_header(struct allocator_hdr *allocator, uint64_t nlines,
+	uint64_t idx, int *badp)
+{
+	struct thread_line_info *line = LINE_HDR(allocator, idx);
+
+	if (line->valid == HUGE_INFO_VALID) {
+		struct huge_info *huge = (struct huge_info *)line;
+		uint64_t start = LINE_START(allocator, idx);
+
+		if (huge->lines == 0 || huge->lines > nlines - idx ||
+			start + huge->lines * LINE_SIZE >
+					allocator->pool_size) {
+			LOG(1, "line %" PRIu64 ": bad huge object of %" PRIu64
+					" lines", idx, huge->lines);
+			*badp = 1;
+			return idx + 1;
+		}
+
+		*badp = !check_line(allocator, idx, LINE_KIND_HUGE);
+		return idx + huge->lines;
+	}
+
+	if (line->valid == LINE_INFO_VALID)
+		*badp = !check_line(allocator, idx, LINE_KIND_SMALL);
+	else
+		*badp = 0;
+
+	return idx + 1;
+}
+
+/*
+ * check_worker -- (internal) walk batches of lines claimed until done
+ *
+ * Each batch is walked as if a header started at its first line, which
+ * is wrong when a huge object runs into it from the batch before; the
+ * walks are joined up afterwards by check_join().
+ */
+static void *
+check_worker(void *arg)
+{
+	struct check_ctx *ctx = arg;
+	uint64_t step = ctx->nlines / CHECK_PROGRESS_STEPS + 1;
+
+	for (;;) {
+		uint64_t first = __sync_fetch_and_add(&ctx->next, CHECK_BATCH);
+		if (first >= ctx->nlines)
+			break;
+
+		uint64_t last = first + CHECK_BATCH;
+		if (last > ctx->nlines)
+			last = ctx->nlines;
+
+		struct check_batch *bp = &ctx->batches[first / CHECK_BATCH];
+		uint64_t idx = first;
+		while (idx < last) {
+			int bad;
+			uint64_t next = check_header(ctx->allocator,
+					ctx->nlines, idx, &bad);
+			ctx->marks[idx] = CHECK_VISITED | (bad ? CHECK_BAD : 0);
+			bp->nbad += bad;
+			idx = next;
+		}
+		bp->end = idx;
+
+		uint64_t done = __sync_add_and_fetch(&ctx->done, last - first);
+		if (ctx->progress != NULL && done - ctx->reported >= step) {
+			pthread_mutex_lock(&ctx->progress_lock);
+			if (done > ctx->reported) {
+				ctx->reported = done;
+				(*ctx->progress)(done, ctx->nlines);
+			}
+			pthread_mutex_unlock(&ctx->progress_lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * check_join -- (internal) follow the chain of headers over the batches
+ *
+ * Where the chain enters a batch at a header its walk found, the rest of
+ * that walk is taken as it is.  Only where it lands on a line the walk
+ * skipped, inside a huge object that came from the batch before, are
+ * headers verified again until the chain meets the walk.  Returns the
+ * number of inconsistent headers on the chain.
+ */
+static uint64_t
+check_join(struct check_ctx *ctx)
+{
+	uint64_t nbad = 0;
+	uint64_t idx = 0;
+
+	while (idx < ctx->nlines) {
+		uint64_t first = idx / CHECK_BATCH * CHECK_BATCH;
+		struct check_batch *bp = &ctx->batches[idx / CHECK_BATCH];
+
+		if (idx == first) {
+			nbad += bp->nbad;
+			idx = bp->end;
+		} else if (ctx->marks[idx] & CHECK_VISITED) {
+			uint64_t last = first + CHECK_BATCH;
+			if (last > ctx->nlines)
+				last = ctx->nlines;
+			for (; idx < last; idx++)
+				if (ctx->marks[idx] & CHECK_BAD)
+					nbad++;
+			idx = bp->end;
+		} else {
+			int bad;
+			idx = check_header(ctx->allocator, ctx->nlines, idx,
+					&bad);
+			nbad += bad;
+		}
+	}
+
+	return nbad;
+}
+
+/*
+ * allocator_check -- verify the line headers of a pool
+ *
+ * The lines are split into batches walked by nthreads threads in
+ * parallel, and the walks are then joined up into the one chain of line
+ * headers, which is the only way to tell where huge objects end.
+ * Progress (lines verified, total lines) is reported through progress,
+ * if not NULL.  Returns the number of inconsistent lines, or -1 if the
+ * check could not run.
+ */
+int
+allocator_check(struct allocator_hdr *allocator, unsigned nthreads,
+	void (*progress)(size_t done, size_t total))
+{
+	LOG(3, "allocator %p nthreads %u", allocator, nthreads);
+
+	uint64_t nlines = 0;
+	while (line_limit(allocator, nlines) != 0)
+		nlines++;
+
+	struct check_ctx ctx;
+	memset(&ctx, 0, sizeof (ctx));
+	ctx.allocator = allocator;
+	ctx.nlines = nlines;
+	ctx.progress = progress;
+
+	if (nlines == 0)
+		return 0;
+
+	uint64_t nbatches = (nlines + CHECK_BATCH - 1) / CHECK_BATCH;
+	if ((ctx.marks = Malloc(nlines)) == NULL) {
+		LOG(1, "!Malloc");
+		return -1;
+	}
+	if ((ctx.batches = Malloc(nbatches * sizeof (*ctx.batches))) == NULL) {
+		LOG(1, "!Malloc");
+		Free(ctx.marks);
+		return -1;
+	}
+	memset(ctx.marks, 0, nlines);
+	memset(ctx.batches, 0, nbatches * sizeof (*ctx.batches));
+
+	if (nthreads == 0)
+		nthreads = 1;
+	if (nthreads > nbatches)
+		nthreads = nbatches;
+
+	pthread_mutex_init(&ctx.progress_lock, NULL);
+
+	pthread_t *threads = Malloc(nthreads * sizeof (pthread_t));
+	unsigned started = 0;
+	if (threads != NULL) {
+		/* the calling thread is one of the workers */
+		for (; started < nthreads - 1; started++)
+			if ((errno = pthread_create(&threads[started], NULL,
+						check_worker, &ctx))) {
+				LOG(1, "!pthread_create");
+				break;
+			}
+	}
+
+	check_worker(&ctx);
+
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	uint64_t nbad = check_join(&ctx);
+
+	if (progress != NULL && ctx.reported < nlines)
+		(*progress)(nlines, nlines);
+
+	pthread_mutex_destroy(&ctx.progress_lock);
+	Free(threads);
+	Free(ctx.batches);
+	Free(ctx.marks);
+
+	LOG(3, "%" PRIu64 " lines, %" PRIu64 " inconsistent", nlines, nbad);
+	return (int)nbad;
 }
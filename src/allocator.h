@@ -34,13 +34,37 @@
  * allocator.h -- internal definitions for allocator module
  */
 
+#define	ALLOC_TYPE_FREE UINT32_MAX	/* type of freed objects */
+
+/*
+ * every object handed out by pmalloc() is preceded by this header, it is
+ * what lets the allocator walk all objects of a line in address order
+ */
+struct alloc_hdr {
+	uint64_t size;		/* usable bytes following the header */
+	uint32_t type_num;	/* given at allocation, or ALLOC_TYPE_FREE */
+	uint32_t unused;
+};
+
 struct allocator_hdr {
-    uint64_t base_offset;
-    uint64_t lines_used;
-    int is_pmem;
+	uint64_t base_offset;	/* pool offset of the first line */
+	uint64_t lines_used;	/* lines handed out during this run */
+	uint64_t pool_size;	/* current size of the pool */
+	uint64_t instance;	/* unique id of this open of the pool */
+	char *pool_addr;	/* address the offsets are relative to */
+	int is_pmem;
+	int cow;		/* private copy, never flush anything */
 };
 
-bool allocator_init(struct allocator_hdr *allocator, uint64_t base_offset,
-	int is_pmem);
-void pmalloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size);
+bool allocator_init(struct allocator_hdr *allocator, void *pool_addr,
+	uint64_t pool_size, uint64_t base_offset, int is_pmem, int cow);
+void allocator_grow(struct allocator_hdr *allocator, uint64_t pool_size);
+int allocator_check(struct allocator_hdr *allocator, unsigned nthreads,
+	void (*progress)(size_t done, size_t total));
+void pmalloc(struct allocator_hdr *allocator, uint64_t *ptr, size_t size,
+	uint32_t type_num);
 void pfree(struct allocator_hdr *allocator, uint64_t ptr);
+void allocator_set_type(struct allocator_hdr *allocator, uint64_t ptr,
+	uint32_t type_num);
+uint64_t allocator_first(struct allocator_hdr *allocator, uint32_t type_num);
+uint64_t allocator_next(struct allocator_hdr *allocator, uint64_t ptr);
@@ -57,6 +57,46 @@
 #include "btt.h"
 #include "blk.h"
 
+/* new pools store a checksum with each block, see blk_init() */
+static int Block_csum;
+
+/*
+ * background scrubbing, see pmemblk_scrub_start()
+ */
+struct blk_scrub {
+	pthread_t thread;
+	pthread_mutex_t lock;	/* protects all below */
+	pthread_cond_t cond;	/* signaled when stop is set */
+	int stop;
+	unsigned rate;		/* blocks per second, 0 for no limit */
+	struct pmemblk_scrub_stats stats;
+};
+
+/*
+ * asynchronous I/O, see pmemblk_aio_start()
+ *
+ * Both queues are rings indexed by free-running counters, depth is a
+ * power of two so the indexes stay right when the counters wrap.  No
+ * more than depth operations are submitted and not reaped yet, so
+ * neither ring can overflow.
+ */
+struct blk_aio {
+	pthread_mutex_t lock;	/* protects all below */
+	pthread_cond_t work;	/* signaled on submissions and stop */
+	pthread_cond_t done;	/* signaled on completions */
+	int stop;
+	unsigned depth;
+	unsigned inflight;	/* submitted and not reaped yet */
+	unsigned sq_head;	/* next operation for the workers */
+	unsigned sq_tail;	/* next free submission entry */
+	unsigned cq_head;	/* next completion to reap */
+	unsigned cq_tail;	/* next free completion entry */
+	struct pmemblk_aio_op *sq;
+	struct pmemblk_aio_cqe *cq;
+	unsigned nthread;	/* worker threads running */
+	pthread_t *threads;
+};
+
 /*
  * blk_init -- (internal) load-time initialization for blk
  *
@@ -69,24 +109,76 @@ blk_init(void)
 	out_init(LOG_PREFIX, LOG_LEVEL_VAR, LOG_FILE_VAR);
 	LOG(3, NULL);
 	util_init();
+
+	/* PMEM_BLK_CHECKSUM=1 creates pools with per-block checksums */
+	char *ptr = getenv("PMEM_BLK_CHECKSUM");
+	if (ptr)
+		Block_csum = atoi(ptr) != 0;
+}
+
+#define	LANE_HINTS 4	/* pools a thread remembers its lane in */
+
+/* the lane this thread used last in each of a few pools, only hints */
+static __thread struct lane_hint {
+	PMEMblk *pbp;
+	unsigned lane;
+} Thread_lanes[LANE_HINTS];
+static __thread unsigned Thread_lanes_next;	/* hint replaced next */
+
+/*
+ * lane_hint -- (internal) the calling thread's lane hint for a pool
+ *
+ * A pool the thread has no hint for takes the place of the one that got
+ * its hint the longest ago.
+ */
+static struct lane_hint *
+lane_hint(PMEMblk *pbp)
+{
+	for (unsigned i = 0; i < LANE_HINTS; i++)
+		if (Thread_lanes[i].pbp == pbp)
+			return &Thread_lanes[i];
+
+	struct lane_hint *hp = &Thread_lanes[Thread_lanes_next++ % LANE_HINTS];
+	hp->pbp = pbp;
+	hp->lane = 0;
+	return hp;
 }
 
 /*
  * lane_enter -- (internal) acquire a unique lane number
+ *
+ * A thread gets the lane it used last in the pool whenever it is free,
+ * so threads settle on lanes of their own and neither share the counter
+ * below nor wait for each other.  Otherwise lanes are tried round-robin,
+ * if they are all busy the caller waits for the first one it tried.
  */
 static int
 lane_enter(PMEMblk *pbp)
 {
-	int mylane;
+	struct lane_hint *hp = lane_hint(pbp);
+	unsigned nlane = pbp->nlane;
+	unsigned mylane = hp->lane % nlane;
+
+	if (pthread_mutex_trylock(&pbp->locks[mylane]) == 0)
+		goto out;
 
-	mylane = __sync_fetch_and_add(&pbp->next_lane, 1) % pbp->nlane;
+	unsigned start = __sync_fetch_and_add(&pbp->next_lane, 1);
 
-	/* lane selected, grab the per-lane lock */
-	if (pthread_mutex_lock(&pbp->locks[mylane]) < 0) {
+	for (unsigned i = 0; i < nlane; i++) {
+		mylane = (start + i) % nlane;
+		if (pthread_mutex_trylock(&pbp->locks[mylane]) == 0)
+			goto out;
+	}
+
+	/* all busy, wait for one */
+	mylane = start % nlane;
+	if ((errno = pthread_mutex_lock(&pbp->locks[mylane])) != 0) {
 		LOG(1, "!pthread_mutex_lock");
 		return -1;
 	}
 
+out:
+	hp->lane = mylane;
 	return mylane;
 }
 
@@ -130,17 +222,17 @@ nsread(void *ns, int lane, void *buf, size_t count, off_t off)
 }
 
 /*
- * nswrite -- (internal) write data to the namespace encapsulating the BTT
+ * ns_write -- (internal) common code for nswrite() and nswrite_nodrain()
  *
- * This routine is provided to btt_init() to allow the btt module to
- * do I/O on the memory pool containing the BTT layout.
+ * With drain set the range is persistent when this returns, otherwise it
+ * is added to the lane's persist batch for the next nsdrain().
  */
 static int
-nswrite(void *ns, int lane, const void *buf, size_t count, off_t off)
+ns_write(struct pmemblk *pbp, int lane, const void *buf, size_t count,
+		off_t off, int drain)
 {
-	struct pmemblk *pbp = (struct pmemblk *)ns;
-
-	LOG(13, "pbp %p lane %d count %zu off %zu", pbp, lane, count, off);
+	LOG(13, "pbp %p lane %d count %zu off %zu drain %d", pbp, lane,
+			count, off, drain);
 
 	if (off + count >= pbp->datasize) {
 		LOG(1, "offset + count (%zu) past end of data area (%zu)",
@@ -160,7 +252,11 @@ nswrite(void *ns, int lane, const void *buf, size_t count, off_t off)
 	/* unprotect the memory (debug version only) */
 	RANGE_RW(dest, count);
 
-	memcpy(dest, buf, count);
+	if (drain)
+		libpmem_memcpy_persist(PMEM_FLUSH_SRC_BLK, pbp->is_pmem,
+				dest, buf, count);
+	else
+		memcpy(dest, buf, count);
 
 	/* protect the memory again (debug version only) */
 	RANGE_RO(dest, count);
@@ -171,11 +267,24 @@ nswrite(void *ns, int lane, const void *buf, size_t count, off_t off)
 		LOG(1, "!pthread_mutex_unlock");
 #endif
 
-	libpmem_persist(pbp->is_pmem, dest, count);
+	if (!drain)
+		libpmem_batch_add(&pbp->batches[lane], dest, count);
 
 	return 0;
 }
 
+/*
+ * nswrite -- (internal) write data to the namespace encapsulating the BTT
+ *
+ * This routine is provided to btt_init() to allow the btt module to
+ * do I/O on the memory pool containing the BTT layout.
+ */
+static int
+nswrite(void *ns, int lane, const void *buf, size_t count, off_t off)
+{
+	return ns_write((struct pmemblk *)ns, lane, buf, count, off, 1);
+}
+
 /*
  * nsmap -- (internal) allow direct access to a range of a namespace
  *
@@ -229,7 +338,41 @@ nssync(void *ns, int lane, void *addr, size_t len)
 
 	LOG(12, "pbp %p lane %d addr %p len %zu", pbp, lane, addr, len);
 
-	libpmem_persist(pbp->is_pmem, addr, len);
+	libpmem_persist(PMEM_FLUSH_SRC_BLK, pbp->is_pmem, addr, len);
+}
+
+/*
+ * nswrite_nodrain -- (internal) write data to the namespace, deferred
+ *
+ * Like nswrite(), except that the range is only added to the lane's
+ * persist batch, it is flushed and fenced by the next nsdrain() on the
+ * lane.
+ *
+ * This routine is provided to btt_init() to allow the btt module to
+ * do I/O on the memory pool containing the BTT layout.
+ */
+static int
+nswrite_nodrain(void *ns, int lane, const void *buf, size_t count, off_t off)
+{
+	return ns_write((struct pmemblk *)ns, lane, buf, count, off, 0);
+}
+
+/*
+ * nsdrain -- (internal) make the deferred writes on a lane durable
+ *
+ * The lane is held by the caller, so its batch needs no locking.
+ *
+ * This routine is provided to btt_init() to allow the btt module to
+ * do I/O on the memory pool containing the BTT layout.
+ */
+static void
+nsdrain(void *ns, int lane)
+{
+	struct pmemblk *pbp = (struct pmemblk *)ns;
+
+	LOG(13, "pbp %p lane %d", pbp, lane);
+
+	libpmem_batch_persist(&pbp->batches[lane]);
 }
 
 /* callbacks for btt_init() */
@@ -237,7 +380,9 @@ static const struct ns_callback ns_cb = {
 	nsread,
 	nswrite,
 	nsmap,
-	nssync
+	nssync,
+	nswrite_nodrain,
+	nsdrain
 };
 
 /*
@@ -258,6 +403,7 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 	void *addr = NULL;
 	struct btt *bttp = NULL;
 	pthread_mutex_t *locks = NULL;
+	struct persist_batch *batches = NULL;
 
 	struct stat stbuf;
 	if (fstat(fd, &stbuf) < 0) {
@@ -275,6 +421,8 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 	if ((addr = util_map(fd, stbuf.st_size, rdonly)) == NULL)
 		return NULL;	/* util_map() set errno, called LOG */
 
+	util_prefault(addr, stbuf.st_size, !rdonly);
+
 	/* check if the mapped region is located in persistent memory */
 	int is_pmem = pmem_is_pmem(addr, stbuf.st_size);
 
@@ -331,25 +479,32 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 		}
 		LOG(3, "creating new blk memory pool");
 
+		/*
+		 * The metadata goes first, a valid header is what makes
+		 * it count, so it must never be found with a zero one.
+		 */
+		pbp->bsize = htole32(bsize);
+		libpmem_persist(PMEM_FLUSH_SRC_BLK, is_pmem, &pbp->bsize,
+				sizeof (bsize));
+
 		struct pool_hdr *hdrp = &pbp->hdr;
+		int csum = util_checksum_create();
 
 		memset(hdrp, '\0', sizeof (*hdrp));
 		strncpy(hdrp->signature, BLK_HDR_SIG, POOL_HDR_SIG_LEN);
 		hdrp->major = htole32(BLK_FORMAT_MAJOR);
 		hdrp->compat_features = htole32(BLK_FORMAT_COMPAT);
-		hdrp->incompat_features = htole32(BLK_FORMAT_INCOMPAT);
+		hdrp->incompat_features = htole32(POOL_HDR_CSUM_FEAT(csum) |
+				(Block_csum ? BLK_FEAT_BLOCK_CSUM : 0));
 		hdrp->ro_compat_features = htole32(BLK_FORMAT_RO_COMPAT);
 		uuid_generate(hdrp->uuid);
 		hdrp->crtime = htole64((uint64_t)time(NULL));
-		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1);
+		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1, csum);
 		hdrp->checksum = htole64(hdrp->checksum);
 
-		/* store pool's header */
-		libpmem_persist(is_pmem, hdrp, sizeof (*hdrp));
-
-		/* create rest of required metadata */
-		pbp->bsize = htole32(bsize);
-		libpmem_persist(is_pmem, &pbp->bsize, sizeof (bsize));
+		/* store the header only once the metadata is persistent */
+		libpmem_persist(PMEM_FLUSH_SRC_BLK, is_pmem, hdrp,
+				sizeof (*hdrp));
 	}
 
 	/*
@@ -371,8 +526,16 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 	if (ncpus < 1)
 		ncpus = 1;
 
+	/* a new BTT layout is checksummed the way the pool header says */
+	uint32_t incompat = le32toh(pbp->hdr.incompat_features);
+	int flags = 0;
+	if (POOL_HDR_CSUM(incompat) == CSUM_CRC32C)
+		flags |= BTT_CRC32C;
+	if (incompat & BLK_FEAT_BLOCK_CSUM)
+		flags |= BTT_BLOCK_CSUM;
+
 	bttp = btt_init(pbp->datasize, (uint32_t)bsize, pbp->hdr.uuid,
-			ncpus, pbp, &ns_cb);
+			flags, ncpus, pbp, &ns_cb);
 
 	if (bttp == NULL)
 		goto err;	/* btt_init set errno, called LOG */
@@ -392,7 +555,19 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 			goto err;
 		}
 
+	if ((batches = Malloc(pbp->nlane * sizeof (*batches))) == NULL) {
+		LOG(1, "!Malloc for lane persist batches");
+		goto err;
+	}
+
+	for (int i = 0; i < pbp->nlane; i++)
+		libpmem_batch_init(&batches[i], PMEM_FLUSH_SRC_BLK,
+				pbp->is_pmem);
+
 	pbp->locks = locks;
+	pbp->batches = batches;
+	pbp->scrub = NULL;
+	pbp->aio = NULL;
 
 #ifdef DEBUG
 	/* initialize debug lock */
@@ -419,6 +594,8 @@ pmemblk_map_common(int fd, size_t bsize, int rdonly)
 err:
 	LOG(4, "error clean up");
 	int oerrno = errno;
+	if (batches)
+		Free(batches);
 	if (locks)
 		Free((void *)locks);
 	if (bttp)
@@ -447,12 +624,19 @@ pmemblk_unmap(PMEMblk *pbp)
 {
 	LOG(3, "pbp %p", pbp);
 
+	if (pbp->aio)
+		pmemblk_aio_stop(pbp);
+	if (pbp->scrub)
+		pmemblk_scrub_stop(pbp);
+
 	btt_fini(pbp->bttp);
 	if (pbp->locks) {
 		for (int i = 0; i < pbp->nlane; i++)
 			pthread_mutex_destroy(&pbp->locks[i]);
 		Free((void *)pbp->locks);
 	}
+	if (pbp->batches)
+		Free(pbp->batches);
 
 #ifdef DEBUG
 	/* destroy debug lock */
@@ -519,6 +703,141 @@ pmemblk_write(PMEMblk *pbp, const void *buf, off_t blockno)
 	return err;
 }
 
+/*
+ * blk_batch -- (internal) read or write a batch of blocks
+ *
+ * The blocks are either given by iov or, if it is NULL, are the count
+ * blocks from blockno on, in buf.  One lane is held for the whole batch,
+ * the blocks are handed to the btt BLK_IOV_CHUNK at a time.
+ */
+static int
+blk_batch(PMEMblk *pbp, int write, const struct pmemblk_iov *iov,
+		char *buf, off_t blockno, size_t count)
+{
+	size_t nlba = btt_nlba(pbp->bttp);
+
+	if (iov != NULL) {
+		for (size_t i = 0; i < count; i++)
+			if (iov[i].blockno < 0 ||
+					(size_t)iov[i].blockno >= nlba) {
+				LOG(1, "invalid block number %zu in iov[%zu]",
+						iov[i].blockno, i);
+				errno = EINVAL;
+				return -1;
+			}
+	} else if (blockno < 0 || count > nlba ||
+			(size_t)blockno > nlba - count) {
+		LOG(1, "invalid block range %zu count %zu", blockno, count);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (count == 0)
+		return 0;
+
+	int lane = lane_enter(pbp);
+
+	if (lane < 0)
+		return -1;
+
+	size_t bsize = le32toh(pbp->bsize);
+	struct btt_iov biov[BLK_IOV_CHUNK];
+	int err = 0;
+
+	for (size_t done = 0; done < count && err == 0; ) {
+		int n;
+		for (n = 0; n < BLK_IOV_CHUNK && done < count; n++, done++) {
+			if (iov != NULL) {
+				biov[n].buf = iov[done].buf;
+				biov[n].lba = iov[done].blockno;
+			} else {
+				biov[n].buf = buf + done * bsize;
+				biov[n].lba = blockno + done;
+			}
+		}
+
+		if (write)
+			err = btt_writev(pbp->bttp, lane, biov, n);
+		else
+			err = btt_readv(pbp->bttp, lane, biov, n);
+	}
+
+	lane_exit(pbp, lane);
+
+	return err;
+}
+
+/*
+ * pmemblk_readv -- read a batch of blocks in a block memory pool
+ */
+int
+pmemblk_readv(PMEMblk *pbp, const struct pmemblk_iov *iov, int iovcnt)
+{
+	LOG(3, "pbp %p iov %p iovcnt %d", pbp, iov, iovcnt);
+
+	if (iovcnt < 0) {
+		LOG(1, "invalid iovcnt %d", iovcnt);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return blk_batch(pbp, 0, iov, NULL, 0, iovcnt);
+}
+
+/*
+ * pmemblk_writev -- write a batch of blocks in a block memory pool
+ */
+int
+pmemblk_writev(PMEMblk *pbp, const struct pmemblk_iov *iov, int iovcnt)
+{
+	LOG(3, "pbp %p iov %p iovcnt %d", pbp, iov, iovcnt);
+
+	if (pbp->rdonly) {
+		LOG(1, "EROFS (pool is read-only)");
+		errno = EROFS;
+		return -1;
+	}
+
+	if (iovcnt < 0) {
+		LOG(1, "invalid iovcnt %d", iovcnt);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return blk_batch(pbp, 1, iov, NULL, 0, iovcnt);
+}
+
+/*
+ * pmemblk_read_range -- read consecutive blocks in a block memory pool
+ */
+int
+pmemblk_read_range(PMEMblk *pbp, void *buf, off_t blockno, size_t nblock)
+{
+	LOG(3, "pbp %p buf %p blockno %zu nblock %zu", pbp, buf, blockno,
+			nblock);
+
+	return blk_batch(pbp, 0, NULL, buf, blockno, nblock);
+}
+
+/*
+ * pmemblk_write_range -- write consecutive blocks in a block memory pool
+ */
+int
+pmemblk_write_range(PMEMblk *pbp, const void *buf, off_t blockno,
+		size_t nblock)
+{
+	LOG(3, "pbp %p buf %p blockno %zu nblock %zu", pbp, buf, blockno,
+			nblock);
+
+	if (pbp->rdonly) {
+		LOG(1, "EROFS (pool is read-only)");
+		errno = EROFS;
+		return -1;
+	}
+
+	return blk_batch(pbp, 1, NULL, (char *)buf, blockno, nblock);
+}
+
 /*
  * pmemblk_set_zero -- zero a block in a block memory pool
  */
@@ -571,6 +890,493 @@ pmemblk_set_error(PMEMblk *pbp, off_t blockno)
 	return err;
 }
 
+/*
+ * blk_scrub_thread -- (internal) verify all blocks, over and over again
+ */
+static void *
+blk_scrub_thread(void *arg)
+{
+	PMEMblk *pbp = arg;
+	struct blk_scrub *sp = pbp->scrub;
+	size_t nlba = btt_nlba(pbp->bttp);
+	uint64_t lba = 0;
+	uint64_t nscrubbed = 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_REALTIME, &start);
+
+	pthread_mutex_lock(&sp->lock);
+	while (!sp->stop) {
+		pthread_mutex_unlock(&sp->lock);
+
+		int bad = 0;
+		int lane = lane_enter(pbp);
+		if (lane >= 0) {
+			bad = btt_scrub(pbp->bttp, lane, lba);
+			lane_exit(pbp, lane);
+		}
+
+		pthread_mutex_lock(&sp->lock);
+		sp->stats.blocks++;
+		if (bad > 0)
+			sp->stats.errors++;
+		if (++lba == nlba) {
+			lba = 0;
+			sp->stats.passes++;
+		}
+
+		if (sp->rate == 0)
+			continue;
+
+		/* keep to the rate, a stop wakes the thread up early */
+		nscrubbed++;
+		struct timespec until = start;
+		until.tv_sec += nscrubbed / sp->rate;
+		until.tv_nsec += (nscrubbed % sp->rate) * 1000000000ULL /
+				sp->rate;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+
+		while (!sp->stop && pthread_cond_timedwait(&sp->cond,
+					&sp->lock, &until) == 0)
+			;
+	}
+	pthread_mutex_unlock(&sp->lock);
+
+	return NULL;
+}
+
+/*
+ * pmemblk_scrub_start -- start verifying the blocks in the background
+ *
+ * rate is in blocks per second, 0 means as fast as possible.  Bad blocks
+ * are set to the error state, see pmemblk_set_error().
+ */
+int
+pmemblk_scrub_start(PMEMblk *pbp, unsigned rate)
+{
+	LOG(3, "pbp %p rate %u", pbp, rate);
+
+	if (pbp->rdonly) {
+		LOG(1, "EROFS (pool is read-only)");
+		errno = EROFS;
+		return -1;
+	}
+
+	if (pbp->scrub) {
+		LOG(1, "scrubber already running");
+		errno = EBUSY;
+		return -1;
+	}
+
+	struct blk_scrub *sp = Malloc(sizeof (*sp));
+	if (sp == NULL) {
+		LOG(1, "!Malloc for scrubber");
+		return -1;
+	}
+
+	memset(sp, '\0', sizeof (*sp));
+	pthread_mutex_init(&sp->lock, NULL);
+	pthread_cond_init(&sp->cond, NULL);
+	sp->rate = rate;
+	pbp->scrub = sp;
+
+	if ((errno = pthread_create(&sp->thread, NULL, blk_scrub_thread,
+					pbp)) != 0) {
+		LOG(1, "!pthread_create");
+		int oerrno = errno;
+		pbp->scrub = NULL;
+		pthread_cond_destroy(&sp->cond);
+		pthread_mutex_destroy(&sp->lock);
+		Free(sp);
+		errno = oerrno;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * pmemblk_scrub_stop -- stop the background scrubber
+ */
+int
+pmemblk_scrub_stop(PMEMblk *pbp)
+{
+	LOG(3, "pbp %p", pbp);
+
+	struct blk_scrub *sp = pbp->scrub;
+	if (sp == NULL) {
+		LOG(1, "scrubber not running");
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sp->lock);
+	sp->stop = 1;
+	pthread_cond_signal(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
+
+	pthread_join(sp->thread, NULL);
+
+	LOG(3, "passes %ju blocks %ju errors %ju",
+			(uintmax_t)sp->stats.passes,
+			(uintmax_t)sp->stats.blocks,
+			(uintmax_t)sp->stats.errors);
+
+	pbp->scrub = NULL;
+	pthread_cond_destroy(&sp->cond);
+	pthread_mutex_destroy(&sp->lock);
+	Free(sp);
+
+	return 0;
+}
+
+/*
+ * pmemblk_scrub_stats -- return how far the running scrubber got
+ */
+int
+pmemblk_scrub_stats(PMEMblk *pbp, struct pmemblk_scrub_stats *statsp)
+{
+	LOG(3, "pbp %p statsp %p", pbp, statsp);
+
+	struct blk_scrub *sp = pbp->scrub;
+	if (sp == NULL) {
+		LOG(1, "scrubber not running");
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sp->lock);
+	*statsp = sp->stats;
+	pthread_mutex_unlock(&sp->lock);
+
+	return 0;
+}
+
+/*
+ * blk_aio_run -- (internal) carry out a batch of operations on a lane
+ *
+ * A run of writes goes to the btt as one batch, sharing fences.  If the
+ * batch fails, its writes are redone one at a time to find out which of
+ * them fail.  errors[i] is set to the outcome of ops[i].
+ */
+static void
+blk_aio_run(PMEMblk *pbp, int lane, const struct pmemblk_aio_op *ops,
+		int *errors, unsigned n)
+{
+	struct btt_iov biov[BLK_IOV_CHUNK];
+
+	for (unsigned i = 0; i < n; ) {
+		const struct pmemblk_aio_op *op = &ops[i];
+		int err = 0;
+
+		if (op->opcode != PMEMBLK_AIO_READ && pbp->rdonly) {
+			errors[i++] = EROFS;
+			continue;
+		}
+
+		switch (op->opcode) {
+		case PMEMBLK_AIO_READ:
+			err = btt_read(pbp->bttp, lane, op->blockno, op->buf);
+			break;
+
+		case PMEMBLK_AIO_SET_ZERO:
+			err = btt_set_zero(pbp->bttp, lane, op->blockno);
+			break;
+
+		case PMEMBLK_AIO_WRITE: {
+			unsigned nw = 0;
+			for (; i + nw < n &&
+				ops[i + nw].opcode == PMEMBLK_AIO_WRITE; nw++) {
+				biov[nw].buf = ops[i + nw].buf;
+				biov[nw].lba = ops[i + nw].blockno;
+			}
+
+			if (btt_writev(pbp->bttp, lane, biov, nw) == 0)
+				for (unsigned k = 0; k < nw; k++)
+					errors[i + k] = 0;
+			else
+				for (unsigned k = 0; k < nw; k++)
+					errors[i + k] = btt_write(pbp->bttp,
+						lane, biov[k].lba,
+						biov[k].buf) < 0 ? errno : 0;
+			i += nw;
+			continue;
+		}
+
+		default:
+			/* pmemblk_aio_submit() lets no other opcode in */
+			ASSERT(0);
+		}
+
+		errors[i++] = err < 0 ? errno : 0;
+	}
+}
+
+/*
+ * blk_aio_thread -- (internal) carry out submitted operations
+ *
+ * Operations are taken a batch at a time, leaving a share for each of
+ * the other workers, and done holding one lane.  With the lanes sticky,
+ * each worker settles on a lane of its own.
+ */
+static void *
+blk_aio_thread(void *arg)
+{
+	PMEMblk *pbp = arg;
+	struct blk_aio *ap = pbp->aio;
+	struct pmemblk_aio_op ops[BLK_IOV_CHUNK];
+	int errors[BLK_IOV_CHUNK];
+
+	pthread_mutex_lock(&ap->lock);
+	for (;;) {
+		while (!ap->stop && ap->sq_head == ap->sq_tail)
+			pthread_cond_wait(&ap->work, &ap->lock);
+
+		unsigned avail = ap->sq_tail - ap->sq_head;
+		if (avail == 0)
+			break;	/* stopped, and nothing is left to do */
+
+		unsigned n = (avail + ap->nthread - 1) / ap->nthread;
+		if (n > BLK_IOV_CHUNK)
+			n = BLK_IOV_CHUNK;
+		for (unsigned i = 0; i < n; i++)
+			ops[i] = ap->sq[ap->sq_head++ & (ap->depth - 1)];
+		pthread_mutex_unlock(&ap->lock);
+
+		int lane = lane_enter(pbp);
+		if (lane < 0) {
+			for (unsigned i = 0; i < n; i++)
+				errors[i] = errno;
+		} else {
+			blk_aio_run(pbp, lane, ops, errors, n);
+			lane_exit(pbp, lane);
+		}
+
+		pthread_mutex_lock(&ap->lock);
+		for (unsigned i = 0; i < n; i++) {
+			struct pmemblk_aio_cqe *cqe =
+				&ap->cq[ap->cq_tail++ & (ap->depth - 1)];
+			cqe->user_data = ops[i].user_data;
+			cqe->error = errors[i];
+		}
+		pthread_cond_broadcast(&ap->done);
+	}
+	pthread_mutex_unlock(&ap->lock);
+
+	return NULL;
+}
+
+/*
+ * blk_aio_fini -- (internal) stop the workers and free the queues
+ */
+static void
+blk_aio_fini(PMEMblk *pbp)
+{
+	struct blk_aio *ap = pbp->aio;
+
+	pthread_mutex_lock(&ap->lock);
+	ap->stop = 1;
+	pthread_cond_broadcast(&ap->work);
+	pthread_mutex_unlock(&ap->lock);
+
+	for (unsigned i = 0; i < ap->nthread; i++)
+		pthread_join(ap->threads[i], NULL);
+
+	pbp->aio = NULL;
+	pthread_cond_destroy(&ap->done);
+	pthread_cond_destroy(&ap->work);
+	pthread_mutex_destroy(&ap->lock);
+	Free(ap->threads);
+	Free(ap->cq);
+	Free(ap->sq);
+	Free(ap);
+}
+
+/*
+ * pmemblk_aio_start -- start the workers for asynchronous I/O
+ */
+int
+pmemblk_aio_start(PMEMblk *pbp, unsigned depth, unsigned nthread)
+{
+	LOG(3, "pbp %p depth %u nthread %u", pbp, depth, nthread);
+
+	if (pbp->aio) {
+		LOG(1, "asynchronous I/O already started");
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (depth > BLK_AIO_MAXDEPTH) {
+		LOG(1, "depth %u larger than %u", depth, BLK_AIO_MAXDEPTH);
+		errno = EINVAL;
+		return -1;
+	}
+
+	unsigned qdepth = 1;
+	while (qdepth < (depth ? depth : BLK_AIO_DEPTH))
+		qdepth <<= 1;
+
+	/* more workers than lanes would only wait for each other */
+	if (nthread == 0 || nthread > (unsigned)pbp->nlane)
+		nthread = pbp->nlane;
+
+	struct blk_aio *ap = Malloc(sizeof (*ap));
+	if (ap == NULL) {
+		LOG(1, "!Malloc for asynchronous I/O");
+		return -1;
+	}
+
+	memset(ap, '\0', sizeof (*ap));
+	ap->depth = qdepth;
+	ap->sq = Malloc(qdepth * sizeof (*ap->sq));
+	ap->cq = Malloc(qdepth * sizeof (*ap->cq));
+	ap->threads = Malloc(nthread * sizeof (*ap->threads));
+	if (ap->sq == NULL || ap->cq == NULL || ap->threads == NULL) {
+		LOG(1, "!Malloc for asynchronous I/O queues");
+		int oerrno = errno;
+		Free(ap->threads);
+		Free(ap->cq);
+		Free(ap->sq);
+		Free(ap);
+		errno = oerrno;
+		return -1;
+	}
+
+	pthread_mutex_init(&ap->lock, NULL);
+	pthread_cond_init(&ap->work, NULL);
+	pthread_cond_init(&ap->done, NULL);
+	pbp->aio = ap;
+
+	/* nthread counts the workers running, they only read it locked */
+	pthread_mutex_lock(&ap->lock);
+	for (; ap->nthread < nthread; ap->nthread++)
+		if ((errno = pthread_create(&ap->threads[ap->nthread], NULL,
+					blk_aio_thread, pbp)) != 0)
+			break;
+	pthread_mutex_unlock(&ap->lock);
+
+	if (ap->nthread < nthread) {
+		LOG(1, "!pthread_create");
+		int oerrno = errno;
+		blk_aio_fini(pbp);
+		errno = oerrno;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * pmemblk_aio_stop -- finish the queued operations and stop the workers
+ */
+int
+pmemblk_aio_stop(PMEMblk *pbp)
+{
+	LOG(3, "pbp %p", pbp);
+
+	if (pbp->aio == NULL) {
+		LOG(1, "asynchronous I/O not started");
+		errno = EINVAL;
+		return -1;
+	}
+
+	blk_aio_fini(pbp);
+
+	return 0;
+}
+
+/*
+ * pmemblk_aio_submit -- queue operations for the workers
+ *
+ * Returns the number of operations queued, otherwise -1/errno.
+ */
+int
+pmemblk_aio_submit(PMEMblk *pbp, const struct pmemblk_aio_op *ops,
+		unsigned nops)
+{
+	LOG(3, "pbp %p ops %p nops %u", pbp, ops, nops);
+
+	struct blk_aio *ap = pbp->aio;
+	if (ap == NULL) {
+		LOG(1, "asynchronous I/O not started");
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (unsigned i = 0; i < nops; i++)
+		if (ops[i].opcode != PMEMBLK_AIO_READ &&
+				ops[i].opcode != PMEMBLK_AIO_WRITE &&
+				ops[i].opcode != PMEMBLK_AIO_SET_ZERO) {
+			LOG(1, "invalid opcode %d in ops[%u]",
+					ops[i].opcode, i);
+			errno = EINVAL;
+			return -1;
+		}
+
+	pthread_mutex_lock(&ap->lock);
+
+	unsigned n = ap->depth - ap->inflight;
+	if (n > nops)
+		n = nops;
+	for (unsigned i = 0; i < n; i++)
+		ap->sq[ap->sq_tail++ & (ap->depth - 1)] = ops[i];
+	ap->inflight += n;
+
+	if (n > 1)
+		pthread_cond_broadcast(&ap->work);
+	else if (n == 1)
+		pthread_cond_signal(&ap->work);
+
+	pthread_mutex_unlock(&ap->lock);
+
+	return n;
+}
+
+/*
+ * pmemblk_aio_reap -- collect completed operations
+ *
+ * Returns the number of completions stored in cqes, otherwise -1/errno.
+ */
+int
+pmemblk_aio_reap(PMEMblk *pbp, struct pmemblk_aio_cqe *cqes,
+		unsigned max, unsigned min)
+{
+	LOG(3, "pbp %p cqes %p max %u min %u", pbp, cqes, max, min);
+
+	struct blk_aio *ap = pbp->aio;
+	if (ap == NULL) {
+		LOG(1, "asynchronous I/O not started");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (min > max)
+		min = max;
+
+	pthread_mutex_lock(&ap->lock);
+
+	/* waiting for more than is outstanding would never end */
+	if (min > ap->inflight)
+		min = ap->inflight;
+
+	while (ap->cq_tail - ap->cq_head < min)
+		pthread_cond_wait(&ap->done, &ap->lock);
+
+	unsigned n = ap->cq_tail - ap->cq_head;
+	if (n > max)
+		n = max;
+	for (unsigned i = 0; i < n; i++)
+		cqes[i] = ap->cq[ap->cq_head++ & (ap->depth - 1)];
+	ap->inflight -= n;
+
+	pthread_mutex_unlock(&ap->lock);
+
+	return n;
+}
+
 /*
  * pmemblk_check -- block memory pool consistency check
  */
@@ -38,9 +38,11 @@
 #define	BLK_HDR_SIG "PMEMBLK"	/* must be 8 bytes including '\0' */
 #define	BLK_FORMAT_MAJOR 1
 #define	BLK_FORMAT_COMPAT 0x0000
-#define	BLK_FORMAT_INCOMPAT 0x0000
+#define	BLK_FORMAT_INCOMPAT (POOL_FEAT_CRC32C|BLK_FEAT_BLOCK_CSUM)
 #define	BLK_FORMAT_RO_COMPAT 0x0000
 
+#define	BLK_FEAT_BLOCK_CSUM 0x0100	/* each block carries a CRC32C */
+
 struct pmemblk {
 	struct pool_hdr hdr;	/* memory pool header */
 
@@ -58,8 +60,11 @@ struct pmemblk {
 	struct btt *bttp;		/* btt handle */
 	struct ns_callback *ns_cbp;	/* callbacks for btt_init() */
 	int nlane;			/* number of lanes */
-	unsigned next_lane;		/* used to rotate through lanes */
+	unsigned next_lane;		/* rotates lanes when one is busy */
 	pthread_mutex_t *locks;		/* one per lane */
+	struct persist_batch *batches;	/* one per lane, see nsdrain() */
+	struct blk_scrub *scrub;	/* see pmemblk_scrub_start() */
+	struct blk_aio *aio;		/* see pmemblk_aio_start() */
 
 #ifdef DEBUG
 	/* held during read/write mprotected sections */
@@ -69,3 +74,10 @@ struct pmemblk {
 
 /* data area starts at this alignement after the struct pmemblk above */
 #define	BLK_FORMAT_DATA_ALIGN 4096
+
+/* blocks of a batch handed to btt_readv() or btt_writev() at a time */
+#define	BLK_IOV_CHUNK 64
+
+/* queue depths of pmemblk_aio_start() */
+#define	BLK_AIO_DEPTH 256	/* the default */
+#define	BLK_AIO_MAXDEPTH 65536
@@ -37,19 +37,24 @@
  * single block powerfail write atomicity, as described by:
  * 	The NVDIMM Namespace Specification
  *
- * To use this module, the caller must provide three routines for
- * accessing the namespace containing the data (in this context,
- * "namespace" refers to the storage containing the BTT layout, such
- * as a file).  All namespace I/O is done by these three calls:
+ * To use this module, the caller must provide routines for accessing
+ * the namespace containing the data (in this context, "namespace" refers
+ * to the storage containing the BTT layout, such as a file).  All
+ * namespace I/O is done by these calls:
  *
  * 	nsread	Read count bytes from namespace at offset off
  * 	nswrite	Write count bytes to namespace at offset off
  * 	nsmap	Return direct access to a range of a namespace
  * 	nssync	Flush changes made to an nsmap'd range
+ * 	nswrite_nodrain
+ * 		Write count bytes to namespace at offset off, deferred
+ * 	nsdrain	Make the deferred writes done on a lane durable
  *
  * Data written by the nswrite callback is flushed out to the media
  * (made durable) when the call returns.  Data written directly via
- * the nsmap callback must be flushed explicitly using nssync.
+ * the nsmap callback must be flushed explicitly using nssync.  Data
+ * written by nswrite_nodrain is only durable once nsdrain returns for
+ * the same lane, so writes with no ordering between them share a fence.
  *
  * The caller passes these callbacks, along with information such as
  * namespace size and UUID to btt_init() and gets back an opaque handle
@@ -65,6 +70,10 @@
  *
  *	btt_write	Writes a single block (atomically) at a given LBA
  *
+ *	btt_readv	Reads a batch of blocks
+ *
+ *	btt_writev	Writes a batch of blocks, each one atomically
+ *
  *	btt_set_zero	Sets a block to read back as zeros
  *
  *	btt_set_error	Sets a block to return error on read
@@ -110,6 +119,8 @@
  *	map_unlock	data structure in an area.
  *	map_abort
  *
+ *	write_block	Common code for btt_write() and btt_writev().
+ *
  *	map_entry_setf	Common code for btt_set_zero() and btt_set_error().
  *
  *	zero_block	Generate a block of all zeros (instead of actually
@@ -160,6 +171,12 @@ struct btt {
 	 */
 	uint8_t parent_uuid[BTTINFO_UUID_LEN];
 
+	/*
+	 * BTTINFO_FLAG_CRC32C and BTTINFO_FLAG_BLOCK_CSUM for a new layout,
+	 * an existing one has them in the flags of its info blocks.
+	 */
+	uint32_t info_flags;
+
 	/*
 	 * Parameters controlling/describing the BTT layout.
 	 */
@@ -234,6 +251,13 @@ struct btt {
 	 */
 	void *ns;
 	const struct ns_callback *ns_cbp;
+
+	/*
+	 * A block and its checksum are written from here, so both are
+	 * made persistent together.  One of lbasize + BTT_BLOCK_CSUM_SIZE
+	 * bytes per lane.
+	 */
+	char *bounce;
 };
 
 /*
@@ -321,7 +345,10 @@ read_info(struct btt_info *infop)
 	infop->checksum = le64toh(infop->checksum);
 
 	/* and to be valid, the fields must checksum correctly */
-	if (!util_checksum(infop, sizeof (*infop), &infop->checksum, 0)) {
+	int csum = (infop->flags & BTTINFO_FLAG_CRC32C) ?
+			CSUM_CRC32C : CSUM_FLETCHER64;
+	if (!util_checksum(infop, sizeof (*infop), &infop->checksum, 0,
+			csum)) {
 		LOG(3, "invalid checksum");
 		return 0;
 	}
@@ -472,6 +499,9 @@ read_flog_pair(struct btt *bttp, int lane, struct arena *arenap,
  * and, only after those fields are known to be written durably, the
  * second write for the seq field is done.
  *
+ * The first write shares its fence with everything else still pending on
+ * the lane, which is how the data block written just before gets durable.
+ *
  * Returns 0 on success, otherwise -1/errno.
  */
 static int
@@ -493,9 +523,10 @@ flog_update(struct btt *bttp, int lane, struct arena *arenap,
 
 	/* write out first three fields first */
 	/* XXX writing two fields and two fields will be faster */
-	if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, &new_flog,
+	if ((*bttp->ns_cbp->nswrite_nodrain)(bttp->ns, lane, &new_flog,
 				sizeof (uint32_t) * 3, new_flog_off) < 0)
 		return -1;
+	(*bttp->ns_cbp->nsdrain)(bttp->ns, lane);
 	new_flog_off += sizeof (uint32_t) * 3;
 
 	/* write out seq field to make it active */
@@ -628,6 +659,15 @@ read_arena(struct btt *bttp, int lane, off_t arena_off, struct arena *arenap)
 	arenap->flogoff = arena_off + le64toh(info.flogoff);
 	arenap->nextoff = arena_off + le64toh(info.nextoff);
 
+	if ((arenap->flags & BTTINFO_FLAG_BLOCK_CSUM) &&
+			arenap->internal_lbasize <
+			bttp->lbasize + BTT_BLOCK_CSUM_SIZE) {
+		LOG(1, "no room for block checksums, internal_lbasize %u",
+				arenap->internal_lbasize);
+		errno = EINVAL;
+		return -1;
+	}
+
 	if (read_flogs(bttp, lane, arenap) < 0)
 		return -1;
 
@@ -731,6 +771,8 @@ write_layout(struct btt *bttp, int lane, int write)
 	flog_size = roundup(flog_size, BTT_ALIGNMENT);
 
 	uint32_t internal_lbasize = bttp->lbasize;
+	if (bttp->info_flags & BTTINFO_FLAG_BLOCK_CSUM)
+		internal_lbasize += BTT_BLOCK_CSUM_SIZE;
 	if (internal_lbasize < BTT_MIN_LBA)
 		internal_lbasize = BTT_MIN_LBA;
 	internal_lbasize =
@@ -852,38 +894,41 @@ write_layout(struct btt *bttp, int lane, int write)
 		if (mapp != NULL)
 			(*bttp->ns_cbp->nssync)(bttp->ns, lane, mapp, mlen);
 
-		/* write out the initial flog */
-		off_t flog_entry_off = arena_off + flogoff;
+		/*
+		 * Write out the initial flog.  Both btt_flog structs in each
+		 * pair are written, the second one as all zeros.  The pairs
+		 * are built in memory and written with one call, so they are
+		 * flushed together instead of one fence per entry.
+		 */
+		size_t flogs_size = bttp->nfree * 2 * sizeof (struct btt_flog);
+		struct btt_flog *flogs = Malloc(flogs_size);
+		if (flogs == NULL) {
+			LOG(1, "!Malloc for %d flog pairs", bttp->nfree);
+			return -1;
+		}
+
 		uint32_t next_free_lba = external_nlba;
 		for (int i = 0; i < bttp->nfree; i++) {
-			struct btt_flog flog;
-			flog.lba = 0;
-			flog.old_map = flog.new_map =
+			struct btt_flog *flog = &flogs[2 * i];
+			flog->lba = 0;
+			flog->old_map = flog->new_map =
 				htole32(next_free_lba | BTT_MAP_ENTRY_ZERO);
-			flog.seq = htole32(1);
+			flog->seq = htole32(1);
+			flog[1] = Zflog;
 
-			/*
-			 * Write both btt_flog structs in the pair, writing
-			 * the second one as all zeros.
-			 */
-			LOG(6, "flog[%d] entry off %zu initial %u + zero = %u",
-					i, flog_entry_off, next_free_lba,
+			LOG(6, "flog[%d] initial %u + zero = %u",
+					i, next_free_lba,
 					next_free_lba | BTT_MAP_ENTRY_ZERO);
-			if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, &flog,
-					sizeof (flog), flog_entry_off) < 0)
-				return -1;
-			flog_entry_off += sizeof (flog);
-
-			LOG(6, "flog[%d] entry off %zu zeros",
-					i, flog_entry_off);
-			if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, &Zflog,
-					sizeof (Zflog), flog_entry_off) < 0)
-				return -1;
-			flog_entry_off += sizeof (flog);
 
 			next_free_lba++;
 		}
 
+		int err = (*bttp->ns_cbp->nswrite)(bttp->ns, lane, flogs,
+					flogs_size, arena_off + flogoff);
+		Free(flogs);
+		if (err < 0)
+			return -1;
+
 		/*
 		 * Construct the BTT info block and write it out
 		 * at both the beginning and end of the arena.
@@ -905,8 +950,11 @@ write_layout(struct btt *bttp, int lane, int write)
 		info.mapoff = htole64(mapoff);
 		info.flogoff = htole64(flogoff);
 		info.infooff = htole64(infooff);
+		info.flags = htole32(bttp->info_flags);
 
-		util_checksum(&info, sizeof (info), &info.checksum, 1);
+		util_checksum(&info, sizeof (info), &info.checksum, 1,
+			(bttp->info_flags & BTTINFO_FLAG_CRC32C) ?
+			CSUM_CRC32C : CSUM_FLETCHER64);
 
 		if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, &info,
 					sizeof (info), arena_off) < 0)
@@ -1075,9 +1123,10 @@ lba_to_arena_lba(struct btt *bttp, uint64_t lba,
  */
 struct btt *
 btt_init(uint64_t rawsize, uint32_t lbasize, uint8_t parent_uuid[],
-		int maxlane, void *ns, const struct ns_callback *ns_cbp)
+		int flags, int maxlane, void *ns,
+		const struct ns_callback *ns_cbp)
 {
-	LOG(3, "rawsize %zu lbasize %u", rawsize, lbasize);
+	LOG(3, "rawsize %zu lbasize %u flags 0x%x", rawsize, lbasize, flags);
 
 	if (rawsize < BTT_MIN_SIZE) {
 		LOG(1, "rawsize smaller than BTT_MIN_SIZE %zu", BTT_MIN_SIZE);
@@ -1096,6 +1145,10 @@ btt_init(uint64_t rawsize, uint32_t lbasize, uint8_t parent_uuid[],
 
 	pthread_mutex_init(&bttp->layout_write_mutex, NULL);
 	memcpy(bttp->parent_uuid, parent_uuid, BTTINFO_UUID_LEN);
+	if (flags & BTT_CRC32C)
+		bttp->info_flags |= BTTINFO_FLAG_CRC32C;
+	if (flags & BTT_BLOCK_CSUM)
+		bttp->info_flags |= BTTINFO_FLAG_BLOCK_CSUM;
 	bttp->rawsize = rawsize;
 	bttp->lbasize = lbasize;
 	bttp->ns = ns;
@@ -1122,6 +1175,14 @@ btt_init(uint64_t rawsize, uint32_t lbasize, uint8_t parent_uuid[],
 	if (maxlane && bttp->nlane > maxlane)
 		bttp->nlane = maxlane;
 
+	size_t bounce_size = bttp->nlane *
+			(size_t)(lbasize + BTT_BLOCK_CSUM_SIZE);
+	if ((bttp->bounce = Malloc(bounce_size)) == NULL) {
+		LOG(1, "!Malloc %zu bytes", bounce_size);
+		btt_fini(bttp);
+		return NULL;
+	}
+
 	LOG(3, "success, bttp %p nlane %d", bttp, bttp->nlane);
 	return bttp;
 }
@@ -1156,14 +1217,31 @@ btt_nlba(struct btt *bttp)
 }
 
 /*
- * btt_read -- read a block from a btt namespace
+ * block_csum -- (internal) compute the checksum stored after a block
+ */
+static uint32_t
+block_csum(struct btt *bttp, const void *buf)
+{
+	uint64_t csum;
+
+	util_checksum((void *)buf, bttp->lbasize, &csum, 1, CSUM_CRC32C);
+
+	return (uint32_t)csum;
+}
+
+/*
+ * read_block -- (internal) read a block, verifying its checksum
+ *
+ * If the block does not match its checksum, EIO is returned and the
+ * post-map LBA it was read from is stored in *badp, unless badp is NULL.
  *
  * Returns 0 on success, otherwise -1/errno.
  */
-int
-btt_read(struct btt *bttp, int lane, uint64_t lba, void *buf)
+static int
+read_block(struct btt *bttp, int lane, uint64_t lba, void *buf,
+		uint32_t *badp)
 {
-	LOG(3, "bttp %p lane %u lba %zu", bttp, lane, lba);
+	LOG(9, "bttp %p lane %u lba %zu", bttp, lane, lba);
 
 	if (invalid_lba(bttp, lba))
 		return -1;
@@ -1252,12 +1330,66 @@ btt_read(struct btt *bttp, int lane, uint64_t lba, void *buf)
 	int readret = (*bttp->ns_cbp->nsread)(bttp->ns, lane, buf,
 					bttp->lbasize, data_block_off);
 
+	uint32_t csum;
+	if (readret == 0 && (arenap->flags & BTTINFO_FLAG_BLOCK_CSUM))
+		readret = (*bttp->ns_cbp->nsread)(bttp->ns, lane, &csum,
+					sizeof (csum),
+					data_block_off + bttp->lbasize);
+
 	/* done with read, so clear out rtt entry */
 	arenap->rtt[lane] = BTT_MAP_ENTRY_ERROR;
 
+	if (readret == 0 && (arenap->flags & BTTINFO_FLAG_BLOCK_CSUM) &&
+			le32toh(csum) != block_csum(bttp, buf)) {
+		LOG(1, "EIO due to block checksum, lba %zu post-map LBA %u",
+				lba, entry);
+		if (badp != NULL)
+			*badp = entry;
+		errno = EIO;
+		return -1;
+	}
+
 	return readret;
 }
 
+/*
+ * btt_read -- read a block from a btt namespace
+ *
+ * Returns 0 on success, otherwise -1/errno.
+ */
+int
+btt_read(struct btt *bttp, int lane, uint64_t lba, void *buf)
+{
+	LOG(3, "bttp %p lane %u lba %zu", bttp, lane, lba);
+
+	return read_block(bttp, lane, lba, buf, NULL);
+}
+
+/*
+ * btt_readv -- read a batch of blocks from a btt namespace
+ *
+ * The blocks are read in order, on an error the ones before the failing
+ * block are read and the rest are not.  All LBAs are checked before
+ * anything is read.
+ *
+ * Returns 0 on success, otherwise -1/errno.
+ */
+int
+btt_readv(struct btt *bttp, int lane, const struct btt_iov *iov, int iovcnt)
+{
+	LOG(3, "bttp %p lane %u iov %p iovcnt %d", bttp, lane, iov, iovcnt);
+
+	for (int i = 0; i < iovcnt; i++)
+		if (invalid_lba(bttp, iov[i].lba))
+			return -1;
+
+	for (int i = 0; i < iovcnt; i++)
+		if (read_block(bttp, lane, iov[i].lba, iov[i].buf, NULL) < 0)
+			return -1;
+
+	return 0;
+}
+
 /*
  * map_lock -- (internal) grab the map_lock and read a map entry
  */
@@ -1303,6 +1435,11 @@ map_abort(struct btt *bttp, int lane, struct arena *arenap, uint32_t premap_lba)
 
 /*
  * map_unlock -- (internal) update the map and drop the map_lock
+ *
+ * The new entry is durable after the next nsdrain on the lane.  Letting
+ * it wait is safe: until then either the flog entry describing the update
+ * is durable and recovery finishes it, or the update is a flag change
+ * which was not promised to anybody yet.
  */
 static int
 map_unlock(struct btt *bttp, int lane, struct arena *arenap,
@@ -1315,7 +1452,7 @@ map_unlock(struct btt *bttp, int lane, struct arena *arenap,
 	int map_lock_num = premap_lba % bttp->nfree;
 
 	/* write the new map entry */
-	int err = (*bttp->ns_cbp->nswrite)(bttp->ns, lane, &entry,
+	int err = (*bttp->ns_cbp->nswrite_nodrain)(bttp->ns, lane, &entry,
 				sizeof (uint32_t), map_entry_off);
 
 	pthread_spin_unlock(&arenap->map_locks[map_lock_num]);
@@ -1329,30 +1466,20 @@ map_unlock(struct btt *bttp, int lane, struct arena *arenap,
 }
 
 /*
- * btt_write -- write a block to a btt namespace
+ * write_block -- (internal) write a block, leaving its map entry undrained
+ *
+ * The layout must be written already.  The data block and the first part
+ * of the flog entry share a fence, the seq field gets one of its own.
+ * The map update is left for the lane's next nsdrain, which is either the
+ * first fence of the next block written on the lane or the one at the end
+ * of btt_write() and btt_writev().
  *
  * Returns 0 on success, otherwise -1/errno.
  */
-int
-btt_write(struct btt *bttp, int lane, uint64_t lba, const void *buf)
+static int
+write_block(struct btt *bttp, int lane, uint64_t lba, const void *buf)
 {
-	LOG(3, "bttp %p lane %u lba %zu", bttp, lane, lba);
-
-	if (invalid_lba(bttp, lba))
-		return -1;
-
-	/* first write through here will initialize the metadata layout */
-	if (!bttp->laidout) {
-		int err = 0;
-
-		pthread_mutex_lock(&bttp->layout_write_mutex);
-		if (!bttp->laidout)
-			err = write_layout(bttp, lane, 1);
-		pthread_mutex_unlock(&bttp->layout_write_mutex);
-
-		if (err < 0)
-			return err;
-	}
+	LOG(9, "bttp %p lane %u lba %zu", bttp, lane, lba);
 
 	/* find which arena LBA lives in, and the offset to the map entry */
 	struct arena *arenap;
@@ -1391,13 +1518,26 @@ btt_write(struct btt *bttp, int lane, uint64_t lba, const void *buf)
 	/* it is now safe to perform write to the free block */
 	off_t data_block_off =
 			arenap->dataoff + free_entry * arenap->internal_lbasize;
-	if ((*bttp->ns_cbp->nswrite)(bttp->ns, lane, buf,
-				bttp->lbasize, data_block_off) < 0)
+	size_t count = bttp->lbasize;
+
+	if (arenap->flags & BTTINFO_FLAG_BLOCK_CSUM) {
+		char *bounce = bttp->bounce +
+			lane * (size_t)(bttp->lbasize + BTT_BLOCK_CSUM_SIZE);
+		uint32_t csum = htole32(block_csum(bttp, buf));
+
+		memcpy(bounce, buf, bttp->lbasize);
+		memcpy(bounce + bttp->lbasize, &csum, sizeof (csum));
+		buf = bounce;
+		count += BTT_BLOCK_CSUM_SIZE;
+	}
+
+	if ((*bttp->ns_cbp->nswrite_nodrain)(bttp->ns, lane, buf,
+				count, data_block_off) < 0)
 		return -1;
 
 	/*
 	 * Make the new block active atomically by updating the on-media flog
-	 * and then updating the map.
+	 * and then updating the map.  The flog update drains the data block.
 	 */
 	uint32_t old_entry;
 	if (map_lock(bttp, lane, arenap, &old_entry, premap_lba) < 0)
@@ -1421,6 +1561,79 @@ btt_write(struct btt *bttp, int lane, uint64_t lba, const void *buf)
 	return 0;
 }
 
+/*
+ * write_layout_once -- (internal) lay out the metadata on the first write
+ *
+ * Returns 0 on success, otherwise -1/errno.
+ */
+static int
+write_layout_once(struct btt *bttp, int lane)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&bttp->layout_write_mutex);
+	if (!bttp->laidout)
+		err = write_layout(bttp, lane, 1);
+	pthread_mutex_unlock(&bttp->layout_write_mutex);
+
+	return err;
+}
+
+/*
+ * btt_write -- write a block to a btt namespace
+ *
+ * Returns 0 on success, otherwise -1/errno.
+ */
+int
+btt_write(struct btt *bttp, int lane, uint64_t lba, const void *buf)
+{
+	LOG(3, "bttp %p lane %u lba %zu", bttp, lane, lba);
+
+	if (invalid_lba(bttp, lba))
+		return -1;
+
+	/* first write through here will initialize the metadata layout */
+	if (!bttp->laidout && write_layout_once(bttp, lane) < 0)
+		return -1;
+
+	int err = write_block(bttp, lane, lba, buf);
+	(*bttp->ns_cbp->nsdrain)(bttp->ns, lane);
+
+	return err;
+}
+
+/*
+ * btt_writev -- write a batch of blocks to a btt namespace
+ *
+ * Each block is written atomically, the batch as a whole is not.  The
+ * blocks are written in order, on an error the ones before the failing
+ * block are written and the rest are not.  All LBAs are checked before
+ * anything is written.  Compared to a btt_write() per block, the map
+ * update of each block shares a fence with the next one.
+ *
+ * Returns 0 on success, otherwise -1/errno.
+ */
+int
+btt_writev(struct btt *bttp, int lane, const struct btt_iov *iov, int iovcnt)
+{
+	LOG(3, "bttp %p lane %u iov %p iovcnt %d", bttp, lane, iov, iovcnt);
+
+	for (int i = 0; i < iovcnt; i++)
+		if (invalid_lba(bttp, iov[i].lba))
+			return -1;
+
+	if (iovcnt > 0 && !bttp->laidout &&
+			write_layout_once(bttp, lane) < 0)
+		return -1;
+
+	int err = 0;
+	for (int i = 0; i < iovcnt && err == 0; i++)
+		err = write_block(bttp, lane, iov[i].lba, iov[i].buf);
+	(*bttp->ns_cbp->nsdrain)(bttp->ns, lane);
+
+	return err;
+}
+
 /*
  * map_entry_setf -- (internal) set a given flag on a map entry
  *
@@ -1447,14 +1660,8 @@ map_entry_setf(struct btt *bttp, int lane, uint64_t lba, uint32_t setf)
 		 * Treat this like the first write and write out
 		 * the metadata layout at this point.
 		 */
-		int err = 0;
-		pthread_mutex_lock(&bttp->layout_write_mutex);
-		if (!bttp->laidout)
-			err = write_layout(bttp, lane, 1);
-		pthread_mutex_unlock(&bttp->layout_write_mutex);
-
-		if (err < 0)
-			return err;
+		if (write_layout_once(bttp, lane) < 0)
+			return -1;
 	}
 
 	/* find which arena LBA lives in, and the offset to the map entry */
@@ -1491,10 +1698,11 @@ map_entry_setf(struct btt *bttp, int lane, uint64_t lba, uint32_t setf)
 	/* create the new map entry */
 	new_entry = old_entry | setf;
 
-	if (map_unlock(bttp, lane, arenap, htole32(new_entry), premap_lba) < 0)
-		return -1;
+	int err = map_unlock(bttp, lane, arenap, htole32(new_entry),
+					premap_lba);
+	(*bttp->ns_cbp->nsdrain)(bttp->ns, lane);
 
-	return 0;
+	return err;
 }
 
 /*
@@ -1523,6 +1731,59 @@ btt_set_error(struct btt *bttp, int lane, uint64_t lba)
 	return map_entry_setf(bttp, lane, lba, BTT_MAP_ENTRY_ERROR);
 }
 
+/*
+ * btt_scrub -- verify a block, setting its error state if it is bad
+ *
+ * Blocks without a checksum, zeroed ones and those already in the error
+ * state are taken as good.  A block rewritten since it was found bad is
+ * left alone.
+ *
+ * Returns 1 if the block was bad, 0 if not, otherwise -1/errno.
+ */
+int
+btt_scrub(struct btt *bttp, int lane, uint64_t lba)
+{
+	/* called for every block, over and over, by the scrubber */
+	LOG(9, "bttp %p lane %u lba %zu", bttp, lane, lba);
+
+	if (invalid_lba(bttp, lba))
+		return -1;
+
+	if (!bttp->laidout)
+		return 0;
+
+	char *buf = bttp->bounce +
+		lane * (size_t)(bttp->lbasize + BTT_BLOCK_CSUM_SIZE);
+	uint32_t bad = BTT_MAP_ENTRY_ERROR;
+
+	if (read_block(bttp, lane, lba, buf, &bad) == 0)
+		return 0;
+	if (bad == BTT_MAP_ENTRY_ERROR)
+		return errno == EIO ? 0 : -1;	/* already marked */
+
+	struct arena *arenap;
+	uint32_t premap_lba;
+	if (lba_to_arena_lba(bttp, lba, &arenap, &premap_lba) < 0)
+		return -1;
+
+	uint32_t entry;
+	if (map_lock(bttp, lane, arenap, &entry, premap_lba) < 0)
+		return -1;
+
+	entry = le32toh(entry);
+
+	if (entry != bad) {
+		map_abort(bttp, lane, arenap, premap_lba);
+		return 0;
+	}
+
+	int err = map_unlock(bttp, lane, arenap,
+			htole32(entry | BTT_MAP_ENTRY_ERROR), premap_lba);
+	(*bttp->ns_cbp->nsdrain)(bttp->ns, lane);
+
+	return err < 0 ? -1 : 1;
+}
+
 /*
  * check_arena -- (internal) perform a consistency check on an arena
  */
@@ -1688,5 +1949,7 @@ btt_fini(struct btt *bttp)
 		}
 		Free(bttp->arenas);
 	}
+	if (bttp->bounce)
+		Free(bttp->bounce);
 	Free(bttp);
 }
@@ -42,15 +42,35 @@ struct ns_callback {
 		const void *buf, size_t count, off_t off);
 	int (*nsmap)(void *ns, int lane, void **addrp, size_t len, off_t off);
 	void (*nssync)(void *ns, int lane, void *addr, size_t len);
+	int (*nswrite_nodrain)(void *ns, int lane,
+		const void *buf, size_t count, off_t off);
+	void (*nsdrain)(void *ns, int lane);
 };
 
+/* flags for btt_init(), they only matter when a new layout is written */
+#define	BTT_CRC32C 0x0001	/* checksum info blocks with CRC32C */
+#define	BTT_BLOCK_CSUM 0x0002	/* store a checksum with each block */
+
 struct btt *btt_init(uint64_t rawsize, uint32_t lbasize, uint8_t parent_uuid[],
-		int maxlane, void *ns, const struct ns_callback *ns_cbp);
+		int flags, int maxlane, void *ns,
+		const struct ns_callback *ns_cbp);
 int btt_nlane(struct btt *bttp);
 size_t btt_nlba(struct btt *bttp);
 int btt_read(struct btt *bttp, int lane, uint64_t lba, void *buf);
 int btt_write(struct btt *bttp, int lane, uint64_t lba, const void *buf);
+
+/* one block of a btt_readv() or btt_writev() */
+struct btt_iov {
+	void *buf;
+	uint64_t lba;
+};
+
+int btt_readv(struct btt *bttp, int lane, const struct btt_iov *iov,
+		int iovcnt);
+int btt_writev(struct btt *bttp, int lane, const struct btt_iov *iov,
+		int iovcnt);
 int btt_set_zero(struct btt *bttp, int lane, uint64_t lba);
 int btt_set_error(struct btt *bttp, int lane, uint64_t lba);
+int btt_scrub(struct btt *bttp, int lane, uint64_t lba);
 int btt_check(struct btt *bttp);
 void btt_fini(struct btt *bttp);
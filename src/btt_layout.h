@@ -67,7 +67,7 @@ struct btt_info {
 
 	char unused[3984];		/* must be zero */
 
-	uint64_t checksum;		/* Fletcher64 of all fields */
+	uint64_t checksum;		/* Fletcher64 or CRC32C of all fields */
 };
 
 /*
@@ -75,6 +75,8 @@ struct btt_info {
  */
 #define	BTTINFO_FLAG_ERROR	0x00000001 /* error state (read-only) */
 #define	BTTINFO_FLAG_ERROR_MASK	0x00000001 /* all error bits */
+#define	BTTINFO_FLAG_CRC32C	0x00000002 /* checksum is CRC32C */
+#define	BTTINFO_FLAG_BLOCK_CSUM	0x00000004 /* data blocks carry a CRC32C */
 
 /*
  * Current on-media format versions.
@@ -113,3 +115,10 @@ struct btt_flog {
 #define	BTT_MIN_LBA 512
 #define	BTT_INTERNAL_LBA_ALIGNMENT 256
 #define	BTT_DEFAULT_NFREE 256
+
+/*
+ * With BTTINFO_FLAG_BLOCK_CSUM set, each data block is followed by the
+ * little-endian CRC32C of its external_lbasize bytes, inside the
+ * internal_lbasize of the block (which grows if it has no room left).
+ */
+#define	BTT_BLOCK_CSUM_SIZE 4
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY LOG OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * epoch.c -- epoch-based reclamation of objects read without locks
+ *
+ * Readers bracket their accesses with epoch_enter() and epoch_exit(),
+ * which only touch the calling thread's own state.  Writers hand the
+ * objects they unlinked to epoch_retire() instead of freeing them, each
+ * tagged with the global epoch at that time.  The global epoch only
+ * advances once every thread inside an epoch has seen the current one,
+ * so when it is two past an object's tag no reader can still hold a
+ * reference to the object and it is passed to the free function.
+ *
+ * Retired objects stay on the list of the thread that retired them, but
+ * epoch_reclaim() frees the safe ones of every thread, so the objects
+ * of a thread that went idle or exited are freed by whichever thread
+ * reclaims next, or by epoch_delete() when no readers are left.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "util.h"
+#include "out.h"
+#include "epoch.h"
+
+static uint64_t Instances;	/* source of epoch instance ids */
+
+static __thread struct {
+	uint64_t instance;
+	struct epoch_thread *slot;
+} Thread_epoch;
+
+/*
+ * epoch_new -- set up epochs for objects released through free_func
+ */
+struct epoch *
+epoch_new(void (*free_func)(void *arg, uint64_t off), void *arg)
+{
+	struct epoch *ep;
+
+	if ((ep = Malloc(sizeof (*ep))) == NULL) {
+		LOG(1, "!Malloc");
+		return NULL;
+	}
+
+	memset(ep, 0, sizeof (*ep));
+	if ((errno = pthread_mutex_init(&ep->lock, NULL))) {
+		LOG(1, "!pthread_mutex_init");
+		Free(ep);
+		return NULL;
+	}
+	ep->instance = __sync_add_and_fetch(&Instances, 1);
+	ep->global = 1;
+	ep->free_func = free_func;
+	ep->free_arg = arg;
+
+	return ep;
+}
+
+/*
+ * epoch_delete -- free everything still retired and the epochs
+ *
+ * No thread may be inside an epoch any more.
+ */
+void
+epoch_delete(struct epoch *ep)
+{
+	while (ep->threads != NULL) {
+		struct epoch_thread *tp = ep->threads;
+		ep->threads = tp->next;
+
+		if (tp->nesting != 0)
+			LOG(1, "thread still inside an epoch");
+
+		for (size_t i = 0; i < tp->nretired; i++)
+			ep->free_func(ep->free_arg, tp->retired[i].off);
+		pthread_mutex_destroy(&tp->lock);
+		Free(tp->retired);
+		Free(tp);
+	}
+
+	pthread_mutex_destroy(&ep->lock);
+	Free(ep);
+}
+
+/*
+ * epoch_slot -- (internal) return the calling thread's state
+ *
+ * Returns NULL if new state cannot be allocated.
+ */
+static struct epoch_thread *
+epoch_slot(struct epoch *ep)
+{
+	if (Thread_epoch.instance == ep->instance)
+		return Thread_epoch.slot;
+
+	pthread_t self = pthread_self();
+	struct epoch_thread *tp;
+
+	pthread_mutex_lock(&ep->lock);
+	for (tp = ep->threads; tp != NULL; tp = tp->next)
+		if (pthread_equal(tp->tid, self))
+			break;
+
+	if (tp == NULL && (tp = Malloc(sizeof (*tp))) != NULL) {
+		memset(tp, 0, sizeof (*tp));
+		if ((errno = pthread_mutex_init(&tp->lock, NULL))) {
+			LOG(1, "!pthread_mutex_init");
+			Free(tp);
+			tp = NULL;
+		} else {
+			tp->tid = self;
+			tp->next = ep->threads;
+			ep->threads = tp;
+		}
+	}
+	pthread_mutex_unlock(&ep->lock);
+
+	if (tp != NULL) {
+		Thread_epoch.instance = ep->instance;
+		Thread_epoch.slot = tp;
+	}
+
+	return tp;
+}
+
+/*
+ * epoch_enter -- start reading objects that may be retired meanwhile
+ *
+ * Calls nest, only the outermost one counts.  Returns -1 with errno set
+ * if the thread's state cannot be allocated.
+ */
+int
+epoch_enter(struct epoch *ep)
+{
+	struct epoch_thread *tp = epoch_slot(ep);
+	if (tp == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (tp->nesting++ != 0)
+		return 0;
+
+	/* publish the epoch before any object is read, then make sure */
+	uint64_t global;
+	do {
+		global = ep->global;
+		tp->local = global;
+		__sync_synchronize();
+	} while (ep->global != global);
+
+	return 0;
+}
+
+/*
+ * epoch_exit -- stop reading, the objects read must no longer be used
+ */
+void
+epoch_exit(struct epoch *ep)
+{
+	struct epoch_thread *tp = epoch_slot(ep);
+	if (tp == NULL || tp->nesting == 0) {
+		LOG(1, "epoch_exit without epoch_enter");
+		return;
+	}
+
+	if (--tp->nesting == 0) {
+		__sync_synchronize();
+		tp->local = 0;
+	}
+}
+
+/*
+ * epoch_advance -- (internal) move to the next epoch if all readers can
+ *
+ * Returns the global epoch, advanced or not.
+ */
+static uint64_t
+epoch_advance(struct epoch *ep)
+{
+	uint64_t global = ep->global;
+
+	pthread_mutex_lock(&ep->lock);
+	struct epoch_thread *tp;
+	for (tp = ep->threads; tp != NULL; tp = tp->next) {
+		uint64_t local = tp->local;
+		if (local != 0 && local != global)
+			break;
+	}
+	if (tp == NULL)
+		__sync_bool_compare_and_swap(&ep->global, global, global + 1);
+	pthread_mutex_unlock(&ep->lock);
+
+	return ep->global;
+}
+
+/*
+ * epoch_reclaim_thread -- (internal) free what a thread retired, if safe
+ */
+static size_t
+epoch_reclaim_thread(struct epoch *ep, struct epoch_thread *tp,
+		uint64_t global)
+{
+	pthread_mutex_lock(&tp->lock);
+
+	size_t n = 0;
+	while (n < tp->nretired && tp->retired[n].epoch + 2 <= global) {
+		ep->free_func(ep->free_arg, tp->retired[n].off);
+		n++;
+	}
+
+	tp->nretired -= n;
+	memmove(tp->retired, tp->retired + n,
+			tp->nretired * sizeof (*tp->retired));
+
+	pthread_mutex_unlock(&tp->lock);
+
+	return n;
+}
+
+/*
+ * epoch_reclaim -- free what any thread retired and is now safe
+ *
+ * Returns the number of objects freed.
+ */
+size_t
+epoch_reclaim(struct epoch *ep)
+{
+	uint64_t global = epoch_advance(ep);
+
+	size_t n = 0;
+	pthread_mutex_lock(&ep->lock);
+	for (struct epoch_thread *tp = ep->threads; tp != NULL; tp = tp->next)
+		n += epoch_reclaim_thread(ep, tp, global);
+	pthread_mutex_unlock(&ep->lock);
+
+	return n;
+}
+
+/*
+ * epoch_retire -- free an object once no reader can see it any more
+ *
+ * The object must already be unreachable for new readers.  Returns -1
+ * with errno set if it cannot be put on the deferred list, the caller
+ * then still owns it.
+ */
+int
+epoch_retire(struct epoch *ep, uint64_t off)
+{
+	struct epoch_thread *tp = epoch_slot(ep);
+	if (tp == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	if (tp->nretired == tp->maxretired) {
+		size_t max = tp->maxretired ? 2 * tp->maxretired :
+				EPOCH_RETIRED_MAX;
+		struct epoch_retired *retired;
+		if ((retired = Realloc(tp->retired,
+				max * sizeof (*retired))) == NULL) {
+			LOG(1, "!Realloc");
+			pthread_mutex_unlock(&tp->lock);
+			return -1;
+		}
+		tp->retired = retired;
+		tp->maxretired = max;
+	}
+
+	__sync_synchronize();
+	tp->retired[tp->nretired].off = off;
+	tp->retired[tp->nretired].epoch = ep->global;
+	int reclaim = ++tp->nretired % EPOCH_RETIRED_MAX == 0;
+	pthread_mutex_unlock(&tp->lock);
+
+	if (reclaim)
+		epoch_reclaim(ep);
+
+	return 0;
+}
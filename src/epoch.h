@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY LOG OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * epoch.h -- internal definitions for epoch module
+ */
+
+#define	EPOCH_RETIRED_MAX 64	/* deferred frees between reclaims */
+
+/* an object waiting for the readers that may still see it */
+struct epoch_retired {
+	uint64_t off;		/* what to free */
+	uint64_t epoch;		/* global epoch when it was unlinked */
+};
+
+/* one thread's state, only the retired list is touched by others */
+struct epoch_thread {
+	struct epoch_thread *next;
+	pthread_t tid;
+	unsigned nesting;		/* epoch_enter() calls not exited yet */
+	volatile uint64_t local;	/* epoch entered, 0 if outside */
+	pthread_mutex_t lock;		/* protects the retired list */
+	struct epoch_retired *retired;	/* deferred frees, oldest first */
+	size_t nretired;
+	size_t maxretired;
+};
+
+struct epoch {
+	pthread_mutex_t lock;		/* protects the list of threads */
+	struct epoch_thread *threads;
+	uint64_t instance;		/* unique id of this epoch */
+	volatile uint64_t global;	/* current epoch, starts at 1 */
+	void (*free_func)(void *arg, uint64_t off);
+	void *free_arg;
+};
+
+struct epoch *epoch_new(void (*free_func)(void *arg, uint64_t off),
+	void *arg);
+void epoch_delete(struct epoch *ep);
+int epoch_enter(struct epoch *ep);
+void epoch_exit(struct epoch *ep);
+int epoch_retire(struct epoch *ep, uint64_t off);
+size_t epoch_reclaim(struct epoch *ep);
@@ -73,19 +73,155 @@ void pmem_persist(void *addr, size_t len, int flags);
 void pmem_flush(void *addr, size_t len, int flags);
 void pmem_fence(void);
 void pmem_drain(void);
+int pmem_msync(void *addr, size_t len);	/* for non-pmem mappings */
+
+/*
+ * memmove(), memcpy() and memset() to PMEM that return with the range
+ * persistent, like a pmem_persist() of the range afterwards.  Copies of
+ * more than a few hundred bytes (PMEM_MOVNT_THRESHOLD) bypass the cache
+ * with non-temporal stores, so the destination is not flushed line by
+ * line and the copy does not evict the caller's working set.
+ */
+void *pmem_memmove_persist(void *pmemdest, const void *src, size_t len);
+void *pmem_memcpy_persist(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist(void *pmemdest, int c, size_t len);
+
+/*
+ * How pmem_map() and the pools map files: the alignment of the address
+ * asked for (a power of two multiple of the page size, 1GB by default,
+ * so large pages can be used) and any of the PMEM_MAP_* flags.  These
+ * are hints, mapping does not fail because the system cannot honor
+ * them.  The environment variables PMEM_MAP_ALIGN ("2M", "1G"...) and
+ * PMEM_MAP_FLAGS ("thp,populate"...) set the initial policy.
+ */
+#define	PMEM_MAP_THP 0x1	/* advise transparent huge pages */
+#define	PMEM_MAP_HUGETLB 0x2	/* use MAP_HUGETLB, for hugetlbfs files */
+#define	PMEM_MAP_POPULATE 0x4	/* fault the whole mapping in right away */
+int pmem_set_map_policy(size_t align, int flags);
+
+/*
+ * Pools opened from now on (obj, blk and log) are pre-faulted by
+ * nthreads threads before the open returns, so the first accesses do
+ * not take page faults.  Zero, the default unless the environment
+ * variable PMEM_PREFAULT_THREADS is set, turns this off.  Progress (bytes
+ * done, total bytes) is reported through progress_func, if not NULL,
+ * from the thread opening the pool.  Pools on pmem are faulted for
+ * writing, others only for reading so no page is dirtied.
+ */
+void pmem_set_prefault(unsigned nthreads,
+		void (*progress_func)(size_t done, size_t total));
+
+/*
+ * Profile of the flushing done by each part of the library, and by the
+ * application through pmem_persist() and friends, summed over all
+ * threads since the program started.  Each thread counts on its own, so
+ * keeping the profile costs no more than a few additions per flush.
+ */
+#define	PMEM_FLUSH_SRC_APP 0	/* the application */
+#define	PMEM_FLUSH_SRC_OBJ 1	/* pmemobj, except its allocator */
+#define	PMEM_FLUSH_SRC_ALLOC 2	/* the pmemobj allocator */
+#define	PMEM_FLUSH_SRC_BLK 3	/* pmemblk and its BTT */
+#define	PMEM_FLUSH_SRC_LOG 4	/* pmemlog */
+#define	PMEM_FLUSH_NSRC 5
+
+struct pmem_flush_stats {
+	uint64_t calls;		/* ranges asked to be made persistent */
+	uint64_t bytes;		/* bytes in those ranges */
+	uint64_t lines;		/* cache lines flushed */
+	uint64_t redundant;	/* lines the thread's last flush also had */
+	uint64_t fences;
+	uint64_t msyncs;	/* for files not on pmem */
+};
+
+int pmem_flush_stats(int src, struct pmem_flush_stats *statsp);
 
 /*
  * support for memory allocation and transactions in PMEM...
  */
 #define	PMEMOBJ_MIN_POOL ((size_t)(1024 * 1024 * 2)) /* min pool size: 2MB */
 
-/* path can be "/file/one:/file/two" to force mirrored operation */
+/*
+ * path can be "/file/one:/file/two" to force mirrored operation, every
+ * flush to the first file is then replayed to the second one (batched
+ * per transaction commit), while all reads are served by the first one.
+ *
+ * path can also name a pool set file, which starts with a line reading
+ * "PMEMPOOLSET" followed by "size path" lines, one for each part file
+ * (size may use a K, M, G or T suffix, relative paths are relative to the
+ * set file, sizes that do not fit in a size_t are rejected).  The parts
+ * are mapped contiguously and the pool can be grown while open with
+ * pmemobj_pool_extend(), which creates a new part file and appends it to
+ * the set.  Each part file carries a 4K header right past its size bytes
+ * naming the set and the position of the part in it, so a set naming a
+ * part of another set, or its parts out of order, fails with EINVAL.
+ */
 PMEMobjpool *pmemobj_pool_open(const char *path);
 PMEMobjpool *pmemobj_pool_open_mirrored(const char *path1, const char *path2);
+
+/*
+ * read-only and private copy-on-write views of a pool, neither ever writes
+ * to the pool files: a read-only pool rejects all changes with EROFS, a
+ * copy-on-write pool accepts them but drops them on close (a pool with
+ * read-only compatible features this library does not know is always
+ * opened read-only, whichever call opens it).  The PMEMmutex, PMEMrwlock
+ * and PMEMcond locks of a read-only pool can still be used, their
+ * run-time state is kept outside of the pool.
+ */
+PMEMobjpool *pmemobj_pool_open_rdonly(const char *path);
+PMEMobjpool *pmemobj_pool_open_cow(const char *path);
 void pmemobj_pool_close(PMEMobjpool *pop);
+int pmemobj_pool_extend(PMEMobjpool *pop, const char *path, size_t size);
 int pmemobj_pool_check(const char *path);
 int pmemobj_pool_check_mirrored(const char *path1, const char *path2);
 
+/*
+ * pmemobj_pool_check() rolls back interrupted transactions and verifies
+ * the pool using all CPUs (PMEMOBJ_CHECK_THREADS overrides the number of
+ * threads), reporting progress through the function set here, if any.
+ */
+void pmemobj_set_check_progress_func(void (*progress_func)(size_t done,
+		size_t total));
+
+/*
+ * If the environment variable PMEMOBJ_STATS is set to 1, every pool counts
+ * what its users do and times transactions (from begin to commit),
+ * allocations and flushes, for as long as it is open.  Each thread keeps
+ * its own counters, pmemobj_pool_stats() and pmemobj_pool_latency() add
+ * them up, they fail with ENOTSUP for a pool without stats.  If
+ * PMEMOBJ_STATS_DUMP is set to a number of seconds, stats are gathered
+ * and those of every open pool are printed that often, as by
+ * pmemobj_pool_stats_print(), which logs them at level 0.
+ */
+struct pmemobj_stats {
+	uint64_t tx_begun;	/* outermost transactions begun */
+	uint64_t tx_committed;
+	uint64_t tx_aborted;
+	uint64_t undo_bytes;	/* bytes snapshotted by transactions */
+	uint64_t allocs;	/* successful allocations of all kinds */
+	uint64_t alloc_bytes;	/* bytes requested by them */
+	uint64_t frees;
+	uint64_t flushes;
+	uint64_t flush_bytes;
+};
+
+#define	PMEMOBJ_LATENCY_TX 0	/* begin to commit of a transaction */
+#define	PMEMOBJ_LATENCY_ALLOC 1	/* a single allocation */
+#define	PMEMOBJ_LATENCY_FLUSH 2	/* a single flush */
+
+/* percentiles in nanoseconds, within 25% of the exact ones */
+struct pmemobj_latency {
+	uint64_t count;		/* operations timed */
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+int pmemobj_pool_stats(PMEMobjpool *pop, struct pmemobj_stats *statsp);
+int pmemobj_pool_latency(PMEMobjpool *pop, int which,
+		struct pmemobj_latency *latp);
+void pmemobj_pool_stats_print(PMEMobjpool *pop);
+
 /*
  * Object IDs used with pmemobj...
  */
@@ -149,6 +285,13 @@ int pmemobj_cond_wait(PMEMcond *condp,
 void *pmemobj_root_direct(PMEMobjpool *pop, size_t size);
 int pmemobj_root_resize(PMEMobjpool *pop, size_t size);
 
+/*
+ * A transaction begun inside another one is nested in it and must be on
+ * the same pool, pmemobj_tx_begin() fails with EINVAL otherwise.
+ * pmemobj_tx_begin_lock() and pmemobj_tx_begin_wrlock() take the lock
+ * once the transaction has begun and release it when that transaction
+ * ends, nested or not, committed or aborted.
+ */
 PMEMtid pmemobj_tx_begin(PMEMobjpool *pop, jmp_buf env);
 PMEMtid pmemobj_tx_begin_lock(PMEMobjpool *pop,
 		jmp_buf env, PMEMmutex *mutexp);
@@ -161,7 +304,26 @@ int pmemobj_tx_commit_multiv(PMEMtid tids[]);
 int pmemobj_tx_abort(int errnum);
 int pmemobj_tx_abort_tid(PMEMtid tid, int errnum);
 
+/*
+ * Caps the bytes of undo each transaction may copy, pmemobj_memcpy()
+ * fails with EFBIG past the limit.  Zero, the default, means no limit.
+ */
+void pmemobj_tx_set_undo_limit(PMEMobjpool *pop, size_t limit);
+
+/*
+ * Objects freed by the library, in a transaction or not, are only
+ * released once no thread is still inside an epoch it entered before
+ * the free, so readers that follow pointers without taking locks
+ * bracket their accesses with pmemobj_epoch_enter() and
+ * pmemobj_epoch_exit().  pmemobj_epoch_reclaim() releases what is safe
+ * to release, whichever thread freed it.
+ */
+int pmemobj_epoch_enter(PMEMobjpool *pop);
+void pmemobj_epoch_exit(PMEMobjpool *pop);
+size_t pmemobj_epoch_reclaim(PMEMobjpool *pop);
+
 PMEMoid pmemobj_alloc(size_t size);
+PMEMoid pmemobj_alloc_type(size_t size, unsigned type_num);
 PMEMoid pmemobj_zalloc(size_t size);
 PMEMoid pmemobj_realloc(PMEMoid oid, size_t size);
 PMEMoid pmemobj_aligned_alloc(size_t alignment, size_t size);
@@ -171,6 +333,7 @@ int pmemobj_free(PMEMoid oid);
 size_t pmemobj_size(PMEMoid oid);	/* no lock/tx required */
 
 PMEMoid pmemobj_alloc_tid(PMEMtid tid, size_t size);
+PMEMoid pmemobj_alloc_type_tid(PMEMtid tid, size_t size, unsigned type_num);
 PMEMoid pmemobj_zalloc_tid(PMEMtid tid, size_t size);
 PMEMoid pmemobj_realloc_tid(PMEMtid tid, PMEMoid oid, size_t size);
 PMEMoid pmemobj_aligned_alloc_tid(PMEMtid tid, size_t alignment, size_t size);
@@ -182,6 +345,86 @@ void *pmemobj_direct_ntx(PMEMoid oid);
 
 int pmemobj_nulloid(PMEMoid oid);
 
+/*
+ * Every object carries the type number it was allocated with, type 0
+ * unless allocated by pmemobj_alloc_type().  pmemobj_first() and
+ * pmemobj_next() visit all live objects of one type in address order by
+ * scanning the allocator's metadata, no lists have to be maintained.
+ * The NULL object has no type, pmemobj_type_num() returns
+ * PMEMOBJ_NUM_TYPES for it.
+ */
+#define	PMEMOBJ_NUM_TYPES 65536	/* valid type numbers are below this */
+
+unsigned pmemobj_type_num(PMEMoid oid);
+
+/*
+ * Non-transactional, failure-atomic allocation and free.  The object is
+ * allocated, passed to the constructor (if not NULL), flushed and then
+ * both typed and stored at *dest in one failure-atomic step: after a
+ * crash either both happened or the object does not exist.  *dest must
+ * be in the pool, or dest NULL.  pmemobj_free_atomic() likewise frees
+ * the object *dest refers to and sets *dest to the NULL object.  Inside
+ * a transaction on the same pool both take effect right away, they are
+ * not undone if the transaction aborts.
+ */
+int pmemobj_alloc_atomic(PMEMobjpool *pop, PMEMoid *dest, size_t size,
+	unsigned type_num,
+	void (*constructor)(PMEMobjpool *pop, void *ptr, void *arg),
+	void *arg);
+int pmemobj_free_atomic(PMEMobjpool *pop, PMEMoid *dest);
+PMEMoid pmemobj_first(PMEMobjpool *pop, unsigned type_num);
+PMEMoid pmemobj_next(PMEMoid oid);
+
+/*
+ * Flush a range of the pool, for changes made outside of transactions,
+ * like the ones done by the constructors below.
+ */
+void pmemobj_persist(PMEMobjpool *pop, void *addr, size_t len);
+
+/*
+ * Persistent lists, updated failure-atomically without transactions.
+ * The PMEMlistentry is embedded in the objects, pe_offset bytes into
+ * each of them, the PMEMlisthead lives anywhere in the pool.  A NULL
+ * where inserts at the head of the list if before is set, at its tail
+ * otherwise.  Changes are serialized by the head's lock, iterating is
+ * not protected against concurrent changes.
+ */
+typedef struct pmemlistentry {
+	PMEMoid next;
+	PMEMoid prev;
+} PMEMlistentry;
+
+typedef struct pmemlisthead {
+	PMEMoid first;
+	PMEMmutex lock;
+} PMEMlisthead;
+
+int pmemobj_list_insert(PMEMobjpool *pop, PMEMlisthead *head,
+	size_t pe_offset, PMEMoid where, int before, PMEMoid oid);
+PMEMoid pmemobj_list_insert_new(PMEMobjpool *pop, PMEMlisthead *head,
+	size_t pe_offset, PMEMoid where, int before, size_t size,
+	unsigned type_num,
+	void (*constructor)(PMEMobjpool *pop, void *ptr, void *arg),
+	void *arg);
+int pmemobj_list_remove(PMEMobjpool *pop, PMEMlisthead *head,
+	size_t pe_offset, PMEMoid oid, int freeobj);
+PMEMoid pmemobj_list_first(PMEMobjpool *pop, PMEMlisthead *head);
+PMEMoid pmemobj_list_next(PMEMobjpool *pop, PMEMlisthead *head,
+	size_t pe_offset, PMEMoid oid);
+
+/*
+ * Persistent hash maps from 64-bit keys to OIDs, safe to use from many
+ * threads at once and growing as needed.  Every change is a single
+ * failure-atomic step, no transactions are involved.
+ */
+int pmemobj_map_create(PMEMobjpool *pop, PMEMoid *dest, size_t nbuckets);
+int pmemobj_map_destroy(PMEMobjpool *pop, PMEMoid *dest);
+int pmemobj_map_insert(PMEMobjpool *pop, PMEMoid map, uint64_t key,
+	PMEMoid value);
+PMEMoid pmemobj_map_get(PMEMobjpool *pop, PMEMoid map, uint64_t key);
+PMEMoid pmemobj_map_remove(PMEMobjpool *pop, PMEMoid map, uint64_t key);
+size_t pmemobj_map_count(PMEMobjpool *pop, PMEMoid map);
+
 int pmemobj_memcpy(void *dstp, void *srcp, size_t size);
 int pmemobj_memcpy_tid(PMEMtid tid, void *dstp, void *srcp, size_t size);
 
@@ -203,6 +446,78 @@ int pmemblk_write(PMEMblk *pbp, const void *buf, off_t blockno);
 int pmemblk_set_zero(PMEMblk *pbp, off_t blockno);
 int pmemblk_set_error(PMEMblk *pbp, off_t blockno);
 
+/*
+ * Batches of blocks, each one read or written as by pmemblk_read() or
+ * pmemblk_write(), in order.  A batch is cheaper than the same blocks
+ * one call at a time, but only each block is written atomically, not
+ * the batch.  When a block fails, the ones before it are done and the
+ * rest are not.  Nothing is done if any block number is out of range.
+ */
+struct pmemblk_iov {
+	void *buf;		/* bsize bytes */
+	off_t blockno;
+};
+
+int pmemblk_readv(PMEMblk *pbp, const struct pmemblk_iov *iov, int iovcnt);
+int pmemblk_writev(PMEMblk *pbp, const struct pmemblk_iov *iov, int iovcnt);
+int pmemblk_read_range(PMEMblk *pbp, void *buf, off_t blockno,
+		size_t nblock);
+int pmemblk_write_range(PMEMblk *pbp, const void *buf, off_t blockno,
+		size_t nblock);
+
+/*
+ * A pool created with PMEM_BLK_CHECKSUM=1 in the environment stores a
+ * CRC32C with each block.  Reading a block that does not match it fails
+ * with EIO, and a scrubber thread can look for such blocks ahead of the
+ * reads, setting them to the error state.  rate is in blocks per second,
+ * 0 for no limit.
+ */
+struct pmemblk_scrub_stats {
+	uint64_t passes;	/* completed passes over all blocks */
+	uint64_t blocks;	/* blocks verified */
+	uint64_t errors;	/* bad blocks found, now in the error state */
+};
+
+int pmemblk_scrub_start(PMEMblk *pbp, unsigned rate);
+int pmemblk_scrub_stop(PMEMblk *pbp);
+int pmemblk_scrub_stats(PMEMblk *pbp, struct pmemblk_scrub_stats *statsp);
+
+/*
+ * Asynchronous block I/O.  pmemblk_aio_start() starts nthread worker
+ * threads, 0 for one per lane, which carry out the operations queued by
+ * pmemblk_aio_submit().  Each operation's outcome is queued for
+ * pmemblk_aio_reap(), in the order they finish.  depth, 0 for 256, is
+ * rounded up to a power of two and limits the operations submitted and
+ * not reaped yet.  pmemblk_aio_submit() queues as many of the given ones
+ * as fit and returns how many it did.  pmemblk_aio_reap() waits for at
+ * least min completions, unless fewer are outstanding, and returns up
+ * to max.  pmemblk_aio_stop() waits for the queued operations to finish,
+ * their completions are dropped.  Starting and stopping must not race
+ * with submitting and reaping.
+ */
+#define	PMEMBLK_AIO_READ 0
+#define	PMEMBLK_AIO_WRITE 1
+#define	PMEMBLK_AIO_SET_ZERO 2
+
+struct pmemblk_aio_op {
+	int opcode;		/* PMEMBLK_AIO_* */
+	void *buf;		/* bsize bytes, unused by SET_ZERO */
+	off_t blockno;
+	uint64_t user_data;	/* handed back with the completion */
+};
+
+struct pmemblk_aio_cqe {
+	uint64_t user_data;
+	int error;		/* 0, or errno as the sync call would set */
+};
+
+int pmemblk_aio_start(PMEMblk *pbp, unsigned depth, unsigned nthread);
+int pmemblk_aio_stop(PMEMblk *pbp);
+int pmemblk_aio_submit(PMEMblk *pbp, const struct pmemblk_aio_op *ops,
+		unsigned nops);
+int pmemblk_aio_reap(PMEMblk *pbp, struct pmemblk_aio_cqe *cqes,
+		unsigned max, unsigned min);
+
 /*
  * support for PMEM-resident log files...
  */
@@ -242,7 +557,7 @@ const char *pmem_check_version(
  *
  * The print_func is called by libpmem based on the environment
  * variable PMEM_LOG_LEVEL:
- * 	0 or unset: print_func is only called for pmem_pool_stats_print()
+ * 	0 or unset: print_func is only called for pmemobj_pool_stats_print()
  * 	1:          additional details are logged when errors are returned
  * 	2:          basic operations (allocations/frees) are logged
  * 	3:          produce very verbose tracing of function calls in libpmem
@@ -41,6 +41,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <libpmem.h>
 #include "pmem.h"
 #include "util.h"
@@ -111,35 +112,665 @@ pmem_set_funcs(
 	pmem_set_persist_func(persist_func);
 }
 
+/*
+ * pmem_set_map_policy -- choose how files are mapped from now on
+ */
+int
+pmem_set_map_policy(size_t align, int flags)
+{
+	LOG(3, "align %zu flags 0x%x", align, flags);
+
+	return util_map_policy(align, flags);
+}
+
+/*
+ * pmem_set_prefault -- choose how pools are pre-faulted when opened
+ */
+void
+pmem_set_prefault(unsigned nthreads,
+		void (*progress_func)(size_t done, size_t total))
+{
+	LOG(3, "nthreads %u progress %p", nthreads, progress_func);
+
+	util_set_prefault(nthreads, progress_func);
+}
+
+/*
+ * deferred msyncs
+ *
+ * Between libpmem_msync_batch_begin() and libpmem_msync_batch_end() the
+ * pages a thread would msync are only recorded, and when the outermost
+ * batch ends the recorded ranges are merged and each run of adjacent
+ * pages is msync'ed once.  This is only for ranges that need not become
+ * durable in any particular order, like the objects flushed on commit.
+ */
+static __thread struct {
+	int nesting;		/* batch_begin calls not yet ended */
+	unsigned nranges;
+	unsigned maxranges;
+	struct dirty_range {
+		uintptr_t start;
+		uintptr_t end;
+	} *ranges;
+} Dirty;
+
+#define	DIRTY_BATCH_MIN 16	/* initial size of the range array */
+
+/*
+ * dirty_add -- (internal) remember the pages of a range to msync later
+ *
+ * Returns false if the range could not be recorded.
+ */
+static int
+dirty_add(void *addr, size_t len)
+{
+	uintptr_t start = (uintptr_t)addr & ~(Pagesize - 1);
+	uintptr_t end = ((uintptr_t)addr + len + Pagesize - 1) &
+				~(Pagesize - 1);
+
+	/* the common case of the same pages flushed again */
+	if (Dirty.nranges > 0) {
+		struct dirty_range *last = &Dirty.ranges[Dirty.nranges - 1];
+		if (start <= last->end && end >= last->start) {
+			if (start < last->start)
+				last->start = start;
+			if (end > last->end)
+				last->end = end;
+			return 1;
+		}
+	}
+
+	if (Dirty.nranges == Dirty.maxranges) {
+		unsigned max = Dirty.maxranges ?
+				Dirty.maxranges * 2 : DIRTY_BATCH_MIN;
+		struct dirty_range *ranges;
+		if ((ranges = Realloc(Dirty.ranges,
+				max * sizeof (*ranges))) == NULL) {
+			LOG(1, "!Realloc");
+			return 0;
+		}
+		Dirty.ranges = ranges;
+		Dirty.maxranges = max;
+	}
+
+	Dirty.ranges[Dirty.nranges].start = start;
+	Dirty.ranges[Dirty.nranges].end = end;
+	Dirty.nranges++;
+	return 1;
+}
+
+/*
+ * libpmem_msync -- (internal) msync a range, or record it for later
+ */
+static void
+libpmem_msync(void *addr, size_t len)
+{
+	if (Dirty.nesting && dirty_add(addr, len))
+		return;
+
+	pmem_msync(addr, len);
+}
+
+/*
+ * dirty_range_cmp -- (internal) qsort comparator for dirty ranges
+ */
+static int
+dirty_range_cmp(const void *a, const void *b)
+{
+	const struct dirty_range *ra = a;
+	const struct dirty_range *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+/*
+ * libpmem_msync_batch_begin -- start deferring msyncs on this thread
+ *
+ * Batches nest, the msyncs are done when the outermost one ends.
+ */
+void
+libpmem_msync_batch_begin(void)
+{
+	Dirty.nesting++;
+}
+
+/*
+ * libpmem_msync_batch_end -- msync the ranges recorded on this thread
+ */
+void
+libpmem_msync_batch_end(void)
+{
+	ASSERT(Dirty.nesting > 0);
+	if (--Dirty.nesting > 0 || Dirty.nranges == 0)
+		return;
+
+	LOG(5, "%u ranges", Dirty.nranges);
+
+	struct dirty_range *r = Dirty.ranges;
+	qsort(r, Dirty.nranges, sizeof (*r), dirty_range_cmp);
+
+	unsigned i = 0;
+	while (i < Dirty.nranges) {
+		uintptr_t start = r[i].start;
+		uintptr_t end = r[i].end;
+		for (i++; i < Dirty.nranges && r[i].start <= end; i++)
+			if (r[i].end > end)
+				end = r[i].end;
+
+		pmem_msync((void *)start, end - start);
+	}
+	Dirty.nranges = 0;
+}
+
+/*
+ * mirrored ranges
+ *
+ * A mirrored range is a mapping (the primary) with a second mapping of
+ * the same size (the replica) that must receive every change flushed to
+ * the primary.  libpmem_persist() looks up the range being flushed and
+ * replays it to the replica, or, when a batch is open on the calling
+ * thread, just remembers it so the whole batch can be copied out with a
+ * single fence when it ends.
+ */
+struct mirror {
+	struct mirror *next;
+	char *addr;		/* primary */
+	size_t len;
+	char *replica;
+	int replica_is_pmem;
+};
+
+static struct mirror *Mirrors;
+static pthread_rwlock_t Mirrors_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* ranges waiting to be replayed, per thread */
+static __thread struct {
+	int nesting;		/* batch_begin calls not yet ended */
+	unsigned nranges;
+	unsigned maxranges;
+	struct mirror_range {
+		char *addr;
+		size_t len;
+	} *ranges;
+} Batch;
+
+#define	MIRROR_BATCH_MIN 16	/* initial size of the range array */
+
+/*
+ * libpmem_mirror_register -- start replaying flushes of a range to a replica
+ */
+int
+libpmem_mirror_register(void *addr, size_t len, void *replica,
+		int replica_is_pmem)
+{
+	LOG(3, "addr %p len %zu replica %p replica_is_pmem %d",
+			addr, len, replica, replica_is_pmem);
+
+	struct mirror *mp;
+	if ((mp = Malloc(sizeof (*mp))) == NULL) {
+		LOG(1, "!Malloc");
+		return -1;
+	}
+
+	mp->addr = addr;
+	mp->len = len;
+	mp->replica = replica;
+	mp->replica_is_pmem = replica_is_pmem;
+
+	pthread_rwlock_wrlock(&Mirrors_lock);
+	mp->next = Mirrors;
+	Mirrors = mp;
+	pthread_rwlock_unlock(&Mirrors_lock);
+
+	return 0;
+}
+
+/*
+ * libpmem_mirror_unregister -- stop mirroring the range starting at addr
+ */
+void
+libpmem_mirror_unregister(void *addr)
+{
+	LOG(3, "addr %p", addr);
+
+	pthread_rwlock_wrlock(&Mirrors_lock);
+	struct mirror **mpp = &Mirrors;
+	while (*mpp != NULL && (*mpp)->addr != addr)
+		mpp = &(*mpp)->next;
+
+	struct mirror *mp = *mpp;
+	if (mp != NULL)
+		*mpp = mp->next;
+	pthread_rwlock_unlock(&Mirrors_lock);
+
+	if (mp == NULL)
+		LOG(1, "addr %p is not mirrored", addr);
+	Free(mp);
+}
+
+/*
+ * mirror_copy -- (internal) copy a range to the replica
+ *
+ * On pmem the copy uses non-temporal stores, see pmem_memmove_nodrain(),
+ * so the replica neither pollutes the cache nor needs flushing.  The
+ * caller issues the fence.
+ */
+static void
+mirror_copy(char *dst, const char *src, size_t len, int is_pmem)
+{
+	if (!is_pmem || Persist != pmem_persist) {
+		memcpy(dst, src, len);
+		if (is_pmem)
+			Persist(dst, len, 0);
+		else
+			libpmem_msync(dst, len);
+		return;
+	}
+
+	pmem_memmove_nodrain(dst, src, len);
+}
+
+/*
+ * mirror_replay -- (internal) copy a flushed range to its replica, if any
+ *
+ * Returns true if anything was copied.
+ */
+static int
+mirror_replay(char *addr, size_t len)
+{
+	int copied = 0;
+
+	pthread_rwlock_rdlock(&Mirrors_lock);
+	for (struct mirror *mp = Mirrors; mp != NULL; mp = mp->next) {
+		if (addr + len <= mp->addr || addr >= mp->addr + mp->len)
+			continue;
+
+		/* clip to the mirrored range */
+		char *start = (addr < mp->addr) ? mp->addr : addr;
+		char *end = (addr + len > mp->addr + mp->len) ?
+				mp->addr + mp->len : addr + len;
+
+		mirror_copy(mp->replica + (start - mp->addr), start,
+				end - start, mp->replica_is_pmem);
+		copied = 1;
+	}
+	pthread_rwlock_unlock(&Mirrors_lock);
+
+	return copied;
+}
+
+/*
+ * mirror_range_cmp -- (internal) qsort comparator for batched ranges
+ */
+static int
+mirror_range_cmp(const void *a, const void *b)
+{
+	const struct mirror_range *ra = a;
+	const struct mirror_range *rb = b;
+
+	if (ra->addr < rb->addr)
+		return -1;
+	return ra->addr > rb->addr;
+}
+
+/*
+ * libpmem_mirror_batch_begin -- start collecting ranges on this thread
+ *
+ * Batches nest, the ranges are replayed when the outermost one ends.
+ */
+void
+libpmem_mirror_batch_begin(void)
+{
+	Batch.nesting++;
+}
+
+/*
+ * libpmem_mirror_batch_end -- replay the ranges collected on this thread
+ *
+ * Overlapping and adjacent ranges are merged first, so a range flushed
+ * several times during a transaction is copied to the replica once.
+ */
+void
+libpmem_mirror_batch_end(void)
+{
+	ASSERT(Batch.nesting > 0);
+	if (--Batch.nesting > 0 || Batch.nranges == 0)
+		return;
+
+	LOG(5, "%u ranges", Batch.nranges);
+
+	struct mirror_range *r = Batch.ranges;
+	qsort(r, Batch.nranges, sizeof (*r), mirror_range_cmp);
+
+	int copied = 0;
+	unsigned i = 0;
+	while (i < Batch.nranges) {
+		char *start = r[i].addr;
+		char *end = r[i].addr + r[i].len;
+		for (i++; i < Batch.nranges && r[i].addr <= end; i++)
+			if (r[i].addr + r[i].len > end)
+				end = r[i].addr + r[i].len;
+
+		copied |= mirror_replay(start, end - start);
+	}
+	Batch.nranges = 0;
+
+	if (copied) {
+		pmem_fence();
+		pmem_drain();
+	}
+}
+
+/*
+ * mirror_batch_add -- (internal) remember a range for the current batch
+ *
+ * Returns false if the range could not be recorded.
+ */
+static int
+mirror_batch_add(void *addr, size_t len)
+{
+	if (Batch.nranges == Batch.maxranges) {
+		unsigned max = Batch.maxranges ?
+				Batch.maxranges * 2 : MIRROR_BATCH_MIN;
+		struct mirror_range *ranges;
+		if ((ranges = Realloc(Batch.ranges,
+				max * sizeof (*ranges))) == NULL) {
+			LOG(1, "!Realloc");
+			return 0;
+		}
+		Batch.ranges = ranges;
+		Batch.maxranges = max;
+	}
+
+	Batch.ranges[Batch.nranges].addr = addr;
+	Batch.ranges[Batch.nranges].len = len;
+	Batch.nranges++;
+	return 1;
+}
+
+/*
+ * libpmem_mirror -- (internal) hand a flushed range to the mirroring code
+ */
+static void
+libpmem_mirror(void *addr, size_t len)
+{
+	if (Mirrors == NULL)
+		return;		/* nothing is mirrored, the common case */
+
+	if (Batch.nesting && mirror_batch_add(addr, len))
+		return;
+
+	if (mirror_replay(addr, len)) {
+		pmem_fence();
+		pmem_drain();
+	}
+}
+
 /*
  * libpmem_persist -- libpmem's central routine for flushing to persistence
  *
- * This routine calls msync() or Persist(), depending on the is_pmem flag.
+ * This routine calls msync() or Persist(), depending on the is_pmem flag,
+ * and then replays the range to its replica if it is mirrored.  src is
+ * the PMEM_FLUSH_SRC_* the flush is counted for in the flush profile.
  */
 void
-libpmem_persist(int is_pmem, void *addr, size_t len)
+libpmem_persist(unsigned src, int is_pmem, void *addr, size_t len)
 {
-	LOG(5, "is_pmem %d addr %p len %zu", is_pmem, addr, len);
+	LOG(5, "src %u is_pmem %d addr %p len %zu", src, is_pmem, addr, len);
 
-	if (is_pmem) {
+	unsigned osrc = pmem_prof_source(src);
+	pmem_prof_add(PROF_CALLS, 1);
+	pmem_prof_add(PROF_BYTES, len);
+
+	if (is_pmem)
 		Persist(addr, len, 0);
+	else
+		libpmem_msync(addr, len);
+
+	libpmem_mirror(addr, len);
+	pmem_prof_source(osrc);
+}
+
+/*
+ * libpmem_memcpy_persist -- copy a range to a pool and make it persistent
+ *
+ * Same as a memcpy() followed by libpmem_persist(), except that on pmem
+ * the copy is done with pmem_memcpy_persist(), which uses non-temporal
+ * stores for all but short copies, so there is nothing left to flush.
+ */
+void
+libpmem_memcpy_persist(unsigned src, int is_pmem, void *dest,
+		const void *from, size_t len)
+{
+	LOG(5, "src %u is_pmem %d dest %p from %p len %zu", src, is_pmem,
+			dest, from, len);
+
+	unsigned osrc = pmem_prof_source(src);
+	pmem_prof_add(PROF_CALLS, 1);
+	pmem_prof_add(PROF_BYTES, len);
+
+	if (is_pmem && Persist == pmem_persist)
+		pmem_memcpy_persist(dest, from, len);
+	else {
+		memcpy(dest, from, len);
+		if (is_pmem)
+			Persist(dest, len, 0);
+		else
+			libpmem_msync(dest, len);
+	}
+
+	libpmem_mirror(dest, len);
+	pmem_prof_source(osrc);
+}
+
+/*
+ * libpmem_memcpy_nodrain -- copy a range to a pool, without the fence
+ *
+ * Same as libpmem_memcpy_persist(), except that on pmem the fence is left
+ * to libpmem_drain(), so several copies can share one.  When not on pmem
+ * the copy is left for the caller to msync.
+ */
+void
+libpmem_memcpy_nodrain(unsigned src, int is_pmem, void *dest,
+		const void *from, size_t len)
+{
+	LOG(5, "src %u is_pmem %d dest %p from %p len %zu", src, is_pmem,
+			dest, from, len);
+
+	if (!is_pmem) {
+		memcpy(dest, from, len);
 		return;
 	}
 
-	uintptr_t uptr;
+	unsigned osrc = pmem_prof_source(src);
+	pmem_prof_add(PROF_CALLS, 1);
+	pmem_prof_add(PROF_BYTES, len);
 
-	/*
-	 * msync requires len to be a multiple of pagesize, so
-	 * adjust addr and len to represent the full 4k chunks
-	 * covering the given range.
-	 */
+	if (Persist == pmem_persist)
+		pmem_memmove_nodrain(dest, from, len);
+	else {
+		memcpy(dest, from, len);
+		Persist(dest, len, 0);
+	}
 
-	/* increase len by the amount we gain when we round addr down */
-	len += (uintptr_t)addr & (Pagesize - 1);
+	libpmem_mirror(dest, len);
+	pmem_prof_source(osrc);
+}
 
-	/* round addr down to page boundary */
-	uptr = (uintptr_t)addr & ~(Pagesize - 1);
+/*
+ * libpmem_memset_nodrain -- fill a range of a pool, without the fence
+ *
+ * The libpmem_memcpy_nodrain() counterpart for filling a range.
+ */
+void
+libpmem_memset_nodrain(unsigned src, int is_pmem, void *dest, int c,
+		size_t len)
+{
+	LOG(5, "src %u is_pmem %d dest %p c %d len %zu", src, is_pmem,
+			dest, c, len);
+
+	if (!is_pmem) {
+		memset(dest, c, len);
+		return;
+	}
 
-	if (msync((void *)uptr, len, MS_SYNC) < 0)
-		LOG(1, "!msync");
+	unsigned osrc = pmem_prof_source(src);
+	pmem_prof_add(PROF_CALLS, 1);
+	pmem_prof_add(PROF_BYTES, len);
+
+	if (Persist == pmem_persist)
+		pmem_memset_nodrain(dest, c, len);
+	else {
+		memset(dest, c, len);
+		Persist(dest, len, 0);
+	}
+
+	libpmem_mirror(dest, len);
+	pmem_prof_source(osrc);
+}
+
+/*
+ * libpmem_drain -- wait for earlier libpmem_*_nodrain() stores
+ */
+void
+libpmem_drain(unsigned src, int is_pmem)
+{
+	LOG(5, "src %u is_pmem %d", src, is_pmem);
+
+	if (is_pmem && Persist == pmem_persist) {
+		unsigned osrc = pmem_prof_source(src);
+		pmem_fence();
+		pmem_drain();
+		pmem_prof_source(osrc);
+	}
+}
+
+/*
+ * batched persists
+ *
+ * Callers with several independent ranges to make persistent add them to
+ * a struct persist_batch, usually on the stack, and persist them all with
+ * one fence instead of one per range.  Ranges are rounded out to whole
+ * cache lines (whole pages when msync is used), so a line or page shared
+ * by several ranges is only flushed once.
+ */
+
+/*
+ * libpmem_batch_init -- start an empty batch for a pool
+ */
+void
+libpmem_batch_init(struct persist_batch *bp, unsigned src, int is_pmem)
+{
+	bp->src = src;
+	bp->is_pmem = is_pmem;
+	bp->nranges = 0;
+}
+
+/*
+ * batch_flush -- (internal) flush the ranges collected, without a fence
+ */
+static void
+batch_flush(struct persist_batch *bp)
+{
+	struct persist_range *r = bp->ranges;
+	unsigned osrc = pmem_prof_source(bp->src);
+
+	/* insertion sort, the batch is small */
+	for (unsigned i = 1; i < bp->nranges; i++) {
+		struct persist_range tmp = r[i];
+		unsigned j = i;
+		for (; j > 0 && r[j - 1].start > tmp.start; j--)
+			r[j] = r[j - 1];
+		r[j] = tmp;
+	}
+
+	for (unsigned i = 0; i < bp->nranges; ) {
+		uintptr_t start = r[i].start;
+		uintptr_t end = r[i].end;
+
+		/* coalesce overlapping and adjacent ranges */
+		for (i++; i < bp->nranges && r[i].start <= end; i++)
+			if (r[i].end > end)
+				end = r[i].end;
+
+		void *addr = (void *)start;
+		size_t len = end - start;
+
+		if (!bp->is_pmem)
+			libpmem_msync(addr, len);
+		else if (Persist == pmem_persist)
+			pmem_flush(addr, len, 0);
+		else
+			Persist(addr, len, 0);
+
+		libpmem_mirror(addr, len);
+	}
+
+	bp->nranges = 0;
+	pmem_prof_source(osrc);
+}
+
+/*
+ * libpmem_batch_add -- add a range to be persisted with the batch
+ *
+ * A full batch is flushed right away, only the fence waits for
+ * libpmem_batch_persist().
+ */
+void
+libpmem_batch_add(struct persist_batch *bp, void *addr, size_t len)
+{
+	LOG(5, "bp %p addr %p len %zu", bp, addr, len);
+
+	if (len == 0)
+		return;
+
+	unsigned osrc = pmem_prof_source(bp->src);
+	pmem_prof_add(PROF_CALLS, 1);
+	pmem_prof_add(PROF_BYTES, len);
+	pmem_prof_source(osrc);
+
+	uintptr_t align = bp->is_pmem ? FLUSH_ALIGN : Pagesize;
+	uintptr_t start = (uintptr_t)addr & ~(align - 1);
+	uintptr_t end = ((uintptr_t)addr + len + align - 1) & ~(align - 1);
+
+	/* the common case of a range next to or within the last one */
+	if (bp->nranges > 0) {
+		struct persist_range *last = &bp->ranges[bp->nranges - 1];
+		if (start <= last->end && end >= last->start) {
+			if (start < last->start)
+				last->start = start;
+			if (end > last->end)
+				last->end = end;
+			return;
+		}
+	}
+
+	if (bp->nranges == PERSIST_BATCH_MAX)
+		batch_flush(bp);
+
+	bp->ranges[bp->nranges].start = start;
+	bp->ranges[bp->nranges].end = end;
+	bp->nranges++;
+}
+
+/*
+ * libpmem_batch_persist -- make all ranges added to the batch persistent
+ *
+ * The batch is empty again afterwards and can be reused.
+ */
+void
+libpmem_batch_persist(struct persist_batch *bp)
+{
+	LOG(5, "bp %p nranges %u", bp, bp->nranges);
+
+	batch_flush(bp);
+
+	if (bp->is_pmem && Persist == pmem_persist) {
+		unsigned osrc = pmem_prof_source(bp->src);
+		pmem_fence();
+		pmem_drain();
+		pmem_prof_source(osrc);
+	}
 }
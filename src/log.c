@@ -98,6 +98,8 @@ pmemlog_map_common(int fd, int rdonly)
 	if ((addr = util_map(fd, stbuf.st_size, rdonly)) == NULL)
 		return NULL;	/* util_map() set errno, called LOG */
 
+	util_prefault(addr, stbuf.st_size, !rdonly);
+
 	/* check if the mapped region is located in persistent memory */
 	int is_pmem = pmem_is_pmem(addr, stbuf.st_size);
 
@@ -167,31 +169,34 @@ pmemlog_map_common(int fd, int rdonly)
 		}
 		LOG(3, "creating new log memory pool");
 
+		/*
+		 * The descriptor goes first, a valid header is what makes
+		 * it count, so it must never be found with a zero one.
+		 */
+		plp->start_offset = htole64(roundup(sizeof (*plp),
+						LOG_FORMAT_DATA_ALIGN));
+		plp->end_offset = htole64(stbuf.st_size);
+		plp->write_offset = plp->start_offset;
+		libpmem_persist(PMEM_FLUSH_SRC_LOG, is_pmem, &plp->start_offset,
+				3 * sizeof (uint64_t));
+
 		struct pool_hdr *hdrp = &plp->hdr;
+		int csum = util_checksum_create();
 
 		memset(hdrp, '\0', sizeof (*hdrp));
 		strncpy(hdrp->signature, LOG_HDR_SIG, POOL_HDR_SIG_LEN);
 		hdrp->major = htole32(LOG_FORMAT_MAJOR);
 		hdrp->compat_features = htole32(LOG_FORMAT_COMPAT);
-		hdrp->incompat_features = htole32(LOG_FORMAT_INCOMPAT);
+		hdrp->incompat_features = htole32(POOL_HDR_CSUM_FEAT(csum));
 		hdrp->ro_compat_features = htole32(LOG_FORMAT_RO_COMPAT);
 		uuid_generate(hdrp->uuid);
 		hdrp->crtime = htole64((uint64_t)time(NULL));
-		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1);
+		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1, csum);
 		hdrp->checksum = htole64(hdrp->checksum);
 
-		/* store pool's header */
-		libpmem_persist(is_pmem, hdrp, sizeof (*hdrp));
-
-		/* create rest of required metadata */
-		plp->start_offset = htole64(roundup(sizeof (*plp),
-						LOG_FORMAT_DATA_ALIGN));
-		plp->end_offset = htole64(stbuf.st_size);
-		plp->write_offset = plp->start_offset;
-
-		/* store non-volatile part of pool's descriptor */
-		libpmem_persist(is_pmem, &plp->start_offset,
-							3 * sizeof (uint64_t));
+		/* store the header only once the descriptor is persistent */
+		libpmem_persist(PMEM_FLUSH_SRC_LOG, is_pmem, hdrp,
+				sizeof (*hdrp));
 	}
 
 	/*
@@ -286,6 +291,19 @@ pmemlog_nbyte(PMEMlog *plp)
 	return size;
 }
 
+/*
+ * pmemlog_copy -- (internal) copy data to be appended into the log space
+ *
+ * Nothing is waited for here, pmemlog_persist() fences all the copies of
+ * an append at once on pmem, or msyncs them otherwise.
+ */
+static void
+pmemlog_copy(PMEMlog *plp, char *dest, const void *buf, size_t count)
+{
+	libpmem_memcpy_nodrain(PMEM_FLUSH_SRC_LOG, plp->is_pmem,
+			dest, buf, count);
+}
+
 /*
  * pmemlog_persist -- (internal) persist data, then metadata
  *
@@ -297,14 +315,19 @@ pmemlog_persist(PMEMlog *plp, uint64_t new_write_offset)
 	uint64_t old_write_offset = le64toh(plp->write_offset);
 	size_t length = new_write_offset - old_write_offset;
 
-	/* unprotect the log space range (debug version only) */
-	RANGE_RW(plp->addr + old_write_offset, length);
+	/* persist the data, on pmem pmemlog_copy() only left the fence */
+	if (plp->is_pmem)
+		libpmem_drain(PMEM_FLUSH_SRC_LOG, 1);
+	else {
+		/* unprotect the log space range (debug version only) */
+		RANGE_RW(plp->addr + old_write_offset, length);
 
-	/* persist the data */
-	libpmem_persist(plp->is_pmem, plp->addr + old_write_offset, length);
+		libpmem_persist(PMEM_FLUSH_SRC_LOG, 0,
+				plp->addr + old_write_offset, length);
 
-	/* protect the log space range (debug version only) */
-	RANGE_RO(plp->addr + old_write_offset, length);
+		/* protect the log space range (debug version only) */
+		RANGE_RO(plp->addr + old_write_offset, length);
+	}
 
 	/* unprotect the pool descriptor (debug version only) */
 	RANGE_RW(plp->addr + sizeof (struct pool_hdr), LOG_FORMAT_DATA_ALIGN);
@@ -313,8 +336,8 @@ pmemlog_persist(PMEMlog *plp, uint64_t new_write_offset)
 	plp->write_offset = htole64(new_write_offset);
 
 	/* persist the metadata */
-	libpmem_persist(plp->is_pmem, &plp->write_offset,
-			sizeof (plp->write_offset));
+	libpmem_persist(PMEM_FLUSH_SRC_LOG, plp->is_pmem,
+			&plp->write_offset, sizeof (plp->write_offset));
 
 	/* set the write-protection again (debug version only) */
 	RANGE_RO(plp->addr + sizeof (struct pool_hdr), LOG_FORMAT_DATA_ALIGN);
@@ -364,7 +387,7 @@ pmemlog_append(PMEMlog *plp, const void *buf, size_t count)
 			 */
 			RANGE_RW(&data[write_offset], count);
 
-			memcpy(&data[write_offset], buf, count);
+			pmemlog_copy(plp, &data[write_offset], buf, count);
 
 			/* protect the log space range (debug version only) */
 			RANGE_RO(&data[write_offset], count);
@@ -441,7 +464,8 @@ pmemlog_appendv(PMEMlog *plp, const struct iovec *iov, int iovcnt)
 				 */
 				RANGE_RW(&data[write_offset], count);
 
-				memcpy(&data[write_offset], buf, count);
+				pmemlog_copy(plp, &data[write_offset],
+						buf, count);
 
 				/*
 				 * protect the log space range
@@ -511,7 +535,8 @@ pmemlog_rewind(PMEMlog *plp)
 	RANGE_RW(plp->addr + sizeof (struct pool_hdr), LOG_FORMAT_DATA_ALIGN);
 
 	plp->write_offset = plp->start_offset;
-	libpmem_persist(plp->is_pmem, &plp->write_offset, sizeof (uint64_t));
+	libpmem_persist(PMEM_FLUSH_SRC_LOG, plp->is_pmem, &plp->write_offset,
+			sizeof (uint64_t));
 
 	/* set the write-protection again (debug version only) */
 	RANGE_RO(plp->addr + sizeof (struct pool_hdr), LOG_FORMAT_DATA_ALIGN);
@@ -38,7 +38,7 @@
 #define	LOG_HDR_SIG "PMEMLOG"	/* must be 8 bytes including '\0' */
 #define	LOG_FORMAT_MAJOR 1
 #define	LOG_FORMAT_COMPAT 0x0000
-#define	LOG_FORMAT_INCOMPAT 0x0000
+#define	LOG_FORMAT_INCOMPAT POOL_FEAT_CRC32C	/* all understood */
 #define	LOG_FORMAT_RO_COMPAT 0x0000
 
 struct pmemlog {
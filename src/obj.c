@@ -55,15 +55,20 @@
 #include "util.h"
 #include "out.h"
 #include "allocator.h"
+#include "stats.h"
+#include "epoch.h"
 #include "obj.h"
 
 
 static uint64_t Runid;		/* unique "run ID" for this program run */
+static int Stats_enabled;	/* pools opened gather stats */
+static unsigned Stats_dump;	/* seconds between dumps of the stats */
 
 typedef enum {
 	TXOP_ALLOC,
 	TXOP_FREE,
 	TXOP_SET,
+	TXOP_SET_EXTENT,	/* a TXOP_SET with its undo copy in an extent */
 } op_t;
 
 struct tx {
@@ -73,6 +78,8 @@ struct tx {
 	PMEMrwlock *rwlockp;
 	PMEMobjpool *pool;
 
+	unsigned lane;		/* lane holding the undo log */
+	uint64_t start;		/* when the outermost transaction began */
 	struct tx *next;	/* outer transaction when nested */
 	/* one of these is pushed for each operation in a transaction */
 	struct txop *head;
@@ -84,6 +91,7 @@ struct tx {
 		union txop_args {
 			struct {
 				uint64_t addr;
+				size_t size;	/* bytes to flush on commit */
 			} alloc;
 			struct {
 				uint64_t addr;
@@ -125,975 +133,3969 @@ obj_init(void)
 		Runid = ts.tv_sec * 1000000000 + ts.tv_nsec;
 	}
 	LOG(4, "Runid %" PRIx64, Runid);
+
+	/* PMEMOBJ_STATS=1 makes pools gather stats, a dump implies it */
+	char *ptr = getenv("PMEMOBJ_STATS");
+	if (ptr)
+		Stats_enabled = atoi(ptr) != 0;
+	ptr = getenv("PMEMOBJ_STATS_DUMP");
+	if (ptr && atoi(ptr) > 0) {
+		Stats_dump = (unsigned)atoi(ptr);
+		Stats_enabled = 1;
+	}
 }
 
 /*
- * pmemobj_pool_open -- open a transactional memory pool
+ * obj_persist -- (internal) flush a range of the pool
+ *
+ * Nothing is flushed for a copy-on-write pool, whose changes only ever
+ * live in private pages.
  */
-PMEMobjpool *
-pmemobj_pool_open(const char *path)
+static void
+obj_persist(PMEMobjpool *pop, void *addr, size_t len)
 {
-	LOG(3, "path \"%s\"", path);
+	if (pop->cow)
+		return;
 
-	struct stat stbuf;
-	if (stat(path, &stbuf) < 0) {
-		LOG(1, "!%s", path);
-		return NULL;
+	if (pop->stats == NULL) {
+		libpmem_persist(PMEM_FLUSH_SRC_OBJ, pop->is_pmem, addr, len);
+		return;
 	}
 
-	if (stbuf.st_size < PMEMOBJ_MIN_POOL) {
-		LOG(1, "size %zu smaller than %zu",
-				stbuf.st_size, PMEMOBJ_MIN_POOL);
-		errno = EINVAL;
-		return NULL;
-	}
+	uint64_t start = stats_now();
+	libpmem_persist(PMEM_FLUSH_SRC_OBJ, pop->is_pmem, addr, len);
+	stats_record(pop->stats, PMEMOBJ_LATENCY_FLUSH, stats_now() - start);
+	stats_add(pop->stats, OBJ_STAT_FLUSHES, 1);
+	stats_add(pop->stats, OBJ_STAT_FLUSH_BYTES, len);
+}
 
-	int fd;
-	if ((fd = open(path, O_RDWR)) < 0) {
-		LOG(1, "!%s", path);
-		return NULL;
+/*
+ * obj_memcpy_persist -- (internal) copy a range into the pool, persistently
+ */
+static void
+obj_memcpy_persist(PMEMobjpool *pop, void *dest, const void *src, size_t len)
+{
+	if (pop->cow) {
+		memcpy(dest, src, len);
+		return;
 	}
 
-	void *addr;
-	if ((addr = util_map(fd, stbuf.st_size, 0)) == NULL)
-		return NULL;	/* util_map() set errno, called LOG */
-
-	close(fd);
-
-	/* check if the mapped region is located in persistent memory */
-	int is_pmem = pmem_is_pmem(addr, stbuf.st_size);
-
-	/* opaque info lives at the beginning of mapped memory pool */
-	struct pmemobjpool *pop = addr;
-
-	struct pool_hdr hdr;
-	memcpy(&hdr, &pop->hdr, sizeof (hdr));
-
-	if (util_convert_hdr(&hdr)) {
-		/*
-		 * valid header found
-		 */
-		if (strncmp(hdr.signature, OBJ_HDR_SIG, POOL_HDR_SIG_LEN)) {
-			LOG(1, "wrong pool type: \"%s\"", hdr.signature);
-
-			errno = EINVAL;
-			goto err;
-		}
-
-		if (hdr.major != OBJ_FORMAT_MAJOR) {
-			LOG(1, "obj pool version %d (library expects %d)",
-				hdr.major, OBJ_FORMAT_MAJOR);
-
-			errno = EINVAL;
-			goto err;
-		}
-
-		int retval = util_feature_check(&hdr, OBJ_FORMAT_INCOMPAT,
-							OBJ_FORMAT_RO_COMPAT,
-							OBJ_FORMAT_COMPAT);
-		if (retval < 0)
-		    goto err;
-		else if (retval == 0) {
-			/* XXX switch to read-only mode */
-		}
-	} else {
-		/*
-		 * no valid header was found
-		 */
-		LOG(3, "creating new obj memory pool");
-
-		struct pool_hdr *hdrp = &pop->hdr;
-
-		memset(hdrp, '\0', sizeof (*hdrp));
-		strncpy(hdrp->signature, OBJ_HDR_SIG, POOL_HDR_SIG_LEN);
-		hdrp->major = htole32(OBJ_FORMAT_MAJOR);
-		hdrp->compat_features = htole32(OBJ_FORMAT_COMPAT);
-		hdrp->incompat_features = htole32(OBJ_FORMAT_INCOMPAT);
-		hdrp->ro_compat_features = htole32(OBJ_FORMAT_RO_COMPAT);
-		uuid_generate(hdrp->uuid);
-		hdrp->crtime = htole64((uint64_t)time(NULL));
-		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1);
-		hdrp->checksum = htole64(hdrp->checksum);
-
-		/* store pool's header */
-		libpmem_persist(is_pmem, hdrp, sizeof (*hdrp));
-
-		/* initialize pool metadata */
-		memset(&pop->rootlock, '\0', sizeof (pop->rootlock));
-		pop->root.off = 0;
+	if (pop->stats == NULL) {
+		libpmem_memcpy_persist(PMEM_FLUSH_SRC_OBJ, pop->is_pmem,
+				dest, src, len);
+		return;
 	}
 
-	/* use some of the memory pool area for run-time info */
-	pop->addr = addr;
-	pop->size = stbuf.st_size;
+	uint64_t start = stats_now();
+	libpmem_memcpy_persist(PMEM_FLUSH_SRC_OBJ, pop->is_pmem,
+			dest, src, len);
+	stats_record(pop->stats, PMEMOBJ_LATENCY_FLUSH, stats_now() - start);
+	stats_add(pop->stats, OBJ_STAT_FLUSHES, 1);
+	stats_add(pop->stats, OBJ_STAT_FLUSH_BYTES, len);
+}
 
-	allocator_init(&pop->allocator, sizeof (struct pmemobjpool), is_pmem);
+/*
+ * obj_memset_nodrain -- (internal) fill a range of the pool, no fence
+ *
+ * On pmem the range is only persistent after the next fence, the one of
+ * an obj_persist() or obj_memcpy_persist() following it.
+ */
+static void
+obj_memset_nodrain(PMEMobjpool *pop, void *dest, int c, size_t len)
+{
+	if (pop->cow) {
+		memset(dest, c, len);
+		return;
+	}
 
-	/*
-	 * If possible, turn off all permissions on the pool header page.
-	 *
-	 * The prototype PMFS doesn't allow this when large pages are in
-	 * use not it is not considered an error if this fails.
-	 */
-	util_range_none(addr, sizeof (struct pool_hdr));
+	libpmem_memset_nodrain(PMEM_FLUSH_SRC_OBJ, pop->is_pmem,
+			dest, c, len);
+	if (!pop->is_pmem)
+		libpmem_persist(PMEM_FLUSH_SRC_OBJ, 0, dest, len);
 
-	/* the rest should be kept read-only for debug version */
-	RANGE_RW(addr + sizeof (struct pool_hdr),
-			stbuf.st_size - sizeof (struct pool_hdr));
+	if (pop->stats != NULL) {
+		stats_add(pop->stats, OBJ_STAT_FLUSHES, 1);
+		stats_add(pop->stats, OBJ_STAT_FLUSH_BYTES, len);
+	}
+}
 
-	LOG(3, "pop %p", pop);
-	return pop;
+/*
+ * obj_pmalloc -- (internal) allocate from the pool, keeping stats
+ */
+static void
+obj_pmalloc(PMEMobjpool *pop, uint64_t *ptr, size_t size, uint32_t type_num)
+{
+	if (pop->stats == NULL) {
+		pmalloc(&pop->allocator, ptr, size, type_num);
+		return;
+	}
 
-err:
-	LOG(4, "error clean up");
-	int oerrno = errno;
-	util_unmap(addr, stbuf.st_size);
-	errno = oerrno;
-	return NULL;
+	uint64_t start = stats_now();
+	pmalloc(&pop->allocator, ptr, size, type_num);
+	stats_record(pop->stats, PMEMOBJ_LATENCY_ALLOC, stats_now() - start);
+	if (*ptr != 0) {
+		stats_add(pop->stats, OBJ_STAT_ALLOCS, 1);
+		stats_add(pop->stats, OBJ_STAT_ALLOC_BYTES, size);
+	}
 }
 
 /*
- * pmemobj_pool_open_mirrored -- open a mirrored pool
+ * obj_pfree -- (internal) free an object of the pool, keeping stats
  */
-PMEMobjpool *
-pmemobj_pool_open_mirrored(const char *path1, const char *path2)
+static void
+obj_pfree(PMEMobjpool *pop, uint64_t ptr)
 {
-	return NULL;
+	pfree(&pop->allocator, ptr);
+	if (pop->stats != NULL && ptr != 0)
+		stats_add(pop->stats, OBJ_STAT_FREES, 1);
 }
 
 /*
- * pmemobj_pool_close -- close a transactional memory pool
+ * obj_epoch_free -- (internal) free a retired object, called by epochs
  */
-void
-pmemobj_pool_close(PMEMobjpool *pop)
+static void
+obj_epoch_free(void *arg, uint64_t off)
 {
-	LOG(3, "pop %p", pop);
-
-	util_unmap(pop->addr, pop->size);
+	obj_pfree(arg, off);
 }
 
 /*
- * pmemobj_pool_check -- transactional memory pool consistency check
+ * obj_type -- (internal) return the type an object is tagged with
  */
-int
-pmemobj_pool_check(const char *path)
+static uint32_t
+obj_type(PMEMobjpool *pop, uint64_t off)
 {
-	LOG(3, "path \"%s\"", path);
-
-	/* XXX stub */
-	return 0;
+	return ((struct alloc_hdr *)((char *)pop->addr + off) - 1)->type_num;
 }
 
 /*
- * pmemobj_pool_check_mirrored -- mirrored memory pool consistency check
+ * obj_retire -- (internal) free an object once no reader can see it
+ *
+ * The object is tagged OBJ_TYPE_RETIRED right away, so it no longer
+ * shows up when iterating over the pool and is freed by the next open
+ * if the program ends before the readers are done with it.
  */
-int
-pmemobj_pool_check_mirrored(const char *path1, const char *path2)
+static void
+obj_retire(PMEMobjpool *pop, uint64_t off)
 {
-	LOG(3, "path1 \"%s\", path2 \"%s\"", path1, path2);
+	if (off == 0)
+		return;
+
+	if (pop->epoch != NULL) {
+		/* a transactional free tagged it at commit already */
+		if (obj_type(pop, off) != OBJ_TYPE_RETIRED)
+			allocator_set_type(&pop->allocator, off,
+					OBJ_TYPE_RETIRED);
+		if (epoch_retire(pop->epoch, off) == 0)
+			return;
+	}
 
-	/* XXX stub */
-	return 0;
+	obj_pfree(pop, off);
 }
 
 /*
- * tx_error -- (internal) set error state
- *
- * This is typically called for pmemobj error cases like this:
- *	return tx_error(tid, errnum);
- * A tid of zero is passed to mean the current tid for this thread.
- *
- * If there's no transaction in progress or if the transaction does
- * not have a jmp_buf defined, tx_error sets errno and returns -1.
- * If there's a jmp_buf defined, tx_error sets errno and longjmps.
+ * obj_retired_recover -- (internal) free what was retired in an old run
  */
-static int
-tx_error(int tid, int errnum)
+static void
+obj_retired_recover(PMEMobjpool *pop)
 {
-	errno = errnum;
-	/* XXX if jmp_buf defined, longjmp */
-	return -1;
+	uint64_t off = allocator_first(&pop->allocator, OBJ_TYPE_RETIRED);
+
+	while (off != 0) {
+		uint64_t next = allocator_next(&pop->allocator, off);
+		obj_pfree(pop, off);
+		off = next;
+	}
 }
 
 /*
- * mutexof -- (internal) find or allocate a pthread_mutex_t
- *
- * The first time mutexof() is used on a zeroed PMEMmutex, or
- * the first time it is used during this run of the  program,
- * mutexof() allocates a new pthread_mutex_t in DRAM and initializes
- * it for use.  On subsequent calls, mutexof() returns the existing
- * pthread_mutex_t.
- *
- * NULL is returned if the pthread_mutex_t cannot be allocated or initialized.
+ * lanes_init -- (internal) set up the run-time state of the lanes
  */
-pthread_mutex_t *
-mutexof(PMEMmutex *mutexp)
+static int
+lanes_init(PMEMobjpool *pop)
 {
-	if (mutexp->runid == Runid)
-		return mutexp->pthread_mutexp;	/* already allocated */
-	else if ((mutexp->pthread_mutexp =
-				Malloc(sizeof (pthread_mutex_t))) == NULL)
-		return NULL;
-	else if ((errno = pthread_mutex_init(mutexp->pthread_mutexp, NULL)))
-		return NULL;
-	else
-		return mutexp->pthread_mutexp;	/* newly allocated */
+	if ((pop->lanes = Malloc(OBJ_NLANES * sizeof (struct lane))) == NULL) {
+		LOG(1, "!Malloc");
+		return -1;
+	}
+
+	for (unsigned i = 0; i < OBJ_NLANES; i++) {
+		if ((errno = pthread_mutex_init(&pop->lanes[i].lock, NULL))) {
+			LOG(1, "!pthread_mutex_init");
+			int oerrno = errno;
+			while (i-- > 0)
+				pthread_mutex_destroy(&pop->lanes[i].lock);
+			Free(pop->lanes);
+			pop->lanes = NULL;
+			errno = oerrno;
+			return -1;
+		}
+		pop->lanes[i].tail = NULL;
+		pop->lanes[i].ext = NULL;
+		pop->lanes[i].ext_used = 0;
+		pop->lanes[i].undo_bytes = 0;
+	}
+	pop->next_lane = 0;
+
+	return 0;
 }
 
 /*
- * rwlockof -- (internal) find or allocate a pthread_rwlock_t
- *
- * NULL is returned if the pthread_rwlock_t cannot be allocated or initialized.
+ * lanes_fini -- (internal) release the run-time state of the lanes
  */
-pthread_rwlock_t *
-rwlockof(PMEMrwlock *rwlockp)
+static void
+lanes_fini(PMEMobjpool *pop)
 {
-	if (rwlockp->runid == Runid)
-		return rwlockp->pthread_rwlockp;	/* already allocated */
-	else if ((rwlockp->pthread_rwlockp =
-				Malloc(sizeof (pthread_rwlock_t))) == NULL)
-		return NULL;
-	else if ((errno = pthread_rwlock_init(rwlockp->pthread_rwlockp, NULL)))
-		return NULL;
-	else
-		return rwlockp->pthread_rwlockp;	/* newly allocated */
+	if (pop->lanes == NULL)
+		return;
+
+	for (unsigned i = 0; i < OBJ_NLANES; i++)
+		pthread_mutex_destroy(&pop->lanes[i].lock);
+	Free(pop->lanes);
+	pop->lanes = NULL;
 }
 
+#define	LANE_HINTS 4	/* pools a thread remembers its lane in */
+
+/* the lane this thread used last in each of a few pools, only hints */
+static __thread struct lane_hint {
+	PMEMobjpool *pop;
+	unsigned lane;
+} Thread_lanes[LANE_HINTS];
+static __thread unsigned Thread_lanes_next;	/* hint replaced next */
+
 /*
- * condof -- (internal) find or allocate a pthread_cond_t
+ * lane_hint -- (internal) the calling thread's lane hint for a pool
  *
- * NULL is returned if the pthread_cond_t cannot be allocated or initialized.
+ * A pool the thread has no hint for takes the place of the one that got
+ * its hint the longest ago, so a thread alternating between a few pools
+ * keeps a lane in each of them.
  */
-pthread_cond_t *
-condof(PMEMcond *condp)
+static struct lane_hint *
+lane_hint(PMEMobjpool *pop)
 {
-	if (condp->runid == Runid)
-		return condp->pthread_condp;	/* already allocated */
-	else if ((condp->pthread_condp =
-				Malloc(sizeof (pthread_cond_t))) == NULL)
-		return NULL;
-	else if ((errno = pthread_cond_init(condp->pthread_condp, NULL)))
-		return NULL;
-	else
-		return condp->pthread_condp;	/* newly allocated */
+	for (unsigned i = 0; i < LANE_HINTS; i++)
+		if (Thread_lanes[i].pop == pop)
+			return &Thread_lanes[i];
+
+	struct lane_hint *hp = &Thread_lanes[Thread_lanes_next++ % LANE_HINTS];
+	hp->pop = pop;
+	hp->lane = 0;
+	return hp;
 }
 
 /*
- * pmemobj_mutex_init -- initialize a PMEMmutex
- *
- * Calling pmemobj_mutex_init() is only necessary on new allocations,
- * and even then only if the PMEMmutex has not been zeroed.  Unlike
- * pthread_mutex_t, PMEMmutexes are considered initialized when they
- * are zeroed (so PMEMmutexes allocated via pmemobj_zalloc() need not be
- * initialized, for example).  In addition, they are automatically
- * re-initialized each time the memory pool is opened (any state stored
- * in pmem for a PMEMmutex resets).
+ * lane_hold -- (internal) grab a lane for a new outermost transaction
  *
- * Unlike pthread_mutex_init(), no attr argument is supported.
+ * A thread gets the lane it used last in the pool whenever it is free,
+ * so the undo log chunks and extents it warmed up are reused.  Otherwise
+ * lanes are tried round-robin so concurrent transactions spread out, if
+ * they are all busy the caller waits for the first one it tried.
  */
-int
-pmemobj_mutex_init(PMEMmutex *mutexp)
+static unsigned
+lane_hold(PMEMobjpool *pop)
 {
-	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
+	struct lane_hint *hp = lane_hint(pop);
+	unsigned idx = hp->lane;
 
-	if (pthread_mutexp == NULL)
-		return tx_error(0, ENOMEM);
+	if (pthread_mutex_trylock(&pop->lanes[idx].lock) == 0)
+		goto out;
 
-	return pthread_mutex_init(pthread_mutexp, NULL);
+	unsigned start = __sync_fetch_and_add(&pop->next_lane, 1);
+
+	for (unsigned i = 0; i < OBJ_NLANES; i++) {
+		idx = (start + i) % OBJ_NLANES;
+		if (pthread_mutex_trylock(&pop->lanes[idx].lock) == 0)
+			goto out;
+	}
+
+	idx = start % OBJ_NLANES;
+	pthread_mutex_lock(&pop->lanes[idx].lock);
+
+out:
+	pop->lanes[idx].tail = NULL;
+	hp->lane = idx;
+	return idx;
 }
 
 /*
- * pmemobj_mutex_lock -- lock a PMEMmutex
+ * tx_lane -- (internal) the lane of the calling thread's transaction
+ *
+ * Returns OBJ_NLANES if the thread is not inside a transaction on pop.
  */
-int
-pmemobj_mutex_lock(PMEMmutex *mutexp)
+static unsigned
+tx_lane(PMEMobjpool *pop)
 {
-	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
-
-	if (pthread_mutexp == NULL)
-		return tx_error(0, ENOMEM);
+	if (Curthread_txinfop != NULL && Curthread_txinfop->txp->pool == pop)
+		return Curthread_txinfop->txp->lane;
 
-	return pthread_mutex_lock(pthread_mutexp);
+	return OBJ_NLANES;
 }
 
 /*
- * pmemobj_mutex_trylock -- try to lock a PMEMmutex
+ * lane_release -- (internal) give a lane back
  */
-int
-pmemobj_mutex_trylock(PMEMmutex *mutexp)
+static void
+lane_release(PMEMobjpool *pop, unsigned idx)
 {
-	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
-
-	if (pthread_mutexp == NULL)
-		return tx_error(0, ENOMEM);
-
-	return pthread_mutex_trylock(pthread_mutexp);
+	pthread_mutex_unlock(&pop->lanes[idx].lock);
 }
 
 /*
- * pmemobj_mutex_unlock -- unlock a PMEMmutex
+ * txlog_valid -- (internal) true if off points to a whole log chunk
  */
-int
-pmemobj_mutex_unlock(PMEMmutex *mutexp)
+static int
+txlog_valid(PMEMobjpool *pop, uint64_t off)
 {
-	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
-
-	if (pthread_mutexp == NULL)
-		return tx_error(0, ENOMEM);
-
-	return pthread_mutex_unlock(pthread_mutexp);
+	return off >= sizeof (struct pmemobjpool) &&
+		off <= pop->size - sizeof (struct txlog);
 }
 
 /*
- * pmemobj_rwlock_init -- initialize a PMEMrwlock
+ * txlog_append -- (internal) record an operation in a lane's undo log
+ *
+ * The entry is made durable before it is counted, so a crash leaves
+ * either the old or the new log, never one with a torn entry.
  */
-int
-pmemobj_rwlock_init(PMEMrwlock *rwlockp)
+static int
+txlog_append(PMEMobjpool *pop, unsigned lane, uint64_t type,
+	uint64_t off, uint64_t data, uint64_t len)
 {
-	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+	struct lane *lp = &pop->lanes[lane];
+	struct txlog *log = lp->tail;
+
+	if (log == NULL || log->nentries == TXLOG_NENTRIES) {
+		uint64_t *nextp = (log == NULL) ?
+				&pop->lane_logs[lane] : &log->next;
+
+		if (*nextp == 0) {
+			uint64_t newoff;
+			obj_pmalloc(pop, &newoff, sizeof (*log),
+					OBJ_TYPE_INTERNAL);
+			if (newoff == 0) {
+				LOG(1, "cannot allocate undo log chunk");
+				errno = ENOMEM;
+				return -1;
+			}
+
+			struct txlog *newlog =
+				(void *)((char *)pop->addr + newoff);
+			newlog->next = 0;
+			newlog->nentries = 0;
+			obj_persist(pop, newlog, sizeof (*newlog));
+
+			*nextp = newoff;
+			obj_persist(pop, nextp, sizeof (*nextp));
+		}
 
-	if (pthread_rwlockp == NULL)
-		return tx_error(0, ENOMEM);
+		log = (void *)((char *)pop->addr + *nextp);
 
-	return pthread_rwlock_init(pthread_rwlockp, NULL);
+		/* a reused chunk may still count entries of an old log */
+		if (log->nentries != 0) {
+			log->nentries = 0;
+			obj_persist(pop, &log->nentries,
+					sizeof (log->nentries));
+		}
+		lp->tail = log;
+	}
+
+	struct txlog_entry *entry = &log->entries[log->nentries];
+	entry->type = type;
+	entry->off = off;
+	entry->data = data;
+	entry->len = len;
+	obj_persist(pop, entry, sizeof (*entry));
+
+	log->nentries++;
+	obj_persist(pop, &log->nentries, sizeof (log->nentries));
+
+	return 0;
 }
 
 /*
- * pmemobj_rwlock_rdlock -- read lock a PMEMrwlock
+ * txlog_extent_valid -- (internal) true if off points to a whole extent
  */
-int
-pmemobj_rwlock_rdlock(PMEMrwlock *rwlockp)
+static int
+txlog_extent_valid(PMEMobjpool *pop, uint64_t off)
 {
-	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+	return off >= sizeof (struct pmemobjpool) &&
+		off <= pop->size - sizeof (struct txlog_extent);
+}
 
-	if (pthread_rwlockp == NULL)
-		return tx_error(0, ENOMEM);
+/*
+ * txlog_extent_trim -- (internal) free the extents a lane keeps past a few
+ *
+ * Only called once the log is cleared, when no entry refers to the
+ * extents any more.  A crash after the chain is cut leaks the extents
+ * beyond it, but never frees one still in the chain.
+ */
+static void
+txlog_extent_trim(PMEMobjpool *pop, unsigned lane)
+{
+	uint64_t *nextp = &pop->lane_extents[lane];
+	for (unsigned n = 0; n < TXLOG_EXTENT_KEEP; n++) {
+		if (*nextp == 0 || !txlog_extent_valid(pop, *nextp))
+			return;
+		struct txlog_extent *ext =
+			(void *)((char *)pop->addr + *nextp);
+		nextp = &ext->next;
+	}
 
-	return pthread_rwlock_rdlock(pthread_rwlockp);
+	uint64_t off = *nextp;
+	if (off == 0)
+		return;
+
+	*nextp = 0;
+	obj_persist(pop, nextp, sizeof (*nextp));
+
+	while (off != 0 && txlog_extent_valid(pop, off)) {
+		struct txlog_extent *ext = (void *)((char *)pop->addr + off);
+		uint64_t next = ext->next;
+		obj_pfree(pop, off);
+		off = next;
+	}
 }
 
 /*
- * pmemobj_rwlock_wrlock -- write lock a PMEMrwlock
+ * txlog_clear -- (internal) discard a lane's undo log
  */
-int
-pmemobj_rwlock_wrlock(PMEMrwlock *rwlockp)
+static void
+txlog_clear(PMEMobjpool *pop, unsigned lane)
 {
-	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+	if (pop->lane_logs[lane] != 0) {
+		struct txlog *log = (void *)((char *)pop->addr +
+					pop->lane_logs[lane]);
+		if (log->nentries != 0) {
+			log->nentries = 0;
+			obj_persist(pop, &log->nentries,
+					sizeof (log->nentries));
+		}
+	}
 
-	if (pthread_rwlockp == NULL)
-		return tx_error(0, ENOMEM);
+	if (pop->lanes != NULL) {
+		if (pop->lanes[lane].ext != NULL)
+			txlog_extent_trim(pop, lane);
+		pop->lanes[lane].tail = NULL;
+		pop->lanes[lane].ext = NULL;
+		pop->lanes[lane].ext_used = 0;
+		pop->lanes[lane].undo_bytes = 0;
+	}
+}
 
-	return pthread_rwlock_wrlock(pthread_rwlockp);
+/*
+ * txlog_extent_reserve -- (internal) take room for an undo copy
+ *
+ * Hands out up to *lenp bytes of the lane's extents, *lenp is cut down
+ * to what is left in the current extent.  Extents are only added to the
+ * chain, never removed, so the chain grows to the largest set of large
+ * ranges a transaction in this lane has modified.  Returns NULL when a
+ * new extent cannot be allocated.
+ */
+static char *
+txlog_extent_reserve(PMEMobjpool *pop, unsigned lane, size_t *lenp)
+{
+	struct lane *lp = &pop->lanes[lane];
+
+	if (lp->ext == NULL || lp->ext_used == TXLOG_EXTENT_SIZE) {
+		uint64_t *nextp = (lp->ext == NULL) ?
+				&pop->lane_extents[lane] : &lp->ext->next;
+
+		if (*nextp == 0 || !txlog_extent_valid(pop, *nextp)) {
+			uint64_t newoff;
+			obj_pmalloc(pop, &newoff, sizeof (struct txlog_extent),
+					OBJ_TYPE_INTERNAL);
+			if (newoff == 0) {
+				LOG(1, "cannot allocate undo log extent");
+				errno = ENOMEM;
+				return NULL;
+			}
+
+			struct txlog_extent *newext =
+				(void *)((char *)pop->addr + newoff);
+			newext->next = 0;
+			obj_persist(pop, &newext->next, sizeof (newext->next));
+
+			*nextp = newoff;
+			obj_persist(pop, nextp, sizeof (*nextp));
+		}
+
+		lp->ext = (void *)((char *)pop->addr + *nextp);
+		lp->ext_used = 0;
+	}
+
+	size_t avail = TXLOG_EXTENT_SIZE - lp->ext_used;
+	if (*lenp > avail)
+		*lenp = avail;
+
+	char *copy = lp->ext->data + lp->ext_used;
+	lp->ext_used += *lenp;
+
+	return copy;
 }
 
 /*
- * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ * txlog_chunk -- (internal) return the nth valid chunk of a lane's log
  */
-int
-pmemobj_rwlock_timedrdlock(PMEMrwlock *restrict rwlockp,
-		const struct timespec *restrict abs_timeout)
+static struct txlog *
+txlog_chunk(PMEMobjpool *pop, unsigned lane, unsigned n)
 {
-	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+	uint64_t off = pop->lane_logs[lane];
+	struct txlog *log = (void *)((char *)pop->addr + off);
 
-	if (pthread_rwlockp == NULL)
-		return tx_error(0, ENOMEM);
+	while (n--) {
+		off = log->next;
+		log = (void *)((char *)pop->addr + off);
+	}
 
-	return pthread_rwlock_timedrdlock(pthread_rwlockp, abs_timeout);
+	return log;
 }
 
 /*
- * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ * txlog_alloc -- (internal) allocate an object logged in a lane's undo log
+ *
+ * The entry is appended first, with no object in it, and the allocator
+ * stores the new offset straight into the entry, durably before the
+ * object exists, so a crash never leaves an object the log does not
+ * know about.  Returns the offset, or 0 with errno set.
  */
-int
-pmemobj_rwlock_timedwrlock(PMEMrwlock *restrict rwlockp,
-		const struct timespec *restrict abs_timeout)
+static uint64_t
+txlog_alloc(PMEMobjpool *pop, unsigned lane, size_t size, uint32_t type_num)
 {
-	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+	if (txlog_append(pop, lane, TXOP_ALLOC, 0, 0, size) < 0)
+		return 0;
 
-	if (pthread_rwlockp == NULL)
-		return tx_error(0, ENOMEM);
+	struct txlog *log = pop->lanes[lane].tail;
+	struct txlog_entry *entry = &log->entries[log->nentries - 1];
+	obj_pmalloc(pop, &entry->off, size, type_num);
 
-	return pthread_rwlock_timedwrlock(pthread_rwlockp, abs_timeout);
+	return entry->off;
 }
 
 /*
- * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ * txlog_rollback -- (internal) undo the operations in a lane's log
+ *
+ * Entries are undone newest first.  Returns the number of entries that
+ * had to be skipped because they point outside of the pool.
  */
-int
-pmemobj_rwlock_tryrdlock(PMEMrwlock *rwlockp)
+static int
+txlog_rollback(PMEMobjpool *pop, unsigned lane)
 {
-	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+	/* count chunks in use, each is valid only if its predecessor is full */
+	unsigned nchunks = 0;
+	uint64_t off = pop->lane_logs[lane];
+	while (off != 0 && txlog_valid(pop, off)) {
+		struct txlog *log = (void *)((char *)pop->addr + off);
+		if (log->nentries > TXLOG_NENTRIES)
+			break;
+		nchunks++;
+		if (log->nentries < TXLOG_NENTRIES)
+			break;
+		off = log->next;
+	}
 
-	if (pthread_rwlockp == NULL)
-		return tx_error(0, ENOMEM);
+	int bad = 0;
+	char *base = pop->addr;
+	while (nchunks-- > 0) {
+		struct txlog *log = txlog_chunk(pop, lane, nchunks);
+		for (uint64_t i = log->nentries; i-- > 0; ) {
+			struct txlog_entry *e = &log->entries[i];
+
+			if (e->off >= pop->size ||
+				e->len > pop->size - e->off ||
+				((e->type == TXOP_SET ||
+				e->type == TXOP_SET_EXTENT) &&
+				(e->data >= pop->size ||
+				e->len > pop->size - e->data))) {
+				LOG(1, "lane %u: bad undo log entry %" PRIu64,
+						lane, i);
+				bad++;
+				continue;
+			}
+
+			switch (e->type) {
+			case TXOP_SET:
+				/* the copy goes with its own TXOP_ALLOC */
+			case TXOP_SET_EXTENT:
+				memcpy(base + e->off, base + e->data, e->len);
+				obj_persist(pop, base + e->off,
+						e->len);
+				break;
+			case TXOP_ALLOC:
+				obj_pfree(pop, e->off);
+				break;
+			case TXOP_FREE:
+				/* not freed after all, give it its type back */
+				if (e->off != 0 && obj_type(pop, e->off) ==
+						OBJ_TYPE_RETIRED)
+					allocator_set_type(&pop->allocator,
+						e->off, (uint32_t)e->data);
+				break;
+			default:
+				LOG(1, "lane %u: bad undo log entry type %"
+						PRIu64, lane, e->type);
+				bad++;
+				break;
+			}
+		}
+	}
 
-	return pthread_rwlock_tryrdlock(pthread_rwlockp);
+	return bad;
 }
 
 /*
- * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ * redo_apply -- (internal) carry out a lane's committed atomic operation
+ *
+ * Applying a record twice has the same effect as applying it once.
  */
-int
-pmemobj_rwlock_trywrlock(PMEMrwlock *rwlockp)
+static void
+redo_apply(PMEMobjpool *pop, struct redo *rp)
 {
-	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+	char *base = pop->addr;
+
+	if (rp->dest != 0) {
+		PMEMoid *dest = (PMEMoid *)(base + rp->dest);
+		if (rp->op == REDO_ALLOC) {
+			dest->pool = (uint64_t)pop->addr;
+			dest->off = rp->obj;
+		} else {
+			dest->pool = 0;
+			dest->off = 0;
+		}
+		obj_persist(pop, dest, sizeof (*dest));
+	}
 
-	if (pthread_rwlockp == NULL)
-		return tx_error(0, ENOMEM);
+	for (uint64_t i = 0; i < rp->nstores; i++) {
+		struct redo_store *sp = &rp->stores[i];
+		if (sp->kind == REDO_STORE_OID) {
+			PMEMoid *oidp = (PMEMoid *)(base + sp->dest);
+			oidp->pool = sp->value ? (uint64_t)pop->addr : 0;
+			oidp->off = sp->value;
+			obj_persist(pop, oidp, sizeof (*oidp));
+		} else {
+			uint64_t *wordp = (uint64_t *)(base + sp->dest);
+			*wordp = sp->value;
+			obj_persist(pop, wordp, sizeof (*wordp));
+		}
+	}
 
-	return pthread_rwlock_trywrlock(pthread_rwlockp);
+	if (rp->op == REDO_ALLOC) {
+		allocator_set_type(&pop->allocator, rp->obj, rp->type_num);
+		obj_retire(pop, rp->old);
+	} else if (rp->op == REDO_FREE)
+		obj_retire(pop, rp->obj);
+
+	rp->op = REDO_NONE;
+	obj_persist(pop, &rp->op, sizeof (rp->op));
 }
 
 /*
- * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ * redo_valid -- (internal) true if a redo record refers to the pool only
  */
-int
-pmemobj_rwlock_unlock(PMEMrwlock *rwlockp)
+static int
+redo_valid(PMEMobjpool *pop, struct redo *rp)
 {
-	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+	uint64_t start = sizeof (struct pmemobjpool);
+
+	if (rp->op != REDO_ALLOC && rp->op != REDO_FREE &&
+			rp->op != REDO_STORE)
+		return 0;
+	if (rp->op != REDO_STORE && (rp->obj < start || rp->obj >= pop->size))
+		return 0;
+	if (rp->dest != 0 && (rp->dest < sizeof (struct pool_hdr) ||
+			rp->dest + sizeof (PMEMoid) > pop->size))
+		return 0;
+	if (rp->op == REDO_ALLOC && rp->type_num > OBJ_TYPE_INTERNAL)
+		return 0;
+	if (rp->op == REDO_ALLOC && rp->old != 0 &&
+			(rp->old < start || rp->old >= pop->size))
+		return 0;
+	if (rp->nstores > REDO_NSTORES)
+		return 0;
+
+	for (uint64_t i = 0; i < rp->nstores; i++) {
+		struct redo_store *sp = &rp->stores[i];
+		size_t len = (sp->kind == REDO_STORE_OID) ?
+				sizeof (PMEMoid) : sizeof (uint64_t);
+		if (sp->kind != REDO_STORE_WORD && sp->kind != REDO_STORE_OID)
+			return 0;
+		if (sp->dest < sizeof (struct pool_hdr) ||
+				sp->dest + len > pop->size)
+			return 0;
+		if (sp->kind == REDO_STORE_OID && sp->value >= pop->size)
+			return 0;
+	}
 
-	if (pthread_rwlockp == NULL)
-		return tx_error(0, ENOMEM);
+	return 1;
+}
 
-	return pthread_rwlock_unlock(pthread_rwlockp);
+/*
+ * redo_recover -- (internal) finish atomic operations cut short by a crash
+ *
+ * Returns the number of records that could not be applied.
+ */
+static int
+redo_recover(PMEMobjpool *pop)
+{
+	int bad = 0;
+
+	for (unsigned lane = 0; lane < OBJ_NLANES; lane++) {
+		struct redo *rp = &pop->lane_redo[lane];
+		if (rp->op == REDO_NONE)
+			continue;
+
+		if (!redo_valid(pop, rp)) {
+			LOG(1, "lane %u: bad redo record", lane);
+			rp->op = REDO_NONE;
+			obj_persist(pop, &rp->op, sizeof (rp->op));
+			bad++;
+			continue;
+		}
+
+		LOG(3, "lane %u: applying redo record", lane);
+		redo_apply(pop, rp);
+	}
+
+	return bad;
 }
 
 /*
- * pmemobj_cond_init -- initialize a PMEMcond
+ * redo_begin -- (internal) grab a lane and start an empty redo record
  */
-int
-pmemobj_cond_init(PMEMcond *condp)
+static struct redo *
+redo_begin(PMEMobjpool *pop, unsigned *lanep)
 {
-	pthread_cond_t *pthread_condp = condof(condp);
+	/* inside a transaction its lane is used, it cannot be waited for */
+	unsigned lane = tx_lane(pop);
+	if (lane == OBJ_NLANES)
+		lane = lane_hold(pop);
 
-	if (pthread_condp == NULL)
-		return tx_error(0, ENOMEM);
+	struct redo *rp = &pop->lane_redo[lane];
 
-	return pthread_cond_init(pthread_condp, NULL);
+	rp->dest = 0;
+	rp->obj = 0;
+	rp->type_num = 0;
+	rp->nstores = 0;
+	rp->old = 0;
+
+	*lanep = lane;
+	return rp;
 }
 
 /*
- * pmemobj_cond_init -- initialize a PMEMcond
+ * redo_add -- (internal) add a store of a word or an OID to a redo record
+ */
+static void
+redo_add(PMEMobjpool *pop, struct redo *rp, uint64_t kind, void *dest,
+	uint64_t value)
+{
+	ASSERT(rp->nstores < REDO_NSTORES);
+
+	struct redo_store *sp = &rp->stores[rp->nstores++];
+	sp->kind = kind;
+	sp->dest = (uint64_t)((char *)dest - (char *)pop->addr);
+	sp->value = value;
+}
+
+/*
+ * redo_commit -- (internal) make a redo record durable, apply it
+ *
+ * The lane taken by redo_begin() is released.
+ */
+static void
+redo_commit(PMEMobjpool *pop, unsigned lane, uint64_t op)
+{
+	struct redo *rp = &pop->lane_redo[lane];
+
+	obj_persist(pop, rp, sizeof (*rp));
+
+	rp->op = op;
+	obj_persist(pop, &rp->op, sizeof (rp->op));
+
+	redo_apply(pop, rp);
+	if (tx_lane(pop) != lane)
+		lane_release(pop, lane);
+}
+
+/*
+ * pmemobj_tx_recover -- (internal) roll back transactions cut short by a crash
+ *
+ * Any lane with a non-empty undo log belonged to a transaction that never
+ * reached its commit point.  Returns the number of problems found in the
+ * logs, which are dropped either way.
+ */
+static int
+pmemobj_tx_recover(PMEMobjpool *pop)
+{
+	int bad = 0;
+
+	for (unsigned lane = 0; lane < OBJ_NLANES; lane++) {
+		uint64_t ext = pop->lane_extents[lane];
+		if (ext != 0 && !txlog_extent_valid(pop, ext)) {
+			LOG(1, "lane %u: bad undo extent offset 0x%" PRIx64,
+					lane, ext);
+			pop->lane_extents[lane] = 0;
+			obj_persist(pop, &pop->lane_extents[lane],
+					sizeof (pop->lane_extents[lane]));
+			bad++;
+		}
+
+		uint64_t off = pop->lane_logs[lane];
+		if (off == 0)
+			continue;
+
+		if (!txlog_valid(pop, off)) {
+			LOG(1, "lane %u: bad undo log offset 0x%" PRIx64,
+					lane, off);
+			pop->lane_logs[lane] = 0;
+			obj_persist(pop, &pop->lane_logs[lane],
+					sizeof (pop->lane_logs[lane]));
+			bad++;
+			continue;
+		}
+
+		struct txlog *log = (void *)((char *)pop->addr + off);
+		if (log->nentries == 0)
+			continue;
+
+		LOG(3, "lane %u: rolling back %" PRIu64 " entries", lane,
+				log->nentries);
+		bad += txlog_rollback(pop, lane);
+		txlog_clear(pop, lane);
+	}
+
+	return bad;
+}
+
+/*
+ * pmemobj_replica_open -- (internal) attach a replica to a freshly opened pool
+ *
+ * The replica must be a file of the same size as the pool.  Unless both
+ * copies were closed cleanly with identical headers, the whole pool is
+ * copied over the replica first, which also covers a crash between a
+ * flush to the pool and the matching flush to the replica.  From then on
+ * every range flushed through libpmem_persist() is replayed to the
+ * replica, while all reads are served by the pool.
+ */
+static int
+pmemobj_replica_open(PMEMobjpool *pop, const char *path)
+{
+	LOG(3, "pop %p path \"%s\"", pop, path);
+
+	if (pop->set != NULL) {
+		LOG(1, "pool sets cannot be mirrored");
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd;
+	if ((fd = open(path, O_RDWR)) < 0) {
+		LOG(1, "!%s", path);
+		return -1;
+	}
+
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) < 0) {
+		LOG(1, "!fstat %s", path);
+		close(fd);
+		return -1;
+	}
+
+	if (stbuf.st_size != pop->size) {
+		LOG(1, "replica size %zu does not match pool size %zu",
+				(size_t)stbuf.st_size, pop->size);
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	void *replica;
+	if ((replica = util_map(fd, pop->size, 0)) == NULL) {
+		close(fd);
+		return -1;	/* util_map() set errno, called LOG */
+	}
+
+	close(fd);
+
+	int replica_is_pmem = pmem_is_pmem(replica, pop->size);
+	struct pmemobjpool *rep = replica;
+
+	if (!pop->replica_synced || !rep->replica_synced ||
+			memcmp(&pop->hdr, &rep->hdr, sizeof (pop->hdr))) {
+		LOG(3, "resyncing replica %s", path);
+		memcpy(replica, pop->addr, pop->size);
+		libpmem_persist(PMEM_FLUSH_SRC_OBJ, replica_is_pmem,
+				replica, pop->size);
+	}
+
+	/* until closed cleanly, the copies may diverge */
+	pop->replica_synced = 0;
+	obj_persist(pop, &pop->replica_synced,
+			sizeof (pop->replica_synced));
+	rep->replica_synced = 0;
+	libpmem_persist(PMEM_FLUSH_SRC_OBJ, replica_is_pmem,
+			&rep->replica_synced, sizeof (rep->replica_synced));
+
+	if (libpmem_mirror_register(pop->addr, pop->size, replica,
+					replica_is_pmem) < 0) {
+		int oerrno = errno;
+		util_unmap(replica, pop->size);
+		errno = oerrno;
+		return -1;
+	}
+
+	pop->replica = replica;
+	pop->replica_is_pmem = replica_is_pmem;
+	return 0;
+}
+
+/*
+ * pmemobj_replica_close -- (internal) detach the replica from a pool
+ *
+ * If synced is set, both copies are marked as matching, which lets the
+ * next open skip the resync.
+ */
+static void
+pmemobj_replica_close(PMEMobjpool *pop, int synced)
+{
+	struct pmemobjpool *rep = pop->replica;
+
+	libpmem_mirror_unregister(pop->addr);
+
+	if (synced) {
+		/* every flush has been replayed, the copies match again */
+		pop->replica_synced = 1;
+		obj_persist(pop, &pop->replica_synced,
+				sizeof (pop->replica_synced));
+		rep->replica_synced = 1;
+		libpmem_persist(PMEM_FLUSH_SRC_OBJ, pop->replica_is_pmem,
+				&rep->replica_synced,
+				sizeof (rep->replica_synced));
+	}
+
+	util_unmap(rep, pop->size);
+	pop->replica = NULL;
+}
+
+/*
+ * pmemobj_epoch_enter -- start reading objects without holding locks
+ *
+ * Objects freed by transactions committed meanwhile stay intact until
+ * the matching pmemobj_epoch_exit().
  */
 int
-pmemobj_cond_broadcast(PMEMcond *condp)
+pmemobj_epoch_enter(PMEMobjpool *pop)
 {
-	pthread_cond_t *pthread_condp = condof(condp);
+	if (pop->epoch == NULL)
+		return 0;
 
-	if (pthread_condp == NULL)
-		return tx_error(0, ENOMEM);
+	return epoch_enter(pop->epoch);
+}
 
-	return pthread_cond_broadcast(pthread_condp);
+/*
+ * pmemobj_epoch_exit -- stop reading objects without holding locks
+ */
+void
+pmemobj_epoch_exit(PMEMobjpool *pop)
+{
+	if (pop->epoch != NULL)
+		epoch_exit(pop->epoch);
 }
 
 /*
- * pmemobj_cond_init -- initialize a PMEMcond
+ * pmemobj_epoch_reclaim -- free what any thread freed and is now safe
+ *
+ * Deferred frees are also carried out every so often as objects are
+ * freed, and all of them on close.  Returns the number of objects freed.
+ */
+size_t
+pmemobj_epoch_reclaim(PMEMobjpool *pop)
+{
+	if (pop->epoch == NULL)
+		return 0;
+
+	return epoch_reclaim(pop->epoch);
+}
+
+/*
+ * pmemobj_pool_stats -- return the counters of a pool
+ *
+ * The counters of all threads that used the pool since it was opened are
+ * added up, updates made meanwhile may or may not be included.
  */
 int
-pmemobj_cond_signal(PMEMcond *condp)
+pmemobj_pool_stats(PMEMobjpool *pop, struct pmemobj_stats *statsp)
 {
-	pthread_cond_t *pthread_condp = condof(condp);
+	if (pop->stats == NULL) {
+		LOG(1, "no stats for this pool");
+		errno = ENOTSUP;
+		return -1;
+	}
 
-	if (pthread_condp == NULL)
-		return tx_error(0, ENOMEM);
+	uint64_t counters[STATS_NCOUNTERS];
+	stats_sum(pop->stats, counters);
 
-	return pthread_cond_signal(pthread_condp);
+	statsp->tx_begun = counters[OBJ_STAT_TX_BEGUN];
+	statsp->tx_committed = counters[OBJ_STAT_TX_COMMITTED];
+	statsp->tx_aborted = counters[OBJ_STAT_TX_ABORTED];
+	statsp->undo_bytes = counters[OBJ_STAT_UNDO_BYTES];
+	statsp->allocs = counters[OBJ_STAT_ALLOCS];
+	statsp->alloc_bytes = counters[OBJ_STAT_ALLOC_BYTES];
+	statsp->frees = counters[OBJ_STAT_FREES];
+	statsp->flushes = counters[OBJ_STAT_FLUSHES];
+	statsp->flush_bytes = counters[OBJ_STAT_FLUSH_BYTES];
+
+	return 0;
 }
 
 /*
- * pmemobj_cond_init -- initialize a PMEMcond
+ * pmemobj_pool_latency -- return the percentiles of one of a pool's latencies
+ *
+ * The percentiles, in nanoseconds, are within 25% of the exact ones, all
+ * 0 if nothing was timed yet.
  */
 int
-pmemobj_cond_timedwait(PMEMcond *restrict condp,
-		PMEMmutex *restrict mutexp,
-		const struct timespec *restrict abstime)
+pmemobj_pool_latency(PMEMobjpool *pop, int which,
+	struct pmemobj_latency *latp)
 {
-	pthread_cond_t *pthread_condp = condof(condp);
-	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
+	if (which < 0 || which > PMEMOBJ_LATENCY_FLUSH) {
+		LOG(1, "invalid latency %d", which);
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (pthread_condp == NULL || pthread_mutexp == NULL)
-		return tx_error(0, ENOMEM);
+	if (pop->stats == NULL) {
+		LOG(1, "no stats for this pool");
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	uint64_t hist[STATS_HIST_NBUCKETS];
+	stats_sum_hist(pop->stats, (unsigned)which, hist);
+
+	latp->count = 0;
+	for (unsigned b = 0; b < STATS_HIST_NBUCKETS; b++)
+		latp->count += hist[b];
+	latp->p50 = stats_percentile(hist, 50);
+	latp->p99 = stats_percentile(hist, 99);
+	latp->p999 = stats_percentile(hist, 99.9);
+	latp->max = stats_percentile(hist, 100);
+
+	return 0;
+}
+
+/*
+ * pmemobj_pool_stats_print -- print the counters and latencies of a pool
+ *
+ * The lines are logged at level 0, so they go to the print function set
+ * by pmem_set_funcs() or the log file no matter what the log level is.
+ */
+void
+pmemobj_pool_stats_print(PMEMobjpool *pop)
+{
+	static const char *names[] = { "tx", "alloc", "flush" };
+	struct pmemobj_stats st;
+
+	if (pmemobj_pool_stats(pop, &st) < 0)
+		return;
+
+	out_log(__FILE__, __LINE__, __func__, 0,
+			"pool %p: tx begun %" PRIu64 " committed %" PRIu64
+			" aborted %" PRIu64 " undo bytes %" PRIu64,
+			pop, st.tx_begun, st.tx_committed, st.tx_aborted,
+			st.undo_bytes);
+	out_log(__FILE__, __LINE__, __func__, 0,
+			"pool %p: allocs %" PRIu64 " (%" PRIu64 " bytes)"
+			" frees %" PRIu64 " flushes %" PRIu64
+			" (%" PRIu64 " bytes)",
+			pop, st.allocs, st.alloc_bytes, st.frees,
+			st.flushes, st.flush_bytes);
+
+	for (int i = 0; i < sizeof (names) / sizeof (names[0]); i++) {
+		struct pmemobj_latency lat;
+		(void) pmemobj_pool_latency(pop, i, &lat);
+		out_log(__FILE__, __LINE__, __func__, 0,
+			"pool %p: %s latency ns count %" PRIu64
+			" p50 %" PRIu64 " p99 %" PRIu64 " p99.9 %" PRIu64
+			" max %" PRIu64, pop, names[i], lat.count,
+			lat.p50, lat.p99, lat.p999, lat.max);
+	}
+}
+
+/*
+ * pmemobj_pool_stats_dump -- (internal) periodic dump of a pool's stats
+ */
+static void
+pmemobj_pool_stats_dump(void *arg)
+{
+	pmemobj_pool_stats_print(arg);
+}
+
+/* ways to open a pool */
+#define	OBJ_MODE_RDWR 0		/* shared mapping, changes are flushed */
+#define	OBJ_MODE_RDONLY 1	/* private mapping, nothing may change */
+#define	OBJ_MODE_COW 2		/* private mapping, changes are discarded */
+
+/*
+ * pmemobj_pool_mode -- (internal) decide the mode from the header on file
+ *
+ * A pool with read-only compatible features this library does not know
+ * is opened read-only.  That is decided from the header as found in the
+ * file before anything is mapped, so the pool is then mapped privately
+ * and the file is never opened for writing.  A file without a valid
+ * header, or not created yet, keeps the mode asked for.  Returns -1 if
+ * the file cannot be read.
+ */
+static int
+pmemobj_pool_mode(const char *path, int mode)
+{
+	if (mode != OBJ_MODE_RDWR)
+		return mode;
+
+	int fd;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return mode;	/* a part created when mapped */
+		LOG(1, "!%s", path);
+		return -1;
+	}
+
+	struct pool_hdr hdr;
+	ssize_t cc = pread(fd, &hdr, sizeof (hdr), 0);
+	if (cc < 0) {
+		LOG(1, "!pread %s", path);
+		int oerrno = errno;
+		close(fd);
+		errno = oerrno;
+		return -1;
+	}
+	close(fd);
+
+	if (cc == sizeof (hdr) && util_convert_hdr(&hdr) &&
+			strncmp(hdr.signature, OBJ_HDR_SIG,
+					POOL_HDR_SIG_LEN) == 0 &&
+			util_feature_check(&hdr, OBJ_FORMAT_INCOMPAT,
+					OBJ_FORMAT_RO_COMPAT,
+					OBJ_FORMAT_COMPAT) == 0) {
+		LOG(1, "switching to read-only mode");
+		return OBJ_MODE_RDONLY;
+	}
+
+	return mode;
+}
+
+/*
+ * locks in read-only pools
+ *
+ * A PMEMmutex, PMEMrwlock or PMEMcond keeps its pthread lock pointer and
+ * the run ID in the pool, where a read-only pool has no room for them.
+ * The pthread locks of a read-only pool live in a DRAM table instead,
+ * found by the address of the PMEM lock and freed when the pool closes.
+ */
+#define	RDONLY_LOCK_BUCKETS 64
+
+#define	RDONLY_MUTEX 0
+#define	RDONLY_RWLOCK 1
+#define	RDONLY_COND 2
+
+struct rdonly_lock {
+	struct rdonly_lock *next;
+	const void *key;	/* the PMEMmutex, PMEMrwlock or PMEMcond */
+	int kind;		/* RDONLY_MUTEX, RDONLY_RWLOCK or RDONLY_COND */
+	union {
+		pthread_mutex_t mutex;
+		pthread_rwlock_t rwlock;
+		pthread_cond_t cond;
+	} u;
+};
+
+struct rdonly_pool {
+	struct rdonly_pool *next;
+	char *addr;
+	size_t size;
+	struct rdonly_lock *locks[RDONLY_LOCK_BUCKETS];
+};
+
+static struct rdonly_pool *Rdonly_pools;	/* read-only pools open */
+static pthread_rwlock_t Rdonly_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * rdonly_register -- (internal) start keeping the locks of a read-only pool
+ */
+static int
+rdonly_register(PMEMobjpool *pop)
+{
+	struct rdonly_pool *rp;
+	if ((rp = Malloc(sizeof (*rp))) == NULL) {
+		LOG(1, "!Malloc");
+		return -1;
+	}
+	memset(rp, '\0', sizeof (*rp));
+	rp->addr = pop->addr;
+	rp->size = pop->size;
+
+	pthread_rwlock_wrlock(&Rdonly_lock);
+	rp->next = Rdonly_pools;
+	Rdonly_pools = rp;
+	pthread_rwlock_unlock(&Rdonly_lock);
+
+	return 0;
+}
+
+/*
+ * rdonly_unregister -- (internal) free the locks of a read-only pool
+ */
+static void
+rdonly_unregister(PMEMobjpool *pop)
+{
+	pthread_rwlock_wrlock(&Rdonly_lock);
+	struct rdonly_pool **rpp = &Rdonly_pools;
+	while (*rpp != NULL && (*rpp)->addr != pop->addr)
+		rpp = &(*rpp)->next;
+
+	struct rdonly_pool *rp = *rpp;
+	if (rp != NULL)
+		*rpp = rp->next;
+	pthread_rwlock_unlock(&Rdonly_lock);
+
+	if (rp == NULL)
+		return;
+
+	for (unsigned b = 0; b < RDONLY_LOCK_BUCKETS; b++) {
+		struct rdonly_lock *lp;
+		while ((lp = rp->locks[b]) != NULL) {
+			rp->locks[b] = lp->next;
+			if (lp->kind == RDONLY_MUTEX)
+				pthread_mutex_destroy(&lp->u.mutex);
+			else if (lp->kind == RDONLY_RWLOCK)
+				pthread_rwlock_destroy(&lp->u.rwlock);
+			else
+				pthread_cond_destroy(&lp->u.cond);
+			Free(lp);
+		}
+	}
+	Free(rp);
+}
+
+/*
+ * rdonly_find -- (internal) look a lock up, called with Rdonly_lock held
+ *
+ * Returns the bucket the lock belongs in, NULL if key is not in a
+ * read-only pool.  *lpp is set to the lock, NULL if it has none yet.
+ */
+static struct rdonly_lock **
+rdonly_find(const void *key, struct rdonly_lock **lpp)
+{
+	struct rdonly_pool *rp = Rdonly_pools;
+	while (rp != NULL && ((const char *)key < rp->addr ||
+			(const char *)key >= rp->addr + rp->size))
+		rp = rp->next;
+	if (rp == NULL)
+		return NULL;
+
+	struct rdonly_lock **bucket =
+		&rp->locks[((uintptr_t)key >> 4) % RDONLY_LOCK_BUCKETS];
+	struct rdonly_lock *lp = *bucket;
+	while (lp != NULL && lp->key != key)
+		lp = lp->next;
+	*lpp = lp;
+	return bucket;
+}
+
+/*
+ * rdonly_lockof -- (internal) find or create the pthread lock of a lock
+ * in a read-only pool
+ *
+ * Returns 0 if key is not in a read-only pool.  Otherwise returns 1 with
+ * *lockpp set to the pthread lock, NULL if it could not be allocated or
+ * initialized.
+ */
+static int
+rdonly_lockof(const void *key, int kind, void **lockpp)
+{
+	if (Rdonly_pools == NULL)
+		return 0;	/* no read-only pools, the common case */
+
+	struct rdonly_lock *lp;
+	pthread_rwlock_rdlock(&Rdonly_lock);
+	struct rdonly_lock **bucket = rdonly_find(key, &lp);
+	pthread_rwlock_unlock(&Rdonly_lock);
+	if (bucket == NULL)
+		return 0;
+	if (lp != NULL) {
+		*lockpp = &lp->u;
+		return 1;
+	}
+
+	/* first use, look again with the table locked for writing */
+	pthread_rwlock_wrlock(&Rdonly_lock);
+	if ((bucket = rdonly_find(key, &lp)) == NULL) {
+		pthread_rwlock_unlock(&Rdonly_lock);
+		return 0;
+	}
+
+	/* create it, unless another thread got here first */
+	if (lp == NULL) {
+		if ((lp = Malloc(sizeof (*lp))) == NULL)
+			LOG(1, "!Malloc");
+		else if ((errno = (kind == RDONLY_MUTEX) ?
+				pthread_mutex_init(&lp->u.mutex, NULL) :
+				(kind == RDONLY_RWLOCK) ?
+				pthread_rwlock_init(&lp->u.rwlock, NULL) :
+				pthread_cond_init(&lp->u.cond, NULL))) {
+			Free(lp);
+			lp = NULL;
+		} else {
+			lp->key = key;
+			lp->kind = kind;
+			lp->next = *bucket;
+			*bucket = lp;
+		}
+	}
+	pthread_rwlock_unlock(&Rdonly_lock);
+
+	*lockpp = (lp != NULL) ? &lp->u : NULL;
+	return 1;
+}
+
+/*
+ * pmemobj_pool_open_common -- (internal) open a pool, optionally mirrored
+ *
+ * Transactions cut short by a crash are rolled back, except in read-only
+ * mode, which leaves the pool exactly as found.  If nbadp is not NULL
+ * the pool is being checked: it must already have a valid header and the
+ * number of problems found in the undo logs is stored at *nbadp.
+ */
+static PMEMobjpool *
+pmemobj_pool_open_common(const char *path, const char *replica, int mode,
+	int *nbadp)
+{
+	LOG(3, "path \"%s\" replica \"%s\" mode %d", path,
+			replica ? replica : "", mode);
+
+	struct pool_set *set = NULL;
+	struct stats *stats = NULL;
+	void *addr;
+	size_t poolsize;
+
+	int is_set = util_poolset_is(path);
+	if (is_set < 0)
+		return NULL;	/* util_poolset_is() set errno, called LOG */
+
+	if (is_set) {
+		if ((set = util_poolset_parse(path)) == NULL)
+			return NULL;	/* util_poolset_parse() called LOG */
+
+		poolsize = set->size;
+	} else {
+		struct stat stbuf;
+		if (stat(path, &stbuf) < 0) {
+			LOG(1, "!%s", path);
+			return NULL;
+		}
+
+		poolsize = stbuf.st_size;
+	}
+	addr = NULL;
+
+	if (poolsize < PMEMOBJ_MIN_POOL) {
+		LOG(1, "size %zu smaller than %zu",
+				poolsize, PMEMOBJ_MIN_POOL);
+		if (set)
+			util_poolset_close(set);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* the header of a pool set is at the beginning of its first part */
+	if ((mode = pmemobj_pool_mode(set ? set->parts[0].path : path,
+			mode)) < 0) {
+		if (set)
+			util_poolset_close(set);
+		return NULL;
+	}
+
+	if (set) {
+		if (util_poolset_map(set, OBJ_POOLSET_RESERVE,
+				mode != OBJ_MODE_RDWR) < 0) {
+			util_poolset_close(set);
+			return NULL;	/* util_poolset_map() called LOG */
+		}
+
+		addr = set->addr;
+	}
+
+	if (addr == NULL) {
+		int fd;
+		if ((fd = open(path, (mode == OBJ_MODE_RDWR) ?
+					O_RDWR : O_RDONLY)) < 0) {
+			LOG(1, "!%s", path);
+			return NULL;
+		}
+
+		if ((addr = util_map(fd, poolsize,
+					mode != OBJ_MODE_RDWR)) == NULL) {
+			close(fd);
+			return NULL;	/* util_map() set errno, called LOG */
+		}
+
+		close(fd);
+	}
+
+	util_prefault(addr, poolsize, mode == OBJ_MODE_RDWR);
+
+	/* check if the mapped region is located in persistent memory */
+	int is_pmem = pmem_is_pmem(addr, poolsize);
+
+	/* opaque info lives at the beginning of mapped memory pool */
+	struct pmemobjpool *pop = addr;
+
+	struct pool_hdr hdr;
+	memcpy(&hdr, &pop->hdr, sizeof (hdr));
+
+	if (util_convert_hdr(&hdr)) {
+		/*
+		 * valid header found
+		 */
+		if (strncmp(hdr.signature, OBJ_HDR_SIG, POOL_HDR_SIG_LEN)) {
+			LOG(1, "wrong pool type: \"%s\"", hdr.signature);
+
+			errno = EINVAL;
+			goto err;
+		}
+
+		if (hdr.major != OBJ_FORMAT_MAJOR) {
+			LOG(1, "obj pool version %d (library expects %d)",
+				hdr.major, OBJ_FORMAT_MAJOR);
+
+			errno = EINVAL;
+			goto err;
+		}
+
+		int retval = util_feature_check(&hdr, OBJ_FORMAT_INCOMPAT,
+							OBJ_FORMAT_RO_COMPAT,
+							OBJ_FORMAT_COMPAT);
+		if (retval < 0)
+		    goto err;
+		else if (retval == 0 && mode == OBJ_MODE_RDWR) {
+			/* changed since pmemobj_pool_mode() looked at it */
+			LOG(1, "pool header changed while opening");
+			errno = EAGAIN;
+			goto err;
+		}
+	} else {
+		/*
+		 * no valid header was found
+		 */
+		if (nbadp != NULL || mode == OBJ_MODE_RDONLY) {
+			LOG(1, "no valid obj pool header");
+			errno = EINVAL;
+			goto err;
+		}
+
+		LOG(3, "creating new obj memory pool");
+
+		struct pool_hdr *hdrp = &pop->hdr;
+		int csum = util_checksum_create();
+
+		memset(hdrp, '\0', sizeof (*hdrp));
+		strncpy(hdrp->signature, OBJ_HDR_SIG, POOL_HDR_SIG_LEN);
+		hdrp->major = htole32(OBJ_FORMAT_MAJOR);
+		hdrp->compat_features = htole32(OBJ_FORMAT_COMPAT);
+		hdrp->incompat_features = htole32(POOL_HDR_CSUM_FEAT(csum));
+		hdrp->ro_compat_features = htole32(OBJ_FORMAT_RO_COMPAT);
+		uuid_generate(hdrp->uuid);
+		hdrp->crtime = htole64((uint64_t)time(NULL));
+		util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 1, csum);
+		hdrp->checksum = htole64(hdrp->checksum);
+
+		/* store pool's header */
+		if (mode == OBJ_MODE_RDWR)
+			libpmem_persist(PMEM_FLUSH_SRC_OBJ, is_pmem,
+					hdrp, sizeof (*hdrp));
+
+		/* initialize pool metadata */
+		memset(&pop->rootlock, '\0', sizeof (pop->rootlock));
+		pop->root.off = 0;
+		pop->root_size = 0;
+		pop->replica_synced = 0;
+		memset(pop->lane_logs, '\0', sizeof (pop->lane_logs));
+		memset(pop->lane_redo, '\0', sizeof (pop->lane_redo));
+		memset(pop->lane_extents, '\0', sizeof (pop->lane_extents));
+		if (mode == OBJ_MODE_RDWR)
+			libpmem_persist(PMEM_FLUSH_SRC_OBJ, is_pmem,
+				pop->lane_logs,
+				sizeof (pop->lane_logs) +
+				sizeof (pop->lane_redo) +
+				sizeof (pop->lane_extents));
+	}
+
+	/* use some of the memory pool area for run-time info */
+	pop->addr = addr;
+	pop->size = poolsize;
+	pop->is_pmem = is_pmem;
+	pop->set = set;
+	pop->replica = NULL;
+	pop->lanes = NULL;
+	pop->undo_limit = 0;
+	pop->epoch = NULL;
+	pop->rdonly = (mode == OBJ_MODE_RDONLY);
+	pop->cow = (mode == OBJ_MODE_COW);
+
+	/* the pool works without stats, they are just not gathered */
+	if (Stats_enabled && (stats = stats_new()) == NULL)
+		LOG(1, "no stats for this pool");
+	pop->stats = stats;
+
+	if (stats != NULL && nbadp == NULL && Stats_dump > 0)
+		stats_dump_start(stats, Stats_dump,
+				pmemobj_pool_stats_dump, pop);
+
+	/* only run-time fields are set up, the pool can still be iterated */
+	allocator_init(&pop->allocator, addr, poolsize,
+			sizeof (struct pmemobjpool), is_pmem, pop->cow);
+
+	/*
+	 * A read-only pool is used as found, nothing is set up for writing.
+	 * Its run-time fields only ever live in private pages, everything
+	 * past them is made read-only so no stray store goes unnoticed.
+	 */
+	if (pop->rdonly) {
+		if (rdonly_register(pop) < 0)
+			goto err;
+
+		util_range_ro(addr, sizeof (struct pool_hdr));
+		size_t rt = (sizeof (struct pmemobjpool) + Pagesize - 1) &
+				~(Pagesize - 1);
+		util_range_ro((char *)addr + rt, poolsize - rt);
+
+		LOG(3, "pop %p (read-only)", pop);
+		return pop;
+	}
+
+	if (replica != NULL && pmemobj_replica_open(pop, replica) < 0)
+		goto err;
+
+	if (lanes_init(pop) < 0) {
+		if (pop->replica != NULL)
+			pmemobj_replica_close(pop, 0);
+		goto err;
+	}
+
+	int nbad = redo_recover(pop) + pmemobj_tx_recover(pop);
+	if (nbadp != NULL)
+		*nbadp = nbad;
+	obj_retired_recover(pop);
+
+	/* without epochs objects are simply freed at commit */
+	if ((pop->epoch = epoch_new(obj_epoch_free, pop)) == NULL)
+		LOG(1, "no deferred frees for this pool");
+
+	/*
+	 * If possible, turn off all permissions on the pool header page.
+	 *
+	 * The prototype PMFS doesn't allow this when large pages are in
+	 * use not it is not considered an error if this fails.
+	 */
+	util_range_none(addr, sizeof (struct pool_hdr));
+
+	/* the rest should be kept read-only for debug version */
+	RANGE_RW(addr + sizeof (struct pool_hdr),
+			poolsize - sizeof (struct pool_hdr));
+
+	LOG(3, "pop %p", pop);
+	return pop;
+
+err:
+	LOG(4, "error clean up");
+	int oerrno = errno;
+	if (stats)
+		stats_delete(stats);
+	if (set)
+		util_poolset_close(set);
+	else
+		util_unmap(addr, poolsize);
+	errno = oerrno;
+	return NULL;
+}
+
+/*
+ * pmemobj_pool_open -- open a transactional memory pool
+ *
+ * A path of the form "/file/one:/file/two" opens a mirrored pool.
+ */
+PMEMobjpool *
+pmemobj_pool_open(const char *path)
+{
+	LOG(3, "path \"%s\"", path);
+
+	const char *sep = strchr(path, ':');
+	if (sep == NULL)
+		return pmemobj_pool_open_common(path, NULL, OBJ_MODE_RDWR,
+				NULL);
+
+	char *path1;
+	if ((path1 = Strdup(path)) == NULL) {
+		LOG(1, "!Strdup");
+		return NULL;
+	}
+	path1[sep - path] = '\0';
+
+	PMEMobjpool *pop = pmemobj_pool_open_common(path1, sep + 1,
+			OBJ_MODE_RDWR, NULL);
+
+	int oerrno = errno;
+	Free(path1);
+	errno = oerrno;
+	return pop;
+}
+
+/*
+ * pmemobj_pool_open_mirrored -- open a mirrored pool
+ *
+ * path1 is the pool all reads are served from, path2 is its replica.
+ */
+PMEMobjpool *
+pmemobj_pool_open_mirrored(const char *path1, const char *path2)
+{
+	LOG(3, "path1 \"%s\", path2 \"%s\"", path1, path2);
+
+	return pmemobj_pool_open_common(path1, path2, OBJ_MODE_RDWR, NULL);
+}
+
+/*
+ * pmemobj_pool_open_rdonly -- open a pool for reading only
+ *
+ * The file is opened read-only and mapped privately, and the pool is used
+ * exactly as found: no header is created, no interrupted transaction is
+ * rolled back and nothing is ever flushed.  Transactions and everything
+ * else that would modify the pool fail with EROFS.
+ */
+PMEMobjpool *
+pmemobj_pool_open_rdonly(const char *path)
+{
+	LOG(3, "path \"%s\"", path);
+
+	return pmemobj_pool_open_common(path, NULL, OBJ_MODE_RDONLY, NULL);
+}
+
+/*
+ * pmemobj_pool_open_cow -- open a private copy-on-write view of a pool
+ *
+ * The pool can be modified as usual, but changes only go to private pages
+ * of this process: nothing is flushed and everything is discarded when
+ * the pool is closed.  The file itself is opened read-only.
+ */
+PMEMobjpool *
+pmemobj_pool_open_cow(const char *path)
+{
+	LOG(3, "path \"%s\"", path);
+
+	return pmemobj_pool_open_common(path, NULL, OBJ_MODE_COW, NULL);
+}
+
+/*
+ * pmemobj_pool_close -- close a transactional memory pool
+ */
+void
+pmemobj_pool_close(PMEMobjpool *pop)
+{
+	LOG(3, "pop %p", pop);
+
+	if (pop->epoch != NULL) {
+		epoch_delete(pop->epoch);
+		pop->epoch = NULL;
+	}
+
+	lanes_fini(pop);
+
+	if (pop->stats != NULL) {
+		stats_delete(pop->stats);
+		pop->stats = NULL;
+	}
+
+	if (pop->replica != NULL)
+		pmemobj_replica_close(pop, 1);
+
+	if (pop->rdonly)
+		rdonly_unregister(pop);
+
+	/* the pool set description lives in DRAM, the pointer does not */
+	struct pool_set *set = pop->set;
+	if (set)
+		util_poolset_close(set);
+	else
+		util_unmap(pop->addr, pop->size);
+}
+
+/*
+ * pmemobj_pool_extend -- grow a pool set by appending a new part file
+ *
+ * The part is created with the given size, mapped right after the current
+ * end of the pool and recorded in the set file.  Since the pool never
+ * moves, existing OIDs and pointers stay valid and the allocator can use
+ * the new space as soon as this returns.
+ */
+int
+pmemobj_pool_extend(PMEMobjpool *pop, const char *path, size_t size)
+{
+	LOG(3, "pop %p path \"%s\" size %zu", pop, path, size);
+
+	static pthread_mutex_t extend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	if (pop->rdonly || pop->cow) {
+		LOG(1, "pool files are not writable");
+		errno = EROFS;
+		return -1;
+	}
+
+	if (pop->set == NULL) {
+		LOG(1, "pool was not opened from a pool set");
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&extend_lock);
+
+	size_t oldsize = pop->set->size;
+	if (util_poolset_extend(pop->set, path, size) < 0) {
+		int oerrno = errno;
+		pthread_mutex_unlock(&extend_lock);
+		errno = oerrno;
+		return -1;	/* util_poolset_extend() called LOG */
+	}
+
+	void *part = (char *)pop->addr + oldsize;
+	if (!pmem_is_pmem(part, size)) {
+		pop->is_pmem = 0;
+		pop->allocator.is_pmem = 0;
+	}
+
+	RANGE_RW(part, size);
+
+	pop->size = pop->set->size;
+	allocator_grow(&pop->allocator, pop->size);
+
+	pthread_mutex_unlock(&extend_lock);
+
+	LOG(3, "pool now %zu bytes", pop->size);
+	return 0;
+}
+
+/* called with (lines verified, total lines) while a pool is checked */
+static void (*Check_progress)(size_t done, size_t total);
+
+/*
+ * pmemobj_set_check_progress_func -- report progress of pool checks
+ */
+void
+pmemobj_set_check_progress_func(void (*progress_func)(size_t done,
+		size_t total))
+{
+	LOG(3, "progress %p", progress_func);
+
+	Check_progress = progress_func;
+}
+
+/*
+ * pmemobj_check_nthreads -- (internal) number of threads to check a pool with
+ *
+ * Defaults to the number of online CPUs, PMEMOBJ_CHECK_THREADS overrides.
+ */
+static unsigned
+pmemobj_check_nthreads(void)
+{
+	char *ptr = getenv("PMEMOBJ_CHECK_THREADS");
+	if (ptr && atoi(ptr) > 0)
+		return (unsigned)atoi(ptr);
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (ncpus > 0) ? (unsigned)ncpus : 1;
+}
+
+/*
+ * pmemobj_pool_check -- transactional memory pool consistency check
+ *
+ * The pool header is validated, transactions cut short by a crash are
+ * rolled back and the allocator's line headers are verified, spread over
+ * all CPUs.  Returns true if consistent, zero if inconsistent, -1/error
+ * if checking cannot happen due to other errors.
+ */
+int
+pmemobj_pool_check(const char *path)
+{
+	LOG(3, "path \"%s\"", path);
+
+	int nbad = 0;
+	PMEMobjpool *pop = pmemobj_pool_open_common(path, NULL, OBJ_MODE_RDWR,
+			&nbad);
+	if (pop == NULL)
+		return (errno == EINVAL) ? 0 : -1;
+
+	int consistent = (nbad == 0);
+
+	if (pop->root.off != 0 && (pop->root.off >= pop->size ||
+			pop->root_size > pop->size - pop->root.off)) {
+		LOG(1, "bad root object 0x%" PRIx64 " size %" PRIu64,
+				pop->root.off, pop->root_size);
+		consistent = 0;
+	}
+
+	int nlines = allocator_check(&pop->allocator, pmemobj_check_nthreads(),
+			Check_progress);
+	if (nlines < 0)
+		consistent = -1;
+	else if (nlines > 0 && consistent > 0)
+		consistent = 0;
+
+	int oerrno = errno;
+	pmemobj_pool_close(pop);
+	errno = oerrno;
+
+	return consistent;
+}
+
+/*
+ * pmemobjs_check -- obj memory pool consistency check
+ *
+ * Same as pmemobj_pool_check(), including the roll back of interrupted
+ * transactions.
+ */
+int
+pmemobjs_check(const char *path)
+{
+	return pmemobj_pool_check(path);
+}
+
+/*
+ * pmemobj_pool_map_ro -- (internal) map a pool file privately for checking
+ */
+static void *
+pmemobj_pool_map_ro(const char *path, size_t *sizep)
+{
+	int fd;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		LOG(1, "!%s", path);
+		return NULL;
+	}
+
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) < 0) {
+		LOG(1, "!fstat %s", path);
+		close(fd);
+		return NULL;
+	}
+
+	if (stbuf.st_size < sizeof (struct pmemobjpool)) {
+		LOG(1, "%s: size %zu too small", path, (size_t)stbuf.st_size);
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *addr = util_map(fd, stbuf.st_size, 1);
+	int oerrno = errno;
+	close(fd);
+	errno = oerrno;
+
+	*sizep = stbuf.st_size;
+	return addr;
+}
+
+/*
+ * pmemobj_pool_check_mirrored -- mirrored memory pool consistency check
+ *
+ * Both copies must carry the same valid header, the same root and the
+ * same contents past the pool descriptor, whose run-time fields are
+ * allowed to differ.  Returns true if consistent, zero if inconsistent,
+ * -1/error if checking cannot happen due to other errors.
+ */
+int
+pmemobj_pool_check_mirrored(const char *path1, const char *path2)
+{
+	LOG(3, "path1 \"%s\", path2 \"%s\"", path1, path2);
+
+	size_t size1, size2;
+	struct pmemobjpool *pop1, *pop2;
+
+	if ((pop1 = pmemobj_pool_map_ro(path1, &size1)) == NULL)
+		return -1;
+
+	if ((pop2 = pmemobj_pool_map_ro(path2, &size2)) == NULL) {
+		int oerrno = errno;
+		util_unmap(pop1, size1);
+		errno = oerrno;
+		return -1;
+	}
+
+	int consistent = 1;
+	struct pool_hdr hdr;
+
+	memcpy(&hdr, &pop1->hdr, sizeof (hdr));
+	if (!util_convert_hdr(&hdr) ||
+			strncmp(hdr.signature, OBJ_HDR_SIG, POOL_HDR_SIG_LEN)) {
+		LOG(1, "%s: no valid obj pool header", path1);
+		consistent = 0;
+	} else if (size1 != size2) {
+		LOG(1, "size mismatch: %zu != %zu", size1, size2);
+		consistent = 0;
+	} else if (memcmp(&pop1->hdr, &pop2->hdr, sizeof (pop1->hdr))) {
+		LOG(1, "pool headers differ");
+		consistent = 0;
+	} else if (pop1->root.off != pop2->root.off ||
+			pop1->root_size != pop2->root_size) {
+		LOG(1, "root objects differ");
+		consistent = 0;
+	} else {
+		size_t off = sizeof (struct pmemobjpool);
+		if (memcmp((char *)pop1 + off, (char *)pop2 + off,
+					size1 - off)) {
+			LOG(1, "pool contents differ");
+			consistent = 0;
+		}
+	}
+
+	util_unmap(pop1, size1);
+	util_unmap(pop2, size2);
+
+	return consistent;
+}
+
+/*
+ * tx_error -- (internal) set error state
+ *
+ * This is typically called for pmemobj error cases like this:
+ *	return tx_error(tid, errnum);
+ * A tid of zero is passed to mean the current tid for this thread.
+ *
+ * If there's no transaction in progress or if the transaction does
+ * not have a jmp_buf defined, tx_error sets errno and returns -1.
+ * If there's a jmp_buf defined, tx_error sets errno and longjmps.
+ */
+static int
+tx_error(int tid, int errnum)
+{
+	errno = errnum;
+	/* XXX if jmp_buf defined, longjmp */
+	return -1;
+}
+
+/* serializes the first use of a PMEMmutex, PMEMrwlock or PMEMcond in a run */
+static pthread_mutex_t Lockof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * mutexof -- (internal) find or allocate a pthread_mutex_t
+ *
+ * The first time mutexof() is used on a zeroed PMEMmutex, or
+ * the first time it is used during this run of the  program,
+ * mutexof() allocates a new pthread_mutex_t in DRAM and initializes
+ * it for use.  On subsequent calls, mutexof() returns the existing
+ * pthread_mutex_t.  The runid is stored last, so threads racing on the
+ * first use all end up with the same lock.  A PMEMmutex in a read-only
+ * pool is never written, its pthread_mutex_t is kept in DRAM.
+ *
+ * NULL is returned if the pthread_mutex_t cannot be allocated or initialized.
+ */
+pthread_mutex_t *
+mutexof(PMEMmutex *mutexp)
+{
+	if (mutexp->runid == Runid)
+		return mutexp->pthread_mutexp;	/* already allocated */
+
+	pthread_mutex_t *pthread_mutexp = NULL;
+	if (rdonly_lockof(mutexp, RDONLY_MUTEX, (void **)&pthread_mutexp))
+		return pthread_mutexp;
+
+	pthread_mutex_lock(&Lockof_lock);
+	if (mutexp->runid == Runid) {
+		pthread_mutexp = mutexp->pthread_mutexp;
+	} else if ((pthread_mutexp =
+				Malloc(sizeof (pthread_mutex_t))) == NULL) {
+		LOG(1, "!Malloc");
+	} else if ((errno = pthread_mutex_init(pthread_mutexp, NULL))) {
+		Free(pthread_mutexp);
+		pthread_mutexp = NULL;
+	} else {
+		mutexp->pthread_mutexp = pthread_mutexp;
+		__sync_synchronize();
+		mutexp->runid = Runid;
+	}
+	pthread_mutex_unlock(&Lockof_lock);
+
+	return pthread_mutexp;
+}
+
+/*
+ * rwlockof -- (internal) find or allocate a pthread_rwlock_t
+ *
+ * NULL is returned if the pthread_rwlock_t cannot be allocated or initialized.
+ */
+pthread_rwlock_t *
+rwlockof(PMEMrwlock *rwlockp)
+{
+	if (rwlockp->runid == Runid)
+		return rwlockp->pthread_rwlockp;	/* already allocated */
+
+	pthread_rwlock_t *pthread_rwlockp = NULL;
+	if (rdonly_lockof(rwlockp, RDONLY_RWLOCK, (void **)&pthread_rwlockp))
+		return pthread_rwlockp;
+
+	pthread_mutex_lock(&Lockof_lock);
+	if (rwlockp->runid == Runid) {
+		pthread_rwlockp = rwlockp->pthread_rwlockp;
+	} else if ((pthread_rwlockp =
+				Malloc(sizeof (pthread_rwlock_t))) == NULL) {
+		LOG(1, "!Malloc");
+	} else if ((errno = pthread_rwlock_init(pthread_rwlockp, NULL))) {
+		Free(pthread_rwlockp);
+		pthread_rwlockp = NULL;
+	} else {
+		rwlockp->pthread_rwlockp = pthread_rwlockp;
+		__sync_synchronize();
+		rwlockp->runid = Runid;
+	}
+	pthread_mutex_unlock(&Lockof_lock);
+
+	return pthread_rwlockp;
+}
+
+/*
+ * condof -- (internal) find or allocate a pthread_cond_t
+ *
+ * NULL is returned if the pthread_cond_t cannot be allocated or initialized.
+ */
+pthread_cond_t *
+condof(PMEMcond *condp)
+{
+	if (condp->runid == Runid)
+		return condp->pthread_condp;	/* already allocated */
+
+	pthread_cond_t *pthread_condp = NULL;
+	if (rdonly_lockof(condp, RDONLY_COND, (void **)&pthread_condp))
+		return pthread_condp;
+
+	pthread_mutex_lock(&Lockof_lock);
+	if (condp->runid == Runid) {
+		pthread_condp = condp->pthread_condp;
+	} else if ((pthread_condp = Malloc(sizeof (pthread_cond_t))) == NULL) {
+		LOG(1, "!Malloc");
+	} else if ((errno = pthread_cond_init(pthread_condp, NULL))) {
+		Free(pthread_condp);
+		pthread_condp = NULL;
+	} else {
+		condp->pthread_condp = pthread_condp;
+		__sync_synchronize();
+		condp->runid = Runid;
+	}
+	pthread_mutex_unlock(&Lockof_lock);
+
+	return pthread_condp;
+}
+
+/*
+ * pmemobj_mutex_init -- initialize a PMEMmutex
+ *
+ * Calling pmemobj_mutex_init() is only necessary on new allocations,
+ * and even then only if the PMEMmutex has not been zeroed.  Unlike
+ * pthread_mutex_t, PMEMmutexes are considered initialized when they
+ * are zeroed (so PMEMmutexes allocated via pmemobj_zalloc() need not be
+ * initialized, for example).  In addition, they are automatically
+ * re-initialized each time the memory pool is opened (any state stored
+ * in pmem for a PMEMmutex resets).
+ *
+ * Unlike pthread_mutex_init(), no attr argument is supported.
+ */
+int
+pmemobj_mutex_init(PMEMmutex *mutexp)
+{
+	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
+
+	if (pthread_mutexp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_mutex_init(pthread_mutexp, NULL);
+}
+
+/*
+ * pmemobj_mutex_lock -- lock a PMEMmutex
+ */
+int
+pmemobj_mutex_lock(PMEMmutex *mutexp)
+{
+	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
+
+	if (pthread_mutexp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_mutex_lock(pthread_mutexp);
+}
+
+/*
+ * pmemobj_mutex_trylock -- try to lock a PMEMmutex
+ */
+int
+pmemobj_mutex_trylock(PMEMmutex *mutexp)
+{
+	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
+
+	if (pthread_mutexp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_mutex_trylock(pthread_mutexp);
+}
+
+/*
+ * pmemobj_mutex_unlock -- unlock a PMEMmutex
+ */
+int
+pmemobj_mutex_unlock(PMEMmutex *mutexp)
+{
+	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
+
+	if (pthread_mutexp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_mutex_unlock(pthread_mutexp);
+}
+
+/*
+ * pmemobj_rwlock_init -- initialize a PMEMrwlock
+ */
+int
+pmemobj_rwlock_init(PMEMrwlock *rwlockp)
+{
+	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+
+	if (pthread_rwlockp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_rwlock_init(pthread_rwlockp, NULL);
+}
+
+/*
+ * pmemobj_rwlock_rdlock -- read lock a PMEMrwlock
+ */
+int
+pmemobj_rwlock_rdlock(PMEMrwlock *rwlockp)
+{
+	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+
+	if (pthread_rwlockp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_rwlock_rdlock(pthread_rwlockp);
+}
+
+/*
+ * pmemobj_rwlock_wrlock -- write lock a PMEMrwlock
+ */
+int
+pmemobj_rwlock_wrlock(PMEMrwlock *rwlockp)
+{
+	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+
+	if (pthread_rwlockp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_rwlock_wrlock(pthread_rwlockp);
+}
+
+/*
+ * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ */
+int
+pmemobj_rwlock_timedrdlock(PMEMrwlock *restrict rwlockp,
+		const struct timespec *restrict abs_timeout)
+{
+	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+
+	if (pthread_rwlockp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_rwlock_timedrdlock(pthread_rwlockp, abs_timeout);
+}
+
+/*
+ * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ */
+int
+pmemobj_rwlock_timedwrlock(PMEMrwlock *restrict rwlockp,
+		const struct timespec *restrict abs_timeout)
+{
+	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+
+	if (pthread_rwlockp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_rwlock_timedwrlock(pthread_rwlockp, abs_timeout);
+}
+
+/*
+ * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ */
+int
+pmemobj_rwlock_tryrdlock(PMEMrwlock *rwlockp)
+{
+	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+
+	if (pthread_rwlockp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_rwlock_tryrdlock(pthread_rwlockp);
+}
+
+/*
+ * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ */
+int
+pmemobj_rwlock_trywrlock(PMEMrwlock *rwlockp)
+{
+	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+
+	if (pthread_rwlockp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_rwlock_trywrlock(pthread_rwlockp);
+}
+
+/*
+ * pmemobj_rwlock_unlock -- unlock a PMEMrwlock
+ */
+int
+pmemobj_rwlock_unlock(PMEMrwlock *rwlockp)
+{
+	pthread_rwlock_t *pthread_rwlockp = rwlockof(rwlockp);
+
+	if (pthread_rwlockp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_rwlock_unlock(pthread_rwlockp);
+}
+
+/*
+ * pmemobj_cond_init -- initialize a PMEMcond
+ */
+int
+pmemobj_cond_init(PMEMcond *condp)
+{
+	pthread_cond_t *pthread_condp = condof(condp);
+
+	if (pthread_condp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_cond_init(pthread_condp, NULL);
+}
+
+/*
+ * pmemobj_cond_init -- initialize a PMEMcond
+ */
+int
+pmemobj_cond_broadcast(PMEMcond *condp)
+{
+	pthread_cond_t *pthread_condp = condof(condp);
+
+	if (pthread_condp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_cond_broadcast(pthread_condp);
+}
+
+/*
+ * pmemobj_cond_init -- initialize a PMEMcond
+ */
+int
+pmemobj_cond_signal(PMEMcond *condp)
+{
+	pthread_cond_t *pthread_condp = condof(condp);
+
+	if (pthread_condp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_cond_signal(pthread_condp);
+}
+
+/*
+ * pmemobj_cond_init -- initialize a PMEMcond
+ */
+int
+pmemobj_cond_timedwait(PMEMcond *restrict condp,
+		PMEMmutex *restrict mutexp,
+		const struct timespec *restrict abstime)
+{
+	pthread_cond_t *pthread_condp = condof(condp);
+	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
+
+	if (pthread_condp == NULL || pthread_mutexp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_cond_timedwait(pthread_condp, pthread_mutexp, abstime);
+}
+
+/*
+ * pmemobj_cond_init -- initialize a PMEMcond
+ */
+int
+pmemobj_cond_wait(PMEMcond *condp, PMEMmutex *restrict mutexp)
+{
+	pthread_cond_t *pthread_condp = condof(condp);
+	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
+
+	if (pthread_condp == NULL || pthread_mutexp == NULL)
+		return tx_error(0, ENOMEM);
+
+	return pthread_cond_wait(pthread_condp, pthread_mutexp);
+}
+
+/*
+ * zalloc -- (internal) fake version zeroed malloc
+ */
+static void *
+zalloc(size_t size)
+{
+	char *ptr = Malloc(size);
+	if (ptr)
+		memset(ptr, '\0', size);
+	return (void *)ptr;
+}
+
+/*
+ * root_publish -- (internal) create the root object, or move it
+ *
+ * A new object of size bytes is allocated as a free object, which
+ * recovery ignores, the first keep bytes of the current root are copied
+ * into it and the rest is zeroed.  Only then the lane's redo record
+ * commits, giving it its type, making it the root, setting the size and
+ * freeing the old root, all or nothing.  Called with the root lock held.
+ */
+static int
+root_publish(PMEMobjpool *pop, size_t size, size_t keep)
+{
+	uint64_t off;
+	obj_pmalloc(pop, &off, size, ALLOC_TYPE_FREE);
+	if (off == 0)
+		return -1;
+
+	/* the fence of the copy covers the zeroed tail as well */
+	char *dst = (char *)pop->addr + off;
+	obj_memset_nodrain(pop, dst + keep, 0, size - keep);
+	obj_memcpy_persist(pop, dst, (char *)pop->addr + pop->root.off, keep);
+
+	unsigned lane;
+	struct redo *rp = redo_begin(pop, &lane);
+	rp->dest = (uint64_t)((char *)&pop->root - (char *)pop->addr);
+	rp->obj = off;
+	rp->type_num = OBJ_TYPE_INTERNAL;
+	rp->old = pop->root.off;
+	redo_add(pop, rp, REDO_STORE_WORD, &pop->root_size, size);
+	redo_commit(pop, lane, REDO_ALLOC);
+
+	return 0;
+}
+
+/*
+ * pmemobj_root_direct -- return direct access to root object
+ *
+ * The root object is special.  If it doesn't exist, a pre-zeroed instance
+ * is created, persisted, and then returned.  If it does exist, the
+ * instance already in pmem is returned.  Creation is done atomically, so
+ * two threads calling pmemobj_root_direct() concurrently will get back
+ * the same pointer to the same object, even if it has to be created.  But
+ * beyond that there's no protection against concurrent updates and the
+ * object almost certainly needs to contain a lock to make updates to it
+ * MT-safe.
+ *
+ * The argument "size" is used to determine the size of the root object,
+ * the first time this is called, but after that the object already exists
+ * and size is used to verify the caller knows the correct size.
+ */
+void *
+pmemobj_root_direct(PMEMobjpool *pop, size_t size)
+{
+	if (pop->rdonly) {
+		/* no locking, nothing to create or update */
+		if (pop->root.off == 0) {
+			LOG(1, "read-only pool has no root object");
+			errno = EROFS;
+			return NULL;
+		}
+		return (char *)pop->addr + pop->root.off;
+	}
+
+	pmemobj_mutex_lock(&pop->rootlock);
+	if (pop->root.off == 0 && root_publish(pop, size, 0) < 0) {
+		LOG(1, "cannot allocate root of size %zu", size);
+		pmemobj_mutex_unlock(&pop->rootlock);
+		return NULL;
+	}
+	pmemobj_mutex_unlock(&pop->rootlock);
+
+	/* the pool may be mapped elsewhere than when the root was created */
+	return (char *)pop->addr + pop->root.off;
+}
+
+/*
+ * pmemobj_root_resize -- set the root object size
+ *
+ * This is for the (extremely rare) case where the root object needs
+ * to change size.  If the object grows in size, the new portion of
+ * the object is zeroed.
+ *
+ * Growing the root is done by relocation: a new object is allocated,
+ * the old contents are copied in and the tail is zeroed, all of which
+ * is made durable before a redo record switches the root over, sets the
+ * new size and frees the old root in one atomic operation.  A crash
+ * leaves either the old or the new root in place, nothing is leaked.
+ *
+ * Pointers previously returned by pmemobj_root_direct() are not valid
+ * after the root object grows.
+ */
+int
+pmemobj_root_resize(PMEMobjpool *pop, size_t newsize)
+{
+	LOG(3, "pop %p newsize %zu", pop, newsize);
+
+	if (pop->rdonly) {
+		LOG(1, "pool is read-only");
+		errno = EROFS;
+		return -1;
+	}
+
+	if (pmemobj_mutex_lock(&pop->rootlock))
+		return -1;
+
+	if (pop->root.off == 0) {
+		LOG(1, "root object does not exist");
+		pmemobj_mutex_unlock(&pop->rootlock);
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint64_t oldsize = pop->root_size;
+
+	if (newsize <= oldsize) {
+		/* shrinking, the object stays where it is */
+		pop->root_size = newsize;
+		obj_persist(pop, &pop->root_size,
+				sizeof (pop->root_size));
+		pmemobj_mutex_unlock(&pop->rootlock);
+		return 0;
+	}
+
+	if (root_publish(pop, newsize, oldsize) < 0) {
+		LOG(1, "cannot allocate new root of size %zu", newsize);
+		pmemobj_mutex_unlock(&pop->rootlock);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pmemobj_mutex_unlock(&pop->rootlock);
+
+	LOG(4, "root moved to 0x%" PRIx64, pop->root.off);
+	return 0;
+}
+
+/*
+ * pmemobj_tx_begin -- begin a transaction
+ */
+PMEMtid
+pmemobj_tx_begin(PMEMobjpool *pop, jmp_buf env)
+{
+	if (pop->rdonly) {
+		LOG(1, "pool is read-only");
+		tx_error(0, EROFS);
+		return 0;
+	}
+
+	/* a nested transaction shares the lane, so the pool, of its parent */
+	if (Curthread_txinfop != NULL && Curthread_txinfop->txp->pool != pop) {
+		LOG(1, "nested transaction on another pool");
+		tx_error(0, EINVAL);
+		return 0;
+	}
+
+	struct tx *txp = zalloc(sizeof (*txp));
+	txp->pool = pop;
+
+	if (env) {
+		txp->valid_env = 1;
+		memcpy((void *)txp->env, (void *)env, sizeof (jmp_buf));
+	}
+
+	if (Curthread_txinfop == NULL) {
+		struct txinfo *txinfop = zalloc(sizeof (*txinfop));
+		txinfop->txp = txp;
+		Curthread_txinfop = txinfop;
+		txp->next = NULL;
+		txp->lane = lane_hold(pop);
+		if (pop->stats != NULL) {
+			stats_add(pop->stats, OBJ_STAT_TX_BEGUN, 1);
+			txp->start = stats_now();
+		}
+	} else {
+		txp->next = Curthread_txinfop->txp;
+		txp->lane = txp->next->lane;
+		Curthread_txinfop->txp = txp;
+	}
+
+	return (PMEMtid)txp;
+}
+
+/*
+ * pmemobj_tx_begin_lock -- begin a transaction, locking a mutex
+ */
+PMEMtid
+pmemobj_tx_begin_lock(PMEMobjpool *pop, jmp_buf env, PMEMmutex *mutexp)
+{
+	struct tx *txp = (struct tx *)pmemobj_tx_begin(pop, env);
+	if (txp == NULL)
+		return 0;
+	pmemobj_mutex_lock(mutexp);
+	txp->mutexp = mutexp;
+	return (PMEMtid)txp;
+}
+
+/*
+ * pmemobj_tx_begin_wrlock -- begin a transaction, write locking an rwlock
+ */
+PMEMtid
+pmemobj_tx_begin_wrlock(PMEMobjpool *pop, jmp_buf env, PMEMrwlock *rwlockp)
+{
+	struct tx *txp = (struct tx *)pmemobj_tx_begin(pop, env);
+	if (txp == NULL)
+		return 0;
+	pmemobj_rwlock_wrlock(rwlockp);
+	txp->rwlockp = rwlockp;
+	return (PMEMtid)txp;
+}
+
+/*
+ * pmemobj_tx_commit -- commit transaction, implicit tid
+ */
+int
+pmemobj_tx_commit(void)
+{
+	return pmemobj_tx_commit_tid((PMEMtid)Curthread_txinfop->txp);
+}
+
+/*
+ * Ending a transaction takes two passes over its operations, newest first.
+ * The first pass makes the outcome durable: on commit the new objects and
+ * the modified ranges are flushed, on abort the modified ranges are
+ * restored from their undo copies.  The lane's undo log is then cleared,
+ * which is the point of no return, and the second pass releases what is
+ * no longer needed: freed objects and undo copies on commit, new objects
+ * and undo copies on abort.
+ */
+void
+pmemobj_txop_oncommit_alloc(struct tx *txp, union txop_args args)
+{
+	if (args.alloc.addr && args.alloc.size)
+		obj_persist(txp->pool,
+			(char *)txp->pool->addr + args.alloc.addr,
+			args.alloc.size);
+}
+
+void
+pmemobj_txop_oncommit_free(struct tx *txp, union txop_args args)
+{
+	/* freed by the next open if the release pass never gets to it */
+	if (args.free.addr)
+		allocator_set_type(&txp->pool->allocator, args.free.addr,
+				OBJ_TYPE_RETIRED);
+}
+
+void
+pmemobj_txop_oncommit_set(struct tx *txp, union txop_args args)
+{
+	obj_persist(txp->pool, args.set.addr, args.set.len);
+}
+
+pmemobj_txop_onaction_t oncommit_funcs[] = {
+	pmemobj_txop_oncommit_alloc,
+	pmemobj_txop_oncommit_free,
+	pmemobj_txop_oncommit_set,
+	pmemobj_txop_oncommit_set
+};
+
+void
+pmemobj_txop_oncommitted_alloc(struct tx *txp, union txop_args args)
+{
+}
+
+void
+pmemobj_txop_oncommitted_free(struct tx *txp, union txop_args args)
+{
+	obj_retire(txp->pool, args.free.addr);
+}
+
+void
+pmemobj_txop_oncommitted_set(struct tx *txp, union txop_args args)
+{
+	obj_pfree(txp->pool, args.set.data);
+}
+
+void
+pmemobj_txop_oncommitted_set_extent(struct tx *txp, union txop_args args)
+{
+	/* the extent is reused by the lane's next transaction */
+}
+
+pmemobj_txop_onaction_t oncommitted_funcs[] = {
+	pmemobj_txop_oncommitted_alloc,
+	pmemobj_txop_oncommitted_free,
+	pmemobj_txop_oncommitted_set,
+	pmemobj_txop_oncommitted_set_extent
+};
+
+/*
+ * tx_unlock -- (internal) drop the lock a transaction was begun with
+ */
+static void
+tx_unlock(struct tx *tx)
+{
+	if (tx->mutexp != NULL)
+		pmemobj_mutex_unlock(tx->mutexp);
+	if (tx->rwlockp != NULL)
+		pmemobj_rwlock_unlock(tx->rwlockp);
+}
+
+int
+pmemobj_tx_action_tid(PMEMtid tid, pmemobj_txop_onaction_t *actions,
+	pmemobj_txop_onaction_t *release)
+{
+	struct tx *tx = (struct tx *)tid;
+	if (tx->next == NULL) {
+		PMEMobjpool *pop = tx->pool;
+		struct txop *op;
+
+		/* the deferred msyncs and mirror copies belong to obj too */
+		unsigned osrc = pmem_prof_source(PMEM_FLUSH_SRC_OBJ);
+
+		/* replay everything flushed below to a mirror in one go */
+		libpmem_mirror_batch_begin();
+
+		/*
+		 * The ranges made durable by the first pass do not depend on
+		 * each other, on non-pmem their pages are msync'ed together
+		 * before the log is cleared.
+		 */
+		libpmem_msync_batch_begin();
+		for (op = tx->tail; op != NULL; op = op->prev)
+			actions[op->op](tx, op->args);
+		libpmem_msync_batch_end();
+
+		txlog_clear(pop, tx->lane);
+
+		for (op = tx->tail; op != NULL; op = op->prev)
+			release[op->op](tx, op->args);
+		libpmem_mirror_batch_end();
+		pmem_prof_source(osrc);
+
+		lane_release(pop, tx->lane);
+		tx_unlock(tx);
+
+		if (pop->stats != NULL && actions == oncommit_funcs) {
+			stats_add(pop->stats, OBJ_STAT_TX_COMMITTED, 1);
+			stats_record(pop->stats, PMEMOBJ_LATENCY_TX,
+					stats_now() - tx->start);
+		} else if (pop->stats != NULL) {
+			stats_add(pop->stats, OBJ_STAT_TX_ABORTED, 1);
+		}
+
+		free(tx);
+		free(Curthread_txinfop);
+		Curthread_txinfop = NULL;
+	} else {
+		/* hand the operations, if any, to the enclosing transaction */
+		if (tx->head != NULL) {
+			tx->head->prev = tx->next->tail;
+			if (tx->next->tail != NULL)
+				tx->next->tail->next = tx->head;
+			else
+				tx->next->head = tx->head;
+			tx->next->tail = tx->tail;
+		}
+		Curthread_txinfop->txp = tx->next;
+		tx_unlock(tx);
+		free(tx);
+	}
+
+	return 0;
+}
+
+/*
+ * pmemobj_tx_commit_tid -- commit transaction
+ */
+int
+pmemobj_tx_commit_tid(PMEMtid tid)
+{
+	return pmemobj_tx_action_tid(tid, oncommit_funcs, oncommitted_funcs);
+}
+
+/*
+ * pmemobj_tx_commit_multi -- commit multiple transactions
+ *
+ * A list of tids is provided varargs-style, terminated by 0
+ */
+int
+pmemobj_tx_commit_multi(PMEMtid tid, ...)
+{
+	return 0;
+}
+
+/*
+ * pmemobj_tx_commit_multiv -- commit multiple transactions, on array of tids
+ *
+ * A list of tids is provided as an array, terminated by a 0 entry
+ */
+int
+pmemobj_tx_commit_multiv(PMEMtid tids[])
+{
+	return 0;
+}
+
+void
+pmemobj_txop_onabort_alloc(struct tx *txp, union txop_args args)
+{
+	/* keep a mirror byte-for-byte identical, even in freed space */
+	if (args.alloc.addr && args.alloc.size)
+		obj_persist(txp->pool,
+			(char *)txp->pool->addr + args.alloc.addr,
+			args.alloc.size);
+}
+
+void
+pmemobj_txop_onabort_free(struct tx *txp, union txop_args args)
+{
+}
+
+void
+pmemobj_txop_onabort_set(struct tx *txp, union txop_args args)
+{
+	uint64_t base = (uint64_t)txp->pool->addr;
+	memcpy(args.set.addr, (void *)(base + args.set.data), args.set.len);
+	obj_persist(txp->pool, args.set.addr, args.set.len);
+}
+
+pmemobj_txop_onaction_t onabort_funcs[] = {
+	pmemobj_txop_onabort_alloc,
+	pmemobj_txop_onabort_free,
+	pmemobj_txop_onabort_set,
+	pmemobj_txop_onabort_set
+};
+
+void
+pmemobj_txop_onaborted_alloc(struct tx *txp, union txop_args args)
+{
+	obj_pfree(txp->pool, args.alloc.addr);
+}
+
+void
+pmemobj_txop_onaborted_free(struct tx *txp, union txop_args args)
+{
+}
+
+void
+pmemobj_txop_onaborted_set(struct tx *txp, union txop_args args)
+{
+	/* the undo copy is released by its own TXOP_ALLOC */
+}
+
+pmemobj_txop_onaction_t onaborted_funcs[] = {
+	pmemobj_txop_onaborted_alloc,
+	pmemobj_txop_onaborted_free,
+	pmemobj_txop_onaborted_set,
+	pmemobj_txop_onaborted_set
+};
+
+/*
+ * pmemobj_tx_abort -- abort transaction, implicit tid
+ */
+int
+pmemobj_tx_abort(int errnum)
+{
+	int status = -1;
+	while (Curthread_txinfop != NULL) {
+		status = pmemobj_tx_abort_tid(
+			(PMEMtid)Curthread_txinfop->txp, errnum);
+	}
+
+	return status;
+}
+
+/*
+ * pmemobj_tx_abort_tid -- abort transaction
+ */
+int
+pmemobj_tx_abort_tid(PMEMtid tid, int errnum)
+{
+	return pmemobj_tx_action_tid(tid, onabort_funcs, onaborted_funcs);
+}
+
+static struct txop *
+pmemobj_log_prepare_alloc(uint64_t **addrpp, size_t size)
+{
+	struct txop *txop = zalloc(sizeof (struct txop));
+	txop->args.alloc.addr = 0;
+	txop->args.alloc.size = size;
+	txop->op = TXOP_ALLOC;
+	*addrpp = &(txop->args.alloc.addr);
+	return txop;
+}
+
+static struct txop *
+pmemobj_log_prepare_free(uint64_t addr)
+{
+	struct txop *txop = zalloc(sizeof (struct txop));
+	txop->args.free.addr = addr;
+	txop->op = TXOP_FREE;
+	return txop;
+}
+
+static struct txop *
+pmemobj_log_prepare_set(op_t op, void *addr, uint64_t data, size_t len)
+{
+	struct txop *txop = zalloc(sizeof (struct txop));
+	txop->args.set.addr = addr;
+	txop->args.set.data = data;
+	txop->args.set.len = len;
+	txop->op = op;
+	return txop;
+}
+
+static void
+pmemobj_log_add(PMEMtid tid, struct txop *txop)
+{
+	struct tx *tx = (struct tx *)tid;
+	if (tx->head == NULL) {
+		tx->head = txop;
+	} else {
+		tx->tail->next = txop;
+		txop->prev = tx->tail;
+	}
+	tx->tail = txop;
+}
+
+static void
+pmemobj_log_add_alloc(PMEMtid tid, uint64_t **addrpp, size_t size)
+{
+	struct txop *txop = pmemobj_log_prepare_alloc(addrpp, size);
+	if (txop) {
+		pmemobj_log_add(tid, txop);
+	}
+}
+
+static void
+pmemobj_log_add_free(PMEMtid tid, uint64_t addr)
+{
+	struct txop *txop = pmemobj_log_prepare_free(addr);
+	if (txop) {
+		pmemobj_log_add(tid, txop);
+	}
+}
+
+static void
+pmemobj_log_add_set(PMEMtid tid, op_t op, void *addr, uint64_t data,
+	size_t len)
+{
+	struct txop *txop = pmemobj_log_prepare_set(op, addr, data, len);
+	if (txop) {
+		pmemobj_log_add(tid, txop);
+	}
+}
+
+/*
+ * pmemobj_alloc -- transactional allocate, implicit tid
+ */
+PMEMoid
+pmemobj_alloc(size_t size)
+{
+	return pmemobj_alloc_tid((PMEMtid)Curthread_txinfop->txp, size);
+}
+
+/*
+ * pmemobj_alloc_type -- transactional allocate of a typed object, implicit tid
+ */
+PMEMoid
+pmemobj_alloc_type(size_t size, unsigned type_num)
+{
+	return pmemobj_alloc_type_tid((PMEMtid)Curthread_txinfop->txp, size,
+							type_num);
+}
+
+/*
+ * pmemobj_zalloc -- transactional allocate, zeroed, implicit tid
+ */
+PMEMoid
+pmemobj_zalloc(size_t size)
+{
+	return pmemobj_zalloc_tid((PMEMtid)Curthread_txinfop->txp, size);
+}
+
+/*
+ * pmemobj_realloc -- transactional realloc, implicit tid
+ */
+PMEMoid
+pmemobj_realloc(PMEMoid oid, size_t size)
+{
+	return pmemobj_realloc_tid((PMEMtid)Curthread_txinfop->txp, oid, size);
+}
+
+/*
+ * pmemobj_aligned_alloc -- transactional alloc of aligned memory, implicit tid
+ */
+PMEMoid
+pmemobj_aligned_alloc(size_t alignment, size_t size)
+{
+	return pmemobj_aligned_alloc_tid((PMEMtid)Curthread_txinfop->txp,
+							alignment, size);
+}
+
+/*
+ * pmemobj_strdup -- transactional strdup of non-pmem string, implicit tid
+ */
+PMEMoid
+pmemobj_strdup(const char *s)
+{
+	return pmemobj_strdup_tid((PMEMtid)Curthread_txinfop->txp, s);
+}
+
+/*
+ * pmemobj_free -- transactional free, implicit tid
+ */
+int
+pmemobj_free(PMEMoid oid)
+{
+	return pmemobj_free_tid((PMEMtid)Curthread_txinfop->txp, oid);
+}
+
+/*
+ * pmemobj_size -- return the current size of an object
+ *
+ * No lock or transaction is required for this call, but of course
+ * if the object is not protected by some sort of locking, another
+ * thread may change the size before the caller uses the return value.
+ */
+size_t
+pmemobj_size(PMEMoid oid)
+{
+	if (oid.off == 0)
+		return 0;
+
+	/* the usable size, which may be more than what was asked for */
+	return ((struct alloc_hdr *)(oid.pool + oid.off) - 1)->size;
+}
+
+/*
+ * pmemobj_alloc_tid -- transactional allocate
+ */
+PMEMoid
+pmemobj_alloc_tid(PMEMtid tid, size_t size)
+{
+	return pmemobj_alloc_type_tid(tid, size, 0);
+}
+
+/*
+ * pmemobj_alloc_type_tid -- transactional allocate of a typed object
+ */
+PMEMoid
+pmemobj_alloc_type_tid(PMEMtid tid, size_t size, unsigned type_num)
+{
+	struct tx *tx = (struct tx *)tid;
+	PMEMoid n = { 0 };
+	uint64_t *ptrp;
+
+	if (type_num >= PMEMOBJ_NUM_TYPES) {
+		LOG(1, "invalid type number %u", type_num);
+		tx_error(tid, EINVAL);
+		return n;
+	}
+
+	n.pool = (uint64_t)tx->pool->addr;
+	pmemobj_log_add_alloc(tid, &ptrp, size);
+	if ((*ptrp = txlog_alloc(tx->pool, tx->lane, size, type_num)) == 0) {
+		tx_error(tid, ENOMEM);
+		return n;
+	}
+	n.off = *ptrp;
+	return n;
+}
+
+/*
+ * pmemobj_zalloc_tid -- transactional allocate, zeroed
+ */
+PMEMoid
+pmemobj_zalloc_tid(PMEMtid tid, size_t size)
+{
+	struct tx *tx = (struct tx *)tid;
+	PMEMoid n = { 0 };
+	uint64_t *ptrp;
+
+	n.pool = (uint64_t)tx->pool->addr;
+	pmemobj_log_add_alloc(tid, &ptrp, size);
+	if ((*ptrp = txlog_alloc(tx->pool, tx->lane, size, 0)) == 0) {
+		tx_error(tid, ENOMEM);
+		return n;
+	}
+	n.off = *ptrp;
+	memset((void *)(n.pool + n.off), 0, size);
+	return n;
+}
+
+/*
+ * pmemobj_realloc_tid -- transactional realloc
+ */
+PMEMoid
+pmemobj_realloc_tid(PMEMtid tid, PMEMoid oid, size_t size)
+{
+	PMEMoid n = { 0 };
+
+	return n;
+}
+
+/*
+ * pmemobj_aligned_alloc -- transactional alloc of aligned memory
+ */
+PMEMoid
+pmemobj_aligned_alloc_tid(PMEMtid tid, size_t alignment, size_t size)
+{
+	PMEMoid n = { 0 };
 
-	return pthread_cond_timedwait(pthread_condp, pthread_mutexp, abstime);
+	return n;
 }
 
 /*
- * pmemobj_cond_init -- initialize a PMEMcond
+ * pmemobj_strdup_tid -- transactional strdup of non-pmem string
  */
-int
-pmemobj_cond_wait(PMEMcond *condp, PMEMmutex *restrict mutexp)
+PMEMoid
+pmemobj_strdup_tid(PMEMtid tid, const char *s)
 {
-	pthread_cond_t *pthread_condp = condof(condp);
-	pthread_mutex_t *pthread_mutexp = mutexof(mutexp);
-
-	if (pthread_condp == NULL || pthread_mutexp == NULL)
-		return tx_error(0, ENOMEM);
+	struct tx *tx = (struct tx *)tid;
+	size_t size = strlen(s) + 1;
+	PMEMoid n = { 0 };
+	uint64_t *ptrp;
 
-	return pthread_cond_wait(pthread_condp, pthread_mutexp);
+	n.pool = (uint64_t)tx->pool->addr;
+	pmemobj_log_add_alloc(tid, &ptrp, size);
+	if ((*ptrp = txlog_alloc(tx->pool, tx->lane, size, 0)) == 0) {
+		tx_error(tid, ENOMEM);
+		return n;
+	}
+	n.off = *ptrp;
+	strncpy((char *)(n.pool + n.off), s, size);
+	return n;
 }
 
 /*
- * zalloc -- (internal) fake version zeroed malloc
+ * pmemobj_free_tid -- transactional free
  */
-static void *
-zalloc(size_t size)
+int
+pmemobj_free_tid(PMEMtid tid, PMEMoid oid)
 {
-	char *ptr = Malloc(size);
-	if (ptr)
-		memset(ptr, '\0', size);
-	return (void *)ptr;
+	struct tx *tx = (struct tx *)tid;
+
+	/* the type is kept in the log to be restored by a rollback */
+	if (oid.off != 0 && txlog_append(tx->pool, tx->lane, TXOP_FREE,
+			oid.off, obj_type(tx->pool, oid.off), 0) < 0)
+		return tx_error(tid, ENOMEM);
+
+	pmemobj_log_add_free(tid, oid.off);
+	return 0;
 }
 
 /*
- * pmemobj_root_direct -- return direct access to root object
- *
- * The root object is special.  If it doesn't exist, a pre-zeroed instance
- * is created, persisted, and then returned.  If it does exist, the
- * instance already in pmem is returned.  Creation is done atomically, so
- * two threads calling pmemobj_root_direct() concurrently will get back
- * the same pointer to the same object, even if it has to be created.  But
- * beyond that there's no protection against concurrent updates and the
- * object almost certainly needs to contain a lock to make updates to it
- * MT-safe.
- *
- * The argument "size" is used to determine the size of the root object,
- * the first time this is called, but after that the object already exists
- * and size is used to verify the caller knows the correct size.
+ * pmemobj_atomic_check -- (internal) validate arguments of atomic operations
  */
-void *
-pmemobj_root_direct(PMEMobjpool *pop, size_t size)
+static int
+pmemobj_atomic_check(PMEMobjpool *pop, PMEMoid *dest)
 {
-	pmemobj_mutex_lock(&pop->rootlock);
-	if (pop->root.off == 0) {
-		pop->root.pool = (uint64_t)pop->addr;
-		pmalloc(&(pop->allocator), &(pop->root.off), size);
+	if (pop->rdonly) {
+		LOG(1, "pool is read-only");
+		errno = EROFS;
+		return -1;
 	}
-	pmemobj_mutex_unlock(&pop->rootlock);
-	return pmemobj_direct(pop->root);
+
+	if (dest != NULL && ((char *)dest <
+			(char *)pop->addr + sizeof (struct pool_hdr) ||
+			(char *)(dest + 1) > (char *)pop->addr + pop->size)) {
+		LOG(1, "destination %p not in the pool", dest);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
 }
 
 /*
- * pmemobj_root_resize -- set the root object size
+ * pmemobj_alloc_atomic -- allocate, construct and publish an object
  *
- * This is for the (extremely rare) case where the root object needs
- * to change size.  If the object grows in size, the new portion of
- * the object is zeroed.
+ * No transaction is involved: the object is allocated as a free object,
+ * which iteration skips and recovery ignores, and constructed.  Only then
+ * the lane's redo record commits giving it its type and storing its OID
+ * at *dest.  Returns 0 on success, -1 and sets errno otherwise, in which
+ * case *dest is not touched.
  */
 int
-pmemobj_root_resize(PMEMobjpool *pop, size_t newsize)
+pmemobj_alloc_atomic(PMEMobjpool *pop, PMEMoid *dest, size_t size,
+	unsigned type_num,
+	void (*constructor)(PMEMobjpool *pop, void *ptr, void *arg),
+	void *arg)
 {
-	/* XXX stub */
-	errno = ENOMEM;
-	return -1;
+	LOG(3, "pop %p dest %p size %zu type_num %u", pop, dest, size,
+			type_num);
+
+	if (pmemobj_atomic_check(pop, dest) < 0)
+		return -1;
+
+	if (type_num >= PMEMOBJ_NUM_TYPES) {
+		LOG(1, "invalid type number %u", type_num);
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint64_t off;
+	obj_pmalloc(pop, &off, size, ALLOC_TYPE_FREE);
+	if (off == 0)
+		return -1;	/* pmalloc() set errno, called LOG */
+
+	void *ptr = (char *)pop->addr + off;
+	if (constructor != NULL)
+		(*constructor)(pop, ptr, arg);
+	obj_persist(pop, ptr, size);
+
+	unsigned lane;
+	struct redo *rp = redo_begin(pop, &lane);
+	rp->dest = (dest == NULL) ? 0 : (uint64_t)((char *)dest -
+						(char *)pop->addr);
+	rp->obj = off;
+	rp->type_num = type_num;
+	redo_commit(pop, lane, REDO_ALLOC);
+
+	return 0;
 }
 
 /*
- * pmemobj_tx_begin -- begin a transaction
+ * pmemobj_free_atomic -- free an object and clear the reference to it
+ *
+ * Like pmemobj_alloc_atomic(), but frees the object *dest refers to and
+ * sets *dest to the NULL object, failure-atomically.  Freeing the NULL
+ * object does nothing.
  */
-PMEMtid
-pmemobj_tx_begin(PMEMobjpool *pop, jmp_buf env)
+int
+pmemobj_free_atomic(PMEMobjpool *pop, PMEMoid *dest)
 {
-	struct tx *txp = zalloc(sizeof (*txp));
-	txp->pool = pop;
+	LOG(3, "pop %p dest %p", pop, dest);
 
-	if (env) {
-		txp->valid_env = 1;
-		memcpy((void *)txp->env, (void *)env, sizeof (jmp_buf));
+	if (dest == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	if (Curthread_txinfop == NULL) {
-		struct txinfo *txinfop = zalloc(sizeof (*txinfop));
-		txinfop->txp = txp;
-		Curthread_txinfop = txinfop;
-		txp->next = NULL;
-	} else {
-		txp->next = Curthread_txinfop->txp;
-		Curthread_txinfop->txp = txp;
-	}
+	if (pmemobj_atomic_check(pop, dest) < 0)
+		return -1;
 
-	return (PMEMtid)txp;
+	if (dest->off == 0)
+		return 0;
+
+	unsigned lane;
+	struct redo *rp = redo_begin(pop, &lane);
+	rp->dest = (uint64_t)((char *)dest - (char *)pop->addr);
+	rp->obj = dest->off;
+	redo_commit(pop, lane, REDO_FREE);
+
+	return 0;
 }
 
 /*
- * pmemobj_tx_begin_lock -- begin a transaction, locking a mutex
+ * obj_range_valid -- (internal) true if a range lies within the pool
  */
-PMEMtid
-pmemobj_tx_begin_lock(PMEMobjpool *pop, jmp_buf env, PMEMmutex *mutexp)
+static int
+obj_range_valid(PMEMobjpool *pop, const void *ptr, size_t len)
 {
-	struct tx *txp = (struct tx *)pmemobj_tx_begin(pop, env);
-	pmemobj_mutex_lock(mutexp);
-	txp->mutexp = mutexp;
-	return (PMEMtid)txp;
+	const char *start = (char *)pop->addr + sizeof (struct pool_hdr);
+	const char *end = (char *)pop->addr + pop->size;
+
+	return (const char *)ptr >= start && (const char *)ptr <= end &&
+		len <= end - (const char *)ptr;
 }
 
 /*
- * pmemobj_tx_begin_wrlock -- begin a transaction, write locking an rwlock
+ * pmemobj_persist -- flush a range of the pool
+ *
+ * This is how changes made outside of transactions, such as the ones
+ * done by a constructor, are made durable.
  */
-PMEMtid
-pmemobj_tx_begin_wrlock(PMEMobjpool *pop, jmp_buf env, PMEMrwlock *rwlockp)
+void
+pmemobj_persist(PMEMobjpool *pop, void *addr, size_t len)
 {
-	struct tx *txp = (struct tx *)pmemobj_tx_begin(pop, env);
-	pmemobj_rwlock_wrlock(rwlockp);
-	txp->rwlockp = rwlockp;
-	return (PMEMtid)txp;
+	if (!pop->rdonly)
+		obj_persist(pop, addr, len);
 }
 
+/* the list entry embedded at pe_offset of the object at off */
+#define	LIST_ENTRY(pop, off, pe_offset)\
+	((PMEMlistentry *)((char *)(pop)->addr + (off) + (pe_offset)))
+
 /*
- * pmemobj_tx_commit -- commit transaction, implicit tid
+ * list_check -- (internal) validate the arguments of a list operation
  */
-int
-pmemobj_tx_commit(void)
+static int
+list_check(PMEMobjpool *pop, PMEMlisthead *head, size_t pe_offset,
+	PMEMoid oid)
 {
-	return pmemobj_tx_commit_tid((PMEMtid)Curthread_txinfop->txp);
-}
+	if (pop->rdonly) {
+		LOG(1, "pool is read-only");
+		errno = EROFS;
+		return -1;
+	}
 
-void
-pmemobj_txop_oncommit_alloc(struct tx *txp, union txop_args args)
-{
-}
+	if (!obj_range_valid(pop, head, sizeof (*head))) {
+		LOG(1, "list head %p not in the pool", head);
+		errno = EINVAL;
+		return -1;
+	}
 
-void
-pmemobj_txop_oncommit_free(struct tx *txp, union txop_args args)
-{
-	pfree(&(txp->pool->allocator), args.free.addr);
-}
+	if (oid.off != 0 && !obj_range_valid(pop,
+			LIST_ENTRY(pop, oid.off, pe_offset),
+			sizeof (PMEMlistentry))) {
+		LOG(1, "list entry of 0x%" PRIx64 " not in the pool", oid.off);
+		errno = EINVAL;
+		return -1;
+	}
 
-void
-pmemobj_txop_oncommit_set(struct tx *txp, union txop_args args)
-{
-	pfree(&(txp->pool->allocator), args.set.data);
+	return 0;
 }
 
-pmemobj_txop_onaction_t oncommit_funcs[] = {
-	pmemobj_txop_oncommit_alloc,
-	pmemobj_txop_oncommit_free,
-	pmemobj_txop_oncommit_set
-};
-
-int
-pmemobj_tx_action_tid(PMEMtid tid, pmemobj_txop_onaction_t *actions)
+/*
+ * list_link -- (internal) add the stores linking an object into a list
+ *
+ * The list is circular, the first object's prev is the last object.
+ * The object goes right before or after where, a NULL where stands for
+ * the head of the list if before is set, or for its tail otherwise.
+ * Adds at most five stores to the redo record.
+ */
+static void
+list_link(PMEMobjpool *pop, struct redo *rp, PMEMlisthead *head,
+	size_t pe_offset, uint64_t where, int before, uint64_t off)
 {
-	struct tx *tx = (struct tx *)tid;
-	if (tx->next == NULL) {
-		struct txop *op = tx->tail;
-		for (; op != NULL; op = op->prev) {
-			actions[op->op](tx, op->args);
-		}
-		free(tx);
-		free(Curthread_txinfop);
-		Curthread_txinfop = NULL;
+	PMEMlistentry *ep = LIST_ENTRY(pop, off, pe_offset);
+	uint64_t first = head->first.off;
+
+	if (first == 0) {
+		redo_add(pop, rp, REDO_STORE_OID, &ep->next, off);
+		redo_add(pop, rp, REDO_STORE_OID, &ep->prev, off);
+		redo_add(pop, rp, REDO_STORE_OID, &head->first, off);
+		return;
+	}
+
+	uint64_t prev, next;
+	int becomes_first;
+	if (where == 0) {
+		next = first;
+		prev = LIST_ENTRY(pop, next, pe_offset)->prev.off;
+		becomes_first = before;
+	} else if (before) {
+		next = where;
+		prev = LIST_ENTRY(pop, next, pe_offset)->prev.off;
+		becomes_first = (where == first);
 	} else {
-		tx->head->prev = tx->next->tail;
-		tx->next->tail->next = tx->head;
-		tx->next->tail = tx->tail;
-		Curthread_txinfop->txp = tx->next;
-		free(tx);
+		prev = where;
+		next = LIST_ENTRY(pop, prev, pe_offset)->next.off;
+		becomes_first = 0;
 	}
 
-	return 0;
+	redo_add(pop, rp, REDO_STORE_OID, &ep->next, next);
+	redo_add(pop, rp, REDO_STORE_OID, &ep->prev, prev);
+	redo_add(pop, rp, REDO_STORE_OID,
+			&LIST_ENTRY(pop, prev, pe_offset)->next, off);
+	redo_add(pop, rp, REDO_STORE_OID,
+			&LIST_ENTRY(pop, next, pe_offset)->prev, off);
+	if (becomes_first)
+		redo_add(pop, rp, REDO_STORE_OID, &head->first, off);
 }
 
 /*
- * pmemobj_tx_commit_tid -- commit transaction
+ * list_unlink -- (internal) add the stores taking an object off a list
+ *
+ * Adds at most five stores to the redo record.
  */
-int
-pmemobj_tx_commit_tid(PMEMtid tid)
+static void
+list_unlink(PMEMobjpool *pop, struct redo *rp, PMEMlisthead *head,
+	size_t pe_offset, uint64_t off)
 {
-	return pmemobj_tx_action_tid(tid, oncommit_funcs);
+	PMEMlistentry *ep = LIST_ENTRY(pop, off, pe_offset);
+
+	if (ep->next.off == off) {
+		/* the only object on the list */
+		redo_add(pop, rp, REDO_STORE_OID, &head->first, 0);
+	} else {
+		redo_add(pop, rp, REDO_STORE_OID,
+			&LIST_ENTRY(pop, ep->prev.off, pe_offset)->next,
+			ep->next.off);
+		redo_add(pop, rp, REDO_STORE_OID,
+			&LIST_ENTRY(pop, ep->next.off, pe_offset)->prev,
+			ep->prev.off);
+		if (head->first.off == off)
+			redo_add(pop, rp, REDO_STORE_OID, &head->first,
+					ep->next.off);
+	}
+
+	redo_add(pop, rp, REDO_STORE_OID, &ep->next, 0);
+	redo_add(pop, rp, REDO_STORE_OID, &ep->prev, 0);
 }
 
 /*
- * pmemobj_tx_commit_multi -- commit multiple transactions
+ * pmemobj_list_insert -- link an existing object into a list
  *
- * A list of tids is provided varargs-style, terminated by 0
+ * The object, which must not be on the list already, is linked in
+ * failure-atomically, without a transaction.  Returns 0 on success, -1
+ * and sets errno otherwise.
  */
 int
-pmemobj_tx_commit_multi(PMEMtid tid, ...)
+pmemobj_list_insert(PMEMobjpool *pop, PMEMlisthead *head, size_t pe_offset,
+	PMEMoid where, int before, PMEMoid oid)
 {
+	LOG(3, "pop %p head %p pe_offset %zu where 0x%" PRIx64 " before %d "
+			"oid 0x%" PRIx64, pop, head, pe_offset, where.off,
+			before, oid.off);
+
+	if (oid.off == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (list_check(pop, head, pe_offset, oid) < 0 ||
+			list_check(pop, head, pe_offset, where) < 0)
+		return -1;
+
+	if ((errno = pmemobj_mutex_lock(&head->lock)))
+		return -1;
+
+	unsigned lane;
+	struct redo *rp = redo_begin(pop, &lane);
+	list_link(pop, rp, head, pe_offset, where.off, before, oid.off);
+	redo_commit(pop, lane, REDO_STORE);
+
+	pmemobj_mutex_unlock(&head->lock);
 	return 0;
 }
 
 /*
- * pmemobj_tx_commit_multiv -- commit multiple transactions, on array of tids
+ * pmemobj_list_insert_new -- allocate an object and link it into a list
  *
- * A list of tids is provided as an array, terminated by a 0 entry
+ * Like pmemobj_alloc_atomic(), the object is allocated and constructed
+ * first, the redo record that gives it its type also links it into the
+ * list.  Returns the new object, or the NULL object and sets errno.
  */
-int
-pmemobj_tx_commit_multiv(PMEMtid tids[])
+PMEMoid
+pmemobj_list_insert_new(PMEMobjpool *pop, PMEMlisthead *head,
+	size_t pe_offset, PMEMoid where, int before, size_t size,
+	unsigned type_num,
+	void (*constructor)(PMEMobjpool *pop, void *ptr, void *arg),
+	void *arg)
 {
-	return 0;
-}
+	LOG(3, "pop %p head %p pe_offset %zu where 0x%" PRIx64 " before %d "
+			"size %zu type_num %u", pop, head, pe_offset,
+			where.off, before, size, type_num);
 
-void
-pmemobj_txop_onabort_alloc(struct tx *txp, union txop_args args)
-{
-	pfree(&(txp->pool->allocator), args.alloc.addr);
-}
+	PMEMoid n = { 0 };
 
-void
-pmemobj_txop_onabort_free(struct tx *txp, union txop_args args)
-{
-}
+	if (list_check(pop, head, pe_offset, where) < 0)
+		return n;
 
-void
-pmemobj_txop_onabort_set(struct tx *txp, union txop_args args)
-{
-	uint64_t base = (uint64_t)txp->pool->addr;
-	memcpy(args.set.addr, (void *)(base + args.set.data), args.set.len);
-}
+	if (type_num >= PMEMOBJ_NUM_TYPES ||
+			pe_offset + sizeof (PMEMlistentry) > size) {
+		LOG(1, "invalid type number %u or entry offset %zu",
+				type_num, pe_offset);
+		errno = EINVAL;
+		return n;
+	}
 
-pmemobj_txop_onaction_t onabort_funcs[] = {
-	pmemobj_txop_onabort_alloc,
-	pmemobj_txop_onabort_free,
-	pmemobj_txop_onabort_set
-};
+	uint64_t off;
+	obj_pmalloc(pop, &off, size, ALLOC_TYPE_FREE);
+	if (off == 0)
+		return n;	/* pmalloc() set errno, called LOG */
 
-/*
- * pmemobj_tx_abort -- abort transaction, implicit tid
- */
-int
-pmemobj_tx_abort(int errnum)
-{
-	int status = -1;
-	while (Curthread_txinfop != NULL) {
-		status = pmemobj_tx_abort_tid(
-			(PMEMtid)Curthread_txinfop->txp, errnum);
+	void *ptr = (char *)pop->addr + off;
+	if (constructor != NULL)
+		(*constructor)(pop, ptr, arg);
+	obj_persist(pop, ptr, size);
+
+	if ((errno = pmemobj_mutex_lock(&head->lock))) {
+		obj_pfree(pop, off);
+		return n;
 	}
 
-	return status;
+	unsigned lane;
+	struct redo *rp = redo_begin(pop, &lane);
+	rp->obj = off;
+	rp->type_num = type_num;
+	list_link(pop, rp, head, pe_offset, where.off, before, off);
+	redo_commit(pop, lane, REDO_ALLOC);
+
+	pmemobj_mutex_unlock(&head->lock);
+
+	n.pool = (uint64_t)pop->addr;
+	n.off = off;
+	return n;
 }
 
 /*
- * pmemobj_tx_abort_tid -- abort transaction
+ * pmemobj_list_remove -- unlink an object from a list, optionally free it
+ *
+ * Unlinking and freeing happen in one failure-atomic step.  Returns 0 on
+ * success, -1 and sets errno otherwise.
  */
 int
-pmemobj_tx_abort_tid(PMEMtid tid, int errnum)
+pmemobj_list_remove(PMEMobjpool *pop, PMEMlisthead *head, size_t pe_offset,
+	PMEMoid oid, int freeobj)
 {
-	return pmemobj_tx_action_tid(tid, onabort_funcs);
-}
+	LOG(3, "pop %p head %p pe_offset %zu oid 0x%" PRIx64 " free %d",
+			pop, head, pe_offset, oid.off, freeobj);
 
-static struct txop *
-pmemobj_log_prepare_alloc(uint64_t **addrpp)
-{
-	struct txop *txop = zalloc(sizeof (struct txop));
-	txop->args.alloc.addr = 0;
-	txop->op = TXOP_ALLOC;
-	*addrpp = &(txop->args.alloc.addr);
-	return txop;
-}
+	if (oid.off == 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-static struct txop *
-pmemobj_log_prepare_free(uint64_t addr)
-{
-	struct txop *txop = zalloc(sizeof (struct txop));
-	txop->args.free.addr = addr;
-	txop->op = TXOP_FREE;
-	return txop;
-}
+	if (list_check(pop, head, pe_offset, oid) < 0)
+		return -1;
+
+	if ((errno = pmemobj_mutex_lock(&head->lock)))
+		return -1;
 
-static struct txop *
-pmemobj_log_prepare_set(void *addr, uint64_t data, size_t len)
-{
-	struct txop *txop = zalloc(sizeof (struct txop));
-	txop->args.set.addr = addr;
-	txop->args.set.data = data;
-	txop->args.set.len = len;
-	txop->op = TXOP_SET;
-	return txop;
-}
+	if (LIST_ENTRY(pop, oid.off, pe_offset)->next.off == 0) {
+		LOG(1, "object 0x%" PRIx64 " is not on a list", oid.off);
+		pmemobj_mutex_unlock(&head->lock);
+		errno = EINVAL;
+		return -1;
+	}
 
-static void
-pmemobj_log_add(PMEMtid tid, struct txop *txop)
-{
-	struct tx *tx = (struct tx *)tid;
-	if (tx->head == NULL) {
-		tx->head = txop;
+	unsigned lane;
+	struct redo *rp = redo_begin(pop, &lane);
+	list_unlink(pop, rp, head, pe_offset, oid.off);
+	if (freeobj) {
+		rp->obj = oid.off;
+		redo_commit(pop, lane, REDO_FREE);
 	} else {
-		tx->tail->next = txop;
-		txop->prev = tx->tail;
+		redo_commit(pop, lane, REDO_STORE);
 	}
-	tx->tail = txop;
+
+	pmemobj_mutex_unlock(&head->lock);
+	return 0;
 }
 
-static void
-pmemobj_log_add_alloc(PMEMtid tid, uint64_t **addrpp)
+/*
+ * pmemobj_list_first -- return the first object on a list
+ */
+PMEMoid
+pmemobj_list_first(PMEMobjpool *pop, PMEMlisthead *head)
 {
-	struct txop *txop = pmemobj_log_prepare_alloc(addrpp);
-	if (txop) {
-		pmemobj_log_add(tid, txop);
-	}
+	PMEMoid n = { 0 };
+
+	if ((n.off = head->first.off) != 0)
+		n.pool = (uint64_t)pop->addr;
+	return n;
 }
 
-static void
-pmemobj_log_add_free(PMEMtid tid, uint64_t addr)
+/*
+ * pmemobj_list_next -- return the object following oid on a list
+ *
+ * Returns the NULL object at the end of the list.
+ */
+PMEMoid
+pmemobj_list_next(PMEMobjpool *pop, PMEMlisthead *head, size_t pe_offset,
+	PMEMoid oid)
 {
-	struct txop *txop = pmemobj_log_prepare_free(addr);
-	if (txop) {
-		pmemobj_log_add(tid, txop);
+	PMEMoid n = { 0 };
+
+	if (oid.off == 0)
+		return n;
+
+	uint64_t next = LIST_ENTRY(pop, oid.off, pe_offset)->next.off;
+	if (next != 0 && next != head->first.off) {
+		n.pool = (uint64_t)pop->addr;
+		n.off = next;
 	}
+	return n;
 }
 
-static void
-pmemobj_log_add_set(PMEMtid tid, void *addr, uint64_t data, size_t len)
+#define	MAP_BUCKETS(pop, off) ((uint64_t *)((char *)(pop)->addr + (off)))
+#define	MAP_ENTRY(pop, off)\
+	((struct obj_map_entry *)((char *)(pop)->addr + (off)))
+
+/*
+ * map_hash -- (internal) scramble a key
+ */
+static uint64_t
+map_hash(uint64_t key)
 {
-	struct txop *txop = pmemobj_log_prepare_set(addr, data, len);
-	if (txop) {
-		pmemobj_log_add(tid, txop);
-	}
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
 }
 
 /*
- * pmemobj_alloc -- transactional allocate, implicit tid
+ * map_get -- (internal) validate a map OID and return the map
+ *
+ * With write set, a read-only pool is refused.
  */
-PMEMoid
-pmemobj_alloc(size_t size)
+static struct obj_map *
+map_get(PMEMobjpool *pop, PMEMoid map, int write)
 {
-	return pmemobj_alloc_tid((PMEMtid)Curthread_txinfop->txp, size);
+	if (write && pop->rdonly) {
+		LOG(1, "pool is read-only");
+		errno = EROFS;
+		return NULL;
+	}
+
+	struct obj_map *mp = (void *)((char *)pop->addr + map.off);
+	if (map.off == 0 || !obj_range_valid(pop, mp, sizeof (*mp))) {
+		LOG(1, "bad map 0x%" PRIx64, map.off);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return mp;
 }
 
 /*
- * pmemobj_zalloc -- transactional allocate, zeroed, implicit tid
+ * map_find -- (internal) look a key up in one bucket array
+ *
+ * Returns the offset of the entry, or 0 if the key is not there.  If
+ * linkp is not NULL, the address of the word referring to the entry
+ * (a bucket or the next field of the previous entry) is stored there.
  */
-PMEMoid
-pmemobj_zalloc(size_t size)
+static uint64_t
+map_find(PMEMobjpool *pop, uint64_t buckets, uint64_t nbuckets,
+	uint64_t key, uint64_t **linkp)
 {
-	return pmemobj_zalloc_tid((PMEMtid)Curthread_txinfop->txp, size);
+	uint64_t *link = &MAP_BUCKETS(pop, buckets)[map_hash(key) &
+							(nbuckets - 1)];
+
+	while (*link != 0) {
+		struct obj_map_entry *ep = MAP_ENTRY(pop, *link);
+		if (ep->key == key)
+			break;
+		link = &ep->next;
+	}
+
+	if (linkp != NULL)
+		*linkp = link;
+	return *link;
 }
 
 /*
- * pmemobj_realloc -- transactional realloc, implicit tid
+ * map_buckets_alloc -- (internal) allocate an empty bucket array
  */
-PMEMoid
-pmemobj_realloc(PMEMoid oid, size_t size)
+static uint64_t
+map_buckets_alloc(PMEMobjpool *pop, uint64_t nbuckets)
 {
-	return pmemobj_realloc_tid((PMEMtid)Curthread_txinfop->txp, oid, size);
+	uint64_t off;
+	size_t size = nbuckets * sizeof (uint64_t);
+
+	obj_pmalloc(pop, &off, size, OBJ_TYPE_INTERNAL);
+	if (off == 0)
+		return 0;	/* pmalloc() set errno, called LOG */
+
+	memset((char *)pop->addr + off, 0, size);
+	obj_persist(pop, (char *)pop->addr + off, size);
+	return off;
 }
 
 /*
- * pmemobj_aligned_alloc -- transactional alloc of aligned memory, implicit tid
+ * map_move -- (internal) move all entries to the new bucket array
+ *
+ * Called with the resize lock held for writing.  Every entry is moved by
+ * its own redo operation, the switch to the new array is the last one,
+ * so this also finishes a resize that was cut short by a crash.
  */
-PMEMoid
-pmemobj_aligned_alloc(size_t alignment, size_t size)
+static void
+map_move(PMEMobjpool *pop, struct obj_map *mp)
 {
-	return pmemobj_aligned_alloc_tid((PMEMtid)Curthread_txinfop->txp,
-							alignment, size);
+	uint64_t *old = MAP_BUCKETS(pop, mp->buckets);
+	uint64_t *new = MAP_BUCKETS(pop, mp->new_buckets);
+	uint64_t mask = mp->new_nbuckets - 1;
+	unsigned lane;
+
+	for (uint64_t i = 0; i < mp->nbuckets; i++) {
+		while (old[i] != 0) {
+			uint64_t off = old[i];
+			struct obj_map_entry *ep = MAP_ENTRY(pop, off);
+			uint64_t *dst = &new[map_hash(ep->key) & mask];
+
+			struct redo *rp = redo_begin(pop, &lane);
+			redo_add(pop, rp, REDO_STORE_WORD, &old[i], ep->next);
+			redo_add(pop, rp, REDO_STORE_WORD, &ep->next, *dst);
+			redo_add(pop, rp, REDO_STORE_WORD, dst, off);
+			redo_commit(pop, lane, REDO_STORE);
+		}
+	}
+
+	/* a bucket maps to the same lock stripe in both arrays */
+	struct redo *rp = redo_begin(pop, &lane);
+	rp->obj = mp->buckets;
+	redo_add(pop, rp, REDO_STORE_WORD, &mp->buckets, mp->new_buckets);
+	redo_add(pop, rp, REDO_STORE_WORD, &mp->nbuckets, mp->new_nbuckets);
+	redo_add(pop, rp, REDO_STORE_WORD, &mp->new_buckets, 0);
+	redo_add(pop, rp, REDO_STORE_WORD, &mp->new_nbuckets, 0);
+	redo_commit(pop, lane, REDO_FREE);
 }
 
 /*
- * pmemobj_strdup -- transactional strdup of non-pmem string, implicit tid
+ * map_overloaded -- (internal) true if the map holds too many entries
+ *
+ * Without the resize lock held for writing the counts may be changing,
+ * which only makes the answer a little early or late.
  */
-PMEMoid
-pmemobj_strdup(const char *s)
+static int
+map_overloaded(struct obj_map *mp)
 {
-	return pmemobj_strdup_tid((PMEMtid)Curthread_txinfop->txp, s);
+	uint64_t count = 0;
+	for (unsigned i = 0; i < OBJ_MAP_NLOCKS; i++)
+		count += mp->counts[i];
+
+	return count > mp->nbuckets * OBJ_MAP_LOAD;
 }
 
 /*
- * pmemobj_free -- transactional free, implicit tid
+ * map_resize -- (internal) double the number of buckets if still needed
+ *
+ * Called with the resize lock held for writing.
  */
-int
-pmemobj_free(PMEMoid oid)
+static void
+map_resize(PMEMobjpool *pop, struct obj_map *mp)
 {
-	return pmemobj_free_tid((PMEMtid)Curthread_txinfop->txp, oid);
+	if (mp->new_buckets == 0) {
+		if (!map_overloaded(mp))
+			return;	/* another thread got here first */
+
+		uint64_t nbuckets = mp->nbuckets * 2;
+		uint64_t off = map_buckets_alloc(pop, nbuckets);
+		if (off == 0) {
+			LOG(1, "cannot grow map to %" PRIu64 " buckets",
+					nbuckets);
+			return;	/* the map just gets slower */
+		}
+
+		unsigned lane;
+		struct redo *rp = redo_begin(pop, &lane);
+		redo_add(pop, rp, REDO_STORE_WORD, &mp->new_nbuckets, nbuckets);
+		redo_add(pop, rp, REDO_STORE_WORD, &mp->new_buckets, off);
+		redo_commit(pop, lane, REDO_STORE);
+	}
+
+	LOG(3, "map %p: %" PRIu64 " -> %" PRIu64 " buckets", mp,
+			mp->nbuckets, mp->new_nbuckets);
+	map_move(pop, mp);
 }
 
 /*
- * pmemobj_size -- return the current size of an object
+ * map_lock_read -- (internal) lock a map for a change of a single bucket
  *
- * No lock or transaction is required for this call, but of course
- * if the object is not protected by some sort of locking, another
- * thread may change the size before the caller uses the return value.
+ * A resize cut short by a crash is finished first.
  */
-size_t
-pmemobj_size(PMEMoid oid)
+static int
+map_lock_read(struct obj_map *mp, PMEMobjpool *pop)
 {
-	return 0;
+	for (;;) {
+		if ((errno = pmemobj_rwlock_rdlock(&mp->resize_lock)))
+			return -1;
+		if (mp->new_buckets == 0)
+			return 0;
+
+		pmemobj_rwlock_unlock(&mp->resize_lock);
+		if ((errno = pmemobj_rwlock_wrlock(&mp->resize_lock)))
+			return -1;
+		if (mp->new_buckets != 0)
+			map_move(pop, mp);
+		pmemobj_rwlock_unlock(&mp->resize_lock);
+	}
 }
 
 /*
- * pmemobj_alloc_tid -- transactional allocate
+ * pmemobj_map_create -- allocate an empty hash map
+ *
+ * The map is published at *dest failure-atomically, like an object
+ * allocated by pmemobj_alloc_atomic().  nbuckets is only a hint, the map
+ * grows as needed.  Returns 0 on success, -1 and sets errno otherwise.
  */
-PMEMoid
-pmemobj_alloc_tid(PMEMtid tid, size_t size)
+int
+pmemobj_map_create(PMEMobjpool *pop, PMEMoid *dest, size_t nbuckets)
 {
-	struct tx *tx = (struct tx *)tid;
-	PMEMoid n = { 0 };
-	uint64_t *ptrp;
+	LOG(3, "pop %p dest %p nbuckets %zu", pop, dest, nbuckets);
 
-	n.pool = (uint64_t)tx->pool->addr;
-	pmemobj_log_add_alloc(tid, &ptrp);
-	pmalloc(&(tx->pool->allocator), ptrp, size);
-	n.off = *ptrp;
-	return n;
+	if (dest == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pmemobj_atomic_check(pop, dest) < 0)
+		return -1;
+
+	uint64_t n = OBJ_MAP_MIN_BUCKETS;
+	while (n < nbuckets)
+		n *= 2;
+
+	uint64_t off;
+	obj_pmalloc(pop, &off, sizeof (struct obj_map),
+			ALLOC_TYPE_FREE);
+	if (off == 0)
+		return -1;	/* pmalloc() set errno, called LOG */
+
+	struct obj_map *mp = (void *)((char *)pop->addr + off);
+	memset(mp, 0, sizeof (*mp));
+	if ((mp->buckets = map_buckets_alloc(pop, n)) == 0) {
+		int oerrno = errno;
+		obj_pfree(pop, off);
+		errno = oerrno;
+		return -1;
+	}
+	mp->nbuckets = n;
+	obj_persist(pop, mp, sizeof (*mp));
+
+	unsigned lane;
+	struct redo *rp = redo_begin(pop, &lane);
+	rp->dest = (uint64_t)((char *)dest - (char *)pop->addr);
+	rp->obj = off;
+	rp->type_num = OBJ_TYPE_INTERNAL;
+	redo_commit(pop, lane, REDO_ALLOC);
+
+	return 0;
 }
 
 /*
- * pmemobj_zalloc_tid -- transactional allocate, zeroed
+ * pmemobj_map_destroy -- free a hash map and set *dest to the NULL object
+ *
+ * The objects the map refers to are not freed.  A crash leaves the map
+ * with some of its keys removed, or gone with its bucket array leaked.
  */
-PMEMoid
-pmemobj_zalloc_tid(PMEMtid tid, size_t size)
+int
+pmemobj_map_destroy(PMEMobjpool *pop, PMEMoid *dest)
 {
-	struct tx *tx = (struct tx *)tid;
-	PMEMoid n = { 0 };
-	uint64_t *ptrp;
+	LOG(3, "pop %p dest %p", pop, dest);
 
-	n.pool = (uint64_t)tx->pool->addr;
-	pmemobj_log_add_alloc(tid, &ptrp);
-	pmalloc(&(tx->pool->allocator), ptrp, size);
-	n.off = *ptrp;
-	memset((void *)(n.pool + n.off), 0, size);
-	return n;
+	if (dest == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pmemobj_atomic_check(pop, dest) < 0)
+		return -1;
+
+	if (dest->off == 0)
+		return 0;
+
+	struct obj_map *mp = map_get(pop, *dest, 1);
+	if (mp == NULL)
+		return -1;
+
+	if ((errno = pmemobj_rwlock_wrlock(&mp->resize_lock)))
+		return -1;
+
+	if (mp->new_buckets != 0)
+		map_move(pop, mp);
+
+	uint64_t *buckets = MAP_BUCKETS(pop, mp->buckets);
+	unsigned lane;
+	for (uint64_t i = 0; i < mp->nbuckets; i++) {
+		uint64_t *countp = &mp->counts[i % OBJ_MAP_NLOCKS];
+		while (buckets[i] != 0) {
+			struct redo *rp = redo_begin(pop, &lane);
+			rp->obj = buckets[i];
+			redo_add(pop, rp, REDO_STORE_WORD, &buckets[i],
+					MAP_ENTRY(pop, buckets[i])->next);
+			redo_add(pop, rp, REDO_STORE_WORD, countp, *countp - 1);
+			redo_commit(pop, lane, REDO_FREE);
+		}
+	}
+
+	uint64_t bucketsoff = mp->buckets;
+	pmemobj_rwlock_unlock(&mp->resize_lock);
+
+	struct redo *rp = redo_begin(pop, &lane);
+	rp->dest = (uint64_t)((char *)dest - (char *)pop->addr);
+	rp->obj = dest->off;
+	redo_commit(pop, lane, REDO_FREE);
+
+	obj_retire(pop, bucketsoff);
+	return 0;
 }
 
 /*
- * pmemobj_realloc_tid -- transactional realloc
+ * pmemobj_map_insert -- map key to value, replacing any previous value
+ *
+ * Inserting a new key allocates its entry and links it in with one redo
+ * operation, no transaction is involved.  Inserts and removals of keys
+ * in different lock stripes run concurrently.  Returns 0 on success, -1
+ * and sets errno otherwise.
  */
-PMEMoid
-pmemobj_realloc_tid(PMEMtid tid, PMEMoid oid, size_t size)
+int
+pmemobj_map_insert(PMEMobjpool *pop, PMEMoid map, uint64_t key,
+	PMEMoid value)
 {
-	PMEMoid n = { 0 };
+	LOG(4, "pop %p map 0x%" PRIx64 " key 0x%" PRIx64, pop, map.off, key);
 
-	return n;
+	struct obj_map *mp = map_get(pop, map, 1);
+	if (mp == NULL || map_lock_read(mp, pop) < 0)
+		return -1;
+
+	uint64_t b = map_hash(key) & (mp->nbuckets - 1);
+	unsigned stripe = b % OBJ_MAP_NLOCKS;
+	if ((errno = pmemobj_mutex_lock(&mp->locks[stripe]))) {
+		pmemobj_rwlock_unlock(&mp->resize_lock);
+		return -1;
+	}
+
+	int ret = 0;
+	int grow = 0;
+	unsigned lane;
+	uint64_t off = map_find(pop, mp->buckets, mp->nbuckets, key, NULL);
+	if (off != 0) {
+		struct redo *rp = redo_begin(pop, &lane);
+		redo_add(pop, rp, REDO_STORE_OID,
+				&MAP_ENTRY(pop, off)->value, value.off);
+		redo_commit(pop, lane, REDO_STORE);
+	} else {
+		obj_pmalloc(pop, &off, sizeof (struct obj_map_entry),
+				ALLOC_TYPE_FREE);
+		if (off == 0) {
+			ret = -1;	/* pmalloc() set errno, called LOG */
+			goto out;
+		}
+
+		uint64_t *bucket = &MAP_BUCKETS(pop, mp->buckets)[b];
+		struct obj_map_entry *ep = MAP_ENTRY(pop, off);
+		ep->next = *bucket;
+		ep->key = key;
+		ep->value.pool = value.off ? (uint64_t)pop->addr : 0;
+		ep->value.off = value.off;
+		obj_persist(pop, ep, sizeof (*ep));
+
+		uint64_t *countp = &mp->counts[stripe];
+		struct redo *rp = redo_begin(pop, &lane);
+		rp->obj = off;
+		rp->type_num = OBJ_TYPE_INTERNAL;
+		redo_add(pop, rp, REDO_STORE_WORD, bucket, off);
+		redo_add(pop, rp, REDO_STORE_WORD, countp, *countp + 1);
+		redo_commit(pop, lane, REDO_ALLOC);
+
+		/*
+		 * A full stripe only makes the whole map worth a look, the
+		 * decision is the same one map_resize() makes.
+		 */
+		grow = *countp > mp->nbuckets / OBJ_MAP_NLOCKS * OBJ_MAP_LOAD &&
+				map_overloaded(mp);
+	}
+
+out:
+	pmemobj_mutex_unlock(&mp->locks[stripe]);
+	pmemobj_rwlock_unlock(&mp->resize_lock);
+
+	if (grow && pmemobj_rwlock_wrlock(&mp->resize_lock) == 0) {
+		map_resize(pop, mp);
+		pmemobj_rwlock_unlock(&mp->resize_lock);
+	}
+
+	return ret;
 }
 
 /*
- * pmemobj_aligned_alloc -- transactional alloc of aligned memory
+ * pmemobj_map_get -- return the value key maps to
+ *
+ * Returns the NULL object if the key is not in the map.
  */
 PMEMoid
-pmemobj_aligned_alloc_tid(PMEMtid tid, size_t alignment, size_t size)
+pmemobj_map_get(PMEMobjpool *pop, PMEMoid map, uint64_t key)
 {
 	PMEMoid n = { 0 };
 
+	struct obj_map *mp = map_get(pop, map, 0);
+	if (mp == NULL || (errno = pmemobj_rwlock_rdlock(&mp->resize_lock)))
+		return n;
+
+	uint64_t b = map_hash(key) & (mp->nbuckets - 1);
+	PMEMmutex *lockp = &mp->locks[b % OBJ_MAP_NLOCKS];
+	pmemobj_mutex_lock(lockp);
+
+	uint64_t off = map_find(pop, mp->buckets, mp->nbuckets, key, NULL);
+	if (off == 0 && mp->new_buckets != 0)	/* an unfinished resize */
+		off = map_find(pop, mp->new_buckets, mp->new_nbuckets, key,
+				NULL);
+	if (off != 0 && (n.off = MAP_ENTRY(pop, off)->value.off) != 0)
+		n.pool = (uint64_t)pop->addr;
+
+	pmemobj_mutex_unlock(lockp);
+	pmemobj_rwlock_unlock(&mp->resize_lock);
+
 	return n;
 }
 
 /*
- * pmemobj_strdup_tid -- transactional strdup of non-pmem string
+ * pmemobj_map_remove -- remove a key from a map
+ *
+ * The entry is unlinked and freed with one redo operation.  Returns the
+ * value the key mapped to, the NULL object if the key was not in the
+ * map.
  */
 PMEMoid
-pmemobj_strdup_tid(PMEMtid tid, const char *s)
+pmemobj_map_remove(PMEMobjpool *pop, PMEMoid map, uint64_t key)
 {
-	struct tx *tx = (struct tx *)tid;
-	size_t size = strlen(s) + 1;
+	LOG(4, "pop %p map 0x%" PRIx64 " key 0x%" PRIx64, pop, map.off, key);
+
 	PMEMoid n = { 0 };
-	uint64_t *ptrp;
 
-	n.pool = (uint64_t)tx->pool->addr;
-	pmemobj_log_add_alloc(tid, &ptrp);
-	pmalloc(&(tx->pool->allocator), ptrp, size);
-	n.off = *ptrp;
-	strncpy((char *)(n.pool + n.off), s, size);
+	struct obj_map *mp = map_get(pop, map, 1);
+	if (mp == NULL || map_lock_read(mp, pop) < 0)
+		return n;
+
+	uint64_t b = map_hash(key) & (mp->nbuckets - 1);
+	unsigned stripe = b % OBJ_MAP_NLOCKS;
+	if ((errno = pmemobj_mutex_lock(&mp->locks[stripe]))) {
+		pmemobj_rwlock_unlock(&mp->resize_lock);
+		return n;
+	}
+
+	uint64_t *link;
+	uint64_t off = map_find(pop, mp->buckets, mp->nbuckets, key, &link);
+	if (off != 0) {
+		struct obj_map_entry *ep = MAP_ENTRY(pop, off);
+		if ((n.off = ep->value.off) != 0)
+			n.pool = (uint64_t)pop->addr;
+
+		uint64_t *countp = &mp->counts[stripe];
+		unsigned lane;
+		struct redo *rp = redo_begin(pop, &lane);
+		rp->obj = off;
+		redo_add(pop, rp, REDO_STORE_WORD, link, ep->next);
+		redo_add(pop, rp, REDO_STORE_WORD, countp, *countp - 1);
+		redo_commit(pop, lane, REDO_FREE);
+	}
+
+	pmemobj_mutex_unlock(&mp->locks[stripe]);
+	pmemobj_rwlock_unlock(&mp->resize_lock);
+
 	return n;
 }
 
 /*
- * pmemobj_free_tid -- transactional free
+ * pmemobj_map_count -- return the number of keys in a map
+ *
+ * Keys inserted or removed concurrently may or may not be counted.
  */
-int
-pmemobj_free_tid(PMEMtid tid, PMEMoid oid)
+size_t
+pmemobj_map_count(PMEMobjpool *pop, PMEMoid map)
 {
-	pmemobj_log_add_free(tid, oid.off);
-	return 0;
+	struct obj_map *mp = map_get(pop, map, 0);
+	if (mp == NULL)
+		return 0;
+
+	uint64_t count = 0;
+	for (unsigned i = 0; i < OBJ_MAP_NLOCKS; i++)
+		count += mp->counts[i];
+	return count;
 }
 
 /*
@@ -1128,6 +4130,63 @@ pmemobj_nulloid(PMEMoid oid)
 	return (oid.off == 0);
 }
 
+/*
+ * pmemobj_type_num -- return the type number an object was allocated with
+ */
+unsigned
+pmemobj_type_num(PMEMoid oid)
+{
+	if (oid.off == 0)
+		return PMEMOBJ_NUM_TYPES;
+
+	return ((struct alloc_hdr *)(oid.pool + oid.off) - 1)->type_num;
+}
+
+/*
+ * pmemobj_first -- return the first object of the given type
+ *
+ * Returns the NULL object if the pool holds no object of that type.
+ * Objects allocated or freed by other threads while iterating may or may
+ * not be visited.
+ */
+PMEMoid
+pmemobj_first(PMEMobjpool *pop, unsigned type_num)
+{
+	LOG(3, "pop %p type_num %u", pop, type_num);
+
+	PMEMoid n = { 0 };
+
+	if (type_num >= PMEMOBJ_NUM_TYPES) {
+		LOG(1, "invalid type number %u", type_num);
+		errno = EINVAL;
+		return n;
+	}
+
+	if ((n.off = allocator_first(&pop->allocator, type_num)) != 0)
+		n.pool = (uint64_t)pop->addr;
+	return n;
+}
+
+/*
+ * pmemobj_next -- return the object of the same type following oid
+ *
+ * Returns the NULL object at the end of the pool.
+ */
+PMEMoid
+pmemobj_next(PMEMoid oid)
+{
+	PMEMoid n = { 0 };
+
+	if (oid.off == 0)
+		return n;
+
+	/* the pool starts with the pool descriptor */
+	PMEMobjpool *pop = (PMEMobjpool *)oid.pool;
+	if ((n.off = allocator_next(&pop->allocator, oid.off)) != 0)
+		n.pool = oid.pool;
+	return n;
+}
+
 /*
  * pmemobj_memcpy -- change a range, making undo log entries, implicit tid
  */
@@ -1138,25 +4197,98 @@ pmemobj_memcpy(void *dstp, void *srcp, size_t size)
 								srcp, size);
 }
 
+/*
+ * memcpy_extent -- (internal) change a large range, piece by piece
+ *
+ * Each piece is copied to the lane's undo extents and logged before it
+ * is changed, so the undo copies are streamed with one fence per piece
+ * and never need an allocation of the size of the whole range.
+ */
+static int
+memcpy_extent(struct tx *tx, char *dst, const char *src, size_t size)
+{
+	PMEMobjpool *pop = tx->pool;
+	uint64_t base = (uint64_t)pop->addr;
+
+	while (size > 0) {
+		size_t len = size;
+		char *copy = txlog_extent_reserve(pop, tx->lane, &len);
+		if (copy == NULL)
+			return tx_error((PMEMtid)tx, ENOMEM);
+
+		obj_memcpy_persist(pop, copy, dst, len);
+		if (txlog_append(pop, tx->lane, TXOP_SET_EXTENT,
+				(uint64_t)dst - base, (uint64_t)copy - base,
+				len) < 0)
+			return tx_error((PMEMtid)tx, ENOMEM);
+		pmemobj_log_add_set((PMEMtid)tx, TXOP_SET_EXTENT, dst,
+				(uint64_t)copy - base, len);
+		memcpy(dst, src, len);
+
+		dst += len;
+		src += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
 /*
  * pmemobj_memcpy_tid -- change a range, making undo log entries
+ *
+ * Fails with EFBIG if the transaction would copy more than the pool's
+ * undo limit, see pmemobj_tx_set_undo_limit().
  */
 int
 pmemobj_memcpy_tid(PMEMtid tid, void *dstp, void *srcp, size_t size)
 {
 	struct tx *tx = (struct tx *)tid;
+	struct lane *lp = &tx->pool->lanes[tx->lane];
 	uint64_t base, *oldp;
 
-	pmemobj_log_add_alloc(tid, &oldp);
-	pmalloc(&(tx->pool->allocator), oldp, size);
+	if (tx->pool->undo_limit != 0 &&
+			lp->undo_bytes + size > tx->pool->undo_limit) {
+		LOG(1, "undo limit of %zu bytes exceeded",
+				tx->pool->undo_limit);
+		return tx_error(tid, EFBIG);
+	}
+	lp->undo_bytes += size;
+
+	if (tx->pool->stats != NULL)
+		stats_add(tx->pool->stats, OBJ_STAT_UNDO_BYTES, size);
+
+	if (size >= TXLOG_EXTENT_MIN)
+		return memcpy_extent(tx, dstp, srcp, size);
+
+	/* the undo copy is flushed here, not again on commit */
+	pmemobj_log_add_alloc(tid, &oldp, 0);
+	if ((*oldp = txlog_alloc(tx->pool, tx->lane, size,
+			OBJ_TYPE_INTERNAL)) == 0)
+		return tx_error(tid, ENOMEM);
 
 	base = (uint64_t)tx->pool->addr;
-	memcpy((void *)(base + *oldp), dstp, size);
-	pmemobj_log_add_set(tid, dstp, *oldp, size);
+	obj_memcpy_persist(tx->pool, (void *)(base + *oldp), dstp, size);
+	if (txlog_append(tx->pool, tx->lane, TXOP_SET,
+			(uint64_t)dstp - base, *oldp, size) < 0)
+		return tx_error(tid, ENOMEM);
+	pmemobj_log_add_set(tid, TXOP_SET, dstp, *oldp, size);
 	memcpy(dstp, srcp, size);
 	return 0;
 }
 
+/*
+ * pmemobj_tx_set_undo_limit -- bound the undo copied by each transaction
+ *
+ * A limit of zero, the default, means no limit.
+ */
+void
+pmemobj_tx_set_undo_limit(PMEMobjpool *pop, size_t limit)
+{
+	LOG(3, "pop %p limit %zu", pop, limit);
+
+	pop->undo_limit = limit;
+}
+
 void pmem_assign_void(void *lval, void *rval) {
 	PMEMOBJ_SET(lval, rval);
 }
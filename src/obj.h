@@ -36,11 +36,157 @@
 
 /* attributes of the obj memory pool format for the pool header */
 #define	OBJ_HDR_SIG "OBJPOOL"	/* must be 8 bytes including '\0' */
-#define	OBJ_FORMAT_MAJOR 1
+#define	OBJ_FORMAT_MAJOR 8
 #define	OBJ_FORMAT_COMPAT 0x0000
-#define	OBJ_FORMAT_INCOMPAT 0x0000
+#define	OBJ_FORMAT_INCOMPAT POOL_FEAT_CRC32C	/* all understood */
 #define	OBJ_FORMAT_RO_COMPAT 0x0000
 
+#define	OBJ_NLANES 64		/* transactions that can run concurrently */
+#define	TXLOG_NENTRIES 63	/* undo log entries per log chunk */
+
+/* one record of a lane's undo log */
+struct txlog_entry {
+	uint64_t type;		/* TXOP_ALLOC, TXOP_FREE, TXOP_SET[_EXTENT] */
+	uint64_t off;		/* object or destination offset */
+	uint64_t data;		/* undo copy offset, TXOP_FREE: old type */
+	uint64_t len;		/* length of the undo copy */
+};
+
+/*
+ * a chunk of a lane's undo log
+ *
+ * Chunks are allocated from the pool the first time a lane needs them and
+ * kept chained to the lane for reuse.  Only the entries a chunk's
+ * nentries covers are valid and a chunk is only looked at when the one
+ * before it is full, so clearing the first chunk's nentries discards the
+ * whole log with a single 8-byte store.
+ */
+struct txlog {
+	uint64_t next;		/* offset of the next chunk, 0 if none */
+	uint64_t nentries;	/* valid entries in this chunk */
+	uint64_t unused[2];
+	struct txlog_entry entries[TXLOG_NENTRIES];
+};
+
+#define	TXLOG_EXTENT_SIZE (1 << 20)	/* bytes of undo copies per extent */
+#define	TXLOG_EXTENT_MIN (64 << 10)	/* smallest range put in extents */
+#define	TXLOG_EXTENT_KEEP 8	/* extents a lane keeps for reuse */
+
+/*
+ * an extent of a lane's undo copies
+ *
+ * Ranges of TXLOG_EXTENT_MIN bytes or more do not get an undo copy of
+ * their own, they are streamed into extents chained to the lane, one
+ * TXOP_SET_EXTENT entry per piece.  The extents are kept for reuse like
+ * the log chunks, up to TXLOG_EXTENT_KEEP of them, so a large range
+ * neither takes a huge allocation nor leaves an undo copy behind to be
+ * freed.
+ */
+struct txlog_extent {
+	uint64_t next;		/* offset of the next extent, 0 if none */
+	uint64_t unused[3];
+	char data[TXLOG_EXTENT_SIZE];
+};
+
+#define	REDO_NONE 0		/* no atomic operation in progress */
+#define	REDO_ALLOC 1		/* publish a new object */
+#define	REDO_FREE 2		/* unpublish and free an object */
+#define	REDO_STORE 3		/* only carry out the stores */
+
+#define	REDO_NSTORES 6		/* stores a redo record can carry */
+
+#define	REDO_STORE_WORD 0	/* store value to the 8-byte word at dest */
+#define	REDO_STORE_OID 1	/* make the PMEMoid at dest refer to value */
+
+/* one store of a redo record */
+struct redo_store {
+	uint64_t kind;		/* REDO_STORE_WORD or REDO_STORE_OID */
+	uint64_t dest;		/* offset of the word or PMEMoid to update */
+	uint64_t value;		/* new word, or offset of the object */
+};
+
+/*
+ * redo record of an atomic operation, one per lane
+ *
+ * The record is filled in and flushed with op set to REDO_NONE, setting
+ * op commits the operation, which is then applied and op cleared again.
+ * A record found with op set when the pool is opened is applied again.
+ * Besides allocating or freeing one object, an operation can update up
+ * to REDO_NSTORES words or OIDs, which is what the persistent lists and
+ * hash maps are built on.  An allocation can also free the object it
+ * replaces, which is how the root object is relocated.
+ */
+struct redo {
+	uint64_t op;		/* REDO_NONE or the operation committed */
+	uint64_t dest;		/* offset of the PMEMoid to update, or 0 */
+	uint64_t obj;		/* offset of the object */
+	uint64_t type_num;	/* type of the new object (REDO_ALLOC) */
+	uint64_t nstores;	/* valid entries of stores */
+	uint64_t old;		/* object freed by a REDO_ALLOC, or 0 */
+	uint64_t unused[2];
+	struct redo_store stores[REDO_NSTORES];
+};
+
+#define	OBJ_MAP_NLOCKS 64	/* lock stripes of a hash map */
+#define	OBJ_MAP_MIN_BUCKETS OBJ_MAP_NLOCKS
+#define	OBJ_MAP_LOAD 2		/* entries per bucket that trigger a resize */
+
+/*
+ * hash map, lives in the pool
+ *
+ * Buckets are chains of struct obj_map_entry, bucket b is protected by
+ * lock b % OBJ_MAP_NLOCKS, which also protects the matching entry count.
+ * Resizing holds resize_lock for writing and moves entries to the new
+ * bucket array one at a time, each move a single redo operation, so
+ * after a crash every entry is in exactly one of the arrays and the next
+ * change of the map finishes the job.
+ */
+struct obj_map {
+	PMEMrwlock resize_lock;	/* held for reading by all other users */
+	PMEMmutex locks[OBJ_MAP_NLOCKS];
+	uint64_t counts[OBJ_MAP_NLOCKS];	/* entries of each stripe */
+	uint64_t buckets;	/* offset of the bucket array */
+	uint64_t nbuckets;	/* power of two */
+	uint64_t new_buckets;	/* array being moved to, 0 if none */
+	uint64_t new_nbuckets;
+};
+
+/* one key of a hash map */
+struct obj_map_entry {
+	uint64_t next;		/* offset of the next entry in the bucket */
+	uint64_t key;
+	PMEMoid value;
+};
+
+/* run-time state of a lane, kept in DRAM */
+struct lane {
+	pthread_mutex_t lock;	/* held by the transaction using the lane */
+	struct txlog *tail;	/* chunk the next entry goes to */
+	struct txlog_extent *ext;	/* extent the next copy goes to */
+	size_t ext_used;	/* bytes of it holding copies */
+	size_t undo_bytes;	/* undo copied by the current transaction */
+};
+
+/* counters kept in the pool's stats, see struct pmemobj_stats */
+#define	OBJ_STAT_TX_BEGUN 0
+#define	OBJ_STAT_TX_COMMITTED 1
+#define	OBJ_STAT_TX_ABORTED 2
+#define	OBJ_STAT_UNDO_BYTES 3
+#define	OBJ_STAT_ALLOCS 4
+#define	OBJ_STAT_ALLOC_BYTES 5
+#define	OBJ_STAT_FREES 6
+#define	OBJ_STAT_FLUSHES 7
+#define	OBJ_STAT_FLUSH_BYTES 8
+
+/* type of the library's own objects: undo logs and copies, the root */
+#define	OBJ_TYPE_INTERNAL PMEMOBJ_NUM_TYPES
+
+/* type of freed objects lock-free readers may still be looking at */
+#define	OBJ_TYPE_RETIRED (PMEMOBJ_NUM_TYPES + 1)
+
+/* address space reserved for a pool set so it can grow in place */
+#define	OBJ_POOLSET_RESERVE ((size_t)1 << 40)	/* 1TB */
+
 struct pmemobjpool {
 	struct pool_hdr hdr;	/* memory pool header */
 
@@ -49,10 +195,26 @@ struct pmemobjpool {
 	/* some run-time state, allocated out of memory pool... */
 	void *addr;		/* mapped region */
 	size_t size;		/* size of mapped region */
+	int is_pmem;		/* true if pool is PMEM */
+	struct pool_set *set;	/* parts backing the pool, NULL if one file */
+	void *replica;		/* mapped replica if mirrored, NULL otherwise */
+	int replica_is_pmem;	/* true if replica is PMEM */
+	int rdonly;		/* opened read-only, nothing may change */
+	int cow;		/* private copy, changes are never flushed */
+	struct lane *lanes;	/* run-time state of the lanes */
+	unsigned next_lane;	/* where to start looking for a free lane */
+	struct stats *stats;	/* counters and latencies, NULL if none */
+	size_t undo_limit;	/* undo bytes allowed per transaction */
+	struct epoch *epoch;	/* deferred frees, NULL if freed at once */
 
 	/* for the fake implementation... */
 	PMEMmutex rootlock;
 	PMEMoid root;
+	uint64_t root_size;	/* size of the root object */
+	uint64_t replica_synced;	/* closed cleanly while mirrored */
+	uint64_t lane_logs[OBJ_NLANES];	/* first undo log chunk of each lane */
+	struct redo lane_redo[OBJ_NLANES];	/* atomic op of each lane */
+	uint64_t lane_extents[OBJ_NLANES];	/* undo extents of each lane */
 
 	struct allocator_hdr allocator;
 };
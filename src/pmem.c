@@ -37,17 +37,26 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include <cpuid.h>
 
 #include "libpmem.h"
 #include "pmem.h"
 #include "util.h"
 #include "out.h"
 
-#define	FLUSH_ALIGN 64
+/*
+ * Copies shorter than this go through the cache and get flushed, longer
+ * ones use non-temporal stores.  PMEM_MOVNT_THRESHOLD overrides it.
+ */
+#define	MOVNT_THRESHOLD 256
 
 #define	PROCMAXLEN 2048 /* maximum expected line length in /proc files */
 
@@ -105,9 +114,9 @@ flush_clflushopt(void *addr, size_t len, int flags)
 
 	/*
 	 * Loop through cache-line-size (typically 64B) aligned chunks
-	 * covering the given range.
+	 * covering the given range.  No fence is needed before the loop,
+	 * clflushopt is ordered with earlier stores to the same line.
 	 */
-	__builtin_ia32_sfence();
 	for (uptr = (uintptr_t)addr & ~(FLUSH_ALIGN - 1);
 		uptr < (uintptr_t)addr + len; uptr += FLUSH_ALIGN) {
 		/*
@@ -117,25 +126,195 @@ flush_clflushopt(void *addr, size_t len, int flags)
 		 * so insert the clflushopt instruction by adding the 0x66
 		 * prefix byte to clflush.
 		 */
-		__asm__ volatile(".byte 0x66; clflush %P0" : "+m" (uptr));
+		__asm__ volatile(".byte 0x66; clflush %0"
+				: "+m" (*(volatile char *)uptr));
+	}
+}
+
+/*
+ * flush_clwb -- (internal) flush the CPU cache, using clwb
+ *
+ * Unlike the other two, clwb may leave the line valid in the cache, so
+ * data read back right after it is persisted does not miss.
+ */
+static void
+flush_clwb(void *addr, size_t len, int flags)
+{
+	uintptr_t uptr;
+
+	for (uptr = (uintptr_t)addr & ~(FLUSH_ALIGN - 1);
+		uptr < (uintptr_t)addr + len; uptr += FLUSH_ALIGN) {
+		/*
+		 * clwb is encoded as xsaveopt with the 0x66 prefix, which
+		 * works with assemblers that do not know the instruction.
+		 */
+		__asm__ volatile(".byte 0x66; xsaveopt %0"
+				: "+m" (*(volatile char *)uptr));
 	}
 }
 
 /*
  * pmem_flush() calls through Func_flush to do the work.  Although
- * initialized to flush_clflush(), once the existence of the clflushopt
- * feature is confirmed by pmem_init() at library initialization time,
- * Func_flush is set to flush_clflushopt().  That's the most common case
- * on modern hardware that supports persistent memory.
+ * initialized to flush_clflush(), pmem_init() switches it to the best
+ * instruction CPUID reports at library initialization time: clwb, or
+ * else clflushopt.  PMEM_FLUSH_FORCE can ask for a weaker one.
  */
 static void (*Func_flush)(void *, size_t, int) = flush_clflush;
 
+/*
+ * flush profile
+ *
+ * Every thread counts its persists, flushes, fences and msyncs in a slot
+ * of its own, by the part of the library (or the application) the
+ * thread is flushing for, see pmem_prof_source().  No locks or atomic
+ * instructions are used except to register a thread's slot the first
+ * time, pmem_flush_stats() adds up the slots of all threads, including
+ * those that have exited.
+ */
+struct prof_thread {
+	struct prof_thread *next;
+	uint64_t counters[PMEM_FLUSH_NSRC][PROF_NCOUNTERS];
+	uintptr_t last_start;	/* lines covered by the previous flush */
+	uintptr_t last_end;
+};
+
+static pthread_mutex_t Prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_thread *Prof_threads;
+
+static __thread struct prof_thread *Prof_slot;
+static __thread unsigned Prof_src;	/* PMEM_FLUSH_SRC_APP is 0 */
+
+/*
+ * prof_slot -- (internal) return the calling thread's slot
+ *
+ * Returns NULL if a slot cannot be allocated, the counts are then lost.
+ */
+static struct prof_thread *
+prof_slot(void)
+{
+	if (Prof_slot != NULL)
+		return Prof_slot;
+
+	struct prof_thread *tp;
+	if ((tp = Malloc(sizeof (*tp))) == NULL)
+		return NULL;
+	memset(tp, 0, sizeof (*tp));
+
+	pthread_mutex_lock(&Prof_lock);
+	tp->next = Prof_threads;
+	Prof_threads = tp;
+	pthread_mutex_unlock(&Prof_lock);
+
+	return Prof_slot = tp;
+}
+
+/*
+ * pmem_prof_source -- set who the calling thread is flushing for
+ *
+ * Returns the previous source, for the caller to put back.
+ */
+unsigned
+pmem_prof_source(unsigned src)
+{
+	unsigned old = Prof_src;
+
+	Prof_src = src;
+	return old;
+}
+
+/*
+ * pmem_prof_add -- add to one of the calling thread's flush counters
+ */
+void
+pmem_prof_add(unsigned counter, uint64_t val)
+{
+	struct prof_thread *tp = prof_slot();
+
+	if (tp != NULL)
+		tp->counters[Prof_src][counter] += val;
+}
+
+/*
+ * prof_request -- (internal) count a persist asked for by the application
+ *
+ * Requests made by the library are counted when they are made, see
+ * libpmem_persist(), and not again here.
+ */
+static void
+prof_request(size_t len)
+{
+	if (Prof_src == PMEM_FLUSH_SRC_APP) {
+		pmem_prof_add(PROF_CALLS, 1);
+		pmem_prof_add(PROF_BYTES, len);
+	}
+}
+
+/*
+ * prof_flush -- (internal) count the lines flushed for a range
+ */
+static void
+prof_flush(void *addr, size_t len)
+{
+	struct prof_thread *tp = prof_slot();
+	if (tp == NULL || len == 0)
+		return;
+
+	uintptr_t start = (uintptr_t)addr & ~(FLUSH_ALIGN - 1);
+	uintptr_t end = ((uintptr_t)addr + len + FLUSH_ALIGN - 1) &
+				~(FLUSH_ALIGN - 1);
+
+	uint64_t *counters = tp->counters[Prof_src];
+	counters[PROF_LINES] += (end - start) / FLUSH_ALIGN;
+
+	/* lines the previous flush of this thread just flushed */
+	uintptr_t lo = start > tp->last_start ? start : tp->last_start;
+	uintptr_t hi = end < tp->last_end ? end : tp->last_end;
+	if (lo < hi)
+		counters[PROF_REDUNDANT] += (hi - lo) / FLUSH_ALIGN;
+
+	tp->last_start = start;
+	tp->last_end = end;
+}
+
+/*
+ * pmem_flush_stats -- return the flush profile of one source
+ */
+int
+pmem_flush_stats(int src, struct pmem_flush_stats *statsp)
+{
+	LOG(3, "src %d statsp %p", src, statsp);
+
+	if (src < 0 || src >= PMEM_FLUSH_NSRC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint64_t sum[PROF_NCOUNTERS] = { 0 };
+
+	pthread_mutex_lock(&Prof_lock);
+	for (struct prof_thread *tp = Prof_threads; tp != NULL;
+			tp = tp->next)
+		for (int i = 0; i < PROF_NCOUNTERS; i++)
+			sum[i] += tp->counters[src][i];
+	pthread_mutex_unlock(&Prof_lock);
+
+	statsp->calls = sum[PROF_CALLS];
+	statsp->bytes = sum[PROF_BYTES];
+	statsp->lines = sum[PROF_LINES];
+	statsp->redundant = sum[PROF_REDUNDANT];
+	statsp->fences = sum[PROF_FENCES];
+	statsp->msyncs = sum[PROF_MSYNCS];
+
+	return 0;
+}
+
 /*
  * pmem_flush -- flush processor cache for the given range
  */
 void
 pmem_flush(void *addr, size_t len, int flags)
 {
+	prof_flush(addr, len);
 	(*Func_flush)(addr, len, flags);
 }
 
@@ -145,6 +324,7 @@ pmem_flush(void *addr, size_t len, int flags)
 void
 pmem_fence(void)
 {
+	pmem_prof_add(PROF_FENCES, 1);
 	__builtin_ia32_sfence();
 }
 
@@ -154,11 +334,345 @@ pmem_fence(void)
 void
 pmem_persist(void *addr, size_t len, int flags)
 {
+	prof_request(len);
 	pmem_flush(addr, len, flags);
-	__builtin_ia32_sfence();
+	pmem_fence();
 	pmem_drain();
 }
 
+/*
+ * pmem_msync -- flush a range of a file mapping to the file, using msync
+ *
+ * This is how changes are made durable in mappings of ordinary (not DAX)
+ * files.  The range is rounded out to whole pages, as msync() requires.
+ */
+int
+pmem_msync(void *addr, size_t len)
+{
+	LOG(15, "addr %p len %zu", addr, len);
+
+	prof_request(len);
+	pmem_prof_add(PROF_MSYNCS, 1);
+
+	/* increase len by the amount we gain when we round addr down */
+	len += (uintptr_t)addr & (Pagesize - 1);
+
+	/* round addr down to page boundary */
+	uintptr_t uptr = (uintptr_t)addr & ~(Pagesize - 1);
+
+	int ret;
+	if ((ret = msync((void *)uptr, len, MS_SYNC)) < 0)
+		LOG(1, "!msync");
+
+	return ret;
+}
+
+/*
+ * The non-temporal kernels below copy or fill whole cache lines, both
+ * dst and len must be multiples of FLUSH_ALIGN.  Each line is loaded
+ * completely before it is stored, so a kernel copying in the right
+ * direction handles overlapping ranges.  pmem_init() picks the widest
+ * one the CPU supports.
+ */
+
+/*
+ * movnt_fw_sse2 -- (internal) copy lines forward, using 16 byte stores
+ */
+static void
+movnt_fw_sse2(char *dst, const char *src, size_t len)
+{
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)src + 0);
+		__m128i x1 = _mm_loadu_si128((const __m128i *)src + 1);
+		__m128i x2 = _mm_loadu_si128((const __m128i *)src + 2);
+		__m128i x3 = _mm_loadu_si128((const __m128i *)src + 3);
+		_mm_stream_si128((__m128i *)dst + 0, x0);
+		_mm_stream_si128((__m128i *)dst + 1, x1);
+		_mm_stream_si128((__m128i *)dst + 2, x2);
+		_mm_stream_si128((__m128i *)dst + 3, x3);
+		dst += FLUSH_ALIGN;
+		src += FLUSH_ALIGN;
+	}
+}
+
+/*
+ * movnt_bw_sse2 -- (internal) copy lines backward, using 16 byte stores
+ *
+ * dst and src point to the end of the ranges.
+ */
+static void
+movnt_bw_sse2(char *dst, const char *src, size_t len)
+{
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		dst -= FLUSH_ALIGN;
+		src -= FLUSH_ALIGN;
+		__m128i x0 = _mm_loadu_si128((const __m128i *)src + 0);
+		__m128i x1 = _mm_loadu_si128((const __m128i *)src + 1);
+		__m128i x2 = _mm_loadu_si128((const __m128i *)src + 2);
+		__m128i x3 = _mm_loadu_si128((const __m128i *)src + 3);
+		_mm_stream_si128((__m128i *)dst + 0, x0);
+		_mm_stream_si128((__m128i *)dst + 1, x1);
+		_mm_stream_si128((__m128i *)dst + 2, x2);
+		_mm_stream_si128((__m128i *)dst + 3, x3);
+	}
+}
+
+/*
+ * movnt_set_sse2 -- (internal) fill lines, using 16 byte stores
+ */
+static void
+movnt_set_sse2(char *dst, int c, size_t len)
+{
+	__m128i x = _mm_set1_epi8((char)c);
+
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		_mm_stream_si128((__m128i *)dst + 0, x);
+		_mm_stream_si128((__m128i *)dst + 1, x);
+		_mm_stream_si128((__m128i *)dst + 2, x);
+		_mm_stream_si128((__m128i *)dst + 3, x);
+		dst += FLUSH_ALIGN;
+	}
+}
+
+/*
+ * movnt_fw_avx -- (internal) copy lines forward, using 32 byte stores
+ */
+__attribute__((target("avx")))
+static void
+movnt_fw_avx(char *dst, const char *src, size_t len)
+{
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		__m256i y0 = _mm256_loadu_si256((const __m256i *)src + 0);
+		__m256i y1 = _mm256_loadu_si256((const __m256i *)src + 1);
+		_mm256_stream_si256((__m256i *)dst + 0, y0);
+		_mm256_stream_si256((__m256i *)dst + 1, y1);
+		dst += FLUSH_ALIGN;
+		src += FLUSH_ALIGN;
+	}
+	_mm256_zeroupper();
+}
+
+/*
+ * movnt_bw_avx -- (internal) copy lines backward, using 32 byte stores
+ */
+__attribute__((target("avx")))
+static void
+movnt_bw_avx(char *dst, const char *src, size_t len)
+{
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		dst -= FLUSH_ALIGN;
+		src -= FLUSH_ALIGN;
+		__m256i y0 = _mm256_loadu_si256((const __m256i *)src + 0);
+		__m256i y1 = _mm256_loadu_si256((const __m256i *)src + 1);
+		_mm256_stream_si256((__m256i *)dst + 0, y0);
+		_mm256_stream_si256((__m256i *)dst + 1, y1);
+	}
+	_mm256_zeroupper();
+}
+
+/*
+ * movnt_set_avx -- (internal) fill lines, using 32 byte stores
+ */
+__attribute__((target("avx")))
+static void
+movnt_set_avx(char *dst, int c, size_t len)
+{
+	__m256i y = _mm256_set1_epi8((char)c);
+
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		_mm256_stream_si256((__m256i *)dst + 0, y);
+		_mm256_stream_si256((__m256i *)dst + 1, y);
+		dst += FLUSH_ALIGN;
+	}
+	_mm256_zeroupper();
+}
+
+/*
+ * movnt_fw_avx512 -- (internal) copy lines forward, using 64 byte stores
+ */
+__attribute__((target("avx512f")))
+static void
+movnt_fw_avx512(char *dst, const char *src, size_t len)
+{
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		_mm512_stream_si512((__m512i *)dst,
+				_mm512_loadu_si512((const void *)src));
+		dst += FLUSH_ALIGN;
+		src += FLUSH_ALIGN;
+	}
+	_mm256_zeroupper();
+}
+
+/*
+ * movnt_bw_avx512 -- (internal) copy lines backward, using 64 byte stores
+ */
+__attribute__((target("avx512f")))
+static void
+movnt_bw_avx512(char *dst, const char *src, size_t len)
+{
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		dst -= FLUSH_ALIGN;
+		src -= FLUSH_ALIGN;
+		_mm512_stream_si512((__m512i *)dst,
+				_mm512_loadu_si512((const void *)src));
+	}
+	_mm256_zeroupper();
+}
+
+/*
+ * movnt_set_avx512 -- (internal) fill lines, using 64 byte stores
+ */
+__attribute__((target("avx512f")))
+static void
+movnt_set_avx512(char *dst, int c, size_t len)
+{
+	__m512i z = _mm512_set1_epi8((char)c);
+
+	for (; len > 0; len -= FLUSH_ALIGN) {
+		_mm512_stream_si512((__m512i *)dst, z);
+		dst += FLUSH_ALIGN;
+	}
+	_mm256_zeroupper();
+}
+
+static void (*Func_movnt_fw)(char *, const char *, size_t) = movnt_fw_sse2;
+static void (*Func_movnt_bw)(char *, const char *, size_t) = movnt_bw_sse2;
+static void (*Func_movnt_set)(char *, int, size_t) = movnt_set_sse2;
+
+static size_t Movnt_threshold = MOVNT_THRESHOLD;
+
+/*
+ * pmem_memmove_nodrain -- copy to pmem, without the final fence
+ *
+ * Short copies are done by memmove() and flushed, longer ones with
+ * non-temporal stores for the cache-line aligned middle of the range and
+ * memmove() plus a flush for the partial lines at both ends.  Either way
+ * the caller only has to issue a fence for the range to be persistent.
+ */
+void
+pmem_memmove_nodrain(void *pmemdest, const void *src, size_t len)
+{
+	char *d = pmemdest;
+	const char *s = src;
+
+	if (len < Movnt_threshold) {
+		memmove(d, s, len);
+		pmem_flush(d, len, 0);
+		return;
+	}
+
+	size_t head = (FLUSH_ALIGN - ((uintptr_t)d & (FLUSH_ALIGN - 1))) &
+				(FLUSH_ALIGN - 1);
+	if (head > len)
+		head = len;
+	size_t mid = (len - head) & ~(size_t)(FLUSH_ALIGN - 1);
+	size_t tail = len - head - mid;
+
+	if ((uintptr_t)d - (uintptr_t)s >= len) {
+		/* no harmful overlap, copy forward */
+		if (head) {
+			memmove(d, s, head);
+			pmem_flush(d, head, 0);
+		}
+		(*Func_movnt_fw)(d + head, s + head, mid);
+		if (tail) {
+			memmove(d + head + mid, s + head + mid, tail);
+			pmem_flush(d + head + mid, tail, 0);
+		}
+	} else {
+		/* dst overlaps the end of src, copy backward */
+		if (tail) {
+			memmove(d + head + mid, s + head + mid, tail);
+			pmem_flush(d + head + mid, tail, 0);
+		}
+		(*Func_movnt_bw)(d + head + mid, s + head + mid, mid);
+		if (head) {
+			memmove(d, s, head);
+			pmem_flush(d, head, 0);
+		}
+	}
+}
+
+/*
+ * pmem_memset_nodrain -- fill pmem, without the final fence
+ */
+void
+pmem_memset_nodrain(void *pmemdest, int c, size_t len)
+{
+	char *d = pmemdest;
+
+	if (len < Movnt_threshold) {
+		memset(d, c, len);
+		pmem_flush(d, len, 0);
+		return;
+	}
+
+	size_t head = (FLUSH_ALIGN - ((uintptr_t)d & (FLUSH_ALIGN - 1))) &
+				(FLUSH_ALIGN - 1);
+	if (head > len)
+		head = len;
+	size_t mid = (len - head) & ~(size_t)(FLUSH_ALIGN - 1);
+	size_t tail = len - head - mid;
+
+	if (head) {
+		memset(d, c, head);
+		pmem_flush(d, head, 0);
+	}
+	(*Func_movnt_set)(d + head, c, mid);
+	if (tail) {
+		memset(d + head + mid, c, tail);
+		pmem_flush(d + head + mid, tail, 0);
+	}
+}
+
+/*
+ * pmem_memmove_persist -- memmove to pmem, making the result persistent
+ */
+void *
+pmem_memmove_persist(void *pmemdest, const void *src, size_t len)
+{
+	LOG(15, "pmemdest %p src %p len %zu", pmemdest, src, len);
+
+	prof_request(len);
+	pmem_memmove_nodrain(pmemdest, src, len);
+	pmem_fence();
+	pmem_drain();
+
+	return pmemdest;
+}
+
+/*
+ * pmem_memcpy_persist -- memcpy to pmem, making the result persistent
+ */
+void *
+pmem_memcpy_persist(void *pmemdest, const void *src, size_t len)
+{
+	LOG(15, "pmemdest %p src %p len %zu", pmemdest, src, len);
+
+	prof_request(len);
+	pmem_memmove_nodrain(pmemdest, src, len);
+	pmem_fence();
+	pmem_drain();
+
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset pmem, making the result persistent
+ */
+void *
+pmem_memset_persist(void *pmemdest, int c, size_t len)
+{
+	LOG(15, "pmemdest %p c %d len %zu", pmemdest, c, len);
+
+	prof_request(len);
+	pmem_memset_nodrain(pmemdest, c, len);
+	pmem_fence();
+	pmem_drain();
+
+	return pmemdest;
+}
+
 /*
  * is_pmem_always -- (internal) always true version of pmem_is_pmem()
  */
@@ -180,95 +694,260 @@ is_pmem_never(void *addr, size_t len)
 }
 
 /*
- * is_pmem_proc -- (internal) use /proc to implement pmem_is_pmem()
+ * The mappings of the process, as last read from /proc/self/smaps, are
+ * kept sorted by address so pmem_is_pmem() can look a range up with a
+ * binary search instead of parsing the file on every call.  The table is
+ * read again when the library mapped or unmapped anything since (see
+ * util_map_generation()) or when the range is not found in it, which
+ * covers mappings made by the application itself.
  *
- * This function returns true only if the entire range can be confirmed
- * as being direct access persistent memory.  Finding any part of the
- * range is not direct access, or failing to look up the information
- * because it is unmapped or because any sort of error happens, just
- * results in returning false.
- *
- * This function works by lookup up the range in /proc/self/smaps and
- * verifying the "mixed map" vmflag is set for that range.  While this
- * isn't exactly the same as direct access, there is no DAX flag in
- * the vmflags and the mixed map flag is only true on regular files when
- * DAX is in-use, so it serves the purpose.
+ * The application may also have replaced a mapping at the same address,
+ * so before a range is reported as direct access the file now mapped
+ * there is checked to be the one in the table.  A stale answer of 0 only
+ * costs a needless msync, so ranges that were in no mapping when the
+ * table was read are remembered and answered 0 without reading it again.
+ */
+#define	SMAPS_NMISSES 8	/* ranges remembered as in no mapping */
+
+struct smaps_range {
+	char *lo;		/* beginning of the mapping */
+	char *hi;		/* end of the mapping */
+	dev_t dev;		/* the file mapped, if any */
+	ino_t ino;
+	int mm;			/* "mixed map" vmflag is set */
+};
+
+static struct {
+	pthread_rwlock_t lock;
+	struct smaps_range *ranges;
+	size_t nranges;
+	uint64_t generation;	/* util_map_generation() before reading */
+	int valid;		/* ranges were read successfully */
+	struct {
+		char *addr;
+		size_t len;
+	} misses[SMAPS_NMISSES];	/* found in no mapping since read */
+	unsigned nmisses;
+} Smaps = { PTHREAD_RWLOCK_INITIALIZER };
+
+/*
+ * smaps_read -- (internal) read /proc/self/smaps into the table
  *
- * The range passed in may overlap with multiple entries in the smaps list
- * so this function loops through the smaps entries until the entire range
- * is verified as direct access, or until it is clear the answer is false
- * in which case it stops the loop and returns immediately.
+ * Called with the table write locked.  Returns -1 if the file cannot be
+ * read, the table is then left invalid.
  */
 static int
-is_pmem_proc(void *addr, size_t len)
+smaps_read(void)
 {
-	char *caddr = addr;
+	Smaps.valid = 0;
+	Smaps.nranges = 0;
+	Smaps.nmisses = 0;
+	Smaps.generation = util_map_generation();
 
 	FILE *fp;
 	if ((fp = fopen("/proc/self/smaps", "r")) == NULL) {
 		LOG(1, "!/proc/self/smaps");
-		return 0;
+		return -1;
 	}
 
-	int retval = 0;		/* assume false until proven otherwise */
+	size_t maxranges = 0;
+	struct smaps_range *ranges = Smaps.ranges;
+
 	char line[PROCMAXLEN];	/* for fgets() */
 	char *lo = NULL;	/* beginning of current range in smaps file */
 	char *hi = NULL;	/* end of current range in smaps file */
-	int needmm = 0;		/* looking for mm flag for current range */
 	while (fgets(line, PROCMAXLEN, fp) != NULL) {
 		static const char vmflags[] = "VmFlags:";
 		static const char mm[] = " mm";
 
+		unsigned major = 0;
+		unsigned minor = 0;
+		unsigned long ino = 0;
+
 		/* check for range line */
-		if (sscanf(line, "%p-%p", &lo, &hi) == 2) {
-			if (needmm) {
-				/* last range matched, but no mm flag found */
-				LOG(4, "never found mm flag");
-				break;
-			} else if (caddr < lo) {
-				/* never found the range for caddr */
-				LOG(4, "no match for addr %p", caddr);
-				break;
-			} else if (caddr < hi) {
-				/* start address is in this range */
-				size_t rangelen = hi - caddr;
-
-				/* remember that matching has started */
-				needmm = 1;
-
-				/* calculate remaining range to search for */
-				if (len > rangelen) {
-					len -= rangelen;
-					caddr += rangelen;
-					LOG(4, "matched %zu bytes in range "
-							"%p-%p, %zu left over",
-							rangelen, lo, hi, len);
-				} else {
-					len = 0;
-					LOG(4, "matched all bytes in range "
-							"%p-%p", lo, hi);
+		if (sscanf(line, "%p-%p %*s %*x %x:%x %lu", &lo, &hi,
+				&major, &minor, &ino) >= 2) {
+			if (Smaps.nranges == maxranges) {
+				size_t max = maxranges ? 2 * maxranges : 256;
+				struct smaps_range *r;
+				if ((r = Realloc(ranges,
+						max * sizeof (*r))) == NULL) {
+					LOG(1, "!Realloc");
+					Smaps.ranges = ranges;
+					fclose(fp);
+					return -1;
 				}
+				ranges = r;
+				maxranges = max;
 			}
-		} else if (needmm && strncmp(line, vmflags,
+
+			ranges[Smaps.nranges].lo = lo;
+			ranges[Smaps.nranges].hi = hi;
+			ranges[Smaps.nranges].dev = makedev(major, minor);
+			ranges[Smaps.nranges].ino = (ino_t)ino;
+			ranges[Smaps.nranges].mm = 0;
+			Smaps.nranges++;
+		} else if (Smaps.nranges > 0 && strncmp(line, vmflags,
 					sizeof (vmflags) - 1) == 0) {
-			if (strstr(&line[sizeof (vmflags) - 1], mm) != NULL) {
-				LOG(4, "mm flag found");
-				if (len == 0) {
-					/* entire range matched */
-					retval = 1;
-					break;
-				}
-				needmm = 0;	/* saw what was needed */
-			} else {
-				/* mm flag not set for some or all of range */
-				LOG(4, "range has no mm flag");
-				break;
-			}
+			/* change ending newline to space delimiter */
+			char *nl = strrchr(line, '\n');
+			if (nl)
+				*nl = ' ';
+
+			if (strstr(&line[sizeof (vmflags) - 1], mm) != NULL)
+				ranges[Smaps.nranges - 1].mm = 1;
 		}
 	}
 
 	fclose(fp);
 
+	Smaps.ranges = ranges;
+	Smaps.valid = 1;
+
+	LOG(4, "%zu mappings", Smaps.nranges);
+	return 0;
+}
+
+/*
+ * smaps_current -- (internal) tell whether a mapping is still in place
+ *
+ * The file mapped at exactly the range of the mapping must be the one
+ * read from smaps, if it cannot be checked the mapping is not trusted.
+ */
+static int
+smaps_current(const struct smaps_range *r)
+{
+	char path[PROCMAXLEN];
+	struct stat stbuf;
+
+	snprintf(path, sizeof (path), "/proc/self/map_files/%lx-%lx",
+			(unsigned long)r->lo, (unsigned long)r->hi);
+	if (stat(path, &stbuf) < 0) {
+		LOG(4, "!%s", path);
+		return 0;
+	}
+
+	return stbuf.st_dev == r->dev && stbuf.st_ino == r->ino;
+}
+
+/*
+ * smaps_lookup -- (internal) look a range up in the table
+ *
+ * Called with the table locked.  Returns 1 if the whole range is
+ * direct access, 0 if some part of it is not and -1 if some part of it
+ * is not in the table.  With check set, a direct access mapping no
+ * longer in place counts as not in the table.
+ */
+static int
+smaps_lookup(char *addr, size_t len, int check)
+{
+	/* find the last mapping starting at or before addr */
+	size_t lo = 0;
+	size_t hi = Smaps.nranges;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (Smaps.ranges[mid].lo <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return -1;
+
+	char *end = addr + len;
+	for (size_t i = lo - 1; i < Smaps.nranges; i++) {
+		struct smaps_range *r = &Smaps.ranges[i];
+
+		if (r->lo > addr || r->hi <= addr)
+			return -1;	/* a hole in the mappings */
+		if (!r->mm)
+			return 0;
+		if (check && !smaps_current(r))
+			return -1;
+		if (r->hi >= end)
+			return 1;
+
+		addr = r->hi;
+	}
+
+	return -1;
+}
+
+/*
+ * smaps_missed -- (internal) tell whether a range was in no mapping
+ *
+ * Called with the table locked.
+ */
+static int
+smaps_missed(char *addr, size_t len)
+{
+	for (unsigned i = 0; i < Smaps.nmisses && i < SMAPS_NMISSES; i++)
+		if (Smaps.misses[i].addr == addr && Smaps.misses[i].len == len)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * smaps_miss -- (internal) remember a range was in no mapping
+ *
+ * Called with the table write locked, the oldest range is forgotten.
+ */
+static void
+smaps_miss(char *addr, size_t len)
+{
+	unsigned i = Smaps.nmisses++ % SMAPS_NMISSES;
+
+	Smaps.misses[i].addr = addr;
+	Smaps.misses[i].len = len;
+}
+
+/*
+ * is_pmem_proc -- (internal) use /proc to implement pmem_is_pmem()
+ *
+ * This function returns true only if the entire range can be confirmed
+ * as being direct access persistent memory.  Finding any part of the
+ * range is not direct access, or failing to look up the information
+ * because it is unmapped or because any sort of error happens, just
+ * results in returning false.
+ *
+ * This function works by lookup up the range in /proc/self/smaps and
+ * verifying the "mixed map" vmflag is set for that range.  While this
+ * isn't exactly the same as direct access, there is no DAX flag in
+ * the vmflags and the mixed map flag is only true on regular files when
+ * DAX is in-use, so it serves the purpose.
+ *
+ * The range passed in may overlap with multiple entries in the smaps
+ * list, all of them must have the flag and there must be no hole
+ * between them.  The lookup is done in the cached table, which is only
+ * read again when it may be out of date or a direct access mapping in
+ * it was replaced.
+ */
+static int
+is_pmem_proc(void *addr, size_t len)
+{
+	int retval = -1;
+
+	pthread_rwlock_rdlock(&Smaps.lock);
+	if (Smaps.valid && Smaps.generation == util_map_generation()) {
+		retval = smaps_lookup(addr, len, 1);
+		if (retval < 0 && smaps_missed(addr, len))
+			retval = 0;
+	}
+	pthread_rwlock_unlock(&Smaps.lock);
+
+	if (retval < 0) {
+		pthread_rwlock_wrlock(&Smaps.lock);
+		/* what was just read needs no checking */
+		if (smaps_read() == 0 &&
+				(retval = smaps_lookup(addr, len, 0)) < 0)
+			smaps_miss(addr, len);
+		pthread_rwlock_unlock(&Smaps.lock);
+	}
+
+	if (retval < 0)
+		retval = 0;
+
 	LOG(3, "returning %d", retval);
 	return retval;
 }
@@ -282,6 +961,134 @@ is_pmem_proc(void *addr, size_t len)
  */
 static int (*Func_is_pmem)(void *addr, size_t len) = is_pmem_never;
 
+/* CPU features pmem_init() looks for, as found by cpu_detect() */
+#define	CPU_CLFLUSH	0x01
+#define	CPU_CLFLUSHOPT	0x02
+#define	CPU_CLWB	0x04
+#define	CPU_AVX		0x08
+#define	CPU_AVX512F	0x10
+#define	CPU_AVX2	0x20
+#define	CPU_SSE42	0x40
+
+static unsigned Cpu_features;
+
+/* CPUID bits, not all of them are named by older <cpuid.h> versions */
+#define	CPUID1_EDX_CLFSH	(1U << 19)
+#define	CPUID1_ECX_SSE42	(1U << 20)
+#define	CPUID1_ECX_OSXSAVE	(1U << 27)
+#define	CPUID1_ECX_AVX		(1U << 28)
+#define	CPUID7_EBX_AVX2		(1U << 5)
+#define	CPUID7_EBX_AVX512F	(1U << 16)
+#define	CPUID7_EBX_CLFLUSHOPT	(1U << 23)
+#define	CPUID7_EBX_CLWB		(1U << 24)
+
+/*
+ * cpu_xgetbv -- (internal) read the register state the OS has enabled
+ */
+static uint64_t
+cpu_xgetbv(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * cpu_detect -- (internal) pick the flush, copy and checksum routines
+ *
+ * The wide copies also need the OS to save the AVX (and for AVX-512,
+ * the opmask and upper ZMM) register state, which xgetbv tells.
+ */
+static void
+cpu_detect(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return;
+
+	if (edx & CPUID1_EDX_CLFSH)
+		Cpu_features |= CPU_CLFLUSH;
+	if (ecx & CPUID1_ECX_SSE42)
+		Cpu_features |= CPU_SSE42;
+
+	uint64_t xcr0 = 0;
+	if (ecx & CPUID1_ECX_OSXSAVE)
+		xcr0 = cpu_xgetbv();
+	if ((ecx & CPUID1_ECX_AVX) && (xcr0 & 0x6) == 0x6)
+		Cpu_features |= CPU_AVX;
+
+	if (__get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		if (ebx & CPUID7_EBX_CLFLUSHOPT)
+			Cpu_features |= CPU_CLFLUSHOPT;
+		if (ebx & CPUID7_EBX_CLWB)
+			Cpu_features |= CPU_CLWB;
+		if ((ebx & CPUID7_EBX_AVX2) && (Cpu_features & CPU_AVX))
+			Cpu_features |= CPU_AVX2;
+		if ((ebx & CPUID7_EBX_AVX512F) && (xcr0 & 0xe6) == 0xe6)
+			Cpu_features |= CPU_AVX512F;
+	}
+
+	LOG(3, "cpu features 0x%x", Cpu_features);
+
+	if (Cpu_features & CPU_CLFLUSH)
+		Func_is_pmem = is_pmem_proc;
+
+	if (Cpu_features & CPU_CLWB)
+		Func_flush = flush_clwb;
+	else if (Cpu_features & CPU_CLFLUSHOPT)
+		Func_flush = flush_clflushopt;
+
+	if (Cpu_features & CPU_AVX512F) {
+		Func_movnt_fw = movnt_fw_avx512;
+		Func_movnt_bw = movnt_bw_avx512;
+		Func_movnt_set = movnt_set_avx512;
+	} else if (Cpu_features & CPU_AVX) {
+		Func_movnt_fw = movnt_fw_avx;
+		Func_movnt_bw = movnt_bw_avx;
+		Func_movnt_set = movnt_set_avx;
+	}
+
+	util_checksum_select(Cpu_features & CPU_AVX2,
+			Cpu_features & CPU_SSE42);
+}
+
+/*
+ * flush_force -- (internal) use the flush instruction named by the user
+ *
+ * An instruction the CPU does not have is ignored.
+ */
+static void
+flush_force(const char *name)
+{
+	static const struct {
+		const char *name;
+		unsigned feature;
+		void (*func)(void *, size_t, int);
+	} Flushes[] = {
+		{ "clflush", CPU_CLFLUSH, flush_clflush },
+		{ "clflushopt", CPU_CLFLUSHOPT, flush_clflushopt },
+		{ "clwb", CPU_CLWB, flush_clwb },
+	};
+
+	for (int i = 0; i < sizeof (Flushes) / sizeof (Flushes[0]); i++) {
+		if (strcmp(name, Flushes[i].name) != 0)
+			continue;
+
+		if (Cpu_features & Flushes[i].feature) {
+			Func_flush = Flushes[i].func;
+			LOG(3, "forced flush %s", name);
+		} else
+			LOG(1, "flush %s not supported by the CPU", name);
+		return;
+	}
+
+	LOG(1, "invalid PMEM_FLUSH_FORCE \"%s\"", name);
+}
+
 /*
  * pmem_init -- load-time initialization for pmem.c
  *
@@ -295,42 +1102,21 @@ pmem_init(void)
 	LOG(3, NULL);
 	util_init();
 
-	/* detect supported cache flush features */
-	FILE *fp;
-	if ((fp = fopen("/proc/cpuinfo", "r")) == NULL) {
-		LOG(1, "!/proc/cpuinfo");
-	} else {
-		char line[PROCMAXLEN];	/* for fgets() */
-
-		while (fgets(line, PROCMAXLEN, fp) != NULL) {
-			static const char flags[] = "flags\t\t: ";
-			static const char clflush[] = " clflush ";
-			static const char clflushopt[] = " clflushopt ";
+	cpu_detect();
 
-			if (strncmp(flags, line, sizeof (flags) - 1) == 0) {
-
-				/* change ending newline to space delimiter */
-				char *nl = strrchr(line, '\n');
-				if (nl)
-					*nl = ' ';
-
-				if (strstr(&line[sizeof (flags) - 1],
-							clflush) != NULL) {
-					Func_is_pmem = is_pmem_proc;
-					LOG(3, "clflush supported");
-				}
+	char *ptr = getenv("PMEM_FLUSH_FORCE");
+	if (ptr)
+		flush_force(ptr);
 
-				if (strstr(&line[sizeof (flags) - 1],
-							clflushopt) != NULL) {
-					Func_flush = flush_clflushopt;
-					LOG(3, "clflushopt supported");
-				}
-
-				break;
-			}
-		}
+	ptr = getenv("PMEM_MOVNT_THRESHOLD");
+	if (ptr) {
+		char *endp;
+		unsigned long long threshold = strtoull(ptr, &endp, 0);
 
-		fclose(fp);
+		if (*ptr != '\0' && *endp == '\0')
+			Movnt_threshold = threshold;
+		else
+			LOG(1, "invalid PMEM_MOVNT_THRESHOLD \"%s\"", ptr);
 	}
 
 	/*
@@ -343,7 +1129,7 @@ pmem_init(void)
 	 * systems where pmem_is_pmem() isn't correctly detecting true
 	 * persistent memory.
 	 */
-	char *ptr = getenv("PMEM_IS_PMEM_FORCE");
+	ptr = getenv("PMEM_IS_PMEM_FORCE");
 	if (ptr) {
 		int val = atoi(ptr);
 
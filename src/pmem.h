@@ -40,6 +40,8 @@
 
 extern unsigned long Pagesize;
 
+#define	FLUSH_ALIGN 64		/* cache line size assumed by the flushes */
+
 typedef void (*Persist_func)(void *addr, size_t len, int flags);
 
 Persist_func Persist;
@@ -47,4 +49,51 @@ Persist_func Persist;
 void pmem_set_persist_func(void (*persist_func)(void *addr,
 			size_t len, int flags));
 
-void libpmem_persist(int is_pmem, void *addr, size_t len);
+void pmem_memmove_nodrain(void *pmemdest, const void *src, size_t len);
+void pmem_memset_nodrain(void *pmemdest, int c, size_t len);
+
+/* flush profile counters, per PMEM_FLUSH_SRC_* source */
+#define	PROF_CALLS 0
+#define	PROF_BYTES 1
+#define	PROF_LINES 2
+#define	PROF_REDUNDANT 3
+#define	PROF_FENCES 4
+#define	PROF_MSYNCS 5
+#define	PROF_NCOUNTERS 6
+
+unsigned pmem_prof_source(unsigned src);
+void pmem_prof_add(unsigned counter, uint64_t val);
+
+void libpmem_persist(unsigned src, int is_pmem, void *addr, size_t len);
+void libpmem_memcpy_persist(unsigned src, int is_pmem, void *dest,
+		const void *from, size_t len);
+void libpmem_memcpy_nodrain(unsigned src, int is_pmem, void *dest,
+		const void *from, size_t len);
+void libpmem_memset_nodrain(unsigned src, int is_pmem, void *dest, int c,
+		size_t len);
+void libpmem_drain(unsigned src, int is_pmem);
+
+#define	PERSIST_BATCH_MAX 16	/* ranges kept before flushing them */
+
+struct persist_batch {
+	unsigned src;		/* PMEM_FLUSH_SRC_* of the flushes */
+	int is_pmem;
+	unsigned nranges;
+	struct persist_range {
+		uintptr_t start;
+		uintptr_t end;
+	} ranges[PERSIST_BATCH_MAX];
+};
+
+void libpmem_batch_init(struct persist_batch *bp, unsigned src,
+		int is_pmem);
+void libpmem_batch_add(struct persist_batch *bp, void *addr, size_t len);
+void libpmem_batch_persist(struct persist_batch *bp);
+
+int libpmem_mirror_register(void *addr, size_t len, void *replica,
+		int replica_is_pmem);
+void libpmem_mirror_unregister(void *addr);
+void libpmem_mirror_batch_begin(void);
+void libpmem_mirror_batch_end(void);
+void libpmem_msync_batch_begin(void);
+void libpmem_msync_batch_end(void);
@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY LOG OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * stats.c -- per-thread counters and latency histograms
+ *
+ * Every thread updates its own struct stats_thread without any locking
+ * or atomic instructions, readers merge all of them on demand.  A thread
+ * finds its slot through a one-entry thread-local cache, so only the
+ * first update after switching to other stats takes the lock.
+ *
+ * The slots of a thread are also on a list of the thread, when it exits
+ * they are added to what the exited threads of their stats gathered and
+ * freed.  Stats_lock protects the lists of all threads.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "util.h"
+#include "out.h"
+#include "stats.h"
+
+static uint64_t Instances;	/* source of stats instance ids */
+
+static pthread_mutex_t Stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t Stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t Stats_key;	/* runs stats_thread_exit() */
+static int Stats_key_valid;
+
+static __thread struct {
+	uint64_t instance;
+	struct stats_thread *slot;
+} Thread_stats;
+
+static __thread struct stats_thread *Thread_slots;
+
+/*
+ * stats_unlink -- (internal) take a slot off the list of its thread
+ *
+ * Called with Stats_lock held.
+ */
+static void
+stats_unlink(struct stats_thread *tp)
+{
+	if (tp->tnext != NULL)
+		tp->tnext->tprevp = tp->tprevp;
+	*tp->tprevp = tp->tnext;
+}
+
+/*
+ * stats_thread_exit -- (internal) fold the slots of an exiting thread
+ *
+ * Called by the pthread key destructor with the thread's list of slots.
+ */
+static void
+stats_thread_exit(void *arg)
+{
+	struct stats_thread **headp = arg;
+
+	pthread_mutex_lock(&Stats_lock);
+	while (*headp != NULL) {
+		struct stats_thread *tp = *headp;
+		struct stats *sp = tp->sp;
+
+		stats_unlink(tp);
+
+		pthread_mutex_lock(&sp->lock);
+		struct stats_thread **pp = &sp->threads;
+		while (*pp != tp)
+			pp = &(*pp)->next;
+		*pp = tp->next;
+
+		for (unsigned i = 0; i < STATS_NCOUNTERS; i++)
+			sp->exited.counters[i] += tp->counters[i];
+		for (unsigned h = 0; h < STATS_NHISTS; h++)
+			for (unsigned b = 0; b < STATS_HIST_NBUCKETS; b++)
+				sp->exited.hists[h][b] += tp->hists[h][b];
+		pthread_mutex_unlock(&sp->lock);
+
+		Free(tp);
+	}
+	pthread_mutex_unlock(&Stats_lock);
+
+	/* a later destructor may still update stats, it gets a new slot */
+	Thread_stats.instance = 0;
+}
+
+/*
+ * stats_key_create -- (internal) create the key that reclaims slots
+ *
+ * Without it slots are only freed when their stats are deleted.
+ */
+static void
+stats_key_create(void)
+{
+	if ((errno = pthread_key_create(&Stats_key, stats_thread_exit)))
+		LOG(1, "!pthread_key_create");
+	else
+		Stats_key_valid = 1;
+}
+
+/*
+ * stats_new -- allocate empty stats
+ */
+struct stats *
+stats_new(void)
+{
+	struct stats *sp;
+
+	if ((sp = Malloc(sizeof (*sp))) == NULL) {
+		LOG(1, "!Malloc");
+		return NULL;
+	}
+
+	memset(sp, 0, sizeof (*sp));
+	if ((errno = pthread_mutex_init(&sp->lock, NULL))) {
+		LOG(1, "!pthread_mutex_init");
+		Free(sp);
+		return NULL;
+	}
+	sp->instance = __sync_add_and_fetch(&Instances, 1);
+
+	return sp;
+}
+
+/*
+ * stats_delete -- stop the periodic dump and free the stats
+ */
+void
+stats_delete(struct stats *sp)
+{
+	if (sp->dump_running) {
+		pthread_mutex_lock(&sp->lock);
+		sp->dump_running = 0;
+		pthread_cond_signal(&sp->dump_cond);
+		pthread_mutex_unlock(&sp->lock);
+		pthread_join(sp->dump_thread, NULL);
+		pthread_cond_destroy(&sp->dump_cond);
+	}
+
+	pthread_mutex_lock(&Stats_lock);
+	while (sp->threads != NULL) {
+		struct stats_thread *tp = sp->threads;
+		sp->threads = tp->next;
+		stats_unlink(tp);
+		Free(tp);
+	}
+	pthread_mutex_unlock(&Stats_lock);
+
+	pthread_mutex_destroy(&sp->lock);
+	Free(sp);
+}
+
+/*
+ * stats_now -- return a timestamp in nanoseconds
+ */
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * stats_slot -- (internal) return the calling thread's slot
+ *
+ * Returns NULL if a new slot cannot be allocated, the update is then
+ * simply lost.
+ */
+static struct stats_thread *
+stats_slot(struct stats *sp)
+{
+	if (Thread_stats.instance == sp->instance)
+		return Thread_stats.slot;
+
+	struct stats_thread *tp;
+
+	pthread_once(&Stats_once, stats_key_create);
+
+	pthread_mutex_lock(&Stats_lock);
+	for (tp = Thread_slots; tp != NULL; tp = tp->tnext)
+		if (tp->sp == sp)
+			break;
+
+	if (tp == NULL && (tp = Malloc(sizeof (*tp))) != NULL) {
+		memset(tp, 0, sizeof (*tp));
+		tp->sp = sp;
+		tp->tnext = Thread_slots;
+		tp->tprevp = &Thread_slots;
+		if (Thread_slots != NULL)
+			Thread_slots->tprevp = &tp->tnext;
+		Thread_slots = tp;
+
+		pthread_mutex_lock(&sp->lock);
+		tp->next = sp->threads;
+		sp->threads = tp;
+		pthread_mutex_unlock(&sp->lock);
+
+		if (Stats_key_valid)
+			pthread_setspecific(Stats_key, &Thread_slots);
+	}
+	pthread_mutex_unlock(&Stats_lock);
+
+	if (tp != NULL) {
+		Thread_stats.instance = sp->instance;
+		Thread_stats.slot = tp;
+	}
+
+	return tp;
+}
+
+/*
+ * stats_add -- add val to one of the calling thread's counters
+ */
+void
+stats_add(struct stats *sp, unsigned counter, uint64_t val)
+{
+	struct stats_thread *tp = stats_slot(sp);
+
+	if (tp != NULL)
+		tp->counters[counter] += val;
+}
+
+/*
+ * stats_bucket -- (internal) histogram bucket of a value
+ */
+static unsigned
+stats_bucket(uint64_t val)
+{
+	if (val < (1 << STATS_HIST_SUBBITS))
+		return (unsigned)val;
+
+	unsigned msb = 63 - __builtin_clzll(val);
+	unsigned sub = (val >> (msb - STATS_HIST_SUBBITS)) &
+			((1 << STATS_HIST_SUBBITS) - 1);
+	return (msb << STATS_HIST_SUBBITS) | sub;
+}
+
+/*
+ * stats_bucket_max -- (internal) largest value counted in a bucket
+ */
+static uint64_t
+stats_bucket_max(unsigned bucket)
+{
+	unsigned msb = bucket >> STATS_HIST_SUBBITS;
+	uint64_t sub = bucket & ((1 << STATS_HIST_SUBBITS) - 1);
+
+	if (msb < STATS_HIST_SUBBITS)
+		return bucket;
+
+	unsigned shift = msb - STATS_HIST_SUBBITS;
+	uint64_t lo = (((uint64_t)1 << STATS_HIST_SUBBITS) | sub) << shift;
+	return lo + (((uint64_t)1 << shift) - 1);
+}
+
+/*
+ * stats_record -- count a latency in one of the calling thread's histograms
+ */
+void
+stats_record(struct stats *sp, unsigned hist, uint64_t ns)
+{
+	struct stats_thread *tp = stats_slot(sp);
+
+	if (tp != NULL)
+		tp->hists[hist][stats_bucket(ns)]++;
+}
+
+/*
+ * stats_sum -- add up the counters of all threads
+ *
+ * Updates made while adding may or may not be included.
+ */
+void
+stats_sum(struct stats *sp, uint64_t counters[STATS_NCOUNTERS])
+{
+	pthread_mutex_lock(&sp->lock);
+	memcpy(counters, sp->exited.counters,
+			STATS_NCOUNTERS * sizeof (uint64_t));
+	for (struct stats_thread *tp = sp->threads; tp; tp = tp->next)
+		for (unsigned i = 0; i < STATS_NCOUNTERS; i++)
+			counters[i] += tp->counters[i];
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/*
+ * stats_sum_hist -- merge one histogram of all threads
+ *
+ * Updates made while merging may or may not be included.
+ */
+void
+stats_sum_hist(struct stats *sp, unsigned hist,
+	uint64_t sum[STATS_HIST_NBUCKETS])
+{
+	pthread_mutex_lock(&sp->lock);
+	memcpy(sum, sp->exited.hists[hist],
+			STATS_HIST_NBUCKETS * sizeof (uint64_t));
+	for (struct stats_thread *tp = sp->threads; tp; tp = tp->next)
+		for (unsigned b = 0; b < STATS_HIST_NBUCKETS; b++)
+			sum[b] += tp->hists[hist][b];
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/*
+ * stats_percentile -- return the value pct percent of a histogram is below
+ *
+ * The value returned is the upper bound of the bucket the percentile
+ * falls into, 0 for an empty histogram.
+ */
+uint64_t
+stats_percentile(const uint64_t hist[STATS_HIST_NBUCKETS], double pct)
+{
+	uint64_t total = 0;
+	for (unsigned b = 0; b < STATS_HIST_NBUCKETS; b++)
+		total += hist[b];
+	if (total == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(total * pct / 100.0);
+	if (rank >= total)
+		rank = total - 1;
+
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < STATS_HIST_NBUCKETS; b++) {
+		seen += hist[b];
+		if (seen > rank)
+			return stats_bucket_max(b);
+	}
+
+	return stats_bucket_max(STATS_HIST_NBUCKETS - 1);
+}
+
+/*
+ * stats_dump_thread -- (internal) call the dump function periodically
+ */
+static void *
+stats_dump_thread(void *arg)
+{
+	struct stats *sp = arg;
+
+	pthread_mutex_lock(&sp->lock);
+	while (sp->dump_running) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += sp->dump_interval;
+
+		if (pthread_cond_timedwait(&sp->dump_cond, &sp->lock,
+				&ts) == ETIMEDOUT && sp->dump_running) {
+			/* the dump function merges the stats, which locks */
+			pthread_mutex_unlock(&sp->lock);
+			(*sp->dump_func)(sp->dump_arg);
+			pthread_mutex_lock(&sp->lock);
+		}
+	}
+	pthread_mutex_unlock(&sp->lock);
+
+	return NULL;
+}
+
+/*
+ * stats_dump_start -- call dump_func every interval seconds
+ *
+ * The dumps run on a thread of their own until stats_delete() is called.
+ */
+int
+stats_dump_start(struct stats *sp, unsigned interval,
+	void (*dump_func)(void *arg), void *arg)
+{
+	LOG(3, "sp %p interval %u", sp, interval);
+
+	if ((errno = pthread_cond_init(&sp->dump_cond, NULL))) {
+		LOG(1, "!pthread_cond_init");
+		return -1;
+	}
+
+	sp->dump_interval = interval;
+	sp->dump_func = dump_func;
+	sp->dump_arg = arg;
+	sp->dump_running = 1;
+
+	if ((errno = pthread_create(&sp->dump_thread, NULL,
+			stats_dump_thread, sp))) {
+		LOG(1, "!pthread_create");
+		sp->dump_running = 0;
+		pthread_cond_destroy(&sp->dump_cond);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY LOG OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * stats.h -- internal definitions for stats module
+ */
+
+#define	STATS_NCOUNTERS 16	/* counters kept for each thread */
+#define	STATS_NHISTS 4		/* latency histograms kept for each thread */
+
+/*
+ * histogram buckets: four per power of two, so a value is known to
+ * within 25% of itself, a recorded value never exceeds 2^64
+ */
+#define	STATS_HIST_SUBBITS 2
+#define	STATS_HIST_NBUCKETS (64 << STATS_HIST_SUBBITS)
+
+/* what one thread gathered, only ever written by that thread */
+struct stats_thread {
+	struct stats_thread *next;	/* on the list of the stats */
+	struct stats *sp;		/* the stats the slot belongs to */
+	struct stats_thread *tnext;	/* on the list of the thread */
+	struct stats_thread **tprevp;
+	uint64_t counters[STATS_NCOUNTERS];
+	uint64_t hists[STATS_NHISTS][STATS_HIST_NBUCKETS];
+};
+
+struct stats {
+	pthread_mutex_t lock;		/* protects the list of threads */
+	struct stats_thread *threads;
+	struct stats_thread exited;	/* what exited threads gathered */
+	uint64_t instance;		/* unique id of these stats */
+
+	/* periodic dump, if started */
+	pthread_t dump_thread;
+	int dump_running;
+	pthread_cond_t dump_cond;
+	unsigned dump_interval;		/* seconds */
+	void (*dump_func)(void *arg);
+	void *dump_arg;
+};
+
+struct stats *stats_new(void);
+void stats_delete(struct stats *sp);
+uint64_t stats_now(void);
+void stats_add(struct stats *sp, unsigned counter, uint64_t val);
+void stats_record(struct stats *sp, unsigned hist, uint64_t ns);
+void stats_sum(struct stats *sp, uint64_t counters[STATS_NCOUNTERS]);
+void stats_sum_hist(struct stats *sp, unsigned hist,
+	uint64_t sum[STATS_HIST_NBUCKETS]);
+uint64_t stats_percentile(const uint64_t hist[STATS_HIST_NBUCKETS],
+	double pct);
+int stats_dump_start(struct stats *sp, unsigned interval,
+	void (*dump_func)(void *arg), void *arg);
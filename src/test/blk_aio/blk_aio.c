@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * blk_aio.c -- unit test for pmemblk asynchronous I/O
+ *
+ * usage: blk_aio file nthread
+ *
+ * nthread is passed to pmemblk_aio_start(), 0 for one per lane.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	BSIZE 512
+#define	DEPTH 16
+#define	NBLOCKS 200
+#define	REAP_MAX 5
+
+static char Bufs[NBLOCKS][BSIZE];
+
+/*
+ * fill -- the contents of a block
+ */
+static void
+fill(char *buf, off_t blockno, int gen)
+{
+	memset(buf, 'a' + blockno % 26, BSIZE);
+	sprintf(buf, "block %zu generation %d", blockno, gen);
+}
+
+/*
+ * run -- push ops through, keeping the queue full
+ *
+ * The user_data of each op is its index, the completion of each one is
+ * checked against errors[index] and counted once.
+ */
+static void
+run(PMEMblk *pbp, struct pmemblk_aio_op *ops, const int *errors, int nops)
+{
+	int done[NBLOCKS] = { 0 };
+	int nsubmitted = 0;
+	int nreaped = 0;
+
+	assert(nops <= NBLOCKS);
+
+	while (nreaped < nops) {
+		int n = pmemblk_aio_submit(pbp, ops + nsubmitted,
+				nops - nsubmitted);
+		assert(n >= 0);
+		nsubmitted += n;
+		/* what is not taken did not fit */
+		assert(nsubmitted - nreaped <= DEPTH);
+		if (nsubmitted < nops)
+			assert(nsubmitted - nreaped == DEPTH);
+
+		struct pmemblk_aio_cqe cqes[REAP_MAX];
+		n = pmemblk_aio_reap(pbp, cqes, REAP_MAX, 1);
+		assert(n >= 1 && n <= REAP_MAX);
+		for (int i = 0; i < n; i++) {
+			uint64_t idx = cqes[i].user_data;
+			assert(idx < nops && !done[idx]);
+			assert(cqes[i].error == errors[idx]);
+			done[idx] = 1;
+		}
+		nreaped += n;
+	}
+
+	/* nothing outstanding, reaping does not wait */
+	struct pmemblk_aio_cqe cqe;
+	assert(pmemblk_aio_reap(pbp, &cqe, 1, 1) == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "blk_aio");
+
+	if (argc != 3)
+		FATAL("usage: %s file nthread", argv[0]);
+
+	unsigned nthread = atoi(argv[2]);
+
+	int fd = OPEN(argv[1], O_RDWR);
+	PMEMblk *pbp = pmemblk_map(fd, BSIZE);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map: %s", argv[1]);
+
+	struct pmemblk_aio_op ops[NBLOCKS];
+	int errors[NBLOCKS] = { 0 };
+	errno = 0;
+	assert(pmemblk_aio_submit(pbp, ops, 1) == -1 && errno == EINVAL);
+	errno = 0;
+	assert(pmemblk_aio_stop(pbp) == -1 && errno == EINVAL);
+	errno = 0;
+	assert(pmemblk_aio_start(pbp, 1 << 20, nthread) == -1 &&
+			errno == EINVAL);
+
+	/* rounded up to a power of two */
+	assert(pmemblk_aio_start(pbp, DEPTH - 1, nthread) == 0);
+	errno = 0;
+	assert(pmemblk_aio_start(pbp, DEPTH, nthread) == -1 &&
+			errno == EBUSY);
+
+	/* writes, with a bad block number and a zeroing among them */
+	off_t nblock = pmemblk_nblock(pbp);
+	for (int i = 0; i < NBLOCKS; i++) {
+		ops[i].opcode = PMEMBLK_AIO_WRITE;
+		ops[i].buf = Bufs[i];
+		ops[i].blockno = i;
+		ops[i].user_data = i;
+		fill(Bufs[i], i, 0);
+	}
+	ops[10].blockno = nblock;
+	errors[10] = EINVAL;
+	ops[20].opcode = PMEMBLK_AIO_SET_ZERO;
+	run(pbp, ops, errors, NBLOCKS);
+
+	char buf[BSIZE];
+	char zero[BSIZE];
+	memset(zero, 0, BSIZE);
+	for (int i = 0; i < NBLOCKS; i++) {
+		assert(pmemblk_read(pbp, buf, i) == 0);
+		if (i == 10 || i == 20)
+			assert(memcmp(buf, zero, BSIZE) == 0);
+		else
+			assert(memcmp(buf, Bufs[i], BSIZE) == 0);
+	}
+
+	/* and read back */
+	memset(Bufs, 0, sizeof (Bufs));
+	for (int i = 0; i < NBLOCKS; i++) {
+		ops[i].opcode = PMEMBLK_AIO_READ;
+		ops[i].blockno = i;
+		errors[i] = 0;
+	}
+	ops[30].blockno = -1;
+	errors[30] = EINVAL;
+	run(pbp, ops, errors, NBLOCKS);
+	for (int i = 0; i < NBLOCKS; i++) {
+		if (i == 30)
+			continue;
+		fill(buf, i, 0);
+		if (i == 10 || i == 20)
+			assert(memcmp(Bufs[i], zero, BSIZE) == 0);
+		else
+			assert(memcmp(Bufs[i], buf, BSIZE) == 0);
+	}
+
+	/* an unknown opcode queues nothing */
+	ops[0].opcode = 42;
+	errno = 0;
+	assert(pmemblk_aio_submit(pbp, ops, 2) == -1 && errno == EINVAL);
+
+	/* stopping finishes what is queued */
+	for (int i = 0; i < DEPTH; i++) {
+		ops[i].opcode = PMEMBLK_AIO_WRITE;
+		ops[i].blockno = i;
+		fill(Bufs[i], i, 1);
+	}
+	assert(pmemblk_aio_submit(pbp, ops, DEPTH) == DEPTH);
+	assert(pmemblk_aio_stop(pbp) == 0);
+	for (int i = 0; i < DEPTH; i++) {
+		assert(pmemblk_read(pbp, buf, i) == 0);
+		assert(memcmp(buf, Bufs[i], BSIZE) == 0);
+	}
+
+	/* and so does unmapping */
+	assert(pmemblk_aio_start(pbp, 0, nthread) == 0);
+	for (int i = 0; i < DEPTH; i++)
+		fill(Bufs[i], i, 2);
+	assert(pmemblk_aio_submit(pbp, ops, DEPTH) == DEPTH);
+	pmemblk_unmap(pbp);
+
+	pbp = pmemblk_map(fd, BSIZE);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map: %s", argv[1]);
+	for (int i = 0; i < DEPTH; i++) {
+		assert(pmemblk_read(pbp, buf, i) == 0);
+		assert(memcmp(buf, Bufs[i], BSIZE) == 0);
+	}
+	pmemblk_unmap(pbp);
+	CLOSE(fd);
+
+	assert(pmemblk_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * blk_batch.c -- unit test for pmemblk batches
+ *
+ * usage: blk_batch file pmem|msync
+ *
+ * In pmem mode (PMEM_IS_PMEM_FORCE=1) a single write takes three fences,
+ * a batch two per block plus one per BLK_IOV_CHUNK (64) blocks.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	BSIZE 512
+#define	NVEC 64
+#define	NRANGE 100
+#define	RANGE_START 1000
+
+/*
+ * fill -- the contents of a block
+ */
+static void
+fill(char *buf, off_t blockno, int gen)
+{
+	memset(buf, 'a' + blockno % 26, BSIZE);
+	sprintf(buf, "block %zu generation %d", blockno, gen);
+}
+
+/*
+ * check_block -- read a block on its own and compare it
+ */
+static void
+check_block(PMEMblk *pbp, off_t blockno, int gen)
+{
+	char buf[BSIZE];
+	char expect[BSIZE];
+
+	fill(expect, blockno, gen);
+	assert(pmemblk_read(pbp, buf, blockno) == 0);
+	assert(memcmp(buf, expect, BSIZE) == 0);
+}
+
+/*
+ * fences -- number of fences taken by pmemblk so far
+ */
+static uint64_t
+fences(void)
+{
+	struct pmem_flush_stats stats;
+
+	assert(pmem_flush_stats(PMEM_FLUSH_SRC_BLK, &stats) == 0);
+	return stats.fences;
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "blk_batch");
+
+	if (argc != 3)
+		FATAL("usage: %s file pmem|msync", argv[0]);
+
+	int pmem = strcmp(argv[2], "pmem") == 0;
+
+	int fd = OPEN(argv[1], O_RDWR);
+	PMEMblk *pbp = pmemblk_map(fd, BSIZE);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map: %s", argv[1]);
+
+	/* the first write lays out the btt, leave it out of the counts */
+	char buf[BSIZE];
+	fill(buf, 0, 0);
+	assert(pmemblk_write(pbp, buf, 0) == 0);
+
+	uint64_t before = fences();
+	fill(buf, 1, 0);
+	assert(pmemblk_write(pbp, buf, 1) == 0);
+	if (pmem)
+		assert(fences() - before == 3);
+
+	/* scattered blocks, some of them twice */
+	static char vbufs[NVEC][BSIZE];
+	struct pmemblk_iov iov[NVEC];
+	for (int i = 0; i < NVEC; i++) {
+		iov[i].buf = vbufs[i];
+		iov[i].blockno = 2 + (i * 7) % 50;
+		fill(vbufs[i], iov[i].blockno, i);
+	}
+
+	before = fences();
+	assert(pmemblk_writev(pbp, iov, NVEC) == 0);
+	if (pmem)
+		assert(fences() - before == 2 * NVEC + 1);
+
+	/* the last write of a block wins */
+	int gen[50] = { 0 };
+	for (int i = 0; i < NVEC; i++)
+		gen[iov[i].blockno - 2] = i;
+	for (int i = 0; i < 50; i++)
+		check_block(pbp, 2 + i, gen[i]);
+
+	memset(vbufs, 0, sizeof (vbufs));
+	assert(pmemblk_readv(pbp, iov, NVEC) == 0);
+	for (int i = 0; i < NVEC; i++) {
+		char expect[BSIZE];
+		fill(expect, iov[i].blockno, gen[iov[i].blockno - 2]);
+		assert(memcmp(vbufs[i], expect, BSIZE) == 0);
+	}
+
+	/* a range longer than a chunk */
+	static char rbuf[NRANGE * BSIZE];
+	for (int i = 0; i < NRANGE; i++)
+		fill(rbuf + i * BSIZE, RANGE_START + i, 1);
+
+	before = fences();
+	assert(pmemblk_write_range(pbp, rbuf, RANGE_START, NRANGE) == 0);
+	if (pmem)
+		assert(fences() - before == 2 * NRANGE + 2);
+
+	memset(rbuf, 0, sizeof (rbuf));
+	assert(pmemblk_read_range(pbp, rbuf, RANGE_START, NRANGE) == 0);
+	for (int i = 0; i < NRANGE; i++) {
+		char expect[BSIZE];
+		fill(expect, RANGE_START + i, 1);
+		assert(memcmp(rbuf + i * BSIZE, expect, BSIZE) == 0);
+		check_block(pbp, RANGE_START + i, 1);
+	}
+
+	/* nothing is done when any block number is out of range */
+	off_t nblock = pmemblk_nblock(pbp);
+	fill(vbufs[0], 2, 100);
+	iov[1].blockno = nblock;
+	errno = 0;
+	assert(pmemblk_writev(pbp, iov, 2) == -1 && errno == EINVAL);
+	iov[1].blockno = -1;
+	errno = 0;
+	assert(pmemblk_writev(pbp, iov, 2) == -1 && errno == EINVAL);
+	check_block(pbp, 2, gen[0]);
+
+	errno = 0;
+	assert(pmemblk_write_range(pbp, rbuf, nblock - 1, 2) == -1 &&
+			errno == EINVAL);
+	errno = 0;
+	assert(pmemblk_read_range(pbp, rbuf, -1, 1) == -1 && errno == EINVAL);
+	errno = 0;
+	assert(pmemblk_readv(pbp, iov, -1) == -1 && errno == EINVAL);
+
+	/* empty batches, and the last block */
+	assert(pmemblk_writev(pbp, iov, 0) == 0);
+	assert(pmemblk_read_range(pbp, rbuf, nblock, 0) == 0);
+	fill(rbuf, nblock - 1, 2);
+	assert(pmemblk_write_range(pbp, rbuf, nblock - 1, 1) == 0);
+	check_block(pbp, nblock - 1, 2);
+
+	/* the batches are as durable as single writes */
+	pmemblk_unmap(pbp);
+	pbp = pmemblk_map(fd, BSIZE);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map: %s", argv[1]);
+	check_block(pbp, 1, 0);
+	for (int i = 0; i < 50; i++)
+		check_block(pbp, 2 + i, gen[i]);
+	for (int i = 0; i < NRANGE; i++)
+		check_block(pbp, RANGE_START + i, 1);
+	check_block(pbp, nblock - 1, 2);
+	pmemblk_unmap(pbp);
+	CLOSE(fd);
+
+	assert(pmemblk_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
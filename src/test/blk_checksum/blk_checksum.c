@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * blk_checksum.c -- unit test for per-block checksums and scrubbing
+ *
+ * usage: blk_checksum file csum|nocsum
+ *
+ * Blocks are damaged behind the pool's back, through the file.  With
+ * checksums (the pool created with PMEM_BLK_CHECKSUM=1) reading them
+ * fails and the scrubber sets them to the error state, without they
+ * read back damaged.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+#include <time.h>
+
+#define	BSIZE 512
+#define	NBLOCKS 10
+#define	SCAN_LEN ((off_t)32 << 20)	/* searched at both ends of the file */
+#define	SCAN_CHUNK ((size_t)1 << 20)
+
+/*
+ * fill -- the contents of a block
+ */
+static void
+fill(char *buf, int blockno, int gen)
+{
+	memset(buf, 'a' + blockno, BSIZE);
+	sprintf(buf, "block %d generation %d", blockno, gen);
+}
+
+/*
+ * find -- look for a block in a range of the file
+ *
+ * Returns the offset of the block or -1.
+ */
+static off_t
+find(int fd, const char *marker, off_t start, off_t end)
+{
+	/* the chunks overlap by a block, a block may straddle two */
+	char *chunk = MALLOC(SCAN_CHUNK + BSIZE);
+	off_t found = -1;
+
+	for (off_t off = start; off < end && found < 0; off += SCAN_CHUNK) {
+		ssize_t len = pread(fd, chunk, SCAN_CHUNK + BSIZE, off);
+		assert(len >= BSIZE);
+		for (size_t i = 0; i + BSIZE <= len; i += 256)
+			if (memcmp(chunk + i, marker, BSIZE) == 0) {
+				found = off + i;
+				break;
+			}
+	}
+
+	FREE(chunk);
+	return found;
+}
+
+/*
+ * damage -- flip a byte in the middle of a block, through the file
+ *
+ * Written blocks are either free blocks taken from the end of the data
+ * area, or blocks freed by earlier writes at its start.
+ */
+static void
+damage(int fd, int blockno, int gen)
+{
+	char marker[BSIZE];
+	fill(marker, blockno, gen);
+
+	struct stat stbuf;
+	FSTAT(fd, &stbuf);
+
+	off_t off = find(fd, marker, 0, SCAN_LEN);
+	if (off < 0)
+		off = find(fd, marker, stbuf.st_size - SCAN_LEN,
+				stbuf.st_size);
+	if (off < 0)
+		FATAL("block %d not found", blockno);
+
+	char c = marker[BSIZE / 2] ^ 0x01;
+	assert(pwrite(fd, &c, 1, off + BSIZE / 2) == 1);
+}
+
+/*
+ * check_block -- check a block reads back as written or fails with EIO
+ */
+static void
+check_block(PMEMblk *pbp, int blockno, int gen, int eio)
+{
+	char expect[BSIZE];
+	char buf[BSIZE];
+
+	fill(expect, blockno, gen);
+	if (eio) {
+		assert(pmemblk_read(pbp, buf, blockno) == -1);
+		assert(errno == EIO);
+	} else {
+		assert(pmemblk_read(pbp, buf, blockno) == 0);
+		assert(memcmp(buf, expect, BSIZE) == 0);
+	}
+}
+
+/*
+ * now -- seconds, for the rate limit
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * scrub_pass -- run the scrubber over all blocks once
+ */
+static void
+scrub_pass(PMEMblk *pbp, uint64_t errors)
+{
+	struct pmemblk_scrub_stats stats;
+
+	assert(pmemblk_scrub_start(pbp, 0) == 0);
+	assert(pmemblk_scrub_start(pbp, 0) == -1);
+	assert(errno == EBUSY);
+
+	do {
+		usleep(10000);
+		assert(pmemblk_scrub_stats(pbp, &stats) == 0);
+	} while (stats.passes == 0);
+
+	assert(stats.blocks >= pmemblk_nblock(pbp));
+	assert(stats.errors == errors);
+	assert(pmemblk_scrub_stop(pbp) == 0);
+	assert(pmemblk_scrub_stats(pbp, &stats) == -1);
+	assert(errno == EINVAL);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "blk_checksum");
+
+	if (argc != 3)
+		FATAL("usage: %s file csum|nocsum", argv[0]);
+
+	int csum = strcmp(argv[2], "csum") == 0;
+
+	int fd = OPEN(argv[1], O_RDWR);
+	PMEMblk *pbp = pmemblk_map(fd, BSIZE);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map: %s", argv[1]);
+
+	char buf[BSIZE];
+	for (int i = 0; i < NBLOCKS; i++) {
+		fill(buf, i, 0);
+		assert(pmemblk_write(pbp, buf, i) == 0);
+	}
+
+	damage(fd, 3, 0);
+	damage(fd, 7, 0);
+
+	if (!csum) {
+		/* nothing notices */
+		char expect[BSIZE];
+		fill(expect, 3, 0);
+		assert(pmemblk_read(pbp, buf, 3) == 0);
+		assert(buf[BSIZE / 2] == (expect[BSIZE / 2] ^ 0x01));
+		check_block(pbp, 2, 0, 0);
+		scrub_pass(pbp, 0);
+		pmemblk_unmap(pbp);
+		CLOSE(fd);
+		DONE(NULL);
+	}
+
+	/* a read finds a bad block, the scrubber finds and marks both */
+	check_block(pbp, 3, 0, 1);
+	for (int i = 0; i < NBLOCKS; i++)
+		if (i != 3 && i != 7)
+			check_block(pbp, i, 0, 0);
+	scrub_pass(pbp, 2);
+	check_block(pbp, 3, 0, 1);
+	check_block(pbp, 7, 0, 1);
+
+	/* already in the error state, nothing new is found */
+	scrub_pass(pbp, 0);
+
+	/* rewriting a bad block makes it good again */
+	fill(buf, 3, 1);
+	assert(pmemblk_write(pbp, buf, 3) == 0);
+	check_block(pbp, 3, 1, 0);
+
+	/* the scrubber keeps to its rate and stops right away */
+	struct pmemblk_scrub_stats stats;
+	double start = now();
+	assert(pmemblk_scrub_start(pbp, 1000) == 0);
+	usleep(200000);
+	assert(pmemblk_scrub_stats(pbp, &stats) == 0);
+	assert(stats.blocks <= 1000 * (now() - start) + 2);
+	assert(pmemblk_scrub_stop(pbp) == 0);
+	assert(now() - start < 1.0);
+
+	/* the error state is persistent, unmap stops a running scrubber */
+	assert(pmemblk_scrub_start(pbp, 10) == 0);
+	pmemblk_unmap(pbp);
+	pbp = pmemblk_map(fd, BSIZE);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map: %s", argv[1]);
+	check_block(pbp, 3, 1, 0);
+	check_block(pbp, 7, 0, 1);
+	pmemblk_unmap(pbp);
+	CLOSE(fd);
+
+	assert(pmemblk_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * blk_lanes.c -- unit test for pmemblk lanes
+ *
+ * usage: blk_lanes file nthread
+ *
+ * Each thread owns NBLOCKS blocks and rewrites them NROUNDS times, as
+ * single writes and as a batch on alternate rounds, checking them after
+ * each round.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	BSIZE 512
+#define	NBLOCKS 16
+#define	NROUNDS 50
+
+static PMEMblk *Pbp;
+
+/*
+ * fill -- the contents of a block
+ */
+static void
+fill(char *buf, off_t blockno, int round)
+{
+	memset(buf, 'a' + blockno % 26, BSIZE);
+	sprintf(buf, "block %zu round %d", blockno, round);
+}
+
+/*
+ * check_blocks -- read a thread's blocks and compare them
+ */
+static void
+check_blocks(PMEMblk *pbp, int t, int round)
+{
+	char buf[BSIZE];
+	char expect[BSIZE];
+
+	for (int i = 0; i < NBLOCKS; i++) {
+		off_t blockno = t * NBLOCKS + i;
+		fill(expect, blockno, round);
+		assert(pmemblk_read(pbp, buf, blockno) == 0);
+		assert(memcmp(buf, expect, BSIZE) == 0);
+	}
+}
+
+/*
+ * worker -- rewrite the blocks of a thread over and over
+ */
+static void *
+worker(void *arg)
+{
+	int t = (int)(uintptr_t)arg;
+	static __thread char bufs[NBLOCKS][BSIZE];
+	struct pmemblk_iov iov[NBLOCKS];
+
+	for (int round = 0; round < NROUNDS; round++) {
+		for (int i = 0; i < NBLOCKS; i++) {
+			iov[i].buf = bufs[i];
+			iov[i].blockno = t * NBLOCKS + i;
+			fill(bufs[i], iov[i].blockno, round);
+		}
+
+		if (round % 2)
+			assert(pmemblk_writev(Pbp, iov, NBLOCKS) == 0);
+		else
+			for (int i = 0; i < NBLOCKS; i++)
+				assert(pmemblk_write(Pbp, bufs[i],
+						iov[i].blockno) == 0);
+
+		check_blocks(Pbp, t, round);
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "blk_lanes");
+
+	if (argc != 3)
+		FATAL("usage: %s file nthread", argv[0]);
+
+	int nthread = atoi(argv[2]);
+	if (nthread < 1)
+		FATAL("nthread %d out of range", nthread);
+
+	int fd = OPEN(argv[1], O_RDWR);
+	Pbp = pmemblk_map(fd, BSIZE);
+	if (Pbp == NULL)
+		FATAL("!pmemblk_map: %s", argv[1]);
+
+	pthread_t *threads = MALLOC(nthread * sizeof (*threads));
+	for (int t = 0; t < nthread; t++)
+		PTHREAD_CREATE(&threads[t], NULL, worker, (void *)(uintptr_t)t);
+	for (int t = 0; t < nthread; t++)
+		PTHREAD_JOIN(threads[t], NULL);
+	FREE(threads);
+
+	pmemblk_unmap(Pbp);
+	Pbp = pmemblk_map(fd, BSIZE);
+	if (Pbp == NULL)
+		FATAL("!pmemblk_map: %s", argv[1]);
+	for (int t = 0; t < nthread; t++)
+		check_blocks(Pbp, t, NROUNDS - 1);
+	pmemblk_unmap(Pbp);
+	CLOSE(fd);
+
+	assert(pmemblk_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
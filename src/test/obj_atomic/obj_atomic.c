@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * obj_atomic.c -- unit test for atomic allocation and free
+ *
+ * usage: obj_atomic file a|v
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	TYPE_NODE 1
+#define	NNODES 100
+#define	NLANES 64	/* lanes of a pool, OBJ_NLANES */
+
+struct base {
+	PMEMoid nodes[NNODES];
+	PMEMoid crashed;
+};
+
+/*
+ * construct -- store the index passed as arg in the new object
+ */
+static void
+construct(PMEMobjpool *pop, void *ptr, void *arg)
+{
+	*(int *)ptr = *(int *)arg;
+}
+
+/*
+ * construct_crash -- exit while constructing, without publishing
+ */
+static void
+construct_crash(PMEMobjpool *pop, void *ptr, void *arg)
+{
+	*(int *)ptr = -1;
+	_exit(0);	/* no publish, no close */
+}
+
+static int Nholding;	/* threads inside a transaction */
+static int Go;		/* set when they may end it */
+
+/*
+ * lane_holder -- keep a lane busy in a transaction until told to stop
+ */
+static void *
+lane_holder(void *arg)
+{
+	jmp_buf env;
+	if (setjmp(env))
+		assert(0);
+
+	pmemobj_tx_begin(arg, env);
+	__sync_fetch_and_add(&Nholding, 1);
+	while (!__sync_fetch_and_add(&Go, 0))
+		sched_yield();
+	pmemobj_tx_commit();
+
+	return NULL;
+}
+
+/*
+ * atomic_in_tx -- allocate and free in a transaction with no lane free
+ *
+ * The atomic calls have to use the lane of the transaction, waiting for
+ * a lane would mean waiting for one this thread holds.
+ */
+static void
+atomic_in_tx(PMEMobjpool *pop, struct base *bp)
+{
+	jmp_buf env;
+	if (setjmp(env))
+		assert(0);
+
+	pmemobj_tx_begin(pop, env);
+
+	pthread_t threads[NLANES - 1];
+	for (int t = 0; t < NLANES - 1; t++)
+		PTHREAD_CREATE(&threads[t], NULL, lane_holder, pop);
+	while (__sync_fetch_and_add(&Nholding, 0) < NLANES - 1)
+		sched_yield();
+
+	int i = 0;
+	assert(pmemobj_alloc_atomic(pop, &bp->crashed, sizeof (int),
+			TYPE_NODE, construct, &i) == 0);
+	assert(pmemobj_free_atomic(pop, &bp->crashed) == 0);
+
+	__sync_fetch_and_add(&Go, 1);
+	for (int t = 0; t < NLANES - 1; t++)
+		PTHREAD_JOIN(threads[t], NULL);
+
+	pmemobj_tx_commit();
+}
+
+/*
+ * count_nodes -- count the objects of TYPE_NODE
+ */
+static int
+count_nodes(PMEMobjpool *pop)
+{
+	int n = 0;
+	for (PMEMoid oid = pmemobj_first(pop, TYPE_NODE);
+			!pmemobj_nulloid(oid); oid = pmemobj_next(oid))
+		n++;
+	return n;
+}
+
+/*
+ * check_nodes -- verify every other node was freed
+ */
+static void
+check_nodes(struct base *bp)
+{
+	for (int i = 0; i < NNODES; i++) {
+		if (i % 2) {
+			assert(pmemobj_nulloid(bp->nodes[i]));
+		} else {
+			assert(!pmemobj_nulloid(bp->nodes[i]));
+			assert(pmemobj_type_num(bp->nodes[i]) == TYPE_NODE);
+			assert(*(int *)pmemobj_direct(bp->nodes[i]) == i);
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_atomic");
+
+	if (argc < 3)
+		FATAL("usage: %s file a|v", argv[0]);
+
+	PMEMobjpool *pop;
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+
+	switch (argv[2][0]) {
+	case 'a': {
+		for (int i = 0; i < NNODES; i++)
+			assert(pmemobj_alloc_atomic(pop, &bp->nodes[i],
+				sizeof (int), TYPE_NODE, construct, &i) == 0);
+		assert(count_nodes(pop) == NNODES);
+
+		for (int i = 1; i < NNODES; i += 2)
+			assert(pmemobj_free_atomic(pop, &bp->nodes[i]) == 0);
+		check_nodes(bp);
+		assert(count_nodes(pop) == NNODES / 2);
+
+		/* freeing the NULL object does nothing */
+		assert(pmemobj_free_atomic(pop, &bp->nodes[1]) == 0);
+
+		/* the destination must be in the pool */
+		PMEMoid oid;
+		assert(pmemobj_alloc_atomic(pop, &oid, sizeof (int),
+				TYPE_NODE, NULL, NULL) == -1);
+		assert(errno == EINVAL);
+		assert(pmemobj_alloc_atomic(pop, &bp->crashed, sizeof (int),
+				PMEMOBJ_NUM_TYPES, NULL, NULL) == -1);
+		assert(errno == EINVAL);
+
+		atomic_in_tx(pop, bp);
+		assert(count_nodes(pop) == NNODES / 2);
+
+		int i = 0;
+		pmemobj_alloc_atomic(pop, &bp->crashed, sizeof (int),
+				TYPE_NODE, construct_crash, &i);
+		assert(0);	/* not reached */
+		break;
+	}
+
+	case 'v':
+		/* the object being constructed never became visible */
+		assert(pmemobj_nulloid(bp->crashed));
+		check_nodes(bp);
+		assert(count_nodes(pop) == NNODES / 2);
+		break;
+
+	default:
+		FATAL("unknown op %s", argv[2]);
+	}
+
+	pmemobj_pool_close(pop);
+	assert(pmemobj_pool_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
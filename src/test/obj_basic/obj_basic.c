@@ -317,13 +317,51 @@ do_test_abort_inner_transactions(PMEMobjpool *pop)
 	pmemobj_tx_commit();
 }
 
+void
+do_test_root_resize(PMEMobjpool *pop)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	struct base old = *bp;
+
+	assert(pmemobj_root_resize(pop, 2 * sizeof (*bp)) == 0);
+
+	struct base *nbp = pmemobj_root_direct(pop, 2 * sizeof (*bp));
+	assert(memcmp(nbp, &old, sizeof (old)) == 0);
+
+	char *tail = (char *)(nbp + 1);
+	for (int i = 0; i < sizeof (*bp); i++)
+		assert(tail[i] == 0);
+
+	/* shrinking keeps the object in place */
+	assert(pmemobj_root_resize(pop, sizeof (*bp)) == 0);
+	assert(pmemobj_root_direct(pop, sizeof (*bp)) == nbp);
+}
+
+void
+do_test_nested_other_pool(PMEMobjpool *pop, PMEMobjpool *pop2)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	jmp_buf env;
+
+	if (setjmp(env)) {
+		code_not_reached();
+		return;
+	}
+
+	/* the inner one would run in the lane of the outer pool */
+	pmemobj_tx_begin_lock(pop, env, &bp->mutex);
+	assert(pmemobj_tx_begin(pop2, env) == 0);
+	assert(errno == EINVAL);
+	pmemobj_tx_commit();
+}
+
 int
 main(int argc, char **argv)
 {
 	START(argc, argv, "obj_basic");
 
-	if (argc < 2)
-		FATAL("usage: %s file", argv[0]);
+	if (argc < 3)
+		FATAL("usage: %s file file2", argv[0]);
 
 	PMEMobjpool *pop = pmemobj_pool_open(argv[1]);
 
@@ -337,6 +375,12 @@ main(int argc, char **argv)
 	do_test_abort_set_single_transaction(pop);
 	do_test_abort_delete_single_transaction(pop);
 	do_test_abort_inner_transactions(pop);
+	do_test_root_resize(pop);
+
+	PMEMobjpool *pop2 = pmemobj_pool_open(argv[2]);
+	assert(pop2 != NULL);
+	do_test_nested_other_pool(pop, pop2);
+	pmemobj_pool_close(pop2);
 
 	/* all done */
 	pmemobj_pool_close(pop);
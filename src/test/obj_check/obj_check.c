@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * obj_check.c -- unit test for pool check and transaction recovery
+ *
+ * usage: obj_check file c|k
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	NVALUES 100	/* more than fit in one undo log chunk */
+#define	NHUGE 3		/* huge objects, spanning batches of the check */
+#define	HUGE_SIZE ((size_t)40 << 20)
+#define	TEST_VALUE_A 5
+#define	TEST_VALUE_B 6
+
+struct base {
+	int values[NVALUES];
+	PMEMoid huge[NHUGE];
+};
+
+#define	code_not_reached() assert(0)
+
+static size_t Progress_done;
+
+/*
+ * progress -- record progress reported by the check
+ */
+static void
+progress(size_t done, size_t total)
+{
+	assert(done <= total);
+	assert(done >= Progress_done);
+	Progress_done = done;
+}
+
+/*
+ * set_values -- set all values in a transaction, crash if told to
+ */
+static void
+set_values(PMEMobjpool *pop, int value, int crash)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	jmp_buf env;
+
+	if (setjmp(env)) {
+		code_not_reached();
+		return;
+	}
+
+	pmemobj_tx_begin(pop, env);
+
+	for (int i = 0; i < NVALUES; i++)
+		PMEMOBJ_SET(bp->values[i], value);
+
+	/* another allocation the roll back has to undo */
+	PMEMoid oid = pmemobj_alloc(sizeof (int));
+	assert(!pmemobj_nulloid(oid));
+
+	if (crash)
+		_exit(0);	/* no commit, no close */
+
+	pmemobj_tx_commit();
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_check");
+
+	if (argc < 3)
+		FATAL("usage: %s file c|k", argv[0]);
+
+	PMEMobjpool *pop;
+	struct base *bp;
+
+	switch (argv[2][0]) {
+	case 'c':
+		if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+			FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+		set_values(pop, TEST_VALUE_A, 0);
+
+		bp = pmemobj_root_direct(pop, sizeof (*bp));
+		for (int i = 0; i < NHUGE; i++)
+			assert(pmemobj_alloc_atomic(pop, &bp->huge[i],
+					HUGE_SIZE, 1, NULL, NULL) == 0);
+
+		set_values(pop, TEST_VALUE_B, 1);
+		code_not_reached();
+		break;
+
+	case 'k':
+		pmemobj_set_check_progress_func(progress);
+		assert(pmemobj_pool_check(argv[1]) == 1);
+		assert(Progress_done > 0);
+
+		if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+			FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+		bp = pmemobj_root_direct(pop, sizeof (*bp));
+		for (int i = 0; i < NVALUES; i++)
+			assert(bp->values[i] == TEST_VALUE_A);
+
+		pmemobj_pool_close(pop);
+
+		/* a file without a pool header is not consistent */
+		int fd = OPEN(argv[1], O_RDWR);
+		char zero[64] = { 0 };
+		if (pwrite(fd, zero, sizeof (zero), 0) != sizeof (zero))
+			FATAL("!pwrite");
+		CLOSE(fd);
+		assert(pmemobj_pool_check(argv[1]) == 0);
+		break;
+
+	default:
+		FATAL("unknown op %s", argv[2]);
+	}
+
+	DONE(NULL);
+}
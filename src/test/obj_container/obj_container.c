@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * obj_container.c -- unit test for persistent lists and hash maps
+ *
+ * usage: obj_container file l|v|m
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <stddef.h>
+#include <assert.h>
+
+#define	TYPE_NODE 1
+#define	NNODES 10
+
+#define	NTHREADS 4
+#define	NKEYS 500	/* per thread, enough to resize a few times */
+
+struct node {
+	int value;
+	PMEMlistentry entry;
+};
+
+#define	PE_OFFSET offsetof(struct node, entry)
+
+static PMEMoid Nulloid;	/* the NULL object */
+
+struct base {
+	PMEMlisthead head;
+	PMEMoid map;
+	PMEMoid spare;
+};
+
+/*
+ * construct -- store the value passed as arg in the new node
+ */
+static void
+construct(PMEMobjpool *pop, void *ptr, void *arg)
+{
+	((struct node *)ptr)->value = *(int *)arg;
+}
+
+/*
+ * construct_crash -- exit while constructing, without linking
+ */
+static void
+construct_crash(PMEMobjpool *pop, void *ptr, void *arg)
+{
+	((struct node *)ptr)->value = -1;
+	_exit(0);	/* no publish, no close */
+}
+
+/*
+ * check_list -- verify the list holds the expected values, in order
+ */
+static void
+check_list(PMEMobjpool *pop, PMEMlisthead *head, const int *values, int n)
+{
+	int i = 0;
+	for (PMEMoid oid = pmemobj_list_first(pop, head);
+			!pmemobj_nulloid(oid);
+			oid = pmemobj_list_next(pop, head, PE_OFFSET, oid)) {
+		assert(i < n);
+		assert(((struct node *)pmemobj_direct(oid))->value ==
+				values[i]);
+		i++;
+	}
+	assert(i == n);
+}
+
+/*
+ * do_list -- build a list, move and remove nodes, then crash
+ */
+static void
+do_list(PMEMobjpool *pop, struct base *bp)
+{
+	PMEMoid oids[NNODES];
+	for (int i = 0; i < NNODES; i++) {
+		/* odd values are appended, even ones go to the head */
+		oids[i] = pmemobj_list_insert_new(pop, &bp->head, PE_OFFSET,
+				Nulloid, !(i % 2), sizeof (struct node),
+				TYPE_NODE, construct, &i);
+		assert(!pmemobj_nulloid(oids[i]));
+	}
+	int built[NNODES] = { 8, 6, 4, 2, 0, 1, 3, 5, 7, 9 };
+	check_list(pop, &bp->head, built, NNODES);
+
+	/* move the last node before the first one */
+	assert(pmemobj_list_remove(pop, &bp->head, PE_OFFSET, oids[9],
+			0) == 0);
+	assert(pmemobj_list_insert(pop, &bp->head, PE_OFFSET, oids[8], 1,
+			oids[9]) == 0);
+
+	/* free some, the node after 0 goes away too */
+	assert(pmemobj_list_remove(pop, &bp->head, PE_OFFSET, oids[0],
+			1) == 0);
+	assert(pmemobj_list_remove(pop, &bp->head, PE_OFFSET, oids[1],
+			1) == 0);
+	int changed[] = { 9, 8, 6, 4, 2, 3, 5, 7 };
+	check_list(pop, &bp->head, changed, 8);
+
+	/* removing an unlinked node fails */
+	assert(pmemobj_list_remove(pop, &bp->head, PE_OFFSET, oids[1],
+			0) == -1);
+	assert(errno == EINVAL);
+
+	int i = 0;
+	pmemobj_list_insert_new(pop, &bp->head, PE_OFFSET, oids[2], 0,
+			sizeof (struct node), TYPE_NODE, construct_crash, &i);
+	assert(0);	/* not reached */
+}
+
+/*
+ * verify_list -- the node being constructed never showed up
+ */
+static void
+verify_list(PMEMobjpool *pop, struct base *bp)
+{
+	int changed[] = { 9, 8, 6, 4, 2, 3, 5, 7 };
+	check_list(pop, &bp->head, changed, 8);
+
+	int n = 0;
+	for (PMEMoid oid = pmemobj_first(pop, TYPE_NODE);
+			!pmemobj_nulloid(oid); oid = pmemobj_next(oid))
+		n++;
+	assert(n == 8);
+}
+
+struct worker_args {
+	PMEMobjpool *pop;
+	struct base *bp;
+	uint64_t first;
+};
+
+/*
+ * insert_worker -- insert a range of keys, each mapping to the root
+ */
+static void *
+insert_worker(void *arg)
+{
+	struct worker_args *wa = arg;
+
+	for (uint64_t key = wa->first; key < wa->first + NKEYS; key++)
+		assert(pmemobj_map_insert(wa->pop, wa->bp->map, key,
+				wa->bp->spare) == 0);
+
+	return NULL;
+}
+
+/*
+ * do_map -- fill a map concurrently, then check, shrink and destroy it
+ */
+static void
+do_map(PMEMobjpool *pop, struct base *bp)
+{
+	assert(pmemobj_map_create(pop, &bp->map, 0) == 0);
+	assert(pmemobj_alloc_atomic(pop, &bp->spare, sizeof (int), TYPE_NODE,
+			NULL, NULL) == 0);
+
+	pthread_t threads[NTHREADS];
+	struct worker_args args[NTHREADS];
+	for (int t = 0; t < NTHREADS; t++) {
+		args[t].pop = pop;
+		args[t].bp = bp;
+		args[t].first = (uint64_t)t * NKEYS;
+		PTHREAD_CREATE(&threads[t], NULL, insert_worker, &args[t]);
+	}
+	for (int t = 0; t < NTHREADS; t++)
+		PTHREAD_JOIN(threads[t], NULL);
+
+	assert(pmemobj_map_count(pop, bp->map) == NTHREADS * NKEYS);
+
+	/* replacing a value does not add a key */
+	assert(pmemobj_map_insert(pop, bp->map, 0, Nulloid) == 0);
+	assert(pmemobj_map_count(pop, bp->map) == NTHREADS * NKEYS);
+	assert(pmemobj_nulloid(pmemobj_map_get(pop, bp->map, 0)));
+
+	for (uint64_t key = 1; key < NTHREADS * NKEYS; key++) {
+		PMEMoid oid = pmemobj_map_get(pop, bp->map, key);
+		assert(oid.off == bp->spare.off);
+	}
+	assert(pmemobj_nulloid(pmemobj_map_get(pop, bp->map,
+			NTHREADS * NKEYS)));
+
+	for (uint64_t key = 1; key < NTHREADS * NKEYS; key += 2)
+		assert(pmemobj_map_remove(pop, bp->map, key).off ==
+				bp->spare.off);
+	assert(pmemobj_nulloid(pmemobj_map_remove(pop, bp->map, 1)));
+	assert(pmemobj_map_count(pop, bp->map) == NTHREADS * NKEYS / 2);
+
+	for (uint64_t key = 2; key < NTHREADS * NKEYS; key += 2)
+		assert(!pmemobj_nulloid(pmemobj_map_get(pop, bp->map, key)));
+
+	assert(pmemobj_map_destroy(pop, &bp->map) == 0);
+	assert(pmemobj_nulloid(bp->map));
+
+	/* the value objects are left alone */
+	assert(pmemobj_type_num(bp->spare) == TYPE_NODE);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_container");
+
+	if (argc < 3)
+		FATAL("usage: %s file l|v|m", argv[0]);
+
+	PMEMobjpool *pop;
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+
+	switch (argv[2][0]) {
+	case 'l':
+		do_list(pop, bp);
+		break;
+	case 'v':
+		verify_list(pop, bp);
+		break;
+	case 'm':
+		do_map(pop, bp);
+		break;
+	default:
+		FATAL("unknown op %s", argv[2]);
+	}
+
+	pmemobj_pool_close(pop);
+	assert(pmemobj_pool_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * obj_epoch.c -- unit test for deferred frees
+ *
+ * usage: obj_epoch file w|v
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	TYPE_NODE 1
+#define	NNODES 200	/* more than are kept before a reclaim */
+
+struct base {
+	PMEMoid node;
+	PMEMoid crashed;
+};
+
+/*
+ * alloc_node -- allocate a node holding val and store it in the root
+ */
+static void
+alloc_node(PMEMobjpool *pop, struct base *bp, int val)
+{
+	jmp_buf env;
+	if (setjmp(env))
+		assert(0);
+
+	pmemobj_tx_begin(pop, env);
+	PMEMoid oid = pmemobj_alloc_type(sizeof (int), TYPE_NODE);
+	assert(!pmemobj_nulloid(oid));
+	*(int *)pmemobj_direct(oid) = val;
+	PMEMOBJ_SET(bp->node, oid);
+	pmemobj_tx_commit();
+}
+
+/*
+ * free_node -- free the node in the root
+ */
+static void
+free_node(PMEMobjpool *pop, struct base *bp)
+{
+	jmp_buf env;
+	if (setjmp(env))
+		assert(0);
+
+	PMEMoid oid = bp->node;
+	PMEMoid null = { 0 };
+	pmemobj_tx_begin(pop, env);
+	PMEMOBJ_SET(bp->node, null);
+	pmemobj_free(oid);
+	pmemobj_tx_commit();
+}
+
+/*
+ * free_worker -- free a node without a transaction and exit
+ */
+static void *
+free_worker(void *arg)
+{
+	PMEMobjpool *pop = arg;
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+
+	alloc_node(pop, bp, 3);
+	assert(pmemobj_free_atomic(pop, &bp->node) == 0);
+	assert(pmemobj_nulloid(bp->node));
+
+	return NULL;
+}
+
+/*
+ * count_nodes -- count the objects of TYPE_NODE
+ */
+static int
+count_nodes(PMEMobjpool *pop)
+{
+	int n = 0;
+	for (PMEMoid oid = pmemobj_first(pop, TYPE_NODE);
+			!pmemobj_nulloid(oid); oid = pmemobj_next(oid))
+		n++;
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_epoch");
+
+	if (argc < 3)
+		FATAL("usage: %s file w|v", argv[0]);
+
+	PMEMobjpool *pop;
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	struct pmemobj_stats st;
+
+	switch (argv[2][0]) {
+	case 'w': {
+		/* a reader holds on to a node freed meanwhile */
+		alloc_node(pop, bp, 1);
+		assert(pmemobj_epoch_enter(pop) == 0);
+		int *valp = pmemobj_direct(bp->node);
+		free_node(pop, bp);
+		assert(count_nodes(pop) == 0);
+
+		assert(pmemobj_epoch_reclaim(pop) == 0);
+		assert(pmemobj_epoch_reclaim(pop) == 0);
+		assert(*valp == 1);
+		assert(pmemobj_pool_stats(pop, &st) == 0);
+		uint64_t frees = st.frees;	/* undo copies so far */
+
+		/* epochs nest, only the outermost exit counts */
+		assert(pmemobj_epoch_enter(pop) == 0);
+		pmemobj_epoch_exit(pop);
+		assert(pmemobj_epoch_reclaim(pop) == 0);
+		pmemobj_epoch_exit(pop);
+
+		/* two epochs later nobody can see the node any more */
+		int n = 0;
+		while (pmemobj_epoch_reclaim(pop) == 0)
+			assert(++n <= 2);
+		assert(pmemobj_pool_stats(pop, &st) == 0);
+		assert(st.frees == frees + 1);
+
+		/* what an exited thread freed is reclaimed by another one */
+		assert(pmemobj_epoch_enter(pop) == 0);
+		pthread_t thread;
+		PTHREAD_CREATE(&thread, NULL, free_worker, pop);
+		PTHREAD_JOIN(thread, NULL);
+		assert(count_nodes(pop) == 0);
+		assert(pmemobj_pool_stats(pop, &st) == 0);
+		frees = st.frees;
+		assert(pmemobj_epoch_reclaim(pop) == 0);
+		pmemobj_epoch_exit(pop);
+
+		n = 0;
+		while (pmemobj_epoch_reclaim(pop) == 0)
+			assert(++n <= 2);
+		assert(pmemobj_pool_stats(pop, &st) == 0);
+		assert(st.frees == frees + 1);
+
+		/* without readers frees are carried out as they pile up */
+		for (int i = 0; i < NNODES; i++) {
+			alloc_node(pop, bp, i);
+			free_node(pop, bp);
+		}
+		assert(pmemobj_pool_stats(pop, &st) == 0);
+		assert(st.frees > frees + 1 + 2 * NNODES);
+		assert(count_nodes(pop) == 0);
+
+		/* end the program with a node still retired */
+		alloc_node(pop, bp, 2);
+		bp->crashed = bp->node;
+		pmemobj_persist(pop, &bp->crashed, sizeof (bp->crashed));
+		assert(pmemobj_epoch_enter(pop) == 0);
+		free_node(pop, bp);
+		_exit(0);	/* no reclaim, no close */
+	}
+
+	case 'v':
+		/* the retired node was freed when the pool was opened */
+		assert(pmemobj_type_num(bp->crashed) != TYPE_NODE);
+		assert(pmemobj_pool_stats(pop, &st) == 0);
+		assert(st.frees >= 1);
+		assert(count_nodes(pop) == 0);
+		break;
+
+	default:
+		FATAL("unknown op %s", argv[2]);
+	}
+
+	pmemobj_pool_close(pop);
+	assert(pmemobj_pool_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
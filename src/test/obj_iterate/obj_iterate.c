@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * obj_iterate.c -- unit test for object type numbers and pool iteration
+ *
+ * usage: obj_iterate file
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	TYPE_SMALL 1
+#define	TYPE_HUGE 2
+#define	TYPE_UNUSED 3
+
+#define	NSMALL 1000
+#define	NFREED 10
+#define	HUGE_SIZE (5 * 1024 * 1024)	/* more than one allocator line */
+
+struct base {
+	PMEMoid freed[NFREED];
+};
+
+#define	code_not_reached() assert(0)
+
+/*
+ * alloc_objects -- allocate the test objects, the first few get freed
+ */
+static void
+alloc_objects(PMEMobjpool *pop)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	jmp_buf env;
+
+	if (setjmp(env)) {
+		code_not_reached();
+		return;
+	}
+
+	pmemobj_tx_begin(pop, env);
+	for (int i = 0; i < NSMALL; i++) {
+		PMEMoid oid = pmemobj_alloc_type(sizeof (int) + i % 64,
+							TYPE_SMALL);
+		assert(!pmemobj_nulloid(oid));
+		assert(pmemobj_type_num(oid) == TYPE_SMALL);
+		assert(pmemobj_size(oid) >= sizeof (int) + i % 64);
+		PMEMOBJ_SET(*(int *)pmemobj_direct(oid), i);
+		if (i < NFREED)
+			PMEMOBJ_SET(bp->freed[i], oid);
+	}
+
+	PMEMoid oid = pmemobj_alloc_type(HUGE_SIZE, TYPE_HUGE);
+	assert(!pmemobj_nulloid(oid));
+	assert(pmemobj_size(oid) >= HUGE_SIZE);
+
+	/* untyped objects are of type 0 */
+	oid = pmemobj_alloc(sizeof (int));
+	assert(pmemobj_type_num(oid) == 0);
+
+	assert(pmemobj_nulloid(pmemobj_alloc_type(1, PMEMOBJ_NUM_TYPES)));
+	assert(errno == EINVAL);
+	pmemobj_tx_commit();
+
+	/* objects allocated by an aborted transaction are gone */
+	if (setjmp(env) == 0) {
+		pmemobj_tx_begin(pop, env);
+		for (int i = 0; i < NSMALL; i++)
+			pmemobj_alloc_type(sizeof (int), TYPE_SMALL);
+		pmemobj_tx_abort(ECANCELED);
+	}
+
+	/* so are freed ones */
+	if (setjmp(env)) {
+		code_not_reached();
+		return;
+	}
+
+	pmemobj_tx_begin(pop, env);
+	for (int i = 0; i < NFREED; i++)
+		pmemobj_free(bp->freed[i]);
+	pmemobj_tx_commit();
+}
+
+/*
+ * check_objects -- verify iteration finds exactly the live objects
+ */
+static void
+check_objects(PMEMobjpool *pop)
+{
+	int n = 0;
+	for (PMEMoid oid = pmemobj_first(pop, TYPE_SMALL);
+			!pmemobj_nulloid(oid); oid = pmemobj_next(oid)) {
+		assert(pmemobj_type_num(oid) == TYPE_SMALL);
+		/* objects are visited in allocation order */
+		assert(*(int *)pmemobj_direct(oid) == NFREED + n);
+		n++;
+	}
+	assert(n == NSMALL - NFREED);
+
+	PMEMoid oid = pmemobj_first(pop, TYPE_HUGE);
+	assert(!pmemobj_nulloid(oid));
+	assert(pmemobj_size(oid) >= HUGE_SIZE);
+	assert(pmemobj_nulloid(pmemobj_next(oid)));
+
+	assert(pmemobj_nulloid(pmemobj_first(pop, TYPE_UNUSED)));
+	assert(pmemobj_nulloid(pmemobj_first(pop, PMEMOBJ_NUM_TYPES)));
+
+	PMEMoid null = { 0 };
+	assert(pmemobj_type_num(null) == PMEMOBJ_NUM_TYPES);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_iterate");
+
+	if (argc < 2)
+		FATAL("usage: %s file", argv[0]);
+
+	PMEMobjpool *pop;
+
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+	alloc_objects(pop);
+	check_objects(pop);
+	pmemobj_pool_close(pop);
+
+	/* type numbers are persistent */
+	if ((pop = pmemobj_pool_open_rdonly(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open_rdonly: %s", argv[1]);
+	check_objects(pop);
+	pmemobj_pool_close(pop);
+
+	assert(pmemobj_pool_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * obj_locks.c -- unit test for PMEMmutex, PMEMrwlock and PMEMcond
+ *
+ * usage: obj_locks file
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	NTHREADS 8
+#define	NLOOPS 10000	/* lock round trips per thread */
+
+struct base {
+	PMEMmutex mutex;
+	PMEMrwlock rwlock;
+	PMEMcond cond;
+	int counter;
+	int ready;
+};
+
+#define	code_not_reached() assert(0)
+
+/*
+ * mutex_worker -- count under the mutex, racing on its first use
+ */
+static void *
+mutex_worker(void *arg)
+{
+	struct base *bp = arg;
+
+	for (int i = 0; i < NLOOPS; i++) {
+		assert(pmemobj_mutex_lock(&bp->mutex) == 0);
+		bp->counter++;
+		assert(pmemobj_mutex_unlock(&bp->mutex) == 0);
+	}
+
+	return NULL;
+}
+
+/*
+ * rwlock_worker -- count under the write lock, racing on its first use
+ */
+static void *
+rwlock_worker(void *arg)
+{
+	struct base *bp = arg;
+
+	for (int i = 0; i < NLOOPS; i++) {
+		assert(pmemobj_rwlock_wrlock(&bp->rwlock) == 0);
+		bp->counter++;
+		assert(pmemobj_rwlock_unlock(&bp->rwlock) == 0);
+	}
+
+	return NULL;
+}
+
+/*
+ * cond_worker -- wait for the main thread to signal
+ */
+static void *
+cond_worker(void *arg)
+{
+	struct base *bp = arg;
+
+	assert(pmemobj_mutex_lock(&bp->mutex) == 0);
+	while (!bp->ready)
+		assert(pmemobj_cond_wait(&bp->cond, &bp->mutex) == 0);
+	bp->counter++;
+	assert(pmemobj_mutex_unlock(&bp->mutex) == 0);
+
+	return NULL;
+}
+
+/*
+ * run_threads -- run NTHREADS of func on bp, return the final count
+ */
+static int
+run_threads(void *(*func)(void *), struct base *bp)
+{
+	pthread_t threads[NTHREADS];
+
+	bp->counter = 0;
+	for (int t = 0; t < NTHREADS; t++)
+		PTHREAD_CREATE(&threads[t], NULL, func, bp);
+	for (int t = 0; t < NTHREADS; t++)
+		PTHREAD_JOIN(threads[t], NULL);
+
+	return bp->counter;
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_locks");
+
+	if (argc < 2)
+		FATAL("usage: %s file", argv[0]);
+
+	PMEMobjpool *pop;
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+
+	/* every thread must end up with the same lock */
+	assert(run_threads(mutex_worker, bp) == NTHREADS * NLOOPS);
+	assert(run_threads(rwlock_worker, bp) == NTHREADS * NLOOPS);
+
+	/* and with the same condition variable */
+	bp->ready = 0;
+	pthread_t threads[NTHREADS];
+	bp->counter = 0;
+	for (int t = 0; t < NTHREADS; t++)
+		PTHREAD_CREATE(&threads[t], NULL, cond_worker, bp);
+	assert(pmemobj_mutex_lock(&bp->mutex) == 0);
+	bp->ready = 1;
+	assert(pmemobj_cond_broadcast(&bp->cond) == 0);
+	assert(pmemobj_mutex_unlock(&bp->mutex) == 0);
+	for (int t = 0; t < NTHREADS; t++)
+		PTHREAD_JOIN(threads[t], NULL);
+	assert(bp->counter == NTHREADS);
+
+	/* a transaction begun with a lock releases it when it ends */
+	jmp_buf env;
+	if (setjmp(env))
+		code_not_reached();
+	assert(pmemobj_tx_begin_lock(pop, env, &bp->mutex) != 0);
+	assert(pmemobj_mutex_trylock(&bp->mutex) == EBUSY);
+	assert(pmemobj_tx_commit() == 0);
+	assert(pmemobj_mutex_trylock(&bp->mutex) == 0);
+	assert(pmemobj_mutex_unlock(&bp->mutex) == 0);
+
+	assert(pmemobj_tx_begin_wrlock(pop, env, &bp->rwlock) != 0);
+	assert(pmemobj_rwlock_tryrdlock(&bp->rwlock) == EBUSY);
+	pmemobj_tx_abort(ECANCELED);
+	assert(pmemobj_rwlock_trywrlock(&bp->rwlock) == 0);
+	assert(pmemobj_rwlock_unlock(&bp->rwlock) == 0);
+
+	/* a nested transaction releases its lock, not the outer one's */
+	if (setjmp(env))
+		code_not_reached();
+	assert(pmemobj_tx_begin_lock(pop, env, &bp->mutex) != 0);
+	assert(pmemobj_tx_begin_wrlock(pop, env, &bp->rwlock) != 0);
+	assert(pmemobj_tx_commit() == 0);
+	assert(pmemobj_rwlock_trywrlock(&bp->rwlock) == 0);
+	assert(pmemobj_rwlock_unlock(&bp->rwlock) == 0);
+	assert(pmemobj_mutex_trylock(&bp->mutex) == EBUSY);
+	assert(pmemobj_tx_commit() == 0);
+	assert(pmemobj_mutex_trylock(&bp->mutex) == 0);
+	assert(pmemobj_mutex_unlock(&bp->mutex) == 0);
+
+	pmemobj_pool_close(pop);
+
+	DONE(NULL);
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * obj_mirror.c -- unit test for mirrored pools
+ *
+ * usage: obj_mirror file1 file2
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+struct base {
+	PMEMoid test;
+	int value;	/* copy of *test, the OID is not valid across opens */
+};
+
+#define	TEST_VALUE_A 5
+#define	TEST_VALUE_B 6
+
+#define	code_not_reached() assert(0)
+
+/*
+ * set_value -- replace the object hanging off the root in a transaction
+ */
+static void
+set_value(PMEMobjpool *pop, int value, int abort)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	jmp_buf env;
+
+	if (setjmp(env)) {
+		code_not_reached();
+		return;
+	}
+
+	pmemobj_tx_begin(pop, env);
+
+	PMEMoid oid = pmemobj_alloc(sizeof (int));
+	int *ptr = pmemobj_direct(oid);
+	*ptr = value;
+	PMEMOBJ_SET(bp->test, oid);
+	PMEMOBJ_SET(bp->value, value);
+	assert(*(int *)pmemobj_direct(bp->test) == value);
+
+	if (abort)
+		pmemobj_tx_abort(0);
+	else
+		pmemobj_tx_commit();
+}
+
+/*
+ * get_value -- return the value last stored in the root
+ */
+static int
+get_value(PMEMobjpool *pop)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	return bp->value;
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_mirror");
+
+	if (argc < 3)
+		FATAL("usage: %s file1 file2", argv[0]);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof (path), "%s:%s", argv[1], argv[2]);
+
+	/* first open creates the pool and copies it to the replica */
+	PMEMobjpool *pop = pmemobj_pool_open(path);
+	if (pop == NULL)
+		FATAL("!pmemobj_pool_open: %s", path);
+
+	set_value(pop, TEST_VALUE_A, 0);
+	assert(get_value(pop) == TEST_VALUE_A);
+	pmemobj_pool_close(pop);
+
+	assert(pmemobj_pool_check_mirrored(argv[1], argv[2]) == 1);
+
+	/* committed changes reach the replica, aborted ones are rolled back */
+	if ((pop = pmemobj_pool_open_mirrored(argv[1], argv[2])) == NULL)
+		FATAL("!pmemobj_pool_open_mirrored");
+
+	set_value(pop, TEST_VALUE_B, 0);
+	set_value(pop, TEST_VALUE_A, 1);
+	assert(get_value(pop) == TEST_VALUE_B);
+	pmemobj_pool_close(pop);
+
+	assert(pmemobj_pool_check_mirrored(argv[1], argv[2]) == 1);
+
+	/* damage the replica header, the next open must resync it */
+	int fd = OPEN(argv[2], O_RDWR);
+	char zero[64] = { 0 };
+	if (pwrite(fd, zero, sizeof (zero), 0) != sizeof (zero))
+		FATAL("!pwrite");
+	CLOSE(fd);
+
+	assert(pmemobj_pool_check_mirrored(argv[1], argv[2]) == 0);
+
+	if ((pop = pmemobj_pool_open_mirrored(argv[1], argv[2])) == NULL)
+		FATAL("!pmemobj_pool_open_mirrored");
+	assert(get_value(pop) == TEST_VALUE_B);
+	pmemobj_pool_close(pop);
+
+	assert(pmemobj_pool_check_mirrored(argv[1], argv[2]) == 1);
+
+	DONE(NULL);
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * obj_poolset.c -- unit test for pool sets and pmemobj_pool_extend
+ *
+ * usage: obj_poolset setfile x newpart | setfile o | setfile e
+ *
+ * x extends the pool with newpart, o just opens and closes it and e
+ * expects the open to fail with EINVAL.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	MB (1024 * 1024)
+
+/* too big for what is left of the initial 8MB set */
+#define	BIG_SIZE (6 * MB)
+#define	PART_SIZE (16 * MB)
+#define	TEST_MAGIC 0x7365747365747365
+
+struct base {
+	uint64_t magic;
+	PMEMoid big;
+	PMEMmutex mutex;
+};
+
+#define	code_not_reached() assert(0)
+
+/*
+ * alloc_big -- allocate a huge object and link it from the root
+ */
+static PMEMoid
+alloc_big(PMEMobjpool *pop)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	jmp_buf env;
+
+	if (setjmp(env)) {
+		code_not_reached();
+		return bp->big;
+	}
+
+	pmemobj_tx_begin_lock(pop, env, &bp->mutex);
+
+	PMEMoid big = pmemobj_alloc(BIG_SIZE);
+	if (!pmemobj_nulloid(big)) {
+		memset(pmemobj_direct(big), 0xab, BIG_SIZE);
+		PMEMOBJ_SET(bp->big, big);
+	}
+
+	pmemobj_tx_commit();
+
+	return big;
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_poolset");
+
+	if (argc < 3 || (argv[2][0] == 'x' && argc < 4))
+		FATAL("usage: %s setfile x newpart | setfile o | setfile e",
+				argv[0]);
+
+	PMEMobjpool *pop = pmemobj_pool_open(argv[1]);
+	if (argv[2][0] == 'e') {
+		assert(pop == NULL);
+		assert(errno == EINVAL);
+		DONE(NULL);
+	}
+	if (pop == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+	if (argv[2][0] == 'o') {
+		pmemobj_pool_close(pop);
+		DONE(NULL);
+	}
+	if (argv[2][0] != 'x')
+		FATAL("unknown mode %s", argv[2]);
+
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	bp->magic = TEST_MAGIC;
+
+	/* the initial set cannot hold the object */
+	PMEMoid big = alloc_big(pop);
+	assert(pmemobj_nulloid(big));
+
+	/* grow it while open, the root must not move */
+	if (pmemobj_pool_extend(pop, argv[3], PART_SIZE) < 0)
+		FATAL("!pmemobj_pool_extend: %s", argv[3]);
+	assert(pmemobj_root_direct(pop, sizeof (*bp)) == bp);
+	assert(bp->magic == TEST_MAGIC);
+
+	/* the part is already in the set */
+	assert(pmemobj_pool_extend(pop, argv[3], PART_SIZE) < 0);
+	assert(errno == EEXIST);
+
+	big = alloc_big(pop);
+	assert(!pmemobj_nulloid(big));
+	unsigned char *ptr = pmemobj_direct(big);
+	assert(ptr[0] == 0xab && ptr[BIG_SIZE - 1] == 0xab);
+
+	pmemobj_pool_close(pop);
+
+	/* reopen, the set file now names all three parts */
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+	bp = pmemobj_root_direct(pop, sizeof (*bp));
+	assert(bp->magic == TEST_MAGIC);
+	assert(bp->big.off == big.off);
+
+	/* there is room for one more */
+	big = alloc_big(pop);
+	assert(!pmemobj_nulloid(big));
+
+	pmemobj_pool_close(pop);
+
+	DONE(NULL);
+}
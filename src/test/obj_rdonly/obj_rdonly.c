@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * obj_rdonly.c -- unit test for read-only and copy-on-write pool opens
+ *
+ * usage: obj_rdonly file c|r
+ *
+ * c creates the pool, r then opens it in the various read-only ways, in
+ * a run of its own so none of the pool's locks has been used in it yet.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	TEST_VALUE_A 5
+#define	TEST_VALUE_B 6
+#define	TEST_KEY 7
+
+/* the parts of the pool header looked at */
+#define	HDR_SIZE 4096
+#define	HDR_INCOMPAT_OFF 16
+#define	HDR_RO_COMPAT_OFF 20
+#define	HDR_CSUM_OFF 4088
+#define	HDR_FEAT_CRC32C 0x0001
+#define	HDR_RO_COMPAT_UNKNOWN 0x80000000
+
+#define	HEAD_SIZE (1 << 20)	/* the beginning of the pool compared */
+
+struct base {
+	int value;
+	PMEMmutex mutex;
+	PMEMrwlock rwlock;
+	PMEMoid map;
+};
+
+#define	code_not_reached() assert(0)
+
+/*
+ * set_value -- set the value in the root object in a transaction
+ */
+static void
+set_value(PMEMobjpool *pop, int value)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	jmp_buf env;
+
+	if (setjmp(env)) {
+		code_not_reached();
+		return;
+	}
+
+	pmemobj_tx_begin(pop, env);
+	PMEMOBJ_SET(bp->value, value);
+
+	PMEMoid oid = pmemobj_alloc(sizeof (int));
+	assert(!pmemobj_nulloid(oid));
+
+	pmemobj_tx_commit();
+}
+
+/*
+ * get_value -- read the value from the root object
+ */
+static int
+get_value(PMEMobjpool *pop)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	assert(bp != NULL);
+
+	return bp->value;
+}
+
+/*
+ * set_unknown_ro_compat -- give the pool a feature only readers support
+ *
+ * The header checksum is computed again, the Fletcher64 way new pools
+ * use by default, the checksum field counted as zero.
+ */
+static void
+set_unknown_ro_compat(char *path)
+{
+	int fd = OPEN(path, O_RDWR);
+	unsigned char buf[HDR_SIZE];
+	assert(pread(fd, buf, HDR_SIZE, 0) == HDR_SIZE);
+
+	uint32_t feat;
+	memcpy(&feat, buf + HDR_INCOMPAT_OFF, sizeof (feat));
+	assert((feat & HDR_FEAT_CRC32C) == 0);
+	memcpy(&feat, buf + HDR_RO_COMPAT_OFF, sizeof (feat));
+	feat |= HDR_RO_COMPAT_UNKNOWN;
+	memcpy(buf + HDR_RO_COMPAT_OFF, &feat, sizeof (feat));
+
+	uint32_t lo = 0;
+	uint32_t hi = 0;
+	for (size_t off = 0; off < HDR_SIZE; off += 4) {
+		uint32_t w;
+		memcpy(&w, buf + off, sizeof (w));
+		if (off >= HDR_CSUM_OFF)
+			w = 0;
+		lo += w;
+		hi += lo;
+	}
+	uint64_t csum = (uint64_t)hi << 32 | lo;
+	memcpy(buf + HDR_CSUM_OFF, &csum, sizeof (csum));
+
+	assert(pwrite(fd, buf, HDR_SIZE, 0) == HDR_SIZE);
+	CLOSE(fd);
+}
+
+/*
+ * check_locks -- use the map and the locks of a read-only pool
+ *
+ * None of them may store anything in the pool.
+ */
+static void
+check_locks(PMEMobjpool *pop)
+{
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+	assert(bp != NULL);
+
+	PMEMoid oid = pmemobj_map_get(pop, bp->map, TEST_KEY);
+	assert(oid.off == bp->map.off);
+	assert(pmemobj_map_count(pop, bp->map) == 1);
+	assert(pmemobj_map_insert(pop, bp->map, TEST_KEY + 1, oid) == -1);
+	assert(errno == EROFS);
+
+	assert(pmemobj_mutex_lock(&bp->mutex) == 0);
+	assert(pmemobj_mutex_trylock(&bp->mutex) == EBUSY);
+	assert(pmemobj_mutex_unlock(&bp->mutex) == 0);
+
+	assert(pmemobj_rwlock_rdlock(&bp->rwlock) == 0);
+	assert(pmemobj_rwlock_trywrlock(&bp->rwlock) == EBUSY);
+	assert(pmemobj_rwlock_unlock(&bp->rwlock) == 0);
+}
+
+/*
+ * read_head -- read the beginning of the pool file
+ */
+static void
+read_head(char *path, char *buf)
+{
+	int fd = OPEN(path, O_RDONLY);
+	assert(pread(fd, buf, HEAD_SIZE, 0) == HEAD_SIZE);
+	CLOSE(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_rdonly");
+
+	if (argc < 3)
+		FATAL("usage: %s file c|r", argv[0]);
+
+	PMEMobjpool *pop;
+
+	if (argv[2][0] == 'c') {
+		/* a file without a pool header cannot be opened read-only */
+		assert(pmemobj_pool_open_rdonly(argv[1]) == NULL);
+		assert(errno == EINVAL);
+
+		if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+			FATAL("!pmemobj_pool_open: %s", argv[1]);
+		set_value(pop, TEST_VALUE_A);
+
+		struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+		assert(pmemobj_map_create(pop, &bp->map, 0) == 0);
+		assert(pmemobj_map_insert(pop, bp->map, TEST_KEY,
+				bp->map) == 0);
+		pmemobj_pool_close(pop);
+
+		DONE(NULL);
+	}
+
+	/* changes made through a copy-on-write open are discarded */
+	if ((pop = pmemobj_pool_open_cow(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open_cow: %s", argv[1]);
+	assert(get_value(pop) == TEST_VALUE_A);
+	set_value(pop, TEST_VALUE_B);
+	assert(get_value(pop) == TEST_VALUE_B);
+	assert(pmemobj_pool_extend(pop, argv[1], 1 << 20) == -1);
+	assert(errno == EROFS);
+	pmemobj_pool_close(pop);
+
+	/* a read-only pool can be read, but not changed */
+	if ((pop = pmemobj_pool_open_rdonly(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open_rdonly: %s", argv[1]);
+	assert(get_value(pop) == TEST_VALUE_A);
+	check_locks(pop);
+
+	jmp_buf env;
+	assert(pmemobj_tx_begin(pop, env) == 0);
+	assert(errno == EROFS);
+	assert(pmemobj_root_resize(pop, 2 * sizeof (struct base)) == -1);
+	assert(errno == EROFS);
+	pmemobj_pool_close(pop);
+
+	/* the pool is still intact for a regular open */
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+	assert(get_value(pop) == TEST_VALUE_A);
+	pmemobj_pool_close(pop);
+
+	/*
+	 * A pool with a feature only readers support is opened read-only
+	 * even if asked for writing, and not even its run-time fields are
+	 * written to the file.
+	 */
+	set_unknown_ro_compat(argv[1]);
+	char *before = MALLOC(HEAD_SIZE);
+	char *after = MALLOC(HEAD_SIZE);
+	read_head(argv[1], before);
+
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+	assert(get_value(pop) == TEST_VALUE_A);
+	check_locks(pop);
+	assert(pmemobj_tx_begin(pop, env) == 0);
+	assert(errno == EROFS);
+	pmemobj_pool_close(pop);
+
+	read_head(argv[1], after);
+	assert(memcmp(before, after, HEAD_SIZE) == 0);
+	FREE(before);
+	FREE(after);
+
+	DONE(NULL);
+}
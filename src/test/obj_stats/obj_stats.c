@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * obj_stats.c -- unit test for pool stats
+ *
+ * usage: obj_stats file on|off
+ *
+ * Pools only gather stats with PMEMOBJ_STATS=1 set, "off" checks there
+ * are none without it.  The stats printed are logged to out0.log.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	NTHREADS 4
+#define	NTX 50		/* transactions per thread */
+
+struct base {
+	int values[NTHREADS];
+};
+
+#define	code_not_reached() assert(0)
+
+struct worker_args {
+	PMEMobjpool *pop;
+	int idx;
+};
+
+/*
+ * tx_worker -- run transactions, every other one aborted
+ */
+static void *
+tx_worker(void *arg)
+{
+	struct worker_args *wa = arg;
+	struct base *bp = pmemobj_root_direct(wa->pop, sizeof (*bp));
+
+	for (int i = 0; i < NTX; i++) {
+		jmp_buf env;
+		if (setjmp(env)) {
+			code_not_reached();
+			return NULL;
+		}
+
+		pmemobj_tx_begin(wa->pop, env);
+		PMEMoid oid = pmemobj_alloc(64);
+		assert(!pmemobj_nulloid(oid));
+		pmemobj_memcpy(&bp->values[wa->idx], &i, sizeof (i));
+		if (i % 2)
+			pmemobj_tx_abort(0);
+		else
+			pmemobj_tx_commit();
+	}
+
+	return NULL;
+}
+
+/*
+ * print_stats -- log the lines printed at level 0, the stats
+ */
+static void
+print_stats(const char *s)
+{
+	if (strstr(s, ": <0> [") != NULL)
+		OUT("%.*s", (int)strcspn(s, "\n"), s);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_stats");
+
+	if (argc < 3 || (strcmp(argv[2], "on") && strcmp(argv[2], "off")))
+		FATAL("usage: %s file on|off", argv[0]);
+
+	PMEMobjpool *pop;
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+	struct pmemobj_stats st;
+	struct pmemobj_latency lat;
+	if (strcmp(argv[2], "off") == 0) {
+		assert(pmemobj_pool_stats(pop, &st) < 0 && errno == ENOTSUP);
+		assert(pmemobj_pool_latency(pop, PMEMOBJ_LATENCY_TX,
+				&lat) < 0 && errno == ENOTSUP);
+		pmemobj_pool_close(pop);
+		DONE(NULL);
+	}
+
+	assert(pmemobj_pool_stats(pop, &st) == 0);
+	assert(st.tx_begun == 0);
+
+	/* allocate the root object before the threads race for it */
+	(void) pmemobj_root_direct(pop, sizeof (struct base));
+
+	pthread_t threads[NTHREADS];
+	struct worker_args args[NTHREADS];
+	for (int t = 0; t < NTHREADS; t++) {
+		args[t].pop = pop;
+		args[t].idx = t;
+		PTHREAD_CREATE(&threads[t], NULL, tx_worker, &args[t]);
+	}
+	for (int t = 0; t < NTHREADS; t++)
+		PTHREAD_JOIN(threads[t], NULL);
+
+	/* the counters of the exited threads are still there */
+	assert(pmemobj_pool_stats(pop, &st) == 0);
+	assert(st.tx_begun == NTHREADS * NTX);
+	assert(st.tx_committed == NTHREADS * NTX / 2);
+	assert(st.tx_aborted == NTHREADS * NTX / 2);
+	assert(st.undo_bytes == NTHREADS * NTX * sizeof (int));
+	/* the objects and their undo copies */
+	assert(st.allocs >= 2 * NTHREADS * NTX);
+	assert(st.alloc_bytes >= NTHREADS * NTX * (64 + sizeof (int)));
+	assert(st.frees >= NTHREADS * NTX);
+	assert(st.flushes > 0 && st.flush_bytes > 0);
+
+	int which[] = { PMEMOBJ_LATENCY_TX, PMEMOBJ_LATENCY_ALLOC,
+		PMEMOBJ_LATENCY_FLUSH };
+	for (int i = 0; i < sizeof (which) / sizeof (which[0]); i++) {
+		assert(pmemobj_pool_latency(pop, which[i], &lat) == 0);
+		assert(lat.count > 0);
+		assert(lat.p50 > 0 && lat.p50 <= lat.p99 &&
+				lat.p99 <= lat.p999 && lat.p999 <= lat.max);
+	}
+	assert(pmemobj_pool_latency(pop, PMEMOBJ_LATENCY_TX, &lat) == 0);
+	assert(lat.count == NTHREADS * NTX / 2);
+
+	assert(pmemobj_pool_latency(pop, 3, &lat) < 0 && errno == EINVAL);
+
+	pmem_set_funcs(NULL, NULL, NULL, NULL, print_stats, NULL);
+	pmemobj_pool_stats_print(pop);
+	pmem_set_funcs(NULL, NULL, NULL, NULL, NULL, NULL);
+
+	pmemobj_pool_close(pop);
+
+	DONE(NULL);
+}
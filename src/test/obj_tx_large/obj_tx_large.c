@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * obj_tx_large.c -- unit test for transactions changing large ranges
+ *
+ * usage: obj_tx_large file w file2 | file v
+ *
+ * The second pool is only used by "w", to check a thread keeps its lane
+ * in each pool it alternates between.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	MB (1 << 20)
+#define	BUFSIZE (3 * MB + 100)	/* spans four undo extents */
+
+struct base {
+	PMEMoid buf;
+};
+
+/*
+ * check_buf -- verify every byte of the buffer is c
+ */
+static void
+check_buf(const char *buf, char c)
+{
+	for (size_t i = 0; i < BUFSIZE; i++)
+		assert(buf[i] == c);
+}
+
+/*
+ * update -- change the whole buffer to c in a transaction
+ */
+static void
+update(PMEMobjpool *pop, char *buf, char *tmp, char c, int commit)
+{
+	jmp_buf env;
+	if (setjmp(env))
+		assert(0);
+
+	memset(tmp, c, BUFSIZE);
+	pmemobj_tx_begin(pop, env);
+	assert(pmemobj_memcpy(buf, tmp, BUFSIZE) == 0);
+	if (commit)
+		pmemobj_tx_commit();
+	else
+		pmemobj_tx_abort(0);
+}
+
+static pthread_barrier_t Barrier;
+
+/*
+ * holder -- keep a transaction, so a lane, open on a pool for a while
+ */
+static void *
+holder(void *arg)
+{
+	PMEMobjpool *pop = arg;
+	jmp_buf env;
+	if (setjmp(env))
+		assert(0);
+
+	pmemobj_tx_begin(pop, env);
+	pthread_barrier_wait(&Barrier);	/* the lane is held */
+	pthread_barrier_wait(&Barrier);	/* main is done with the pool */
+	pmemobj_tx_commit();
+
+	return NULL;
+}
+
+/*
+ * other_pool -- use another lane in a second pool, then the first again
+ *
+ * The lane the thread used in the first pool, whose undo extents are
+ * warm, is still the one it gets there.
+ */
+static void
+other_pool(PMEMobjpool *pop, const char *path, char *buf, char *tmp)
+{
+	PMEMobjpool *pop2;
+	if ((pop2 = pmemobj_pool_open(path)) == NULL)
+		FATAL("!pmemobj_pool_open: %s", path);
+
+	pthread_t thread;
+	pthread_barrier_init(&Barrier, NULL, 2);
+	PTHREAD_CREATE(&thread, NULL, holder, pop2);
+	pthread_barrier_wait(&Barrier);
+
+	jmp_buf env;
+	if (setjmp(env))
+		assert(0);
+	pmemobj_tx_begin(pop2, env);
+	pmemobj_tx_commit();
+
+	struct pmemobj_stats before, after;
+	assert(pmemobj_pool_stats(pop, &before) == 0);
+	update(pop, buf, tmp, 'c', 1);
+	assert(pmemobj_pool_stats(pop, &after) == 0);
+	assert(after.allocs == before.allocs);
+
+	pthread_barrier_wait(&Barrier);
+	PTHREAD_JOIN(thread, NULL);
+	pthread_barrier_destroy(&Barrier);
+	pmemobj_pool_close(pop2);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "obj_tx_large");
+
+	if (argc < 3 || (argv[2][0] == 'w' && argc < 4))
+		FATAL("usage: %s file w file2 | file v", argv[0]);
+
+	PMEMobjpool *pop;
+	if ((pop = pmemobj_pool_open(argv[1])) == NULL)
+		FATAL("!pmemobj_pool_open: %s", argv[1]);
+
+	struct base *bp = pmemobj_root_direct(pop, sizeof (*bp));
+
+	switch (argv[2][0]) {
+	case 'w': {
+		assert(pmemobj_alloc_atomic(pop, &bp->buf, BUFSIZE, 1,
+				NULL, NULL) == 0);
+		char *buf = pmemobj_direct(bp->buf);
+		memset(buf, 'a', BUFSIZE);
+		pmemobj_persist(pop, buf, BUFSIZE);
+
+		char *tmp = MALLOC(BUFSIZE);
+
+		update(pop, buf, tmp, 'b', 0);
+		check_buf(buf, 'a');
+
+		update(pop, buf, tmp, 'b', 1);
+		check_buf(buf, 'b');
+
+		/* the undo extents are reused, nothing is allocated */
+		struct pmemobj_stats before, after;
+		assert(pmemobj_pool_stats(pop, &before) == 0);
+		update(pop, buf, tmp, 'c', 1);
+		assert(pmemobj_pool_stats(pop, &after) == 0);
+		check_buf(buf, 'c');
+		assert(after.allocs == before.allocs);
+		assert(after.undo_bytes == before.undo_bytes + BUFSIZE);
+
+		other_pool(pop, argv[3], buf, tmp);
+		check_buf(buf, 'c');
+
+		/* the limit covers everything a transaction copies */
+		jmp_buf env;
+		if (setjmp(env))
+			assert(0);
+		pmemobj_tx_set_undo_limit(pop, MB);
+		pmemobj_tx_begin(pop, env);
+		assert(pmemobj_memcpy(buf, tmp, MB / 2) == 0);
+		assert(pmemobj_memcpy(buf, tmp, MB / 2 + 1) == -1);
+		assert(errno == EFBIG);
+		pmemobj_tx_abort(0);
+		check_buf(buf, 'c');
+		pmemobj_tx_set_undo_limit(pop, 0);
+
+		/* crash in the middle of a large transaction */
+		memset(tmp, 'd', BUFSIZE);
+		pmemobj_tx_begin(pop, env);
+		assert(pmemobj_memcpy(buf, tmp, BUFSIZE) == 0);
+		_exit(0);	/* no commit, no close */
+	}
+
+	case 'v':
+		/* the large range was rolled back from the extents */
+		check_buf(pmemobj_direct(bp->buf), 'c');
+		break;
+
+	default:
+		FATAL("unknown op %s", argv[2]);
+	}
+
+	pmemobj_pool_close(pop);
+	assert(pmemobj_pool_check(argv[1]) == 1);
+
+	DONE(NULL);
+}
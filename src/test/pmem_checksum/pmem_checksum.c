@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_checksum.c -- unit test for the pool header checksums
+ *
+ * usage: pmem_checksum log|blk|obj file fletcher64|crc32c
+ *
+ * The pool is created, or opened if it exists, and some data is stored
+ * in it.  The header (and for blk the BTT info block) must then say it
+ * uses the given algorithm, and carry the checksum computed here the
+ * slow way.  The data must still be there after reopening, so the
+ * library checked the header with the same algorithm.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+/* the parts of the on-media layouts looked at */
+#define	INFO_SIZE 4096		/* pool_hdr and btt_info */
+#define	CSUM_OFF 4088		/* checksum field of both */
+#define	HDR_INCOMPAT_OFF 16
+#define	HDR_FEAT_CRC32C 0x0001
+#define	BTT_SIG "BTT_ARENA_INFO"
+#define	BTT_FLAGS_OFF 32
+#define	BTT_FLAG_CRC32C 0x0002
+
+#define	BLK_SIZE 512
+#define	BLK_NO 5
+
+static char Data[] = "checksummed";
+
+/*
+ * fletcher64 -- the checksum as 32-bit words, the field counted as zero
+ */
+static uint64_t
+fletcher64(const unsigned char *buf)
+{
+	uint32_t lo = 0;
+	uint32_t hi = 0;
+
+	for (size_t off = 0; off < INFO_SIZE; off += 4) {
+		uint32_t w;
+		memcpy(&w, buf + off, sizeof (w));
+		if (off >= CSUM_OFF)
+			w = 0;
+		lo += w;
+		hi += lo;
+	}
+
+	return (uint64_t)hi << 32 | lo;
+}
+
+/*
+ * crc32c -- the checksum bit by bit, the field counted as zero
+ */
+static uint64_t
+crc32c(const unsigned char *buf)
+{
+	uint32_t crc = ~0U;
+
+	for (size_t off = 0; off < INFO_SIZE; off++) {
+		crc ^= off >= CSUM_OFF ? 0 : buf[off];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+/*
+ * check_info -- check a header or info block uses the algorithm
+ */
+static void
+check_info(const unsigned char *buf, int is_crc32c)
+{
+	uint64_t csum;
+	memcpy(&csum, buf + CSUM_OFF, sizeof (csum));
+
+	if (is_crc32c)
+		assert(csum == crc32c(buf));
+	else
+		assert(csum == fletcher64(buf));
+}
+
+/*
+ * check_file -- check the pool header and BTT info block in the file
+ */
+static void
+check_file(char *path, int is_crc32c)
+{
+	int fd = OPEN(path, O_RDONLY);
+	unsigned char buf[INFO_SIZE];
+
+	assert(pread(fd, buf, INFO_SIZE, 0) == INFO_SIZE);
+	uint32_t incompat;
+	memcpy(&incompat, buf + HDR_INCOMPAT_OFF, sizeof (incompat));
+	assert(!!(incompat & HDR_FEAT_CRC32C) == is_crc32c);
+	check_info(buf, is_crc32c);
+
+	/* a blk pool has a BTT in its data area, right after the header */
+	for (off_t off = INFO_SIZE; off < 16 * INFO_SIZE; off += INFO_SIZE) {
+		assert(pread(fd, buf, INFO_SIZE, off) == INFO_SIZE);
+		if (strcmp((char *)buf, BTT_SIG) != 0)
+			continue;
+
+		uint32_t flags;
+		memcpy(&flags, buf + BTT_FLAGS_OFF, sizeof (flags));
+		assert(!!(flags & BTT_FLAG_CRC32C) == is_crc32c);
+		check_info(buf, is_crc32c);
+		OUT("btt info at %jd", (intmax_t)off);
+		break;
+	}
+
+	CLOSE(fd);
+}
+
+/*
+ * do_log -- append to the log once, find it there
+ */
+static int
+do_log(char *path)
+{
+	int fd = OPEN(path, O_RDWR);
+	PMEMlog *plp = pmemlog_map(fd);
+	if (plp == NULL)
+		FATAL("!pmemlog_map: %s", path);
+
+	if (pmemlog_tell(plp) == 0)
+		assert(pmemlog_append(plp, Data, sizeof (Data)) == 0);
+	int found = pmemlog_tell(plp) == sizeof (Data);
+
+	pmemlog_unmap(plp);
+	CLOSE(fd);
+
+	return found;
+}
+
+/*
+ * do_blk -- write a block once, read it back
+ */
+static int
+do_blk(char *path)
+{
+	int fd = OPEN(path, O_RDWR);
+	PMEMblk *pbp = pmemblk_map(fd, BLK_SIZE);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map: %s", path);
+
+	char buf[BLK_SIZE];
+	assert(pmemblk_read(pbp, buf, BLK_NO) == 0);
+	if (buf[0] == '\0') {
+		memset(buf, '\0', sizeof (buf));
+		strcpy(buf, Data);
+		assert(pmemblk_write(pbp, buf, BLK_NO) == 0);
+		assert(pmemblk_read(pbp, buf, BLK_NO) == 0);
+	}
+	int found = strcmp(buf, Data) == 0;
+
+	pmemblk_unmap(pbp);
+	CLOSE(fd);
+
+	return found;
+}
+
+/*
+ * do_obj -- set the root object once, read it back
+ */
+static int
+do_obj(char *path)
+{
+	PMEMobjpool *pop = pmemobj_pool_open(path);
+	if (pop == NULL)
+		FATAL("!pmemobj_pool_open: %s", path);
+
+	uint64_t *rootp = pmemobj_root_direct(pop, sizeof (*rootp));
+	uint64_t val = 0x5eed;
+
+	if (*rootp == 0) {
+		jmp_buf env;
+		if (setjmp(env))
+			FATAL("transaction failed");
+
+		pmemobj_tx_begin(pop, env);
+		assert(PMEMOBJ_SET(*rootp, val) == 0);
+		pmemobj_tx_commit();
+	}
+	int found = *rootp == val;
+
+	pmemobj_pool_close(pop);
+
+	return found;
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "pmem_checksum");
+
+	if (argc != 4)
+		FATAL("usage: %s log|blk|obj file fletcher64|crc32c", argv[0]);
+
+	int (*func)(char *path);
+	if (strcmp(argv[1], "log") == 0)
+		func = do_log;
+	else if (strcmp(argv[1], "blk") == 0)
+		func = do_blk;
+	else if (strcmp(argv[1], "obj") == 0)
+		func = do_obj;
+	else
+		FATAL("unknown pool type %s", argv[1]);
+
+	int is_crc32c = strcmp(argv[3], "crc32c") == 0;
+
+	assert(func(argv[2]));
+	check_file(argv[2], is_crc32c);
+
+	/* an invalid header would have been made over as a new pool */
+	assert(func(argv[2]));
+	check_file(argv[2], is_crc32c);
+
+	DONE(NULL);
+}
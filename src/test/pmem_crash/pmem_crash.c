@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_crash.c -- crash consistency checker for the pools
+ *
+ * usage: pmem_crash log|blk|obj file
+ *
+ * A short workload runs on the pool with a persist function installed by
+ * pmem_set_funcs() that records the cache lines of each range it is
+ * asked to make persistent, every call ending with a fence.  Afterwards
+ * the recorded flushes are applied one fence at a time to a copy of the
+ * pool as it was before the workload, and the pool's own check or
+ * recovery runs on each of these crash images.  Stores that were never
+ * flushed are never in an image.  Lines flushed under the same fence may
+ * reach the media in any order, so for a fence covering several lines an
+ * image with only the last of them is checked as well.
+ *
+ * Lines flushed again without having changed since they were last made
+ * persistent are counted, they show where flushing could be dropped.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	CACHELINE 64
+
+#define	LOG_APPENDS 8
+#define	BLK_BSIZE 512
+#define	BLK_WRITES 6
+#define	OBJ_TOTAL 1000		/* a + b in the obj root, always */
+#define	OBJ_SIZE 200		/* allocated by the obj workload */
+
+/* a range flushed by one call to the persist function */
+struct record {
+	struct record *next;
+	size_t off;		/* offset in the pool file */
+	size_t len;
+	char data[];
+};
+
+static char *Base;		/* the pool's mapping, file offset zero */
+static size_t Len;
+static struct record *Records;
+static struct record **Tailp = &Records;
+static unsigned Ignored;	/* flushes outside the pool */
+
+/*
+ * record_persist -- persist function recording the lines flushed
+ *
+ * Called from libpmem, so it must not call back into it.
+ */
+static void
+record_persist(void *addr, size_t len, int flags)
+{
+	uintptr_t start = (uintptr_t)addr & ~(CACHELINE - 1);
+	uintptr_t end = ((uintptr_t)addr + len + CACHELINE - 1) &
+				~(CACHELINE - 1);
+
+	if (start < (uintptr_t)Base || end > (uintptr_t)Base + Len) {
+		Ignored++;
+		return;
+	}
+
+	struct record *rp = MALLOC(sizeof (*rp) + end - start);
+	rp->next = NULL;
+	rp->off = start - (uintptr_t)Base;
+	rp->len = end - start;
+	memcpy(rp->data, (void *)start, rp->len);
+
+	*Tailp = rp;
+	Tailp = &rp->next;
+}
+
+/*
+ * find_mapping -- find where the pool file is mapped
+ *
+ * The debug library write-protects parts of the pool, which splits the
+ * mapping, so every piece of it is looked at.
+ */
+static void
+find_mapping(const char *path, size_t len)
+{
+	char *rpath = realpath(path, NULL);
+	if (rpath == NULL)
+		FATAL("!realpath: %s", path);
+
+	FILE *fp = fopen("/proc/self/maps", "r");
+	if (fp == NULL)
+		FATAL("!/proc/self/maps");
+
+	char line[4096];
+	Base = NULL;
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		unsigned long lo, hi, off;
+		int n = 0;
+
+		if (sscanf(line, "%lx-%lx %*s %lx %*s %*s %n",
+				&lo, &hi, &off, &n) < 3 || n == 0)
+			continue;
+
+		char *nl = strchr(line + n, '\n');
+		if (nl)
+			*nl = '\0';
+		if (strcmp(line + n, rpath) != 0)
+			continue;
+
+		char *base = (char *)(lo - off);
+		if (Base == NULL || base < Base)
+			Base = base;
+	}
+
+	fclose(fp);
+	free(rpath);
+
+	if (Base == NULL)
+		FATAL("%s is not mapped", path);
+	Len = len;
+}
+
+/*
+ * copy_file -- copy the pool file, leaving holes where it is all zeros
+ */
+static void
+copy_file(char *from, char *to)
+{
+	int ifd = OPEN(from, O_RDONLY);
+	int ofd = OPEN(to, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	struct stat stbuf;
+	FSTAT(ifd, &stbuf);
+	FTRUNCATE(ofd, stbuf.st_size);
+
+	static char buf[1 << 16];
+	static const char zeros[1 << 16];
+	for (off_t off = 0; off < stbuf.st_size; off += sizeof (buf)) {
+		ssize_t n = pread(ifd, buf, sizeof (buf), off);
+		if (n < 0)
+			FATAL("!pread: %s", from);
+		if (memcmp(buf, zeros, n) != 0 &&
+				pwrite(ofd, buf, n, off) != n)
+			FATAL("!pwrite: %s", to);
+	}
+
+	CLOSE(ifd);
+	CLOSE(ofd);
+}
+
+/*
+ * replay -- check the crash image at every fence of the workload
+ */
+static void
+replay(char *path, int (*check)(const char *path))
+{
+	int fd = OPEN(path, O_RDWR);
+	unsigned fences = 0;
+	unsigned images = 0;
+	size_t lines = 0;
+	size_t redundant = 0;
+
+	for (struct record *rp = Records; rp != NULL; ) {
+		char *old = MALLOC(rp->len);
+		if (pread(fd, old, rp->len, rp->off) != rp->len)
+			FATAL("!pread: %s", path);
+
+		for (size_t i = 0; i < rp->len; i += CACHELINE)
+			if (memcmp(old + i, rp->data + i, CACHELINE) == 0)
+				redundant++;
+		lines += rp->len / CACHELINE;
+		FREE(old);
+
+		/* torn: only the last line of the fence made it */
+		if (rp->len > CACHELINE) {
+			size_t last = rp->len - CACHELINE;
+			if (pwrite(fd, rp->data + last, CACHELINE,
+					rp->off + last) != CACHELINE)
+				FATAL("!pwrite: %s", path);
+			if (!(*check)(path))
+				FATAL("fence %u: inconsistent with only the "
+					"last line of %zu bytes at %zu",
+					fences, rp->len, rp->off);
+			images++;
+		}
+
+		if (pwrite(fd, rp->data, rp->len, rp->off) != rp->len)
+			FATAL("!pwrite: %s", path);
+		if (!(*check)(path))
+			FATAL("fence %u: inconsistent after %zu bytes at %zu",
+				fences, rp->len, rp->off);
+		images++;
+		fences++;
+
+		struct record *next = rp->next;
+		FREE(rp);
+		rp = next;
+	}
+
+	CLOSE(fd);
+
+	OUT("%u fences, %u crash images, %zu lines flushed, %zu redundant, "
+		"%u outside the pool", fences, images, lines, redundant,
+		Ignored);
+}
+
+/*
+ * record_start -- copy the pool as it is, then record what is flushed
+ */
+static void
+record_start(char *path, char *crash)
+{
+	struct stat stbuf;
+	STAT(path, &stbuf);
+	find_mapping(path, stbuf.st_size);
+	copy_file(path, crash);
+	pmem_set_funcs(NULL, NULL, NULL, NULL, NULL, record_persist);
+}
+
+/*
+ * record_stop -- go back to the default persist function
+ */
+static void
+record_stop(void)
+{
+	pmem_set_funcs(NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * check_log -- the log check is run on each crash image
+ */
+static int
+check_log(const char *path)
+{
+	return pmemlog_check(path) == 1;
+}
+
+/*
+ * check_blk -- the blk check, which covers the BTT, is run on each image
+ */
+static int
+check_blk(const char *path)
+{
+	return pmemblk_check(path) == 1;
+}
+
+struct obj_root {
+	uint64_t a;
+	uint64_t b;
+	PMEMoid obj;
+};
+
+static size_t Root_off;		/* offset of the root object in the pool */
+
+/*
+ * check_obj -- recover each image in a copy-on-write view and look at it
+ *
+ * Money only moves between a and b, and an object linked from the root
+ * is complete.  No object but the one linked from the root is visible,
+ * an object freed by a committed transaction is gone.
+ */
+static int
+check_obj(const char *path)
+{
+	PMEMobjpool *pop = pmemobj_pool_open_cow(path);
+	if (pop == NULL)
+		return 0;
+
+	struct obj_root *rp = pmemobj_root_direct(pop, sizeof (*rp));
+	int ok = rp != NULL && rp->a + rp->b == OBJ_TOTAL;
+
+	if (ok && !pmemobj_nulloid(rp->obj)) {
+		/* the pool is mapped elsewhere now */
+		PMEMoid oid = rp->obj;
+		oid.pool = (uint64_t)((char *)rp - Root_off);
+
+		char *p = pmemobj_direct_ntx(oid);
+		ok = pmemobj_size(oid) >= OBJ_SIZE &&
+			p[0] == 'x' && p[OBJ_SIZE - 1] == 'x';
+	}
+
+	if (ok) {
+		int nobjs = 0;
+		for (PMEMoid oid = pmemobj_first(pop, 0);
+				!pmemobj_nulloid(oid); oid = pmemobj_next(oid))
+			nobjs++;
+		ok = nobjs == !pmemobj_nulloid(rp->obj);
+	}
+
+	pmemobj_pool_close(pop);
+	return ok;
+}
+
+/*
+ * do_log -- appends of all sizes, single and vectored
+ */
+static void
+do_log(char *path, char *crash)
+{
+	int fd = OPEN(path, O_RDWR);
+	PMEMlog *plp = pmemlog_map(fd);
+	if (plp == NULL)
+		FATAL("!pmemlog_map: %s", path);
+
+	char buf[4096];
+	memset(buf, 'l', sizeof (buf));
+
+	record_start(path, crash);
+	for (int i = 0; i < LOG_APPENDS; i++)
+		assert(pmemlog_append(plp, buf, 1 + i * 511) == 0);
+	struct iovec iov[] = {
+		{ buf, 10 }, { buf, 100 }, { buf, 1000 }
+	};
+	assert(pmemlog_appendv(plp, iov, 3) == 0);
+	pmemlog_unmap(plp);
+	record_stop();
+
+	CLOSE(fd);
+	replay(crash, check_log);
+}
+
+/*
+ * do_blk -- the first writes, which lay out the BTT, and overwrites
+ */
+static void
+do_blk(char *path, char *crash)
+{
+	int fd = OPEN(path, O_RDWR);
+	PMEMblk *pbp = pmemblk_map(fd, BLK_BSIZE);
+	if (pbp == NULL)
+		FATAL("!pmemblk_map: %s", path);
+
+	char buf[BLK_BSIZE];
+
+	record_start(path, crash);
+	for (int i = 0; i < BLK_WRITES; i++) {
+		memset(buf, 'a' + i, sizeof (buf));
+		assert(pmemblk_write(pbp, buf, i % 3) == 0);
+	}
+	assert(pmemblk_set_zero(pbp, 0) == 0);
+	pmemblk_unmap(pbp);
+	record_stop();
+
+	CLOSE(fd);
+	replay(crash, check_blk);
+}
+
+/*
+ * obj_transfer -- move n from a to b in a transaction
+ */
+static void
+obj_transfer(PMEMobjpool *pop, struct obj_root *rp, uint64_t n, int commit)
+{
+	jmp_buf env;
+	if (setjmp(env))
+		FATAL("transaction failed");
+
+	pmemobj_tx_begin(pop, env);
+	uint64_t a = rp->a - n;
+	uint64_t b = rp->b + n;
+	assert(PMEMOBJ_SET(rp->a, a) == 0);
+	assert(PMEMOBJ_SET(rp->b, b) == 0);
+	if (commit)
+		pmemobj_tx_commit();
+	else
+		pmemobj_tx_abort(0);
+}
+
+/*
+ * do_obj -- transactions moving values, allocating and freeing, and
+ * moving the root
+ */
+static void
+do_obj(char *path, char *crash)
+{
+	PMEMobjpool *pop = pmemobj_pool_open(path);
+	if (pop == NULL)
+		FATAL("!pmemobj_pool_open: %s", path);
+
+	struct obj_root *rp = pmemobj_root_direct(pop, sizeof (*rp));
+
+	jmp_buf env;
+	if (setjmp(env))
+		FATAL("transaction failed");
+
+	uint64_t total = OBJ_TOTAL;
+	uint64_t zero = 0;
+	pmemobj_tx_begin(pop, env);
+	assert(PMEMOBJ_SET(rp->a, total) == 0);
+	assert(PMEMOBJ_SET(rp->b, zero) == 0);
+	pmemobj_tx_commit();
+
+	record_start(path, crash);
+	Root_off = (char *)rp - Base;
+	obj_transfer(pop, rp, 10, 1);
+	obj_transfer(pop, rp, 20, 0);
+	obj_transfer(pop, rp, 30, 1);
+
+	/* link a new object */
+	pmemobj_tx_begin(pop, env);
+	PMEMoid oid = pmemobj_alloc(OBJ_SIZE);
+	assert(!pmemobj_nulloid(oid));
+	memset(pmemobj_direct(oid), 'x', OBJ_SIZE);
+	assert(PMEMOBJ_SET(rp->obj, oid) == 0);
+	pmemobj_tx_commit();
+
+	/* and unlink and free it again */
+	PMEMoid null = rp->obj;
+	memset(&null, 0, sizeof (null));
+	pmemobj_tx_begin(pop, env);
+	assert(pmemobj_free(rp->obj) == 0);
+	assert(PMEMOBJ_SET(rp->obj, null) == 0);
+	pmemobj_tx_commit();
+
+	/* move the root, the values go along */
+	assert(pmemobj_root_resize(pop, 4 * sizeof (*rp)) == 0);
+
+	pmemobj_pool_close(pop);
+	record_stop();
+
+	replay(crash, check_obj);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "pmem_crash");
+
+	if (argc < 3)
+		FATAL("usage: %s log|blk|obj file", argv[0]);
+
+	char crash[PATH_MAX];
+	snprintf(crash, sizeof (crash), "%s.crash", argv[2]);
+
+	if (strcmp(argv[1], "log") == 0)
+		do_log(argv[2], crash);
+	else if (strcmp(argv[1], "blk") == 0)
+		do_blk(argv[2], crash);
+	else if (strcmp(argv[1], "obj") == 0)
+		do_obj(argv[2], crash);
+	else
+		FATAL("unknown pool type %s", argv[1]);
+
+	UNLINK(crash);
+
+	DONE(NULL);
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_map.c -- unit test for mapping, msync and pre-faulting pools
+ *
+ * usage: pmem_map file [align]
+ *
+ * align is the alignment the environment asked for, 1G if not given.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	MB ((size_t)1 << 20)
+#define	GB ((size_t)1 << 30)
+
+static size_t Last_done;
+static size_t Last_total;
+static pthread_t Opener;	/* the thread opening pools */
+
+/*
+ * progress -- check pre-faulting only moves forward, in the opener
+ */
+static void
+progress(size_t done, size_t total)
+{
+	assert(pthread_equal(pthread_self(), Opener));
+	assert(done > Last_done && done <= total);
+	Last_done = done;
+	Last_total = total;
+}
+
+/*
+ * map_check -- map the file, check the alignment and store c at its end
+ */
+static char *
+map_check(int fd, size_t len, size_t align, char c)
+{
+	char *addr = pmem_map(fd);
+	assert(addr != NULL);
+	assert((uintptr_t)addr % align == 0);
+
+	addr[len - 1] = c;
+
+	return addr;
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "pmem_map");
+
+	if (argc < 2)
+		FATAL("usage: %s file [align]", argv[0]);
+
+	size_t align = GB;
+	if (argc > 2)
+		align = strtoull(argv[2], NULL, 10) * MB;
+
+	int fd = OPEN(argv[1], O_RDWR);
+	struct stat stbuf;
+	FSTAT(fd, &stbuf);
+	size_t len = stbuf.st_size;
+
+	/* the hints come one after another, without reading /proc again */
+	char *addr1 = map_check(fd, len, align, 'a');
+	char *addr2 = map_check(fd, len, align, 'b');
+	assert(addr1 != addr2);
+	assert(addr1[len - 1] == 'b');	/* the same file twice */
+
+	/* no DAX here, asking again is answered from the cached mappings */
+	for (int i = 0; i < 1000; i++) {
+		assert(pmem_is_pmem(addr1, len) == 0);
+		assert(pmem_is_pmem(addr2 + i, 1) == 0);
+	}
+
+	/* msync rounds out to whole pages, it fails on unmapped ones */
+	assert(pmem_msync(addr1 + 1, 10) == 0);
+	assert(pmem_msync(addr2 + len - 1, 1) == 0);
+	MUNMAP(addr1, len);
+	MUNMAP(addr2, len);
+
+	/* a range in no mapping is remembered, the application remaps it */
+	for (int i = 0; i < 1000; i++)
+		assert(pmem_is_pmem(addr1, len) == 0);
+	char *addr3 = MMAP(addr1, len, PROT_READ, MAP_SHARED|MAP_FIXED, fd, 0);
+	assert(addr3 == addr1);
+	assert(pmem_is_pmem(addr3, len) == 0);
+	MUNMAP(addr3, len);
+	assert(pmem_msync(addr1 + 1, 10) == -1);
+	assert(errno == ENOMEM);
+
+	/* smaller alignment, every flag, hints or not the mapping works */
+	assert(pmem_set_map_policy(2 * MB, PMEM_MAP_THP|PMEM_MAP_HUGETLB|
+			PMEM_MAP_POPULATE) == 0);
+	addr1 = map_check(fd, len, 2 * MB, 'c');
+	MUNMAP(addr1, len);
+
+	/* invalid policies are refused, the old one stays */
+	assert(pmem_set_map_policy(3 * MB, 0) == -1);
+	assert(errno == EINVAL);
+	assert(pmem_set_map_policy(1024, 0) == -1);
+	assert(errno == EINVAL);
+	assert(pmem_set_map_policy(2 * MB, 0x100) == -1);
+	assert(errno == EINVAL);
+	addr1 = map_check(fd, len, 2 * MB, 'd');
+	MUNMAP(addr1, len);
+
+	CLOSE(fd);
+
+	/* a pool is pre-faulted in full before the open returns */
+	Opener = pthread_self();
+	pmem_set_prefault(4, progress);
+	PMEMobjpool *pop = pmemobj_pool_open(argv[1]);
+	assert(pop != NULL);
+	assert(Last_done == len && Last_total == len);
+	pmemobj_pool_close(pop);
+
+	/* turned off, nothing is reported */
+	pmem_set_prefault(0, progress);
+	Last_done = 0;
+	pop = pmemobj_pool_open(argv[1]);
+	assert(pop != NULL);
+	assert(Last_done == 0);
+	pmemobj_pool_close(pop);
+
+	DONE(NULL);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_movnt.c -- unit test for pmem_memcpy_persist() et al.
+ *
+ * usage: pmem_movnt file
+ *
+ * Every size and alignment combination is checked against memmove() and
+ * memset() on a private copy, both with and without overlap.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	AREA ((size_t)128 * 1024)
+
+static const size_t Sizes[] = {
+	0, 1, 15, 63, 64, 65, 255, 256, 257, 1000, 4096 + 17, 65536 + 3
+};
+
+static const size_t Offsets[] = { 0, 1, 15, 33, 63 };
+
+#define	NELEMS(a) (sizeof (a) / sizeof ((a)[0]))
+
+/*
+ * fill -- (internal) put a pattern, different for each seed, in a range
+ */
+static void
+fill(char *buf, size_t len, unsigned seed)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (char)(i * 7 + seed);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "pmem_movnt");
+
+	if (argc < 2)
+		FATAL("usage: %s file", argv[0]);
+
+	int fd = OPEN(argv[1], O_RDWR);
+	struct stat stbuf;
+	FSTAT(fd, &stbuf);
+	assert(stbuf.st_size >= 2 * AREA + AREA / 2);
+	char *pmem = pmem_map(fd);
+	assert(pmem != NULL);
+	CLOSE(fd);
+
+	char *ref = MALLOC(2 * AREA);
+	char *src = MALLOC(AREA);
+	fill(src, AREA, 3);
+
+	for (size_t i = 0; i < NELEMS(Sizes); i++) {
+		size_t len = Sizes[i];
+
+		for (size_t j = 0; j < NELEMS(Offsets); j++) {
+			size_t doff = Offsets[j];
+			size_t soff = Offsets[NELEMS(Offsets) - 1 - j];
+
+			/* copy from outside, nothing around it touched */
+			fill(pmem, 2 * AREA, j);
+			memcpy(ref, pmem, 2 * AREA);
+			memcpy(ref + doff, src + soff, len);
+			assert(pmem_memcpy_persist(pmem + doff, src + soff,
+					len) == pmem + doff);
+			assert(memcmp(pmem, ref, 2 * AREA) == 0);
+
+			/* overlapping moves, in both directions */
+			size_t shift = Offsets[j] + 64 * i + 1;
+			memcpy(ref, pmem, 2 * AREA);
+			memmove(ref + doff + shift, ref + doff, len);
+			pmem_memmove_persist(pmem + doff + shift, pmem + doff,
+					len);
+			assert(memcmp(pmem, ref, 2 * AREA) == 0);
+
+			memmove(ref + doff, ref + doff + shift, len);
+			pmem_memmove_persist(pmem + doff, pmem + doff + shift,
+					len);
+			assert(memcmp(pmem, ref, 2 * AREA) == 0);
+
+			/* fill */
+			memset(ref + doff, (int)len, len);
+			assert(pmem_memset_persist(pmem + doff, (int)len,
+					len) == pmem + doff);
+			assert(memcmp(pmem, ref, 2 * AREA) == 0);
+		}
+	}
+
+	FREE(src);
+	FREE(ref);
+	MUNMAP(pmem, stbuf.st_size);
+
+	DONE(NULL);
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2014, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_stats.c -- unit test for the per-source flush profile
+ *
+ * usage: pmem_stats objfile logfile appfile
+ *
+ * Each pool does some work and only its own source (and the allocator's
+ * for obj) may move.  The application's own persists on appfile are
+ * counted exactly, across two threads.
+ */
+
+#include "unittest.h"
+#include "libpmem.h"
+#include <assert.h>
+
+#define	NSRC PMEM_FLUSH_NSRC
+
+static int Is_pmem;
+
+/*
+ * snapshot -- read the profile of every source
+ */
+static void
+snapshot(struct pmem_flush_stats s[NSRC])
+{
+	for (int i = 0; i < NSRC; i++)
+		assert(pmem_flush_stats(i, &s[i]) == 0);
+}
+
+/*
+ * unchanged -- check a source did not move between two snapshots
+ */
+static void
+unchanged(struct pmem_flush_stats *a, struct pmem_flush_stats *b)
+{
+	assert(memcmp(a, b, sizeof (*a)) == 0);
+}
+
+/*
+ * moved -- check a source counted some persists, the way the pool does it
+ */
+static void
+moved(struct pmem_flush_stats *a, struct pmem_flush_stats *b)
+{
+	assert(b->calls > a->calls);
+	assert(b->bytes > a->bytes);
+	if (Is_pmem) {
+		assert(b->lines > a->lines);
+		assert(b->fences > a->fences);
+		assert(b->msyncs == a->msyncs);
+	} else {
+		assert(b->lines == a->lines);
+		assert(b->msyncs > a->msyncs);
+	}
+}
+
+/*
+ * app_thread -- flush one line of the application's own from a thread
+ */
+static void *
+app_thread(void *arg)
+{
+	char *addr = arg;
+
+	memset(addr, 't', 64);
+	pmem_persist(addr, 64, 0);
+
+	return NULL;
+}
+
+/*
+ * do_obj -- a transaction allocating and setting an object
+ */
+static void
+do_obj(char *path)
+{
+	PMEMobjpool *pop = pmemobj_pool_open(path);
+	if (pop == NULL)
+		FATAL("!pmemobj_pool_open: %s", path);
+
+	PMEMoid *rootp = pmemobj_root_direct(pop, sizeof (*rootp));
+
+	struct pmem_flush_stats a[NSRC], b[NSRC];
+	snapshot(a);
+
+	jmp_buf env;
+	if (setjmp(env))
+		FATAL("transaction failed");
+
+	pmemobj_tx_begin(pop, env);
+	PMEMoid oid = pmemobj_alloc(4096);
+	assert(!pmemobj_nulloid(oid));
+	memset(pmemobj_direct(oid), 'o', 4096);
+	assert(PMEMOBJ_SET(*rootp, oid) == 0);
+	pmemobj_tx_commit();
+
+	snapshot(b);
+	unchanged(&a[PMEM_FLUSH_SRC_APP], &b[PMEM_FLUSH_SRC_APP]);
+	unchanged(&a[PMEM_FLUSH_SRC_BLK], &b[PMEM_FLUSH_SRC_BLK]);
+	unchanged(&a[PMEM_FLUSH_SRC_LOG], &b[PMEM_FLUSH_SRC_LOG]);
+	moved(&a[PMEM_FLUSH_SRC_OBJ], &b[PMEM_FLUSH_SRC_OBJ]);
+	moved(&a[PMEM_FLUSH_SRC_ALLOC], &b[PMEM_FLUSH_SRC_ALLOC]);
+
+	pmemobj_pool_close(pop);
+}
+
+/*
+ * do_log -- a few appends to a log
+ */
+static void
+do_log(char *path)
+{
+	int fd = OPEN(path, O_RDWR);
+	PMEMlog *plp = pmemlog_map(fd);
+	if (plp == NULL)
+		FATAL("!pmemlog_map: %s", path);
+
+	struct pmem_flush_stats a[NSRC], b[NSRC];
+	snapshot(a);
+
+	char buf[1000];
+	memset(buf, 'l', sizeof (buf));
+	for (int i = 0; i < 3; i++)
+		assert(pmemlog_append(plp, buf, sizeof (buf)) == 0);
+
+	snapshot(b);
+	unchanged(&a[PMEM_FLUSH_SRC_APP], &b[PMEM_FLUSH_SRC_APP]);
+	unchanged(&a[PMEM_FLUSH_SRC_OBJ], &b[PMEM_FLUSH_SRC_OBJ]);
+	unchanged(&a[PMEM_FLUSH_SRC_ALLOC], &b[PMEM_FLUSH_SRC_ALLOC]);
+	unchanged(&a[PMEM_FLUSH_SRC_BLK], &b[PMEM_FLUSH_SRC_BLK]);
+	moved(&a[PMEM_FLUSH_SRC_LOG], &b[PMEM_FLUSH_SRC_LOG]);
+	assert(b[PMEM_FLUSH_SRC_LOG].bytes -
+			a[PMEM_FLUSH_SRC_LOG].bytes >= 3 * sizeof (buf));
+
+	pmemlog_unmap(plp);
+	CLOSE(fd);
+}
+
+/*
+ * do_app -- persists of the application's own, counted exactly
+ */
+static void
+do_app(char *path)
+{
+	int fd = OPEN(path, O_RDWR);
+	struct stat stbuf;
+	FSTAT(fd, &stbuf);
+	size_t len = stbuf.st_size;
+	char *addr = pmem_map(fd);
+	assert(addr != NULL);
+	CLOSE(fd);
+
+	struct pmem_flush_stats a, b;
+	assert(pmem_flush_stats(PMEM_FLUSH_SRC_APP, &a) == 0);
+
+	/* 256 bytes at offset 32 touch five lines */
+	memset(addr + 32, 'a', 256);
+	pmem_persist(addr + 32, 256, 0);
+
+	/* two of them again, right after */
+	memset(addr + 64, 'b', 128);
+	pmem_persist(addr + 64, 128, 0);
+
+	/* the syncs of a page are counted, not the lines in it */
+	assert(pmem_msync(addr, 4096) == 0);
+
+	/* another thread's line is added to the sum */
+	pthread_t thread;
+	PTHREAD_CREATE(&thread, NULL, app_thread, addr + 4096);
+	PTHREAD_JOIN(thread, NULL);
+
+	assert(pmem_flush_stats(PMEM_FLUSH_SRC_APP, &b) == 0);
+	assert(b.calls - a.calls == 4);
+	assert(b.bytes - a.bytes == 256 + 128 + 4096 + 64);
+	assert(b.lines - a.lines == 5 + 2 + 1);
+	assert(b.redundant - a.redundant == 2);
+	assert(b.fences - a.fences == 3);
+	assert(b.msyncs - a.msyncs == 1);
+
+	MUNMAP(addr, len);
+}
+
+int
+main(int argc, char **argv)
+{
+	START(argc, argv, "pmem_stats");
+
+	if (argc != 4)
+		FATAL("usage: %s objfile logfile appfile", argv[0]);
+
+	/* PMEM_IS_PMEM_FORCE applies to every file alike */
+	int fd = OPEN(argv[3], O_RDWR);
+	struct stat stbuf;
+	FSTAT(fd, &stbuf);
+	char *addr = pmem_map(fd);
+	assert(addr != NULL);
+	Is_pmem = pmem_is_pmem(addr, stbuf.st_size);
+	MUNMAP(addr, stbuf.st_size);
+	CLOSE(fd);
+
+	do_obj(argv[1]);
+	do_log(argv[2]);
+	do_app(argv[3]);
+
+	/* out of range sources are refused */
+	struct pmem_flush_stats stats;
+	assert(pmem_flush_stats(PMEM_FLUSH_NSRC, &stats) == -1);
+	assert(errno == EINVAL);
+	assert(pmem_flush_stats(-1, &stats) == -1);
+	assert(errno == EINVAL);
+
+	DONE(NULL);
+}
@@ -40,10 +40,16 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <endian.h>
 #include <errno.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include <uuid/uuid.h>
+#include <libpmem.h>
 #include "util.h"
 #include "out.h"
 
@@ -55,6 +61,39 @@
 /* library-wide page size */
 unsigned long Pagesize;
 
+/* how files are mapped, see util_map_policy() */
+static struct {
+	size_t align;		/* alignment of the addresses asked for */
+	int flags;		/* PMEM_MAP_* */
+} Map_policy = { GIGABYTE, 0 };
+
+/*
+ * Hints are handed out from a cursor into the address space above 1TB,
+ * so /proc/self/maps is only parsed for the first mapping and again
+ * whenever mmap() did not take a hint, which means the cursor ran into
+ * a mapping made behind our back.
+ */
+static pthread_mutex_t Hint_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *Hint_next;		/* next hint, NULL if unknown */
+
+/* bumped whenever a mapping is made or removed, see util_map_generation() */
+static uint64_t Map_generation;
+
+/* pre-faulting of pools at open, see util_set_prefault() */
+static unsigned Prefault_threads;	/* 0 if off */
+static void (*Prefault_progress)(size_t done, size_t total);
+
+#define	PREFAULT_BATCH ((size_t)64 << 20)	/* bytes claimed at once */
+#define	PREFAULT_PROGRESS_STEPS 100	/* progress reports per pool */
+
+/* checksums, see util_checksum() */
+#define	CRC32C_POLY 0x82f63b78	/* Castagnoli, reflected */
+#define	CRC32C_STRIDE 256	/* bytes per stream in crc32c_sse42() */
+
+static uint32_t Crc32c_table[256];
+static uint32_t Crc32c_shift[4][256];	/* see crc32c_shift() */
+static int Checksum_create = CSUM_FLETCHER64;	/* for new metadata */
+
 /*
  * our versions of malloc & friends start off pointing to the libc versions
  */
@@ -63,6 +102,52 @@ Free_func Free = free;
 Realloc_func Realloc = realloc;
 Strdup_func Strdup = strdup;
 
+/*
+ * util_parse_size -- (internal) parse a size like "64M"
+ *
+ * Returns 0 if the size is not valid, which includes sizes that do not
+ * fit in a size_t once the suffix is applied.
+ */
+static size_t
+util_parse_size(const char *str, char **endp)
+{
+	/* strtoull() would take a sign and quietly negate the result */
+	if (*str < '0' || *str > '9') {
+		*endp = (char *)str;
+		return 0;
+	}
+
+	errno = 0;
+	unsigned long long val = strtoull(str, endp, 10);
+	if (errno == ERANGE || val > SIZE_MAX)
+		return 0;
+
+	unsigned shift = 0;
+	switch (**endp) {
+	case 'T': case 't':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'G': case 'g':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'M': case 'm':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'K': case 'k':
+		shift += 10;
+		(*endp)++;
+		break;
+	}
+
+	if (**endp != ' ' && **endp != '\t' && **endp != '\0')
+		return 0;
+
+	if (val > (SIZE_MAX >> shift))
+		return 0;
+
+	return (size_t)val << shift;
+}
+
 /*
  * util_init -- initialize the utils
  *
@@ -72,8 +157,76 @@ void
 util_init(void)
 {
 	LOG(3, NULL);
-	if (Pagesize == 0)
-		Pagesize = (unsigned long) sysconf(_SC_PAGESIZE);
+	if (Pagesize != 0)
+		return;
+
+	Pagesize = (unsigned long) sysconf(_SC_PAGESIZE);
+
+	/*
+	 * PMEM_MAP_ALIGN (a size, K, M or G suffix allowed) and
+	 * PMEM_MAP_FLAGS (a comma-separated list of thp, hugetlb and
+	 * populate) set the initial mapping policy.
+	 */
+	size_t align = Map_policy.align;
+	int flags = 0;
+	char *ptr, *endp;
+	if ((ptr = getenv("PMEM_MAP_ALIGN")) != NULL)
+		align = util_parse_size(ptr, &endp);
+	if ((ptr = getenv("PMEM_MAP_FLAGS")) != NULL) {
+		if (strstr(ptr, "thp"))
+			flags |= PMEM_MAP_THP;
+		if (strstr(ptr, "hugetlb"))
+			flags |= PMEM_MAP_HUGETLB;
+		if (strstr(ptr, "populate"))
+			flags |= PMEM_MAP_POPULATE;
+	}
+	if (util_map_policy(align, flags) < 0)
+		LOG(1, "invalid mapping policy in the environment, ignored");
+
+	/* PMEM_PREFAULT_THREADS turns pre-faulting on */
+	if ((ptr = getenv("PMEM_PREFAULT_THREADS")) != NULL && atoi(ptr) > 0)
+		Prefault_threads = (unsigned)atoi(ptr);
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		Crc32c_table[i] = crc;
+	}
+
+	/* PMEM_CHECKSUM=crc32c makes new pools use CRC32C checksums */
+	if ((ptr = getenv("PMEM_CHECKSUM")) != NULL) {
+		if (strcmp(ptr, "crc32c") == 0)
+			Checksum_create = CSUM_CRC32C;
+		else if (strcmp(ptr, "fletcher64") != 0)
+			LOG(1, "invalid PMEM_CHECKSUM \"%s\"", ptr);
+	}
+}
+
+/*
+ * util_map_policy -- set the alignment and flags used to map files
+ *
+ * align must be a power of two and a multiple of the page size.
+ */
+int
+util_map_policy(size_t align, int flags)
+{
+	LOG(3, "align %zu flags 0x%x", align, flags);
+
+	if (align < Pagesize || (align & (align - 1)) ||
+			(flags & ~(PMEM_MAP_THP|PMEM_MAP_HUGETLB|
+			PMEM_MAP_POPULATE))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&Hint_lock);
+	Map_policy.align = align;
+	Map_policy.flags = flags;
+	Hint_next = NULL;
+	pthread_mutex_unlock(&Hint_lock);
+
+	return 0;
 }
 
 /*
@@ -95,20 +248,21 @@ util_set_alloc_funcs(void *(*malloc_func)(size_t size),
 }
 
 /*
- * util_map_hint -- (internal) use /proc to determine a hint address for mmap()
+ * util_map_hint_scan -- (internal) use /proc to find a hint address for mmap()
  *
- * This is a helper function for util_map().  It opens up /proc/self/maps
- * and looks for the first unused address in the process address space that is:
+ * This is a helper function for util_map_hint().  It opens up
+ * /proc/self/maps and looks for the first unused address in the process
+ * address space that is:
  * - greater or equal 1TB,
  * - large enough to hold range of given length,
- * - 1GB aligned.
+ * - aligned as the mapping policy asks (1GB by default).
  *
  * Asking for aligned address like this will allow the DAX code to use large
  * mappings.  It is not an error if mmap() ignores the hint and chooses
  * different address.
  */
 static char *
-util_map_hint(size_t len)
+util_map_hint_scan(size_t len)
 {
 	FILE *fp;
 	if ((fp = fopen("/proc/self/maps", "r")) == NULL) {
@@ -138,9 +292,8 @@ util_map_hint(size_t len)
 			}
 
 			if (hi > raddr) {
-				/* align to 1GB */
 				raddr = (char *)roundup((uintptr_t)hi,
-						GIGABYTE);
+						Map_policy.align);
 				LOG(4, "nearest aligned addr %p", raddr);
 			}
 
@@ -166,6 +319,91 @@ util_map_hint(size_t len)
 	return raddr;
 }
 
+/*
+ * util_map_hint -- (internal) return a hint address for mmap()
+ *
+ * The range up to the next aligned address after the hint is considered
+ * taken from then on.
+ */
+static char *
+util_map_hint(size_t len)
+{
+	pthread_mutex_lock(&Hint_lock);
+
+	if (Hint_next == NULL)
+		Hint_next = util_map_hint_scan(len);
+
+	char *hint = Hint_next;
+	if (hint != NULL) {
+		uintptr_t next = roundup((uintptr_t)hint + len,
+				Map_policy.align);
+		Hint_next = (next < (uintptr_t)hint) ? NULL : (char *)next;
+	}
+
+	pthread_mutex_unlock(&Hint_lock);
+
+	LOG(4, "hint %p", hint);
+	return hint;
+}
+
+/*
+ * util_map_hint_missed -- (internal) note that mmap() did not take a hint
+ */
+static void
+util_map_hint_missed(void *hint, void *addr)
+{
+	if (hint == NULL || hint == addr)
+		return;
+
+	LOG(4, "hint %p not taken, mapped at %p", hint, addr);
+
+	pthread_mutex_lock(&Hint_lock);
+	Hint_next = NULL;
+	pthread_mutex_unlock(&Hint_lock);
+}
+
+/*
+ * util_map_advise -- (internal) apply the mapping policy to a new mapping
+ */
+static void
+util_map_advise(void *addr, size_t len)
+{
+	if ((Map_policy.flags & PMEM_MAP_THP) &&
+			madvise(addr, len, MADV_HUGEPAGE) < 0)
+		LOG(2, "!madvise MADV_HUGEPAGE");
+}
+
+/*
+ * util_map_flags -- (internal) mmap() flags the mapping policy asks for
+ */
+static int
+util_map_flags(void)
+{
+	return (Map_policy.flags & PMEM_MAP_POPULATE) ? MAP_POPULATE : 0;
+}
+
+/*
+ * util_map_generation -- tell whether the mappings may have changed
+ *
+ * The value changes every time this library maps or unmaps something, so
+ * anything cached about the address space is stale once it differs from
+ * the value read before the cache was filled.
+ */
+uint64_t
+util_map_generation(void)
+{
+	return __sync_add_and_fetch(&Map_generation, 0);
+}
+
+/*
+ * util_map_changed -- (internal) note that the mappings changed
+ */
+static void
+util_map_changed(void)
+{
+	__sync_add_and_fetch(&Map_generation, 1);
+}
+
 /*
  * util_map -- memory map a file
  *
@@ -182,19 +420,187 @@ util_map(int fd, size_t len, int cow)
 	LOG(3, "fd %d len %zu cow %d", fd, len, cow);
 
 	void *addr = util_map_hint(len);
+	int flags = ((cow) ? MAP_PRIVATE|MAP_NORESERVE : MAP_SHARED) |
+			util_map_flags();
+
+	/* huge pages only work for files on hugetlbfs, else fall back */
+	base = MAP_FAILED;
+	if (Map_policy.flags & PMEM_MAP_HUGETLB) {
+		base = mmap(addr, len, PROT_READ|PROT_WRITE,
+				flags|MAP_HUGETLB, fd, 0);
+		if (base == MAP_FAILED)
+			LOG(2, "!mmap MAP_HUGETLB");
+	}
 
-	if ((base = mmap(addr, len, PROT_READ|PROT_WRITE,
-			(cow) ? MAP_PRIVATE|MAP_NORESERVE : MAP_SHARED,
-					fd, 0)) == MAP_FAILED) {
+	if (base == MAP_FAILED && (base = mmap(addr, len,
+			PROT_READ|PROT_WRITE, flags, fd, 0)) == MAP_FAILED) {
 		LOG(1, "!mmap %zu bytes", len);
 		return NULL;
 	}
 
+	util_map_changed();
+	util_map_hint_missed(addr, base);
+	util_map_advise(base, len);
+
 	LOG(3, "mapped at %p", base);
 
 	return base;
 }
 
+/*
+ * util_set_prefault -- pre-fault pools as they are opened, or stop it
+ *
+ * Pools are pre-faulted by nthreads threads, 0 turns pre-faulting off.
+ * Progress (bytes done, total bytes) is reported through progress, if
+ * not NULL, always from the thread opening the pool.
+ */
+void
+util_set_prefault(unsigned nthreads, void (*progress)(size_t done,
+		size_t total))
+{
+	LOG(3, "nthreads %u progress %p", nthreads, progress);
+
+	Prefault_threads = nthreads;
+	Prefault_progress = progress;
+}
+
+struct prefault_ctx {
+	char *addr;
+	size_t len;
+	int write;
+	size_t next;		/* first byte not claimed yet */
+	size_t done;		/* bytes touched */
+};
+
+/*
+ * prefault_range -- (internal) touch the pages of one batch
+ *
+ * Write faults are only taken on pmem, where there is no page cache to
+ * dirty.  MADV_POPULATE_WRITE faults the whole batch in one call, an
+ * atomic add of zero on each page is the fallback for older kernels.
+ */
+static void
+prefault_range(struct prefault_ctx *ctx, size_t first, size_t last)
+{
+#ifdef MADV_POPULATE_WRITE
+	if (ctx->write && madvise(ctx->addr + first, last - first,
+			MADV_POPULATE_WRITE) == 0)
+		return;
+#endif
+
+	for (size_t off = first; off < last; off += Pagesize) {
+		char *p = ctx->addr + off;
+		if (ctx->write)
+			__sync_fetch_and_add(p, 0);
+		else
+			(void) *(volatile char *)p;
+	}
+}
+
+/*
+ * prefault_batches -- (internal) touch batches claimed until none is left
+ *
+ * Only the thread opening the pool passes report, so the progress
+ * function is never called from the helper threads.  Returns the bytes
+ * last reported.
+ */
+static size_t
+prefault_batches(struct prefault_ctx *ctx, int report)
+{
+	size_t step = ctx->len / PREFAULT_PROGRESS_STEPS + 1;
+	size_t reported = 0;
+
+	for (;;) {
+		size_t first = __sync_fetch_and_add(&ctx->next,
+				PREFAULT_BATCH);
+		if (first >= ctx->len)
+			break;
+
+		size_t last = first + PREFAULT_BATCH;
+		if (last > ctx->len)
+			last = ctx->len;
+
+		prefault_range(ctx, first, last);
+
+		size_t done = __sync_add_and_fetch(&ctx->done, last - first);
+		if (report && Prefault_progress != NULL &&
+				done - reported >= step) {
+			reported = done;
+			(*Prefault_progress)(done, ctx->len);
+		}
+	}
+
+	return reported;
+}
+
+/*
+ * prefault_worker -- (internal) helper thread of util_prefault()
+ */
+static void *
+prefault_worker(void *arg)
+{
+	(void) prefault_batches(arg, 0);
+	return NULL;
+}
+
+/*
+ * util_prefault -- fault in a freshly mapped pool, if asked to
+ *
+ * Does nothing unless turned on with util_set_prefault().  The pages are
+ * faulted for writing if write is set and the pool is pmem, which must
+ * only be done while no one else can be changing the pool.  Elsewhere
+ * write faults would dirty the whole pool in the page cache, so the
+ * pages are only read.
+ */
+void
+util_prefault(void *addr, size_t len, int write)
+{
+	unsigned nthreads = Prefault_threads;
+	if (nthreads == 0 || len == 0)
+		return;
+
+	if (write && !pmem_is_pmem(addr, len))
+		write = 0;
+
+	LOG(3, "addr %p len %zu write %d nthreads %u", addr, len, write,
+			nthreads);
+
+	/* start the reads of a page cache backed pool in the background */
+	if (!write && madvise(addr, len, MADV_WILLNEED) < 0)
+		LOG(2, "!madvise MADV_WILLNEED");
+
+	struct prefault_ctx ctx;
+	memset(&ctx, 0, sizeof (ctx));
+	ctx.addr = addr;
+	ctx.len = len;
+	ctx.write = write;
+
+	if (nthreads > len / PREFAULT_BATCH + 1)
+		nthreads = len / PREFAULT_BATCH + 1;
+
+	pthread_t *threads = Malloc(nthreads * sizeof (pthread_t));
+	unsigned started = 0;
+	if (threads != NULL) {
+		/* the calling thread is one of the workers */
+		for (; started < nthreads - 1; started++)
+			if ((errno = pthread_create(&threads[started], NULL,
+						prefault_worker, &ctx))) {
+				LOG(1, "!pthread_create");
+				break;
+			}
+	}
+
+	size_t reported = prefault_batches(&ctx, 1);
+
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (Prefault_progress != NULL && reported < len)
+		(*Prefault_progress)(len, len);
+
+	Free(threads);
+}
+
 /*
  * util_unmap -- unmap a file
  *
@@ -207,6 +613,7 @@ util_unmap(void *addr, size_t len)
 	LOG(3, "addr %p len %zu", addr, len);
 
 	int retval = munmap(addr, len);
+	util_map_changed();
 
 	if (retval < 0)
 		LOG(1, "!munmap");
@@ -215,38 +622,790 @@ util_unmap(void *addr, size_t len)
 }
 
 /*
- * util_checksum -- compute Fletcher64 checksum
+ * util_poolset_is -- check if path names a pool set file
+ *
+ * Returns 1 if the file starts with the pool set signature, 0 if it
+ * does not and -1 (with errno set) if the file cannot be read.
+ */
+int
+util_poolset_is(const char *path)
+{
+	LOG(3, "path \"%s\"", path);
+
+	int fd;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		LOG(1, "!%s", path);
+		return -1;
+	}
+
+	char sig[POOLSET_HDR_SIG_LEN];
+	ssize_t cnt = read(fd, sig, POOLSET_HDR_SIG_LEN);
+	int oerrno = errno;
+	close(fd);
+
+	if (cnt < 0) {
+		errno = oerrno;
+		LOG(1, "!%s", path);
+		return -1;
+	}
+
+	return cnt == POOLSET_HDR_SIG_LEN &&
+		strncmp(sig, POOLSET_HDR_SIG, POOLSET_HDR_SIG_LEN) == 0;
+}
+
+/*
+ * util_poolset_partpath -- (internal) resolve a part path from the set file
+ *
+ * Relative part paths are taken relative to the directory holding the
+ * set file.  The returned string must be freed with Free().
+ */
+static char *
+util_poolset_partpath(const char *setpath, const char *path)
+{
+	const char *slash = strrchr(setpath, '/');
+	if (path[0] == '/' || slash == NULL)
+		return Strdup(path);
+
+	size_t dirlen = slash - setpath + 1;
+	char *ret;
+	if ((ret = Malloc(dirlen + strlen(path) + 1)) == NULL) {
+		LOG(1, "!Malloc");
+		return NULL;
+	}
+
+	memcpy(ret, setpath, dirlen);
+	strcpy(ret + dirlen, path);
+	return ret;
+}
+
+/*
+ * util_part_hdr_read -- (internal) read the header of a pool set part
+ *
+ * Returns 1 if the part has a valid header, 0 if it has none yet (the
+ * header area is missing or all zeros) and -1 with errno set otherwise.
+ */
+static int
+util_part_hdr_read(int fd, const char *path, size_t filesize,
+		struct pool_part_hdr *hdrp)
+{
+	LOG(3, "path \"%s\" filesize %zu", path, filesize);
+
+	memset(hdrp, '\0', sizeof (*hdrp));
+	ssize_t cnt;
+	if ((cnt = pread(fd, hdrp, sizeof (*hdrp), (off_t)filesize)) < 0) {
+		LOG(1, "!pread %s", path);
+		return -1;
+	}
+
+	unsigned char *cp = (unsigned char *)hdrp;
+	size_t i;
+	for (i = 0; i < sizeof (*hdrp) && cp[i] == 0; i++)
+		;
+	if (i == sizeof (*hdrp))
+		return 0;
+
+	hdrp->major = le32toh(hdrp->major);
+	hdrp->incompat_features = le32toh(hdrp->incompat_features);
+	hdrp->index = le32toh(hdrp->index);
+	hdrp->filesize = le64toh(hdrp->filesize);
+	hdrp->checksum = le64toh(hdrp->checksum);
+
+	if (cnt != sizeof (*hdrp) || strncmp(hdrp->signature,
+			POOLSET_PART_SIG, sizeof (hdrp->signature)) ||
+			hdrp->major != POOLSET_PART_MAJOR ||
+			(hdrp->incompat_features & ~POOL_FEAT_CRC32C) ||
+			!util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum,
+				0, POOL_HDR_CSUM(hdrp->incompat_features))) {
+		LOG(1, "%s: invalid pool set part header", path);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * util_part_hdr_write -- (internal) write the header of a new set part
+ */
+static int
+util_part_hdr_write(int fd, const char *path, size_t filesize,
+		const unsigned char *uuid, unsigned index)
+{
+	LOG(3, "path \"%s\" filesize %zu index %u", path, filesize, index);
+
+	struct pool_part_hdr hdr;
+	memset(&hdr, '\0', sizeof (hdr));
+	strncpy(hdr.signature, POOLSET_PART_SIG, sizeof (hdr.signature));
+	hdr.major = htole32(POOLSET_PART_MAJOR);
+	int alg = util_checksum_create();
+	hdr.incompat_features = htole32(POOL_HDR_CSUM_FEAT(alg));
+	memcpy(hdr.uuid, uuid, sizeof (hdr.uuid));
+	hdr.index = htole32(index);
+	hdr.filesize = htole64(filesize);
+	util_checksum(&hdr, sizeof (hdr), &hdr.checksum, 1, alg);
+	hdr.checksum = htole64(hdr.checksum);
+
+	/* durable before the set file can name the part */
+	if (pwrite(fd, &hdr, sizeof (hdr), (off_t)filesize) != sizeof (hdr) ||
+			fsync(fd) < 0) {
+		LOG(1, "!%s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * util_poolset_map_part -- (internal) map a part file at the given address
+ *
+ * The part file is created with the requested size if it does not exist.
+ * If excl is set, it must not exist.  If cow is set, the part must exist,
+ * it is opened read-only and mapped privately.  The part header has to
+ * name the set uuid and index, a part without one gets it written here.
+ */
+static int
+util_poolset_map_part(const char *path, size_t size, void *addr,
+		const unsigned char *uuid, unsigned index, int excl, int cow)
+{
+	LOG(3, "path \"%s\" size %zu addr %p index %u excl %d cow %d",
+			path, size, addr, index, excl, cow);
+
+	int fd;
+	int created = 0;
+	if ((fd = open(path, (cow) ? O_RDONLY : O_RDWR)) < 0) {
+		if (cow || errno != ENOENT || (fd = open(path,
+				O_RDWR|O_CREAT|O_EXCL, 0666)) < 0) {
+			LOG(1, "!%s", path);
+			return -1;
+		}
+		created = 1;
+	} else if (excl) {
+		LOG(1, "%s: part already exists", path);
+		close(fd);
+		errno = EEXIST;
+		return -1;
+	}
+
+	struct stat stbuf;
+	if (created) {
+		if ((errno = posix_fallocate(fd, 0, size)) != 0) {
+			LOG(1, "!posix_fallocate %s", path);
+			goto err;
+		}
+	} else {
+		if (fstat(fd, &stbuf) < 0) {
+			LOG(1, "!fstat %s", path);
+			goto err;
+		}
+		if (stbuf.st_size < size) {
+			LOG(1, "%s: size %zu smaller than %zu",
+					path, (size_t)stbuf.st_size, size);
+			errno = EINVAL;
+			goto err;
+		}
+	}
+
+	struct pool_part_hdr hdr;
+	int ret = (created) ? 0 : util_part_hdr_read(fd, path, size, &hdr);
+	if (ret < 0)
+		goto err;
+	if (ret == 0) {
+		if (cow) {
+			LOG(1, "%s: part has no header", path);
+			errno = EINVAL;
+			goto err;
+		}
+		if (util_part_hdr_write(fd, path, size, uuid, index) < 0)
+			goto err;
+	} else if (memcmp(hdr.uuid, uuid, sizeof (hdr.uuid))) {
+		LOG(1, "%s: part of another pool set", path);
+		errno = EINVAL;
+		goto err;
+	} else if (hdr.index != index || hdr.filesize != size) {
+		LOG(1, "%s: header says part %u (%zu bytes), not part %u "
+				"(%zu bytes)", path, hdr.index,
+				(size_t)hdr.filesize, index, size);
+		errno = EINVAL;
+		goto err;
+	}
+
+	if (mmap(addr, size, PROT_READ|PROT_WRITE,
+			((cow) ? MAP_PRIVATE : MAP_SHARED)|MAP_FIXED|
+			util_map_flags(), fd, 0) == MAP_FAILED) {
+		LOG(1, "!mmap %s", path);
+		goto err;
+	}
+	util_map_changed();
+	util_map_advise(addr, size);
+
+	close(fd);
+	return 0;
+
+err:
+	LOG(4, "error clean up");
+	int oerrno = errno;
+	close(fd);
+	if (created)
+		unlink(path);
+	errno = oerrno;
+	return -1;
+}
+
+/*
+ * util_poolset_add_part -- (internal) remember a part in the set
+ */
+static int
+util_poolset_add_part(struct pool_set *set, char *path, size_t size)
+{
+	struct pool_set_part *parts;
+	if ((parts = Realloc(set->parts,
+			(set->nparts + 1) * sizeof (*parts))) == NULL) {
+		LOG(1, "!Realloc");
+		return -1;
+	}
+
+	set->parts = parts;
+	parts[set->nparts].path = path;
+	parts[set->nparts].filesize = size;
+	set->nparts++;
+	set->size += size;
+	return 0;
+}
+
+/*
+ * util_poolset_parse -- parse a pool set file
+ *
+ * Nothing is mapped yet, so the caller can look at the parts first and
+ * then decide how to map them with util_poolset_map().
+ */
+struct pool_set *
+util_poolset_parse(const char *path)
+{
+	LOG(3, "path \"%s\"", path);
+
+	FILE *fp;
+	if ((fp = fopen(path, "r")) == NULL) {
+		LOG(1, "!%s", path);
+		return NULL;
+	}
+
+	struct pool_set *set;
+	if ((set = Malloc(sizeof (*set))) == NULL) {
+		LOG(1, "!Malloc");
+		fclose(fp);
+		return NULL;
+	}
+	memset(set, '\0', sizeof (*set));
+
+	if ((set->path = Strdup(path)) == NULL) {
+		LOG(1, "!Strdup");
+		goto err;
+	}
+
+	char line[PROCMAXLEN];	/* for fgets() */
+	int lineno = 0;
+	while (fgets(line, PROCMAXLEN, fp) != NULL) {
+		lineno++;
+
+		char *cp;
+		if ((cp = strpbrk(line, "#\n")) != NULL)
+			*cp = '\0';
+
+		if (lineno == 1) {
+			if (strcmp(line, POOLSET_HDR_SIG)) {
+				LOG(1, "%s: missing pool set signature", path);
+				errno = EINVAL;
+				goto err;
+			}
+			continue;
+		}
+
+		cp = line;
+		while (*cp == ' ' || *cp == '\t')
+			cp++;
+		if (*cp == '\0')
+			continue;	/* blank line or comment */
+
+		char *endp;
+		size_t size = util_parse_size(cp, &endp);
+		if (size == 0 || size % Pagesize) {
+			LOG(1, "%s:%d: invalid part size", path, lineno);
+			errno = EINVAL;
+			goto err;
+		}
+
+		while (*endp == ' ' || *endp == '\t')
+			endp++;
+		for (cp = endp + strlen(endp);
+			cp > endp && (cp[-1] == ' ' || cp[-1] == '\t'); cp--)
+			cp[-1] = '\0';
+		if (*endp == '\0') {
+			LOG(1, "%s:%d: missing part path", path, lineno);
+			errno = EINVAL;
+			goto err;
+		}
+
+		char *partpath;
+		if ((partpath = util_poolset_partpath(path, endp)) == NULL)
+			goto err;
+		if (util_poolset_add_part(set, partpath, size) < 0) {
+			Free(partpath);
+			goto err;
+		}
+	}
+
+	if (set->nparts == 0) {
+		LOG(1, "%s: no parts in pool set", path);
+		errno = EINVAL;
+		goto err;
+	}
+
+	fclose(fp);
+	return set;
+
+err:
+	LOG(4, "error clean up");
+	int oerrno = errno;
+	fclose(fp);
+	util_poolset_close(set);
+	errno = oerrno;
+	return NULL;
+}
+
+/*
+ * util_poolset_uuid -- (internal) find the uuid of a parsed pool set
+ *
+ * The uuid is taken from the first part with a valid header.  A set none
+ * of whose parts has one yet is new and gets a new uuid.  Parts that can't
+ * be read are skipped here, mapping them reports the error.
+ */
+static void
+util_poolset_uuid(struct pool_set *set)
+{
+	for (unsigned i = 0; i < set->nparts; i++) {
+		int fd;
+		if ((fd = open(set->parts[i].path, O_RDONLY)) < 0)
+			continue;
+
+		struct pool_part_hdr hdr;
+		int ret = util_part_hdr_read(fd, set->parts[i].path,
+				set->parts[i].filesize, &hdr);
+		close(fd);
+		if (ret == 1) {
+			memcpy(set->uuid, hdr.uuid, sizeof (set->uuid));
+			return;
+		}
+	}
+
+	uuid_generate(set->uuid);
+}
+
+/*
+ * util_poolset_map -- map all parts of a parsed pool set
+ *
+ * At least reserve bytes of address space (or the size of the whole set,
+ * whichever is bigger) are reserved, so the pool can later be extended
+ * with util_poolset_extend() without moving.  If cow is set, the parts are
+ * mapped privately and nothing is ever written to the files.  On failure
+ * nothing stays mapped, the set still has to be closed.
+ */
+int
+util_poolset_map(struct pool_set *set, size_t reserve, int cow)
+{
+	LOG(3, "set %p reserve %zu cow %d", set, reserve, cow);
+
+	set->reserved = roundup(MAX(reserve, set->size), Pagesize);
+	void *hint = util_map_hint(set->reserved);
+	if ((set->addr = mmap(hint, set->reserved, PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+					-1, 0)) == MAP_FAILED) {
+		LOG(1, "!mmap reserve %zu bytes", set->reserved);
+		set->addr = NULL;
+		return -1;
+	}
+	util_map_changed();
+	util_map_hint_missed(hint, set->addr);
+
+	util_poolset_uuid(set);
+
+	char *addr = set->addr;
+	for (unsigned i = 0; i < set->nparts; i++) {
+		if (util_poolset_map_part(set->parts[i].path,
+				set->parts[i].filesize, addr, set->uuid, i,
+				0, cow) < 0) {
+			int oerrno = errno;
+			util_unmap(set->addr, set->reserved);
+			set->addr = NULL;
+			errno = oerrno;
+			return -1;
+		}
+		addr += set->parts[i].filesize;
+	}
+
+	LOG(3, "%u parts, %zu bytes mapped at %p", set->nparts, set->size,
+			set->addr);
+	return 0;
+}
+
+/*
+ * util_poolset_extend -- append a new part to an open pool set
+ *
+ * The part file is created, mapped right after the current end of the
+ * pool and only then recorded in the set file, so a crash at any point
+ * leaves either the old or the new set, never a set naming a missing part.
+ */
+int
+util_poolset_extend(struct pool_set *set, const char *path, size_t size)
+{
+	LOG(3, "set %p path \"%s\" size %zu", set, path, size);
+
+	if (size == 0 || size % Pagesize) {
+		LOG(1, "invalid part size %zu", size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (set->reserved - set->size < size) {
+		LOG(1, "reserved range exhausted: %zu left, %zu needed",
+				set->reserved - set->size, size);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	char *partpath;
+	if ((partpath = util_poolset_partpath(set->path, path)) == NULL)
+		return -1;
+
+	/* make room for the part up front, nothing may fail once it's added */
+	struct pool_set_part *parts;
+	if ((parts = Realloc(set->parts,
+			(set->nparts + 1) * sizeof (*parts))) == NULL) {
+		LOG(1, "!Realloc");
+		Free(partpath);
+		return -1;
+	}
+	set->parts = parts;
+
+	char *addr = (char *)set->addr + set->size;
+	if (util_poolset_map_part(partpath, size, addr, set->uuid,
+			set->nparts, 1, 0) < 0) {
+		Free(partpath);
+		return -1;
+	}
+
+	int fd;
+	if ((fd = open(set->path, O_RDWR|O_APPEND)) < 0) {
+		LOG(1, "!%s", set->path);
+		goto err;
+	}
+
+	/* the set file may not end in a newline */
+	char last = '\n';
+	off_t end = lseek(fd, 0, SEEK_END);
+	if (end > 0 && pread(fd, &last, 1, end - 1) != 1)
+		last = '\n';
+
+	if (dprintf(fd, "%s%zu %s\n", (last == '\n') ? "" : "\n",
+				size, path) < 0 || fsync(fd) < 0) {
+		LOG(1, "!%s", set->path);
+		close(fd);
+		goto err;
+	}
+	close(fd);
+
+	parts[set->nparts].path = partpath;
+	parts[set->nparts].filesize = size;
+	set->nparts++;
+	set->size += size;
+
+	LOG(3, "pool set now %zu bytes", set->size);
+	return 0;
+
+err:
+	LOG(4, "error clean up");
+	int oerrno = errno;
+	/* put the reservation back over the new part */
+	mmap(addr, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|
+				MAP_FIXED, -1, 0);
+	util_map_changed();
+	unlink(partpath);
+	Free(partpath);
+	errno = oerrno;
+	return -1;
+}
+
+/*
+ * util_poolset_close -- unmap a pool set and free its description
+ */
+void
+util_poolset_close(struct pool_set *set)
+{
+	LOG(3, "set %p", set);
+
+	if (set->addr != NULL)
+		util_unmap(set->addr, set->reserved);
+
+	for (unsigned i = 0; i < set->nparts; i++)
+		Free(set->parts[i].path);
+	Free(set->parts);
+	Free(set->path);
+	Free(set);
+}
+
+/*
+ * checksums, see util_checksum()
+ *
+ * Both algorithms are computed in pieces around the checksum field, so
+ * the loops themselves never test for it.  The vector and CRC32
+ * instruction versions are picked by util_checksum_select() once the
+ * CPU is known.
+ */
+static void fletcher64_scalar(const uint32_t *p32, size_t nwords,
+		uint32_t *lop, uint32_t *hip);
+static uint32_t crc32c_table(uint32_t crc, const void *addr, size_t len);
+
+static void (*Func_fletcher64)(const uint32_t *p32, size_t nwords,
+		uint32_t *lop, uint32_t *hip) = fletcher64_scalar;
+static uint32_t (*Func_crc32c)(uint32_t crc, const void *addr,
+		size_t len) = crc32c_table;
+
+/*
+ * fletcher64_scalar -- (internal) add words to a Fletcher64 sum
+ */
+static void
+fletcher64_scalar(const uint32_t *p32, size_t nwords, uint32_t *lop,
+		uint32_t *hip)
+{
+	uint32_t lo32 = *lop;
+	uint32_t hi32 = *hip;
+
+	while (nwords--) {
+		lo32 += *p32++;
+		hi32 += lo32;
+	}
+
+	*lop = lo32;
+	*hip = hi32;
+}
+
+/*
+ * fletcher64_avx2 -- (internal) add words to a Fletcher64 sum, 8 at once
+ *
+ * Each lane j sums its own words into a[j] and the running a[j] into
+ * b[j].  After n rounds, word j of round k has been added to the high
+ * sum 8 * (n - k) - j times in the serial order, which is what
+ * 8 * b[j] - j * a[j] gives back.  All of it is modulo 2^32, so the lanes
+ * wrapping does not matter.
+ */
+__attribute__((target("avx2")))
+static void
+fletcher64_avx2(const uint32_t *p32, size_t nwords, uint32_t *lop,
+		uint32_t *hip)
+{
+	size_t nrounds = nwords / 8;
+	__m256i a = _mm256_setzero_si256();
+	__m256i b = _mm256_setzero_si256();
+
+	for (size_t i = 0; i < nrounds; i++) {
+		__m256i w = _mm256_loadu_si256((const __m256i *)p32 + i);
+		a = _mm256_add_epi32(a, w);
+		b = _mm256_add_epi32(b, a);
+	}
+
+	uint32_t av[8], bv[8];
+	_mm256_storeu_si256((__m256i *)av, a);
+	_mm256_storeu_si256((__m256i *)bv, b);
+
+	uint32_t lo32 = *lop;
+	uint32_t hi32 = *hip + (uint32_t)(8 * nrounds) * lo32;
+	for (uint32_t j = 0; j < 8; j++) {
+		lo32 += av[j];
+		hi32 += 8 * bv[j] - j * av[j];
+	}
+
+	*lop = lo32;
+	*hip = hi32;
+
+	fletcher64_scalar(p32 + 8 * nrounds, nwords % 8, lop, hip);
+}
+
+/*
+ * crc32c_table -- (internal) continue a CRC32C a byte at a time
+ */
+static uint32_t
+crc32c_table(uint32_t crc, const void *addr, size_t len)
+{
+	const unsigned char *p = addr;
+
+	while (len--)
+		crc = Crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*
+ * crc32c_shift -- (internal) append CRC32C_STRIDE zero bytes to a CRC32C
+ */
+static uint32_t
+crc32c_shift(uint32_t crc)
+{
+	return Crc32c_shift[0][crc & 0xff] ^
+		Crc32c_shift[1][(crc >> 8) & 0xff] ^
+		Crc32c_shift[2][(crc >> 16) & 0xff] ^
+		Crc32c_shift[3][crc >> 24];
+}
+
+/*
+ * crc32c_shift_init -- (internal) build the tables for crc32c_shift()
+ *
+ * Appending zeros is linear in the CRC, so only the 32 single bit CRCs
+ * are run through the zeros, the rest of the entries are XORs of those.
+ */
+static void
+crc32c_shift_init(void)
+{
+	static const unsigned char zeros[CRC32C_STRIDE];
+	uint32_t bits[32];
+
+	for (int bit = 0; bit < 32; bit++)
+		bits[bit] = crc32c_table(1U << bit, zeros, sizeof (zeros));
+
+	for (int byte = 0; byte < 4; byte++)
+		for (uint32_t v = 0; v < 256; v++) {
+			uint32_t crc = 0;
+			for (int bit = 0; bit < 8; bit++)
+				if (v & (1U << bit))
+					crc ^= bits[8 * byte + bit];
+			Crc32c_shift[byte][v] = crc;
+		}
+}
+
+/*
+ * crc32c_sse42 -- (internal) continue a CRC32C using the crc32 instruction
+ *
+ * The instruction has a latency of three cycles but can start one every
+ * cycle, so long ranges are done as three streams of CRC32C_STRIDE
+ * bytes, which are then joined by crc32c_shift().
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const void *addr, size_t len)
+{
+	const unsigned char *p = addr;
+	uint64_t crc64 = crc;
+
+	for (; len >= 3 * CRC32C_STRIDE; p += 3 * CRC32C_STRIDE,
+			len -= 3 * CRC32C_STRIDE) {
+		uint64_t crc1 = 0;
+		uint64_t crc2 = 0;
+
+		for (size_t i = 0; i < CRC32C_STRIDE; i += 8) {
+			uint64_t v0, v1, v2;
+			memcpy(&v0, p + i, sizeof (v0));
+			memcpy(&v1, p + CRC32C_STRIDE + i, sizeof (v1));
+			memcpy(&v2, p + 2 * CRC32C_STRIDE + i, sizeof (v2));
+			crc64 = _mm_crc32_u64(crc64, v0);
+			crc1 = _mm_crc32_u64(crc1, v1);
+			crc2 = _mm_crc32_u64(crc2, v2);
+		}
+
+		crc64 = crc32c_shift((uint32_t)crc64) ^ (uint32_t)crc1;
+		crc64 = crc32c_shift((uint32_t)crc64) ^ (uint32_t)crc2;
+	}
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof (v));
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = (uint32_t)crc64;
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+/*
+ * util_checksum_select -- use the checksum instructions the CPU has
+ *
+ * Called by pmem_init() after it looked at CPUID.
+ */
+void
+util_checksum_select(int avx2, int sse42)
+{
+	LOG(3, "avx2 %d sse42 %d", avx2, sse42);
+
+	if (avx2)
+		Func_fletcher64 = fletcher64_avx2;
+	if (sse42) {
+		crc32c_shift_init();
+		Func_crc32c = crc32c_sse42;
+	}
+}
+
+/*
+ * util_checksum_create -- return the algorithm for new metadata
+ */
+int
+util_checksum_create(void)
+{
+	return Checksum_create;
+}
+
+/*
+ * util_checksum -- compute Fletcher64 or CRC32C checksum
  *
  * csump points to where the checksum lives, so that location
  * is treated as zeros while calculating the checksum.  If
  * insert is true, the calculated checksum is inserted into
  * the range at *csump.  Otherwise the calculated checksum is
  * checked against *csump and the result returned (true means
- * the range checksummed correctly).
+ * the range checksummed correctly).  alg is CSUM_FLETCHER64, which
+ * sums the range as 32-bit words, or CSUM_CRC32C, whose 32-bit result
+ * is stored zero-extended.
  */
 int
-util_checksum(void *addr, size_t len, uint64_t *csump, int insert)
+util_checksum(void *addr, size_t len, uint64_t *csump, int insert, int alg)
 {
-	uint32_t *p32 = addr;
-	uint32_t *p32end = addr + len;
-	uint32_t lo32 = 0;
-	uint32_t hi32 = 0;
+	char *start = addr;
+	char *hole = (char *)csump;
+	size_t before = len;
+	size_t after = 0;
+	int has_hole = 0;
 	uint64_t csum;
 
-	while (p32 < p32end)
-		if (p32 == (uint32_t *)csump) {
-			/* lo32 += 0; treat first 32-bits as zero */
-			p32++;
-			hi32 += lo32;
-			/* lo32 += 0; treat second 32-bits as zero */
-			p32++;
-			hi32 += lo32;
-		} else {
-			lo32 += *p32++;
-			hi32 += lo32;
+	if (hole >= start && hole + sizeof (*csump) <= start + len) {
+		before = (size_t)(hole - start);
+		after = len - before - sizeof (*csump);
+		has_hole = 1;
+	}
+
+	if (alg == CSUM_CRC32C) {
+		static const uint64_t zero;
+		uint32_t crc = ~0U;
+
+		crc = (*Func_crc32c)(crc, start, before);
+		if (has_hole) {
+			crc = (*Func_crc32c)(crc, &zero, sizeof (zero));
+			crc = (*Func_crc32c)(crc, csump + 1, after);
 		}
 
-	csum = (uint64_t)hi32 << 32 | lo32;
+		csum = ~crc;
+	} else {
+		uint32_t lo32 = 0;
+		uint32_t hi32 = 0;
+
+		(*Func_fletcher64)(addr, before / 4, &lo32, &hi32);
+		if (has_hole) {
+			/* both zero words of the checksum only add to hi32 */
+			hi32 += 2 * lo32;
+			(*Func_fletcher64)((uint32_t *)(csump + 1), after / 4,
+					&lo32, &hi32);
+		}
+
+		csum = (uint64_t)hi32 << 32 | lo32;
+	}
 
 	if (insert) {
 		*csump = csum;
@@ -281,7 +1440,8 @@ util_convert_hdr(struct pool_hdr *hdrp)
 	hdrp->checksum = le64toh(hdrp->checksum);
 
 	/* and to be valid, the fields must checksum correctly */
-	if (!util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 0)) {
+	if (!util_checksum(hdrp, sizeof (*hdrp), &hdrp->checksum, 0,
+			POOL_HDR_CSUM(hdrp->incompat_features))) {
 		LOG(3, "invalid checksum");
 		return 0;
 	}
@@ -52,9 +52,69 @@ void util_set_alloc_funcs(
 		void (*free_func)(void *ptr),
 		void *(*realloc_func)(void *ptr, size_t size),
 		char *(*strdup_func)(const char *s));
+int util_map_policy(size_t align, int flags);
+uint64_t util_map_generation(void);
 void *util_map(int fd, size_t len, int cow);
+void util_set_prefault(unsigned nthreads, void (*progress)(size_t done,
+		size_t total));
+void util_prefault(void *addr, size_t len, int write);
 int util_unmap(void *addr, size_t len);
 
+/*
+ * pool set -- a single memory pool made of several part files
+ *
+ * The set file starts with POOLSET_HDR_SIG on a line of its own, followed
+ * by one "size path" line per part.  The parts are mapped back to back in
+ * a range of address space reserved up front, so the pool looks like one
+ * contiguous mapping and new parts can be appended while it is open.
+ */
+#define	POOLSET_HDR_SIG "PMEMPOOLSET"
+#define	POOLSET_HDR_SIG_LEN 11	/* does NOT include '\0' */
+
+struct pool_set_part {
+	char *path;
+	size_t filesize;	/* bytes of the file that are mapped */
+};
+
+struct pool_set {
+	char *path;		/* the set file itself */
+	unsigned char uuid[16];	/* shared by all parts, see pool_part_hdr */
+	void *addr;		/* beginning of the reserved range */
+	size_t size;		/* bytes currently backed by parts */
+	size_t reserved;	/* size of the reserved range */
+	unsigned nparts;
+	struct pool_set_part *parts;
+};
+
+/*
+ * header linking a part file to its set
+ *
+ * It is kept right past the filesize bytes of data, so the data starts at
+ * file offset 0 and stays aligned for large page mappings, and it is never
+ * mapped.  A part whose header is missing or all zeros is taken as new and
+ * gets one the first time the set is opened for writing.  The integer
+ * types are stored in little-endian byte order.
+ */
+#define	POOLSET_PART_SIG "PMEMSET"
+#define	POOLSET_PART_MAJOR 1
+struct pool_part_hdr {
+	char signature[8];
+	uint32_t major;			/* format major version number */
+	uint32_t incompat_features;	/* only POOL_FEAT_CRC32C for now */
+	unsigned char uuid[16];		/* of the set, same in all parts */
+	uint32_t index;			/* position of the part in the set */
+	uint32_t unused32;		/* must be zero */
+	uint64_t filesize;		/* bytes of data before the header */
+	unsigned char unused[4040];	/* must be zero */
+	uint64_t checksum;		/* checksum of above fields */
+};
+
+int util_poolset_is(const char *path);
+struct pool_set *util_poolset_parse(const char *path);
+int util_poolset_map(struct pool_set *set, size_t reserve, int cow);
+int util_poolset_extend(struct pool_set *set, const char *path, size_t size);
+void util_poolset_close(struct pool_set *set);
+
 /*
  * header used at the beginning of all types of memory pools
  *
@@ -75,7 +135,28 @@ struct pool_hdr {
 	uint64_t checksum;		/* checksum of above fields */
 };
 
-int util_checksum(void *addr, size_t len, uint64_t *csump, int insert);
+/*
+ * incompat_features common to all pool types, the pool specific ones
+ * start at 0x0100
+ */
+#define	POOL_FEAT_CRC32C 0x0001	/* checksums are CRC32C, not Fletcher64 */
+
+/* checksum algorithms */
+#define	CSUM_FLETCHER64 0
+#define	CSUM_CRC32C 1
+
+/* the algorithm a pool header with the given incompat features uses */
+#define	POOL_HDR_CSUM(incompat)\
+	(((incompat) & POOL_FEAT_CRC32C) ? CSUM_CRC32C : CSUM_FLETCHER64)
+
+/* and the other way around, the features a new header gets */
+#define	POOL_HDR_CSUM_FEAT(alg)\
+	((alg) == CSUM_CRC32C ? POOL_FEAT_CRC32C : 0)
+
+int util_checksum(void *addr, size_t len, uint64_t *csump, int insert,
+		int alg);
+int util_checksum_create(void);
+void util_checksum_select(int avx2, int sse42);
 int util_convert_hdr(struct pool_hdr *hdrp);
 
 /*